@@ -118,3 +118,1025 @@ CREATE OR REPLACE FUNCTION tinyhist_buckets(
     RETURNS SETOF record
     AS 'tinyhist', 'tinyhist_buckets'
     LANGUAGE C IMMUTABLE STRICT;
+
+-- estimates of mean, standard deviation, sum and count of values
+CREATE OR REPLACE FUNCTION tinyhist_mean(hist tinyhist, log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_mean'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_mean(hists tinyhist[], log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_mean_array'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_stddev(hist tinyhist, log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_stddev'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_stddev(hists tinyhist[], log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_stddev_array'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_sum_estimate(hist tinyhist, log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_sum_estimate'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_sum_estimate(hists tinyhist[], log_uniform boolean DEFAULT false)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_sum_estimate_array'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_count_estimate(hist tinyhist)
+    RETURNS bigint
+    AS 'tinyhist', 'tinyhist_count_estimate'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_count_estimate(hists tinyhist[])
+    RETURNS bigint
+    AS 'tinyhist', 'tinyhist_count_estimate_array'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- compare distributions represented by two histograms
+CREATE OR REPLACE FUNCTION tinyhist_compare(
+  in  hist1 tinyhist,					-- first histogram
+  in  hist2 tinyhist,					-- second histogram
+  out ks_statistic double precision,	-- Kolmogorov-Smirnov statistic
+  out wasserstein double precision,		-- Wasserstein distance
+  out p_value double precision			-- approximate p-value (KS test)
+)
+    RETURNS record
+    AS 'tinyhist', 'tinyhist_compare'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- compare pairs of histograms from two arrays
+CREATE OR REPLACE FUNCTION tinyhist_compare(
+  in  hists1 tinyhist[],				-- first array of histograms
+  in  hists2 tinyhist[],				-- second array of histograms
+  out pair_index int,					-- index of the pair (1 .. N)
+  out ks_statistic double precision,	-- Kolmogorov-Smirnov statistic
+  out wasserstein double precision,		-- Wasserstein distance
+  out p_value double precision			-- approximate p-value (KS test)
+)
+    RETURNS SETOF record
+    AS 'tinyhist', 'tinyhist_compare_array'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- approximate percentile of values represented by a histogram
+CREATE OR REPLACE FUNCTION tinyhist_percentile(hist tinyhist, fraction double precision)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_percentile'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- approximate drop-in for percentile_cont, without sorting the values
+CREATE OR REPLACE FUNCTION tinyhist_percentile_final(hist tinyhist, fraction double precision, val double precision)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_percentile_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE approx_percentile_cont(double precision ORDER BY double precision) (
+    SFUNC = tinyhist_accum,
+    STYPE = tinyhist,
+    FINALFUNC = tinyhist_percentile_final,
+    FINALFUNC_EXTRA,
+    FINALFUNC_MODIFY = READ_ONLY
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_percentile_array_final(hist tinyhist, fractions double precision[], val double precision)
+    RETURNS double precision[]
+    AS 'tinyhist', 'tinyhist_percentile_array_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE approx_percentile_cont(double precision[] ORDER BY double precision) (
+    SFUNC = tinyhist_accum,
+    STYPE = tinyhist,
+    FINALFUNC = tinyhist_percentile_array_final,
+    FINALFUNC_EXTRA,
+    FINALFUNC_MODIFY = READ_ONLY
+);
+
+-- top-k histograms by percentile
+CREATE TYPE tinyhist_topk_item AS (
+    key text,							-- key identifying the histogram
+    percentile double precision			-- percentile of the histogram
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_topk_accum(state internal, key text, hist tinyhist, fraction double precision, k int)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_topk_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_topk_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_topk_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_topk_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_topk_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_topk_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_topk_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_topk_final(state internal)
+    RETURNS tinyhist_topk_item[]
+    AS 'tinyhist', 'tinyhist_topk_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_topk(key text, hist tinyhist, fraction double precision, k int) (
+    SFUNC = tinyhist_topk_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_topk_final,
+    COMBINEFUNC = tinyhist_topk_combine,
+    SERIALFUNC = tinyhist_topk_serial,
+    DESERIALFUNC = tinyhist_topk_deserial,
+    PARALLEL = SAFE
+);
+
+-- recommend histogram geometry for a relative error target
+CREATE OR REPLACE FUNCTION tinyhist_geometry(
+  in  relative_error double precision,	-- target relative error for quantiles
+  in  expected_count bigint,			-- expected number of values
+  in  min_value double precision,		-- expected minimum (positive) value
+  in  max_value double precision,		-- expected maximum value
+  out sub_buckets int,					-- number of sub-buckets per doubling
+  out buckets bigint,					-- total number of buckets
+  out min_bucket_bits int,				-- smallest bucket size (bits)
+  out max_bucket_bits int,				-- largest bucket size (bits)
+  out total_bytes bigint,				-- size of the histogram (bytes)
+  out max_relative_error double precision,	-- worst-case relative error
+  out tinyhist_sufficient boolean		-- is regular tinyhist good enough?
+)
+    RETURNS record
+    AS 'tinyhist', 'tinyhist_geometry'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- observed error budget of a data set
+CREATE TYPE tinyhist_budget AS (
+    value_count bigint,					-- number of values
+    min_value double precision,			-- minimum value
+    max_value double precision,			-- maximum value
+    hist_unit int,						-- size of "unit" range
+    hist_sample_rate int,				-- sampled fraction of values
+    max_relative_error double precision	-- worst-case relative error
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_budget_accum(state internal, val double precision)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_budget_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_budget_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_budget_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_budget_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_budget_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_budget_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_budget_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_budget_final(state internal)
+    RETURNS tinyhist_budget
+    AS 'tinyhist', 'tinyhist_budget_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_error_budget(double precision) (
+    SFUNC = tinyhist_budget_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_budget_final,
+    COMBINEFUNC = tinyhist_budget_combine,
+    SERIALFUNC = tinyhist_budget_serial,
+    DESERIALFUNC = tinyhist_budget_deserial,
+    PARALLEL = SAFE
+);
+
+-- scale a histogram (e.g. to account for sampled data sources)
+CREATE OR REPLACE FUNCTION tinyhist_scale(hist tinyhist, factor double precision)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_scale'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- multiply values by a power of two (e.g. to convert between units)
+CREATE OR REPLACE FUNCTION tinyhist_rebase(hist tinyhist, shift int)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_rebase'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- sum of independent values from two histograms
+CREATE OR REPLACE FUNCTION tinyhist_convolve(hist1 tinyhist, hist2 tinyhist)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_convolve'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- maximum of n independent values from a histogram
+CREATE OR REPLACE FUNCTION tinyhist_max_of(hist tinyhist, n int)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_max_of'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_accum_hist_weighted(hist1 tinyhist, hist2 tinyhist, weight double precision)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_accum_hist_weighted'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_agg(tinyhist, double precision) (
+    SFUNC = tinyhist_accum_hist_weighted,
+    STYPE = tinyhist,
+    COMBINEFUNC = tinyhist_combine,
+    PARALLEL = SAFE
+);
+
+-- bucket counters and boundaries as arrays
+CREATE OR REPLACE FUNCTION tinyhist_counts(hist tinyhist)
+    RETURNS int[]
+    AS 'tinyhist', 'tinyhist_counts'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_bounds(hist tinyhist)
+    RETURNS double precision[]
+    AS 'tinyhist', 'tinyhist_bounds'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_scaled_counts(hist tinyhist)
+    RETURNS double precision[]
+    AS 'tinyhist', 'tinyhist_scaled_counts'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- build a histogram from sample rate, unit and bucket counters
+CREATE OR REPLACE FUNCTION tinyhist_from_counts(sample int, unit int, counts int[])
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_from_counts'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- element-wise aggregation of arrays of histograms
+CREATE OR REPLACE FUNCTION tinyhist_accum_hist_array(state internal, hists tinyhist[])
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_accum_hist_array'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_array_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_array_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_array_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_array_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_array_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_array_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_array_final(state internal)
+    RETURNS tinyhist[]
+    AS 'tinyhist', 'tinyhist_array_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_agg(tinyhist[]) (
+    SFUNC = tinyhist_accum_hist_array,
+    STYPE = internal,
+    FINALFUNC = tinyhist_array_final,
+    COMBINEFUNC = tinyhist_array_combine,
+    SERIALFUNC = tinyhist_array_serial,
+    DESERIALFUNC = tinyhist_array_deserial,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_add(hists1 tinyhist[], hists2 tinyhist[])
+    RETURNS tinyhist[]
+    AS 'tinyhist', 'tinyhist_add_hist_array'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist[],
+    RIGHTARG = tinyhist[],
+    FUNCTION = tinyhist_add
+);
+
+-- histograms with fixed (user-defined) boundaries, e.g. for SLOs
+CREATE OR REPLACE FUNCTION tinyhist_slo_check_bounds(bounds double precision[])
+    RETURNS boolean
+    AS 'tinyhist', 'tinyhist_slo_check_bounds'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TABLE tinyhist_slo_boundaries (
+    id      serial PRIMARY KEY CHECK (id BETWEEN 1 AND 65535),
+    bounds  double precision[] NOT NULL CHECK (tinyhist_slo_check_bounds(bounds))
+);
+
+-- include the declared boundaries in pg_dump (only possible in CREATE EXTENSION)
+DO $$
+BEGIN
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_slo_boundaries', '');
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_slo_boundaries_id_seq', '');
+EXCEPTION WHEN feature_not_supported THEN
+    NULL;
+END;
+$$;
+
+-- the boundaries are cached by backends, so they must not change
+CREATE OR REPLACE FUNCTION tinyhist_slo_boundaries_immutable()
+    RETURNS trigger
+    AS $$
+BEGIN
+    RAISE EXCEPTION 'histogram boundaries can''t be modified or deleted';
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER tinyhist_slo_boundaries_immutable
+    BEFORE UPDATE OR DELETE ON tinyhist_slo_boundaries
+    FOR EACH ROW EXECUTE FUNCTION tinyhist_slo_boundaries_immutable();
+
+CREATE TRIGGER tinyhist_slo_boundaries_truncate
+    BEFORE TRUNCATE ON tinyhist_slo_boundaries
+    FOR EACH STATEMENT EXECUTE FUNCTION tinyhist_slo_boundaries_immutable();
+
+CREATE TYPE tinyhist_slo;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_in(cstring, oid, integer)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_out(tinyhist_slo)
+    RETURNS cstring
+    AS 'tinyhist', 'tinyhist_slo_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_send(tinyhist_slo)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_slo_send'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_recv(internal, oid, integer)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_recv'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_typmod_in(cstring[])
+    RETURNS integer
+    AS 'tinyhist', 'tinyhist_slo_typmod_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_typmod_out(integer)
+    RETURNS cstring
+    AS 'tinyhist', 'tinyhist_slo_typmod_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE tinyhist_slo (
+    INPUT = tinyhist_slo_in,
+    OUTPUT = tinyhist_slo_out,
+    RECEIVE = tinyhist_slo_recv,
+    SEND = tinyhist_slo_send,
+    TYPMOD_IN = tinyhist_slo_typmod_in,
+    TYPMOD_OUT = tinyhist_slo_typmod_out,
+    INTERNALLENGTH = 32
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_slo(hist tinyhist_slo, typmod integer, explicit boolean)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_typmod_cast'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tinyhist_slo AS tinyhist_slo)
+    WITH FUNCTION tinyhist_slo(tinyhist_slo, integer, boolean) AS IMPLICIT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo(hist tinyhist, typmod integer, explicit boolean)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_from_tinyhist'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tinyhist AS tinyhist_slo)
+    WITH FUNCTION tinyhist_slo(tinyhist, integer, boolean);
+
+CREATE OR REPLACE FUNCTION tinyhist(hist tinyhist_slo)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_slo_to_tinyhist'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tinyhist_slo AS tinyhist)
+    WITH FUNCTION tinyhist(tinyhist_slo);
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_add(hist tinyhist_slo, val double precision)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_add'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist_slo,
+    RIGHTARG = double precision,
+    FUNCTION = tinyhist_slo_add
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_add(hist1 tinyhist_slo, hist2 tinyhist_slo)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_add_hist'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist_slo,
+    RIGHTARG = tinyhist_slo,
+    FUNCTION = tinyhist_slo_add
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_accum(hist tinyhist_slo, val double precision, bounds integer)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_accum_hist(hist1 tinyhist_slo, hist2 tinyhist_slo)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_accum_hist'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_combine(hist_a tinyhist_slo, hist_b tinyhist_slo)
+    RETURNS tinyhist_slo
+    AS 'tinyhist', 'tinyhist_slo_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_slo_agg(double precision, integer) (
+    SFUNC = tinyhist_slo_accum,
+    STYPE = tinyhist_slo,
+    COMBINEFUNC = tinyhist_slo_combine,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tinyhist_slo_agg(tinyhist_slo) (
+    SFUNC = tinyhist_slo_accum_hist,
+    STYPE = tinyhist_slo,
+    COMBINEFUNC = tinyhist_slo_combine,
+    PARALLEL = SAFE
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_counts(hist tinyhist_slo)
+    RETURNS int[]
+    AS 'tinyhist', 'tinyhist_slo_counts'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_bounds(hist tinyhist_slo)
+    RETURNS double precision[]
+    AS 'tinyhist', 'tinyhist_slo_bounds'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_slo_compliance(hist tinyhist_slo, threshold double precision)
+    RETURNS double precision
+    AS 'tinyhist', 'tinyhist_slo_compliance'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- export histograms as an Arrow IPC stream
+CREATE OR REPLACE FUNCTION tinyhist_arrow_accum(state internal, key text, hist tinyhist)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_arrow_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_arrow_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_arrow_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_arrow_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_arrow_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_arrow_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_arrow_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_arrow_final(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_arrow_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_arrow(text, tinyhist) (
+    SFUNC = tinyhist_arrow_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_arrow_final,
+    COMBINEFUNC = tinyhist_arrow_combine,
+    SERIALFUNC = tinyhist_arrow_serial,
+    DESERIALFUNC = tinyhist_arrow_deserial,
+    PARALLEL = SAFE
+);
+
+-- series of histograms, with O(log n) merges of ranges of slots
+CREATE TYPE tinyhist_series;
+
+CREATE OR REPLACE FUNCTION tinyhist_series_in(cstring)
+    RETURNS tinyhist_series
+    AS 'tinyhist', 'tinyhist_series_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_series_out(tinyhist_series)
+    RETURNS cstring
+    AS 'tinyhist', 'tinyhist_series_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE tinyhist_series (
+    INPUT = tinyhist_series_in,
+    OUTPUT = tinyhist_series_out,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = extended
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_series_append(series tinyhist_series, hist tinyhist)
+    RETURNS tinyhist_series
+    AS 'tinyhist', 'tinyhist_series_append'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR || (
+    LEFTARG = tinyhist_series,
+    RIGHTARG = tinyhist,
+    FUNCTION = tinyhist_series_append
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_series_accum(state internal, hist tinyhist)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_series_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_series_final(state internal)
+    RETURNS tinyhist_series
+    AS 'tinyhist', 'tinyhist_series_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_series_agg(tinyhist) (
+    SFUNC = tinyhist_series_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_series_final
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_series_range(series tinyhist_series, from_slot int, to_slot int)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_series_range'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_series_slots(series tinyhist_series)
+    RETURNS int
+    AS 'tinyhist', 'tinyhist_series_slots'
+    LANGUAGE C IMMUTABLE STRICT;
+
+-- map of histograms, keyed by bigint
+CREATE TYPE tinyhist_map;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_in(cstring)
+    RETURNS tinyhist_map
+    AS 'tinyhist', 'tinyhist_map_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_out(tinyhist_map)
+    RETURNS cstring
+    AS 'tinyhist', 'tinyhist_map_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE tinyhist_map (
+    INPUT = tinyhist_map_in,
+    OUTPUT = tinyhist_map_out,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = double,
+    STORAGE = extended
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_map_add(map tinyhist_map, key bigint, value double precision)
+    RETURNS tinyhist_map
+    AS 'tinyhist', 'tinyhist_map_add'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_add(map1 tinyhist_map, map2 tinyhist_map)
+    RETURNS tinyhist_map
+    AS 'tinyhist', 'tinyhist_map_add_map'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist_map,
+    RIGHTARG = tinyhist_map,
+    FUNCTION = tinyhist_map_add
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_map_get(map tinyhist_map, key bigint)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_map_get'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_range(map tinyhist_map, from_key bigint, to_key bigint)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_map_range'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_keys(map tinyhist_map)
+    RETURNS bigint[]
+    AS 'tinyhist', 'tinyhist_map_keys'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_accum(state internal, key bigint, value double precision)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_map_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_accum_map(state internal, map tinyhist_map)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_map_accum_map'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_map_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_map_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_map_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_map_final(state internal)
+    RETURNS tinyhist_map
+    AS 'tinyhist', 'tinyhist_map_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_map_agg(bigint, double precision) (
+    SFUNC = tinyhist_map_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_map_final,
+    COMBINEFUNC = tinyhist_map_combine,
+    SERIALFUNC = tinyhist_map_serial,
+    DESERIALFUNC = tinyhist_map_deserial,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tinyhist_map_agg(tinyhist_map) (
+    SFUNC = tinyhist_map_accum_map,
+    STYPE = internal,
+    FINALFUNC = tinyhist_map_final,
+    COMBINEFUNC = tinyhist_map_combine,
+    SERIALFUNC = tinyhist_map_serial,
+    DESERIALFUNC = tinyhist_map_deserial,
+    PARALLEL = SAFE
+);
+
+-- number of values less than each threshold
+CREATE OR REPLACE FUNCTION tinyhist_threshold_accum(state internal, val double precision, thresholds double precision[])
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_threshold_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_threshold_combine(state_a internal, state_b internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_threshold_combine'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_threshold_serial(state internal)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_threshold_serial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_threshold_deserial(state bytea, dummy internal)
+    RETURNS internal
+    AS 'tinyhist', 'tinyhist_threshold_deserial'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_threshold_final(state internal)
+    RETURNS bigint[]
+    AS 'tinyhist', 'tinyhist_threshold_final'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_threshold_counts(double precision, double precision[]) (
+    SFUNC = tinyhist_threshold_accum,
+    STYPE = internal,
+    FINALFUNC = tinyhist_threshold_final,
+    COMBINEFUNC = tinyhist_threshold_combine,
+    SERIALFUNC = tinyhist_threshold_serial,
+    DESERIALFUNC = tinyhist_threshold_deserial,
+    PARALLEL = SAFE
+);
+
+/* tinyhist with adaptive bucket sizes */
+CREATE TYPE tinyhist_adaptive;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_in(cstring)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_in'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_out(tinyhist_adaptive)
+    RETURNS cstring
+    AS 'tinyhist', 'tinyhist_adaptive_out'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_send(tinyhist_adaptive)
+    RETURNS bytea
+    AS 'tinyhist', 'tinyhist_adaptive_send'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_recv(internal)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_recv'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE TYPE tinyhist_adaptive (
+    INPUT = tinyhist_adaptive_in,
+    OUTPUT = tinyhist_adaptive_out,
+    RECEIVE = tinyhist_adaptive_recv,
+    SEND = tinyhist_adaptive_send,
+    INTERNALLENGTH = 32
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_add(hist tinyhist_adaptive, val double precision)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_add'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist_adaptive,
+    RIGHTARG = double precision,
+    FUNCTION = tinyhist_adaptive_add
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_add(hist1 tinyhist_adaptive, hist2 tinyhist_adaptive)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_add_hist'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OPERATOR + (
+    LEFTARG = tinyhist_adaptive,
+    RIGHTARG = tinyhist_adaptive,
+    FUNCTION = tinyhist_adaptive_add
+);
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_accum(hist tinyhist_adaptive, val double precision)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_accum'
+    LANGUAGE C IMMUTABLE;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_accum_hist(hist1 tinyhist_adaptive, hist2 tinyhist_adaptive)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_accum_hist'
+    LANGUAGE C IMMUTABLE;
+
+CREATE AGGREGATE tinyhist_adaptive_agg(double precision) (
+    SFUNC = tinyhist_adaptive_accum,
+    STYPE = tinyhist_adaptive,
+    COMBINEFUNC = tinyhist_adaptive_accum_hist,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE tinyhist_adaptive_agg(tinyhist_adaptive) (
+    SFUNC = tinyhist_adaptive_accum_hist,
+    STYPE = tinyhist_adaptive,
+    COMBINEFUNC = tinyhist_adaptive_accum_hist,
+    PARALLEL = SAFE
+);
+
+-- number of bits allocated to each bucket
+CREATE OR REPLACE FUNCTION tinyhist_adaptive_layout(hist tinyhist_adaptive)
+    RETURNS int[]
+    AS 'tinyhist', 'tinyhist_adaptive_layout'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_adaptive(hist tinyhist)
+    RETURNS tinyhist_adaptive
+    AS 'tinyhist', 'tinyhist_adaptive_from_tinyhist'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tinyhist AS tinyhist_adaptive)
+    WITH FUNCTION tinyhist_adaptive(tinyhist);
+
+CREATE OR REPLACE FUNCTION tinyhist(hist tinyhist_adaptive)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_adaptive_to_tinyhist'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE CAST (tinyhist_adaptive AS tinyhist)
+    WITH FUNCTION tinyhist(tinyhist_adaptive);
+
+-- histogram counters (base table with histograms, and a table of deltas)
+CREATE TABLE tinyhist_counters (
+    name        text PRIMARY KEY,
+    base_table  regclass NOT NULL,  -- base table
+    delta_table regclass NOT NULL   -- table with deltas
+);
+
+-- include the counters in pg_dump (only possible in CREATE EXTENSION)
+DO $$
+BEGIN
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_counters', '');
+EXCEPTION WHEN feature_not_supported THEN
+    NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_create(name text, unlogged_deltas boolean DEFAULT false)
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_counter_create'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_add(name text, key bigint, val double precision)
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_counter_add'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_add(name text, key bigint, hist tinyhist)
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_counter_add_hist'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_merge(name text)
+    RETURNS bigint
+    AS 'tinyhist', 'tinyhist_counter_merge'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_get(name text, key bigint)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_counter_get'
+    LANGUAGE C STABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_drop(name text)
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_counter_drop'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_counter_worker_start(interval_ms integer DEFAULT 1000)
+    RETURNS integer
+    AS 'tinyhist', 'tinyhist_counter_worker_start'
+    LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION tinyhist_counter_worker_start(integer) FROM PUBLIC;
+
+-- metrics exported in the OpenMetrics text format
+CREATE TABLE tinyhist_exports (
+    metric      text PRIMARY KEY,
+    query       text NOT NULL,      -- query returning (hist) or (key, hist)
+    help        text NOT NULL DEFAULT ''
+);
+
+-- include the exported metrics in pg_dump (only possible in CREATE EXTENSION)
+DO $$
+BEGIN
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_exports', '');
+EXCEPTION WHEN feature_not_supported THEN
+    NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION tinyhist_export_create(metric text, query text, help text DEFAULT '')
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_export_create'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_export_drop(metric text)
+    RETURNS void
+    AS 'tinyhist', 'tinyhist_export_drop'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_export_openmetrics()
+    RETURNS text
+    AS 'tinyhist', 'tinyhist_export_openmetrics'
+    LANGUAGE C VOLATILE;
+
+CREATE OR REPLACE FUNCTION tinyhist_export_worker_start(path text, interval_ms integer DEFAULT 10000)
+    RETURNS integer
+    AS 'tinyhist', 'tinyhist_export_worker_start'
+    LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION tinyhist_export_worker_start(text, integer) FROM PUBLIC;
+
+-- durations collected from the server log (csvlog/jsonlog files)
+CREATE TABLE tinyhist_log_durations (
+    kind        text NOT NULL,      -- statement, auto_explain, autovacuum, autoanalyze, checkpoint
+    key         text NOT NULL,      -- normalized statement, table, checkpoint/restartpoint
+    hist        tinyhist NOT NULL,  -- durations (in milliseconds)
+    PRIMARY KEY (kind, key)
+);
+
+-- amount of data processed in each log file
+CREATE TABLE tinyhist_log_files (
+    file            text PRIMARY KEY,
+    bytes_processed bigint NOT NULL,
+    inode           bigint NOT NULL     -- identity of the file (reset when it changes)
+);
+
+-- include the durations and processed data in pg_dump (only possible in CREATE EXTENSION)
+DO $$
+BEGIN
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_log_durations', '');
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_log_files', '');
+EXCEPTION WHEN feature_not_supported THEN
+    NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION tinyhist_log_parse(
+  in  message text,                 -- log message
+  out kind text,                    -- kind of the duration
+  out key text,                     -- normalized statement, table, ...
+  out duration double precision     -- duration (in milliseconds)
+)
+    RETURNS record
+    AS 'tinyhist', 'tinyhist_log_parse'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_log_records(
+  in  data text,                    -- contents of a log file
+  in  format text DEFAULT 'csvlog', -- csvlog or jsonlog
+  out message text,                 -- log message
+  out bytes_processed bigint        -- data processed after the record
+)
+    RETURNS SETOF record
+    AS 'tinyhist', 'tinyhist_log_records'
+    LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_log_collect()
+    RETURNS bigint
+    AS 'tinyhist', 'tinyhist_log_collect'
+    LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION tinyhist_log_collect() FROM PUBLIC;
+
+CREATE OR REPLACE FUNCTION tinyhist_log_worker_start(interval_ms integer DEFAULT 1000)
+    RETURNS integer
+    AS 'tinyhist', 'tinyhist_log_worker_start'
+    LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION tinyhist_log_worker_start(integer) FROM PUBLIC;
+
+-- rollup tables with histograms for intervals of a raw table
+CREATE TABLE tinyhist_rollups (
+    raw_table       regclass NOT NULL,
+    time_column     name NOT NULL,      -- timestamptz column of the raw table
+    value_column    name NOT NULL,      -- column aggregated by tinyhist_agg
+    rollup_table    regclass NOT NULL,
+    bucket_column   name NOT NULL,      -- date_bin(granularity, time, origin)
+    hist_column     name NOT NULL,      -- histogram for the interval
+    granularity     interval NOT NULL
+                    CHECK (granularity > interval '0' AND
+                           date_part('year', granularity) = 0 AND
+                           date_part('month', granularity) = 0),
+    origin          timestamptz NOT NULL DEFAULT '2000-01-01 00:00:00+00',
+    PRIMARY KEY (raw_table, rollup_table)
+);
+
+-- the planner looks up the rollups for queries of all users
+GRANT SELECT ON tinyhist_rollups TO PUBLIC;
+
+-- cached plans depend on the rollups, so changes have to invalidate them
+CREATE OR REPLACE FUNCTION tinyhist_rollups_invalidate()
+    RETURNS trigger
+    AS 'tinyhist', 'tinyhist_rollups_invalidate'
+    LANGUAGE C;
+
+CREATE TRIGGER tinyhist_rollups_invalidate
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON tinyhist_rollups
+    FOR EACH STATEMENT EXECUTE FUNCTION tinyhist_rollups_invalidate();
+
+-- include the rollups in pg_dump (only possible in CREATE EXTENSION)
+DO $$
+BEGIN
+    PERFORM pg_catalog.pg_extension_config_dump('tinyhist_rollups', '');
+EXCEPTION WHEN feature_not_supported THEN
+    NULL;
+END;
+$$;
+
+CREATE OR REPLACE FUNCTION tinyhist_bench(
+  query text,                       -- benchmarked query
+  iterations integer,               -- number of measured iterations
+  warmup integer DEFAULT 0,         -- number of iterations not measured
+  phase text DEFAULT 'execution'    -- execution, planning or total
+)
+    RETURNS tinyhist
+    AS 'tinyhist', 'tinyhist_bench'
+    LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION tinyhist_load(
+  in  path text,                    -- server-side file
+  in  format text,                  -- csv or binary
+  in  key_column integer,           -- column with keys (NULL - no keys)
+  in  value_column integer,         -- column with values
+  in  header boolean DEFAULT false, -- skip the first line (csv)
+  out key text,
+  out hist tinyhist
+)
+    RETURNS SETOF record
+    AS 'tinyhist', 'tinyhist_load'
+    LANGUAGE C VOLATILE;
+
+REVOKE ALL ON FUNCTION tinyhist_load(text, text, integer, integer, boolean) FROM PUBLIC;
@@ -0,0 +1,17 @@
+CREATE TABLE tinyhist_bench_test (id int);
+
+-- all measured iterations are added to the histogram (warmup iterations are not)
+SELECT phase, tinyhist_count_estimate(tinyhist_bench('SELECT count(*) FROM generate_series(1, 100)', 100, 10, phase)) AS count
+  FROM (VALUES ('execution'), ('planning'), ('total')) p(phase);
+
+-- modifications are visible to the following iterations, the planning phase does not execute the query
+SELECT tinyhist_count_estimate(tinyhist_bench('INSERT INTO tinyhist_bench_test SELECT count(*) FROM tinyhist_bench_test', 50, 5)) AS count;
+SELECT tinyhist_count_estimate(tinyhist_bench('INSERT INTO tinyhist_bench_test VALUES (0)', 20, 0, 'planning')) AS count;
+SELECT count(*), max(id) FROM tinyhist_bench_test;
+
+-- invalid parameters
+SELECT tinyhist_bench('SELECT 1', 0);
+SELECT tinyhist_bench('SELECT 1', 10, -1);
+SELECT tinyhist_bench('SELECT 1', 10, 0, 'parse');
+
+DROP TABLE tinyhist_bench_test;
@@ -0,0 +1,36 @@
+CREATE TABLE tinyhist_compare_test (id int, h1 tinyhist, h2 tinyhist);
+
+-- identical histograms
+INSERT INTO tinyhist_compare_test SELECT 1, tinyhist_agg(i), tinyhist_agg(i) FROM generate_series(1,10000) s(i);
+
+-- different ranges (and units)
+INSERT INTO tinyhist_compare_test SELECT 2, tinyhist_agg(i), tinyhist_agg(i * 10) FROM generate_series(1,10000) s(i);
+INSERT INTO tinyhist_compare_test SELECT 3, tinyhist_agg(i), tinyhist_agg(i) FILTER (WHERE i <= 5000) FROM generate_series(1,10000) s(i);
+
+-- small histograms, with different sample rate and unit
+INSERT INTO tinyhist_compare_test VALUES (4, '{0, 0, 5, 3, 4, 6, 8, 10, 12, 9, 5, 2, 1, 0, 0, 0, 0, 0}', '{1, 1, 2, 1, 2, 3, 4, 6, 5, 4, 2, 1, 0, 0, 0, 0, 0, 0}');
+
+-- empty histogram
+INSERT INTO tinyhist_compare_test VALUES (5, '{0, 0, 5, 3, 4, 6, 8, 10, 12, 9, 5, 2, 1, 0, 0, 0, 0, 0}', '{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+
+SELECT id,
+       round(ks_statistic::numeric, 4) AS ks_statistic,
+       round(wasserstein::numeric, 2) AS wasserstein,
+       round(p_value::numeric, 4) AS p_value
+  FROM tinyhist_compare_test, tinyhist_compare(h1, h2) ORDER BY id;
+
+-- bulk comparison of arrays (with a NULL pair)
+SELECT pair_index,
+       round(ks_statistic::numeric, 4) AS ks_statistic,
+       round(wasserstein::numeric, 2) AS wasserstein,
+       round(p_value::numeric, 4) AS p_value
+  FROM tinyhist_compare(
+         (SELECT array_agg(h1 ORDER BY id) || NULL::tinyhist FROM tinyhist_compare_test),
+         (SELECT array_agg(h2 ORDER BY id) || NULL::tinyhist FROM tinyhist_compare_test));
+
+-- arrays of different lengths
+SELECT * FROM tinyhist_compare(
+         (SELECT array_agg(h1) FROM tinyhist_compare_test),
+         (SELECT array_agg(h2) FROM tinyhist_compare_test WHERE id > 1));
+
+DROP TABLE tinyhist_compare_test;
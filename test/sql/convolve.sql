@@ -0,0 +1,27 @@
+CREATE TABLE tinyhist_convolve_test (id int, h tinyhist);
+INSERT INTO tinyhist_convolve_test SELECT 1, tinyhist_agg(i) FROM generate_series(1,1000) s(i);
+INSERT INTO tinyhist_convolve_test SELECT 2, tinyhist_agg(i * i % 97) FROM generate_series(1,500) s(i);
+
+-- sum of independent values, spread over the overlapping buckets
+SELECT tinyhist_convolve('{0, 0, 0, 0, 0, 0, 100, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist, '{0, 0, 0, 0, 50, 50, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist);
+SELECT tinyhist_convolve(a.h, b.h) FROM tinyhist_convolve_test a, tinyhist_convolve_test b WHERE a.id = 1 AND b.id = 2;
+SELECT tinyhist_convolve(a.h, b.h)::text = tinyhist_convolve(b.h, a.h)::text AS same FROM tinyhist_convolve_test a, tinyhist_convolve_test b WHERE a.id = 1 AND b.id = 2;
+
+-- the result keeps the number of values of the larger (unsampled) input
+SELECT tinyhist_convolve('{3, 1, 0, 10, 20, 30, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist, '{0, 0, 0, 0, 50, 50, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist);
+SELECT tinyhist_convolve('{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist, '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist);
+
+-- empty input gives an empty histogram
+SELECT tinyhist_convolve('{0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist, '{0, 0, 0, 0, 0, 0, 100, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist);
+
+-- maximum of n independent values (n = 1 is the input histogram)
+SELECT tinyhist_max_of(h, 1)::text = h::text AS same FROM tinyhist_convolve_test WHERE id = 1;
+SELECT tinyhist_max_of('{0, 0, 0, 0, 50, 50, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist, 2);
+SELECT tinyhist_max_of(h, 20) FROM tinyhist_convolve_test WHERE id = 1;
+SELECT tinyhist_percentile(tinyhist_max_of(h, 20), 0.5) FROM tinyhist_convolve_test WHERE id = 1;
+SELECT tinyhist_max_of('{0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist, 10);
+
+-- errors
+SELECT tinyhist_convolve('{0, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10}'::tinyhist, '{0, 15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 10}'::tinyhist);
+SELECT tinyhist_max_of(h, 0) FROM tinyhist_convolve_test WHERE id = 1;
+DROP TABLE tinyhist_convolve_test;
@@ -0,0 +1,66 @@
+SELECT tinyhist_counter_create('tinyhist_counter_test');
+SELECT * FROM tinyhist_counters;
+
+-- writes only append deltas
+SELECT count(tinyhist_counter_add('tinyhist_counter_test', i % 3, i)) FROM generate_series(1,100) s(i);
+SELECT count(*) FROM tinyhist_counter_test_deltas;
+SELECT count(*) FROM tinyhist_counter_test;
+
+-- reads include pending deltas
+SELECT key, tinyhist_counter_get('tinyhist_counter_test', key) FROM generate_series(0,3) s(key);
+
+-- merge the deltas into the base table
+SELECT tinyhist_counter_merge('tinyhist_counter_test');
+SELECT count(*) FROM tinyhist_counter_test_deltas;
+SELECT * FROM tinyhist_counter_test ORDER BY key;
+SELECT key, tinyhist_counter_get('tinyhist_counter_test', key) FROM generate_series(0,3) s(key);
+
+-- histogram deltas, merged with the existing histogram
+SELECT tinyhist_counter_add('tinyhist_counter_test', 1, '{0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist);
+SELECT tinyhist_counter_get('tinyhist_counter_test', 1);
+SELECT tinyhist_counter_merge('tinyhist_counter_test');
+SELECT tinyhist_counter_merge('tinyhist_counter_test');
+SELECT * FROM tinyhist_counter_test ORDER BY key;
+
+-- unlogged deltas
+SELECT tinyhist_counter_create('tinyhist_counter_unlogged', true);
+SELECT relname, relpersistence FROM pg_class WHERE relname LIKE 'tinyhist_counter_unlogged%' AND relkind = 'r' ORDER BY relname;
+
+-- the worker merges deltas of all counters, a failing counter does not stop the others
+SELECT tinyhist_counter_create('tinyhist_counter_broken');
+DROP TABLE tinyhist_counter_broken_deltas;
+SELECT count(tinyhist_counter_add('tinyhist_counter_test', i % 3, i)) FROM generate_series(1,10) s(i);
+SELECT tinyhist_counter_worker_start(100) AS pid \gset
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        EXIT WHEN NOT EXISTS (SELECT 1 FROM tinyhist_counter_test_deltas);
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END;
+$$;
+SELECT count(*) FROM tinyhist_counter_test_deltas;
+SELECT * FROM tinyhist_counter_test ORDER BY key;
+SELECT count(*) FROM pg_stat_activity WHERE pid = :pid;
+SELECT pg_terminate_backend(:pid);
+
+-- counters with dropped tables fail, but can still be dropped
+\set VERBOSITY terse
+SELECT tinyhist_counter_get('tinyhist_counter_broken', 1);
+\set VERBOSITY default
+SELECT tinyhist_counter_drop('tinyhist_counter_broken');
+SELECT count(*) FROM pg_class WHERE relname LIKE 'tinyhist_counter_broken%';
+
+-- renaming the tables does not break the counter
+ALTER TABLE tinyhist_counter_unlogged_deltas RENAME TO tinyhist_counter_renamed;
+SELECT tinyhist_counter_add('tinyhist_counter_unlogged', 1, 1);
+SELECT tinyhist_counter_merge('tinyhist_counter_unlogged');
+SELECT * FROM tinyhist_counters WHERE name = 'tinyhist_counter_unlogged';
+
+-- errors
+SELECT tinyhist_counter_get('tinyhist_counter_missing', 1);
+SELECT tinyhist_counter_create('tinyhist_counter_with_a_really_long_name_that_does_not_fit');
+
+SELECT tinyhist_counter_drop('tinyhist_counter_test');
+SELECT tinyhist_counter_drop('tinyhist_counter_unlogged');
+SELECT count(*) FROM tinyhist_counters;
@@ -0,0 +1,22 @@
+CREATE TABLE tinyhist_counts_test (id int, h tinyhist);
+
+INSERT INTO tinyhist_counts_test SELECT 1, tinyhist_agg(i) FROM generate_series(1,10000) s(i);
+INSERT INTO tinyhist_counts_test VALUES (2, '{3, 2, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}');
+
+SELECT id, tinyhist_counts(h) FROM tinyhist_counts_test ORDER BY id;
+SELECT id, tinyhist_bounds(h) FROM tinyhist_counts_test ORDER BY id;
+SELECT id, tinyhist_scaled_counts(h) FROM tinyhist_counts_test ORDER BY id;
+
+-- round trip through arrays
+SELECT id, tinyhist_from_counts(0, 0, tinyhist_counts(h))::text = h::text AS same
+  FROM tinyhist_counts_test WHERE id = 1;
+SELECT tinyhist_from_counts(3, 2, tinyhist_counts(h)) FROM tinyhist_counts_test WHERE id = 2;
+
+-- invalid inputs
+SELECT tinyhist_from_counts(16, 0, '{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}');
+SELECT tinyhist_from_counts(0, -1, '{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}');
+SELECT tinyhist_from_counts(0, 0, '{0,0,0}');
+SELECT tinyhist_from_counts(0, 0, '{0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,NULL}');
+SELECT tinyhist_from_counts(0, 0, '{256,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}');
+
+DROP TABLE tinyhist_counts_test;
@@ -0,0 +1,55 @@
+CREATE TABLE tinyhist_custom_test (g int, k bigint, v double precision, h tinyhist);
+
+INSERT INTO tinyhist_custom_test SELECT i % 3, i % 2, i, tinyhist_add(NULL::tinyhist, i % 50) FROM generate_series(1,1000) s(i);
+INSERT INTO tinyhist_custom_test VALUES (NULL, NULL, NULL, NULL), (1, 0, NULL, NULL);
+
+CREATE TABLE tinyhist_custom_empty (g int, v double precision);
+
+ANALYZE tinyhist_custom_test;
+
+-- the planner hook is installed when loading the library
+LOAD 'tinyhist';
+SET tinyhist.enable_custom_agg = on;
+
+EXPLAIN (COSTS OFF) SELECT tinyhist_agg(v), tinyhist_agg(h) FROM tinyhist_custom_test;
+SELECT tinyhist_agg(v), tinyhist_agg(h) FROM tinyhist_custom_test;
+
+EXPLAIN (COSTS OFF) SELECT g, tinyhist_agg(v) FROM tinyhist_custom_test GROUP BY g;
+SELECT g, tinyhist_agg(v) FROM tinyhist_custom_test GROUP BY g ORDER BY g;
+SELECT k, g, tinyhist_agg(h) FROM tinyhist_custom_test GROUP BY g, k ORDER BY g, k;
+
+-- empty table (one group without grouping keys)
+SELECT tinyhist_agg(v) FROM tinyhist_custom_empty;
+SELECT g, tinyhist_agg(v) FROM tinyhist_custom_empty GROUP BY g;
+
+-- not supported (restrictions, expressions), uses the regular plan
+EXPLAIN (COSTS OFF) SELECT tinyhist_agg(v) FROM tinyhist_custom_test WHERE g = 1;
+EXPLAIN (COSTS OFF) SELECT tinyhist_agg(v * 2) FROM tinyhist_custom_test;
+
+-- many groups with a small work_mem get spilled, and merged from a sort
+CREATE TABLE tinyhist_custom_many (g int, k bool, v double precision);
+INSERT INTO tinyhist_custom_many SELECT i % 5000, (i % 7 = 0), i % 100 FROM generate_series(1,40000) s(i);
+INSERT INTO tinyhist_custom_many VALUES (NULL, NULL, 1), (NULL, true, 2), (1, NULL, NULL);
+ANALYZE tinyhist_custom_many;
+
+SET work_mem = '64kB';
+
+EXPLAIN (COSTS OFF) CREATE TABLE tinyhist_custom_spilled AS SELECT g, k, tinyhist_agg(v) AS h FROM tinyhist_custom_many GROUP BY g, k;
+CREATE TABLE tinyhist_custom_spilled AS SELECT g, k, tinyhist_agg(v) AS h FROM tinyhist_custom_many GROUP BY g, k;
+
+SET tinyhist.enable_custom_agg = off;
+CREATE TABLE tinyhist_custom_regular AS SELECT g, k, tinyhist_agg(v) AS h FROM tinyhist_custom_many GROUP BY g, k;
+
+RESET work_mem;
+
+SELECT count(*) FROM tinyhist_custom_spilled;
+SELECT g, k, h::text FROM tinyhist_custom_spilled EXCEPT SELECT g, k, h::text FROM tinyhist_custom_regular;
+SELECT g, k, h::text FROM tinyhist_custom_regular EXCEPT SELECT g, k, h::text FROM tinyhist_custom_spilled;
+
+RESET tinyhist.enable_custom_agg;
+
+DROP TABLE tinyhist_custom_test;
+DROP TABLE tinyhist_custom_empty;
+DROP TABLE tinyhist_custom_many;
+DROP TABLE tinyhist_custom_spilled;
+DROP TABLE tinyhist_custom_regular;
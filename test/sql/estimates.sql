@@ -0,0 +1,32 @@
+CREATE TABLE tinyhist_estimates_test (id int, h tinyhist);
+
+-- histograms with exact counts (no sampling)
+INSERT INTO tinyhist_estimates_test SELECT 1, tinyhist_agg(i) FROM generate_series(1,10000) s(i);
+INSERT INTO tinyhist_estimates_test SELECT 2, tinyhist_agg(i * 10) FROM generate_series(1,10000) s(i);
+
+-- sampled histogram (1/8 of values), and an empty one
+INSERT INTO tinyhist_estimates_test VALUES (3, '{3, 2, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}');
+INSERT INTO tinyhist_estimates_test VALUES (4, '{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+
+-- estimates for individual histograms, using both within-bucket models
+SELECT id,
+       tinyhist_count_estimate(h) AS count,
+       round(tinyhist_mean(h)::numeric, 2) AS mean,
+       round(tinyhist_mean(h, true)::numeric, 2) AS mean_log,
+       round(tinyhist_stddev(h)::numeric, 2) AS stddev,
+       round(tinyhist_stddev(h, true)::numeric, 2) AS stddev_log,
+       round(tinyhist_sum_estimate(h)::numeric, 2) AS sum,
+       round(tinyhist_sum_estimate(h, true)::numeric, 2) AS sum_log
+  FROM tinyhist_estimates_test ORDER BY id;
+
+-- estimates for an array of histograms (including a NULL element)
+SELECT tinyhist_count_estimate(a) AS count,
+       round(tinyhist_mean(a)::numeric, 2) AS mean,
+       round(tinyhist_mean(a, true)::numeric, 2) AS mean_log,
+       round(tinyhist_stddev(a)::numeric, 2) AS stddev,
+       round(tinyhist_stddev(a, true)::numeric, 2) AS stddev_log,
+       round(tinyhist_sum_estimate(a)::numeric, 2) AS sum,
+       round(tinyhist_sum_estimate(a, true)::numeric, 2) AS sum_log
+  FROM (SELECT array_agg(h) || NULL::tinyhist AS a FROM tinyhist_estimates_test) foo;
+
+DROP TABLE tinyhist_estimates_test;
@@ -0,0 +1,139 @@
+CREATE TABLE tinyhist_export_test (id int, key text, h tinyhist);
+
+INSERT INTO tinyhist_export_test VALUES (1, 'a', '{0, 1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}');
+INSERT INTO tinyhist_export_test VALUES (2, NULL, '{2, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 100}');
+INSERT INTO tinyhist_export_test VALUES (3, 'bcd', '{1, 0, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5}');
+INSERT INTO tinyhist_export_test VALUES (4, 'ignored', NULL);
+
+-- the stream starts with a continuation marker, and ends with end-of-stream marker
+SELECT length(s), substring(s from 1 for 4) AS head, substring(s from length(s) - 7) AS tail, md5(s)
+  FROM (SELECT tinyhist_arrow(key, h ORDER BY id) AS s FROM tinyhist_export_test) foo;
+
+-- decode the structure of the stream (flatbuffers metadata of the messages)
+CREATE FUNCTION arrow_int(b bytea, pos int, len int) RETURNS bigint AS $$
+DECLARE
+    v numeric := 0;
+BEGIN
+    FOR i IN REVERSE len - 1 .. 0 LOOP
+        v := v * 256 + get_byte(b, pos + i);
+    END LOOP;
+    -- signed little-endian integers
+    IF v >= 2::numeric ^ (8 * len - 1) THEN
+        v := v - 2::numeric ^ (8 * len);
+    END IF;
+    RETURN v;
+END;
+$$ LANGUAGE plpgsql;
+
+-- position of a field of a table (NULL if not present)
+CREATE FUNCTION arrow_field(b bytea, tab int, field int) RETURNS int AS $$
+DECLARE
+    vtab int := tab - arrow_int(b, tab, 4);
+    off int;
+BEGIN
+    IF 4 + 2 * field >= arrow_int(b, vtab, 2) THEN
+        RETURN NULL;
+    END IF;
+    off := arrow_int(b, vtab + 4 + 2 * field, 2);
+    RETURN CASE WHEN off = 0 THEN NULL ELSE tab + off END;
+END;
+$$ LANGUAGE plpgsql;
+
+-- follow an offset (to a table, vector or string)
+CREATE FUNCTION arrow_ref(b bytea, pos int) RETURNS int AS $$
+    SELECT pos + arrow_int(b, pos, 4)::int;
+$$ LANGUAGE sql;
+
+CREATE FUNCTION arrow_type(b bytea, field int) RETURNS text AS $$
+DECLARE
+    type_type int := coalesce(arrow_int(b, arrow_field(b, field, 2), 1), 0);
+    type int := arrow_ref(b, arrow_field(b, field, 3));
+    name int := arrow_field(b, field, 0);
+    children int := arrow_field(b, field, 5);
+    nullable bool := coalesce(arrow_int(b, arrow_field(b, field, 1), 1), 0) = 1;
+    result text;
+BEGIN
+    result := CASE WHEN name IS NULL THEN '' ELSE
+        convert_from(substring(b from arrow_ref(b, name) + 5 for arrow_int(b, arrow_ref(b, name), 4)::int), 'SQL_ASCII') || ' ' END;
+    result := result || CASE type_type
+        WHEN 2 THEN 'int' || arrow_int(b, arrow_field(b, type, 0), 4) ||
+                    CASE WHEN coalesce(arrow_int(b, arrow_field(b, type, 1), 1), 0) = 1 THEN ' signed' ELSE ' unsigned' END
+        WHEN 5 THEN 'utf8'
+        WHEN 16 THEN 'fixed_size_list[' || arrow_int(b, arrow_field(b, type, 0), 4) || ']'
+        ELSE 'type ' || type_type END;
+    IF nullable THEN
+        result := result || ' nullable';
+    END IF;
+    IF children IS NOT NULL THEN
+        children := arrow_ref(b, children);
+        FOR i IN 0 .. arrow_int(b, children, 4) - 1 LOOP
+            result := result || ' (' || arrow_type(b, arrow_ref(b, children + 4 + 4 * i)) || ')';
+        END LOOP;
+    END IF;
+    RETURN result;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION arrow_describe(b bytea) RETURNS SETOF text AS $$
+DECLARE
+    pos int := 0;
+    len int;
+    msg int;
+    header int;
+    body bigint;
+    vec int;
+BEGIN
+    LOOP
+        IF arrow_int(b, pos, 4) <> -1 THEN
+            RETURN NEXT 'missing continuation marker at ' || pos;
+            RETURN;
+        END IF;
+        len := arrow_int(b, pos + 4, 4);
+        IF len = 0 THEN
+            RETURN NEXT 'end of stream at ' || pos || ' (length ' || length(b) || ')';
+            RETURN;
+        END IF;
+        msg := arrow_ref(b, pos + 8);
+        header := arrow_ref(b, arrow_field(b, msg, 2));
+        body := coalesce(arrow_int(b, arrow_field(b, msg, 3), 8), 0);
+        CASE arrow_int(b, arrow_field(b, msg, 1), 1)
+        WHEN 1 THEN
+            vec := arrow_ref(b, arrow_field(b, header, 1));
+            RETURN NEXT 'schema (metadata ' || len || ', body ' || body || ')';
+            FOR i IN 0 .. arrow_int(b, vec, 4) - 1 LOOP
+                RETURN NEXT '  field ' || arrow_type(b, arrow_ref(b, vec + 4 + 4 * i));
+            END LOOP;
+        WHEN 3 THEN
+            RETURN NEXT 'record batch (metadata ' || len || ', body ' || body || ', length ' ||
+                        arrow_int(b, arrow_field(b, header, 0), 8) || ')';
+            vec := arrow_ref(b, arrow_field(b, header, 1));
+            FOR i IN 0 .. arrow_int(b, vec, 4) - 1 LOOP
+                RETURN NEXT '  node length ' || arrow_int(b, vec + 4 + 16 * i, 8) ||
+                            ', nulls ' || arrow_int(b, vec + 12 + 16 * i, 8);
+            END LOOP;
+            vec := arrow_ref(b, arrow_field(b, header, 2));
+            FOR i IN 0 .. arrow_int(b, vec, 4) - 1 LOOP
+                RETURN NEXT '  buffer offset ' || arrow_int(b, vec + 4 + 16 * i, 8) ||
+                            ', length ' || arrow_int(b, vec + 12 + 16 * i, 8) ||
+                            CASE WHEN arrow_int(b, vec + 4 + 16 * i, 8) + arrow_int(b, vec + 12 + 16 * i, 8) > body
+                                 THEN ' (beyond the body)' ELSE '' END;
+            END LOOP;
+        ELSE
+            RETURN NEXT 'unexpected message type ' || arrow_int(b, arrow_field(b, msg, 1), 1);
+        END CASE;
+        pos := pos + 8 + len + body::int;
+    END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+SELECT arrow_describe(tinyhist_arrow(key, h ORDER BY id)) FROM tinyhist_export_test;
+
+-- no rows
+SELECT tinyhist_arrow(key, h) IS NULL AS empty FROM tinyhist_export_test WHERE false;
+
+DROP FUNCTION arrow_describe(bytea);
+DROP FUNCTION arrow_type(bytea, int);
+DROP FUNCTION arrow_ref(bytea, int);
+DROP FUNCTION arrow_field(bytea, int, int);
+DROP FUNCTION arrow_int(bytea, int, int);
+DROP TABLE tinyhist_export_test;
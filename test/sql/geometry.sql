@@ -0,0 +1,21 @@
+-- geometry recommendations for various error targets
+SELECT e AS relative_error, n AS expected_count, a AS min_value, b AS max_value,
+       sub_buckets, buckets, min_bucket_bits, max_bucket_bits, total_bytes,
+       round(max_relative_error::numeric, 4) AS max_relative_error, tinyhist_sufficient
+  FROM (VALUES (0.5, 10000, 1, 10000), (0.34, 1000000, 1, 100000), (0.1, 1000000, 1, 100000), (0.01, 1000000, 0.1, 60000), (0.001, 100000000, 1, 3600000)) v(e, n, a, b),
+       tinyhist_geometry(e, n, a, b);
+
+-- invalid parameters
+SELECT * FROM tinyhist_geometry(0, 1000, 1, 1000);
+SELECT * FROM tinyhist_geometry(0.1, 0, 1, 1000);
+SELECT * FROM tinyhist_geometry(0.1, 1000, 1000, 1);
+SELECT * FROM tinyhist_geometry(1e-9, 1000, 1, 1000);
+
+-- observed error budget
+SELECT (b).value_count, (b).min_value, (b).max_value, (b).hist_unit, (b).hist_sample_rate,
+       round((b).max_relative_error::numeric, 4) AS max_relative_error
+  FROM (SELECT tinyhist_error_budget(i) AS b FROM generate_series(1,10000) s(i)) foo;
+SELECT (b).value_count, (b).min_value, (b).max_value, (b).hist_unit, (b).hist_sample_rate,
+       round((b).max_relative_error::numeric, 4) AS max_relative_error
+  FROM (SELECT tinyhist_error_budget(i * 10 + 5) AS b FROM generate_series(100,10000) s(i)) foo;
+SELECT tinyhist_error_budget(i) FROM generate_series(1,10) s(i) WHERE i > 10;
@@ -0,0 +1,40 @@
+CREATE TABLE tinyhist_adaptive_test (v double precision);
+
+-- values concentrated in two buckets (5-8 and 9-16)
+INSERT INTO tinyhist_adaptive_test SELECT 5 + (i % 12) FROM generate_series(1,20000) s(i);
+
+-- tinyhist has to sample, the adaptive histogram is still exact
+SELECT (tinyhist_info(tinyhist_agg(v))).hist_sample_rate > 1 AS sampled FROM tinyhist_adaptive_test;
+SELECT tinyhist_adaptive_agg(v) FROM tinyhist_adaptive_test;
+SELECT tinyhist_adaptive_layout(tinyhist_adaptive_agg(v)) FROM tinyhist_adaptive_test;
+
+-- values in other buckets change the layout
+SELECT tinyhist_adaptive_agg(v) + 1 + 1000 FROM tinyhist_adaptive_test;
+SELECT tinyhist_adaptive_layout(tinyhist_adaptive_agg(v) + 1 + 1000) FROM tinyhist_adaptive_test;
+
+-- merging histograms with different layouts
+SELECT tinyhist_adaptive_agg(h) FROM (
+  SELECT tinyhist_adaptive_agg(v) AS h FROM tinyhist_adaptive_test
+  UNION ALL
+  SELECT tinyhist_adaptive_agg((i * 37) % 10000) FROM generate_series(1,1000) s(i)
+) foo;
+SELECT tinyhist_adaptive_layout(tinyhist_adaptive_agg(h)) FROM (
+  SELECT tinyhist_adaptive_agg(v) AS h FROM tinyhist_adaptive_test
+  UNION ALL
+  SELECT tinyhist_adaptive_agg((i * 37) % 10000) FROM generate_series(1,1000) s(i)
+) foo;
+
+-- casts from/to tinyhist
+SELECT tinyhist_adaptive_agg(v)::tinyhist FROM tinyhist_adaptive_test;
+SELECT tinyhist_percentile(tinyhist_adaptive_agg(v)::tinyhist, 0.5) FROM tinyhist_adaptive_test;
+SELECT '{1, 3, 10, 0, 300, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1}'::tinyhist::tinyhist_adaptive;
+
+-- input / output
+SELECT '{0, 2, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16}'::tinyhist_adaptive;
+SELECT tinyhist_adaptive_layout('{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1073741823}');
+SELECT '{0, 0, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823, 1073741823}'::tinyhist_adaptive;
+SELECT '{16, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist_adaptive;
+SELECT '{0, 0, 1, 2}'::tinyhist_adaptive;
+SELECT tinyhist_adaptive_agg(v) + 1e12::float8 FROM tinyhist_adaptive_test;
+
+DROP TABLE tinyhist_adaptive_test;
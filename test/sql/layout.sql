@@ -0,0 +1,29 @@
+-- the counters are packed into 31 bytes, with the bucket sizes from 8 to 23 bits
+-- (the largest counts use all bits of each bucket)
+SELECT '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist;
+SELECT tinyhist_counts('{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist);
+
+-- alternating bits, to detect counters overlapping or shifted by a bit
+SELECT '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist;
+SELECT '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist;
+SELECT '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist;
+
+-- merging aligns the buckets (sample rate and unit), and packs the result
+SELECT '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist + '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist;
+SELECT '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist + '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist;
+SELECT '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist + '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist;
+SELECT '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist + '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist;
+
+-- the binary format (sample rate and the lowest byte of each bucket) matches
+-- the values sent by the build before the pack/unpack kernels were generated
+SELECT id, tinyhist_send(h) = expected AS same
+  FROM (VALUES
+       (1, '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist, '\x00ffffffffffffffffffffffffffffffff'::bytea),
+       (2, '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist, '\x0055555555555555555555555555555555'::bytea),
+       (3, '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist, '\x00aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa'::bytea),
+       (4, '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist, '\x0200efdecdbcab9a897867564534231201'::bytea),
+       (5, '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist + '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist, '\x00ffffffffffffffffffffffffffffffff'::bytea),
+       (6, '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist + '{0, 0, 255, 511, 1023, 2047, 4095, 8191, 16383, 32767, 65535, 131071, 262143, 524287, 1048575, 2097151, 4194303, 8388607}'::tinyhist, '\x01fefefefefefefefefefefefefefefefe'::bytea),
+       (7, '{0, 0, 85, 341, 341, 1365, 1365, 5461, 5461, 21845, 21845, 87381, 87381, 349525, 349525, 1398101, 1398101, 5592405}'::tinyhist + '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist, '\x048590cc8844ffbb7733eeaa6622884400'::bytea),
+       (8, '{2, 3, 0, 239, 478, 1229, 3004, 6827, 14746, 22665, 63352, 71271, 79190, 87109, 95028, 102947, 110866, 118785}'::tinyhist + '{0, 0, 170, 170, 682, 682, 2730, 2730, 10922, 10922, 43690, 43690, 174762, 174762, 699050, 699050, 2796202, 2796202}'::tinyhist, '\x046ae521dd995410cc8843ffbb77884400'::bytea)) v(id, h, expected)
+ ORDER BY id;
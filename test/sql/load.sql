@@ -0,0 +1,67 @@
+CREATE TABLE tinyhist_load_data AS
+SELECT (CASE WHEN i % 10 = 0 THEN NULL ELSE 'key, "' || (i % 3) || '"' END) AS k,
+       i % 7 AS other,
+       (CASE WHEN i % 11 = 0 THEN NULL ELSE (i * 7) % 1000 / 10.0 END)::float8 AS v
+  FROM generate_series(1, 600) s(i);
+
+-- the files are written to fixed paths in /tmp (and overwritten by the next run)
+COPY tinyhist_load_data TO '/tmp/tinyhist_load_data.csv' WITH (FORMAT csv);
+COPY tinyhist_load_data TO '/tmp/tinyhist_load_header.csv' WITH (FORMAT csv, HEADER);
+COPY tinyhist_load_data TO '/tmp/tinyhist_load_data.bin' WITH (FORMAT binary);
+COPY (VALUES ('a', 1.0::float8), ('b', 'Infinity')) TO '/tmp/tinyhist_load_infinity.csv' WITH (FORMAT csv);
+COPY (VALUES ('a', 1.0::float8), ('b', 1e10)) TO '/tmp/tinyhist_load_large.bin' WITH (FORMAT binary);
+COPY (VALUES ('\x610062'::bytea, 1.0::float8)) TO '/tmp/tinyhist_load_nul.bin' WITH (FORMAT binary);
+COPY (VALUES ('a', '1.0'), ('b', 'secret')) TO '/tmp/tinyhist_load_invalid.csv' WITH (FORMAT csv);
+COPY (SELECT repeat(chr(97 + i), 2000 + i), i FROM generate_series(0, 2) s(i)) TO '/tmp/tinyhist_load_long.csv' WITH (FORMAT csv);
+
+-- the histograms match tinyhist_agg on the same data (quoted keys, NULL keys and values)
+SELECT l.key, tinyhist_count_estimate(l.hist) AS count, l.hist::text = a.hist::text AS same
+  FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', 1, 3) l
+  JOIN (SELECT k, tinyhist_agg(v) AS hist FROM tinyhist_load_data GROUP BY k) a ON (l.key IS NOT DISTINCT FROM a.k)
+ ORDER BY 1;
+SELECT l.key, tinyhist_count_estimate(l.hist) AS count, l.hist::text = a.hist::text AS same
+  FROM tinyhist_load('/tmp/tinyhist_load_header.csv', 'csv', 1, 3, true) l
+  JOIN (SELECT k, tinyhist_agg(v) AS hist FROM tinyhist_load_data GROUP BY k) a ON (l.key IS NOT DISTINCT FROM a.k)
+ ORDER BY 1;
+SELECT l.key, tinyhist_count_estimate(l.hist) AS count, l.hist::text = a.hist::text AS same
+  FROM tinyhist_load('/tmp/tinyhist_load_data.bin', 'binary', 1, 3) l
+  JOIN (SELECT k, tinyhist_agg(v) AS hist FROM tinyhist_load_data GROUP BY k) a ON (l.key IS NOT DISTINCT FROM a.k)
+ ORDER BY 1;
+
+-- without a key column, all values are added to a single histogram
+SELECT key, tinyhist_count_estimate(hist) AS count FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', NULL, 3);
+
+-- invalid parameters and files
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'json', 1, 3);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', 1, 0);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.bin', 'binary', 1, 3, true);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', 1, 4);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_header.csv', 'csv', 1, 3);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.bin', 'binary', 1, 2);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'binary', 1, 3);
+
+-- values out of the histogram range, and keys not valid in the database encoding
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_infinity.csv', 'csv', 1, 2);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_large.bin', 'binary', 1, 2);
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_nul.bin', 'binary', 1, 2);
+
+-- the error does not show the invalid value (contents of the file)
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_invalid.csv', 'csv', 1, 2);
+
+-- keys are not limited in length
+SELECT length(key), tinyhist_count_estimate(hist) AS count FROM tinyhist_load('/tmp/tinyhist_load_long.csv', 'csv', 1, 2) ORDER BY 1;
+
+-- roles without privileges of pg_read_server_files can't read files, even with EXECUTE
+CREATE ROLE regress_tinyhist_load;
+GRANT EXECUTE ON FUNCTION tinyhist_load(text, text, integer, integer, boolean) TO regress_tinyhist_load;
+SET ROLE regress_tinyhist_load;
+SELECT * FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', 1, 3);
+RESET ROLE;
+GRANT pg_read_server_files TO regress_tinyhist_load;
+SET ROLE regress_tinyhist_load;
+SELECT count(*) FROM tinyhist_load('/tmp/tinyhist_load_data.csv', 'csv', 1, 3);
+RESET ROLE;
+REVOKE EXECUTE ON FUNCTION tinyhist_load(text, text, integer, integer, boolean) FROM regress_tinyhist_load;
+DROP ROLE regress_tinyhist_load;
+
+DROP TABLE tinyhist_load_data;
@@ -0,0 +1,44 @@
+-- durations from log_min_duration_statement, auto_explain, autovacuum and checkpoints
+-- (statements are normalized into keys, other messages are ignored)
+SELECT id, kind, key, round(duration::numeric, 3) AS duration
+  FROM (VALUES
+       (1, 'duration: 12.345 ms  statement: SELECT * FROM t WHERE id = 42 AND name = ''abc'''),
+       (2, E'duration: 5 ms  statement: SELECT\n   a1,\tb  FROM t WHERE s = ''it''''s'' LIMIT 10  '),
+       (3, 'duration: 0.120 ms  execute <unnamed>: SELECT $1::int, -2.5e-3 FROM t_2'),
+       (4, E'duration: 1500.2 ms  plan:\nQuery Text: UPDATE t SET x = 1.5e3\nUpdate on t  (cost=0.00..35.50 rows=2550 width=10)'),
+       (5, E'automatic vacuum of table "db.public.t": index scans: 1\npages: 0 removed, 45 remain\nsystem usage: CPU: user: 0.01 s, system: 0.00 s, elapsed: 0.25 s'),
+       (6, E'automatic aggressive vacuum to prevent wraparound of table "db.public.u": index scans: 0\nsystem usage: CPU: user: 0.00 s, system: 0.00 s, elapsed: 12.04 s'),
+       (7, E'automatic analyze of table "db.public.t"\navg read rate: 0.000 MB/s\nsystem usage: CPU: user: 0.00 s, system: 0.00 s, elapsed: 1.50 s'),
+       (8, 'checkpoint complete: wrote 3 buffers (0.0%); 0 WAL file(s) added, 0 removed, 0 recycled; write=0.101 s, sync=0.002 s, total=0.110 s; sync files=2, longest=0.001 s, average=0.001 s; distance=0 kB, estimate=0 kB'),
+       (9, 'restartpoint complete: wrote 0 buffers (0.0%); 0 WAL file(s) added, 0 removed, 0 recycled; write=0.001 s, sync=0.001 s, total=2.005 s; sync files=0, longest=0.000 s, average=0.000 s; distance=0 kB, estimate=0 kB'),
+       (10, 'duration: 1.000 ms'),
+       (11, 'duration: 0.050 ms  parse <unnamed>: SELECT 1'),
+       (12, 'connection received: host=[local]')) m(id, message),
+       LATERAL tinyhist_log_parse(message) p
+ ORDER BY id;
+
+-- long statements are truncated to 1kB, without splitting multibyte characters
+-- (characters are two bytes in UTF8, a single byte in single-byte encodings)
+SELECT octet_length(key) <= 1024 AS truncated,
+       (octet_length(key) - 7) % (octet_length(E'\xc3\xa9') / length(E'\xc3\xa9')) = 0 AS whole_characters
+  FROM tinyhist_log_parse('duration: 1 ms  statement: SELECT ' || repeat(E'\xc3\xa9', 600));
+
+-- csvlog records (quoted fields with commas, quotes and newlines), the incomplete record at the end is not returned
+SELECT * FROM tinyhist_log_records(E'2024-01-01 00:00:00.000 UTC,"u","db",1,"[local]",1,1,"SELECT",2024-01-01 00:00:00 UTC,1/1,0,LOG,00000,"duration: 1.500 ms  statement: SELECT \'a,b\', ""c""",,,,,,,,,"psql","client backend",,0\n'
+                                   '2024-01-01 00:00:01.000 UTC,"u","db",1,"[local]",1,2,"SELECT",2024-01-01 00:00:00 UTC,1/2,0,LOG,00000,"duration: 2 ms  statement: SELECT 1\nFROM t",,,,,,,,,"psql","client backend",,0\n'
+                                   '2024-01-01 00:00:02.000 UTC,"u","db",1,"[local]",1,3,"SELECT",2024-01-01 00:00:00 UTC,1/3,0,LOG,00000,"duration: 3 ms  statement: SEL');
+
+-- a quote at the end of the data may be an escaped one, so the record is incomplete
+SELECT * FROM tinyhist_log_records('2024-01-01 00:00:00.000 UTC,"u","db",1,"[local]",1,1,"SELECT",2024-01-01 00:00:00 UTC,1/1,0,LOG,00000,"x"');
+
+-- jsonlog records (escapes, and a record without a message), the incomplete line at the end is not returned
+SELECT * FROM tinyhist_log_records(E'{"timestamp":"2024-01-01 00:00:00.000 UTC","error_severity":"LOG","message":"duration: 1.500 ms  statement: SELECT \\"a\\",\\n\\t1 \\u0007"}\n'
+                                   '{"timestamp":"2024-01-01 00:00:01.000 UTC","error_severity":"LOG"}\n'
+                                   '{"timestamp":"2024-01-01 00:00:02.000 UTC","error_severity":"LOG","message":"checkpoint complete: total=0.1 s"}\n'
+                                   '{"timestamp":"2024-01-01 00:00:03.000 UTC","message":"dur', 'jsonlog');
+
+SELECT * FROM tinyhist_log_records('', 'csvlog');
+SELECT * FROM tinyhist_log_records('', 'stderr');
+
+-- the collection requires logging_collector, and only the worker interval is checked here
+SELECT tinyhist_log_worker_start(0);
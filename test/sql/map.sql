@@ -0,0 +1,45 @@
+CREATE TABLE tinyhist_map_test (k bigint, v double precision);
+
+INSERT INTO tinyhist_map_test SELECT i % 5, i FROM generate_series(1,500) s(i);
+INSERT INTO tinyhist_map_test VALUES (NULL, 1), (1, NULL);
+
+SELECT tinyhist_map_agg(k, v) FROM tinyhist_map_test;
+SELECT tinyhist_map_keys(tinyhist_map_agg(k, v)) FROM tinyhist_map_test;
+SELECT tinyhist_map_get(tinyhist_map_agg(k, v), 2) FROM tinyhist_map_test;
+SELECT tinyhist_map_get(tinyhist_map_agg(k, v), 5) IS NULL AS missing FROM tinyhist_map_test;
+
+-- ranges of keys (inclusive)
+SELECT f, t, tinyhist_map_range(m, f, t) FROM (SELECT tinyhist_map_agg(k, v) AS m FROM tinyhist_map_test) foo,
+  (VALUES (0, 4), (1, 3), (-10, 0), (4, 100), (5, 10), (3, 1)) r(f, t);
+
+-- many keys (the values for new keys are buffered), same as per-key histograms
+CREATE TABLE tinyhist_map_keys_test AS SELECT (i * 7919) % 3000 AS k, i % 1000 AS v FROM generate_series(1, 30000) s(i);
+
+WITH m AS (SELECT tinyhist_map_agg(k, v) AS m FROM tinyhist_map_keys_test),
+     h AS (SELECT k, tinyhist_agg(v) AS h FROM tinyhist_map_keys_test GROUP BY k)
+SELECT cardinality(tinyhist_map_keys(m)) AS keys,
+       tinyhist_map_keys(m) = (SELECT array_agg(k::bigint ORDER BY k) FROM h) AS sorted,
+       (SELECT bool_and(tinyhist_map_get(m, k)::text = h::text) FROM h) AS same
+  FROM m;
+
+-- merging maps
+WITH p AS (SELECT k % 3 AS part, tinyhist_map_agg(k, v) AS m FROM tinyhist_map_keys_test GROUP BY 1)
+SELECT tinyhist_map_agg(m)::text = (SELECT tinyhist_map_agg(k, v)::text FROM tinyhist_map_keys_test) AS same FROM p;
+WITH p AS (SELECT k % 2 AS part, tinyhist_map_agg(k, v) AS m FROM tinyhist_map_test GROUP BY 1)
+SELECT (SELECT m FROM p WHERE part = 0) + (SELECT m FROM p WHERE part = 1) AS m;
+
+-- input / output
+SELECT '{20: {0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, -3: {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 7: {0, 1, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}'::tinyhist_map;
+SELECT '{}'::tinyhist_map;
+SELECT '{1: {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 1: {0, 1, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}'::tinyhist_map;
+SELECT '{1 {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}'::tinyhist_map;
+
+-- adding values
+SELECT tinyhist_map_add('{20: {0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, -3: {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 7: {0, 1, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}', -3, 100);
+SELECT tinyhist_map_add('{20: {0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, -3: {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 7: {0, 1, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}', 10, 5);
+SELECT tinyhist_map_add(NULL, 10, 5);
+SELECT tinyhist_map_add(NULL, NULL, 5) IS NULL AS is_null;
+SELECT '{20: {0, 0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, -3: {0, 0, 1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, 7: {0, 1, 0, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}}'::tinyhist_map + NULL::tinyhist_map;
+
+DROP TABLE tinyhist_map_test;
+DROP TABLE tinyhist_map_keys_test;
@@ -0,0 +1,52 @@
+CREATE TABLE tinyhist_export_test (key text, h tinyhist);
+INSERT INTO tinyhist_export_test VALUES ('a', '{0, 0, 1, 2, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+INSERT INTO tinyhist_export_test VALUES ('x"y\z', '{1, 2, 0, 5, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+INSERT INTO tinyhist_export_test VALUES ('z', NULL);
+
+-- histograms with a key (exported as a label), and without it
+SELECT tinyhist_export_create('request_latency', 'SELECT key, h FROM tinyhist_export_test ORDER BY key', 'Request latency (ms)');
+SELECT tinyhist_export_create('total_latency', 'SELECT tinyhist_agg(h) FROM tinyhist_export_test');
+SELECT * FROM tinyhist_exports ORDER BY metric;
+
+-- cumulative buckets (scaled by the sample rate), NULL histograms are skipped
+SELECT line FROM regexp_split_to_table(tinyhist_export_openmetrics(), E'\n') AS line;
+
+-- invalid metrics
+SELECT tinyhist_export_create('1_latency', 'SELECT tinyhist_agg(h) FROM tinyhist_export_test');
+SELECT tinyhist_export_create('latency', 'SELECT key FROM tinyhist_export_test');
+SELECT tinyhist_export_create('latency', 'SELECT key, h, h FROM tinyhist_export_test');
+
+-- the worker writes into an absolute path
+SELECT tinyhist_export_worker_start('metrics.prom');
+SELECT tinyhist_export_worker_start('/tmp/metrics.prom', 0);
+
+-- a metric failing in the worker is left out, the other metrics are still written
+CREATE TABLE tinyhist_export_broken (h tinyhist);
+SELECT tinyhist_export_create('broken_latency', 'SELECT h FROM tinyhist_export_broken');
+DROP TABLE tinyhist_export_broken;
+
+-- the file is written to a fixed path (emptied first, in case it's left from a previous run),
+-- and replaced by a rename, so it's complete once it's not empty
+COPY (SELECT WHERE false) TO '/tmp/tinyhist_export.prom';
+SELECT tinyhist_export_worker_start('/tmp/tinyhist_export.prom', 100) AS pid \gset
+DO $$
+BEGIN
+    FOR i IN 1..300 LOOP
+        EXIT WHEN (pg_stat_file('/tmp/tinyhist_export.prom', true)).size > 0;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END;
+$$;
+SELECT line FROM regexp_split_to_table(pg_read_file('/tmp/tinyhist_export.prom'), E'\n') AS line;
+
+-- the worker is still running (after more than one export)
+SELECT pg_sleep(0.5);
+SELECT count(*) FROM pg_stat_activity WHERE pid = :pid;
+SELECT pg_terminate_backend(:pid);
+SELECT tinyhist_export_drop('broken_latency');
+
+SELECT tinyhist_export_drop('request_latency');
+SELECT tinyhist_export_drop('total_latency');
+SELECT tinyhist_export_drop('total_latency');
+SELECT tinyhist_export_openmetrics() = E'# EOF\n' AS empty;
+DROP TABLE tinyhist_export_test;
@@ -0,0 +1,26 @@
+CREATE TABLE tinyhist_percentile_test (g int, v double precision);
+
+INSERT INTO tinyhist_percentile_test SELECT i % 3, i FROM generate_series(1,1000) s(i);
+INSERT INTO tinyhist_percentile_test VALUES (0, NULL);
+
+SELECT approx_percentile_cont(0.5) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test;
+SELECT g, approx_percentile_cont(0.99) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test GROUP BY g ORDER BY g;
+
+-- same as the percentile of a histogram
+SELECT approx_percentile_cont(0.9) WITHIN GROUP (ORDER BY v) = tinyhist_percentile(tinyhist_agg(v), 0.9) AS same
+  FROM tinyhist_percentile_test;
+
+-- array of fractions
+SELECT approx_percentile_cont(ARRAY[0.5, NULL, 0.99]) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test;
+SELECT approx_percentile_cont('{{0.1, 0.2}, {0.3, 0.4}}'::float8[]) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test;
+
+-- no values, NULL fraction
+SELECT approx_percentile_cont(0.5) WITHIN GROUP (ORDER BY v) IS NULL AS is_null FROM tinyhist_percentile_test WHERE v > 2000;
+SELECT approx_percentile_cont(NULL::float8) WITHIN GROUP (ORDER BY v) IS NULL AS is_null FROM tinyhist_percentile_test;
+SELECT approx_percentile_cont(ARRAY[0.5]) WITHIN GROUP (ORDER BY v) IS NULL AS is_null FROM tinyhist_percentile_test WHERE v > 2000;
+
+-- invalid fractions
+SELECT approx_percentile_cont(1.5) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test;
+SELECT approx_percentile_cont(ARRAY[0.5, -1]) WITHIN GROUP (ORDER BY v) FROM tinyhist_percentile_test;
+
+DROP TABLE tinyhist_percentile_test;
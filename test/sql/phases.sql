@@ -0,0 +1,44 @@
+CREATE TABLE tinyhist_phases_test (host int, phases tinyhist[]);
+
+INSERT INTO tinyhist_phases_test SELECT 1, ARRAY[
+    (SELECT tinyhist_agg(i) FROM generate_series(1,100) s(i)),
+    (SELECT tinyhist_agg(i) FROM generate_series(1,1000) s(i)),
+    '{2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}'::tinyhist];
+INSERT INTO tinyhist_phases_test SELECT 2, ARRAY[
+    (SELECT tinyhist_agg(i) FROM generate_series(50,500) s(i)),
+    NULL,
+    '{0, 1, 255, 100, 200, 300, 400, 500, 600, 700, 800, 900, 1000, 1100, 1200, 1300, 1400, 1500}'::tinyhist];
+INSERT INTO tinyhist_phases_test SELECT 3, ARRAY[
+    (SELECT tinyhist_agg(i) FROM generate_series(1,10) s(i)),
+    (SELECT tinyhist_agg(i) FROM generate_series(1000,2000) s(i)),
+    NULL,
+    (SELECT tinyhist_agg(i) FROM generate_series(1,5) s(i))];
+INSERT INTO tinyhist_phases_test VALUES (4, NULL);
+
+-- element-wise aggregation
+SELECT i, h FROM unnest((SELECT tinyhist_agg(phases ORDER BY host) FROM tinyhist_phases_test))
+  WITH ORDINALITY AS x(h, i) ORDER BY i;
+
+-- same as merging the unnested histograms position-wise
+WITH a AS (SELECT tinyhist_agg(phases ORDER BY host) AS phases FROM tinyhist_phases_test),
+     u AS (SELECT i, tinyhist_agg(h ORDER BY host) AS h
+             FROM tinyhist_phases_test, unnest(phases) WITH ORDINALITY AS x(h, i)
+            WHERE h IS NOT NULL GROUP BY i)
+SELECT i, a.phases[i]::text = u.h::text AS same FROM a, u ORDER BY i;
+
+-- no input arrays
+SELECT tinyhist_agg(phases) IS NULL AS empty FROM tinyhist_phases_test WHERE host = 4;
+SELECT tinyhist_agg(phases) IS NULL AS empty FROM tinyhist_phases_test WHERE false;
+
+-- element-wise addition
+SELECT i, h FROM unnest((SELECT phases FROM tinyhist_phases_test WHERE host = 1) +
+                         (SELECT phases FROM tinyhist_phases_test WHERE host = 3))
+  WITH ORDINALITY AS x(h, i) ORDER BY i;
+SELECT i, h FROM unnest((SELECT phases FROM tinyhist_phases_test WHERE host = 2) +
+                         (SELECT phases FROM tinyhist_phases_test WHERE host = 1))
+  WITH ORDINALITY AS x(h, i) ORDER BY i;
+
+-- multi-dimensional arrays are not supported
+SELECT tinyhist_agg(ARRAY[ARRAY[phases[1]], ARRAY[phases[1]]]) FROM tinyhist_phases_test WHERE host = 1;
+
+DROP TABLE tinyhist_phases_test;
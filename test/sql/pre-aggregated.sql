@@ -12,3 +12,15 @@ INSERT INTO tinyhist_test SELECT tinyhist_agg(i * 10) FROM generate_series(1,100
 SELECT tinyhist_agg(h) FROM tinyhist_test;
 
 DROP TABLE tinyhist_test;
+
+-- merging must not modify the input histograms
+CREATE TABLE tinyhist_test (id int, h tinyhist);
+
+INSERT INTO tinyhist_test SELECT 1, tinyhist_agg(i) FROM generate_series(1,1000) s(i);
+INSERT INTO tinyhist_test VALUES (2, '{2, 3, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}');
+
+SELECT tinyhist_agg(h ORDER BY id) FROM tinyhist_test;
+SELECT (SELECT h FROM tinyhist_test WHERE id = 1) + (SELECT h FROM tinyhist_test WHERE id = 2);
+SELECT * FROM tinyhist_test ORDER BY id;
+
+DROP TABLE tinyhist_test;
@@ -0,0 +1,57 @@
+CREATE TABLE tinyhist_rollup_raw (ts timestamptz, service int, latency double precision);
+INSERT INTO tinyhist_rollup_raw SELECT '2024-01-01 00:00:00+00'::timestamptz + m * interval '1 minute', m % 2 + 1, (m * 7) % 50 + 1 FROM generate_series(0, 179) s(m);
+
+CREATE TABLE tinyhist_rollup_hourly (bucket timestamptz, service int, hist tinyhist);
+INSERT INTO tinyhist_rollup_hourly SELECT to_timestamp(floor(extract(epoch FROM ts) / 3600) * 3600), service, tinyhist_agg(latency) FROM tinyhist_rollup_raw GROUP BY 1, 2;
+INSERT INTO tinyhist_rollups (raw_table, time_column, value_column, rollup_table, bucket_column, hist_column, granularity) VALUES ('tinyhist_rollup_raw', 'ts', 'latency', 'tinyhist_rollup_hourly', 'bucket', 'hist', '1 hour');
+
+-- remove raw data for the second hour, to see when the rollup gets used
+DELETE FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 01:00:00+00' AND ts < '2024-01-01 02:00:00+00';
+
+-- without routing, only the raw data is used
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service;
+SELECT tinyhist_agg(latency) AS h FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:00:00+00' AND ts < '2024-01-01 03:00:00+00';
+
+-- with routing, full hours are read from the rollup (and the edges from the raw table)
+SET tinyhist.enable_rollup_routing = on;
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service;
+SELECT tinyhist_agg(latency) AS h FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:00:00+00' AND ts < '2024-01-01 03:00:00+00';
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service DESC;
+
+-- no full hours in the range, or other conditions, use only the raw data
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:10:00+00' AND ts < '2024-01-01 00:50:00+00' GROUP BY service ORDER BY service DESC;
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' AND service = 1 GROUP BY service ORDER BY service;
+
+-- the routed query does not depend on DateStyle and TimeZone (IST is ambiguous)
+SET DateStyle = 'SQL, DMY';
+SET TimeZone = 'Asia/Kolkata';
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service;
+RESET DateStyle;
+RESET TimeZone;
+
+-- rollups with intervals overflowing the timestamp range are skipped
+CREATE TABLE tinyhist_rollup_huge (bucket timestamptz, service int, hist tinyhist);
+INSERT INTO tinyhist_rollups (raw_table, time_column, value_column, rollup_table, bucket_column, hist_column, granularity) VALUES ('tinyhist_rollup_raw', 'ts', 'latency', 'tinyhist_rollup_huge', 'bucket', 'hist', '200000000 days');
+SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service;
+DELETE FROM tinyhist_rollups WHERE rollup_table = 'tinyhist_rollup_huge'::regclass;
+DROP TABLE tinyhist_rollup_huge;
+
+-- cached plans are invalidated when the rollups change, or when routing is toggled
+SET plan_cache_mode = force_generic_plan;
+PREPARE tinyhist_rollup_query AS SELECT service, tinyhist_agg(latency) FROM tinyhist_rollup_raw WHERE ts >= '2024-01-01 00:30:00+00' AND ts < '2024-01-01 02:30:00+00' GROUP BY service ORDER BY service;
+EXECUTE tinyhist_rollup_query;
+DELETE FROM tinyhist_rollups;
+EXECUTE tinyhist_rollup_query;
+INSERT INTO tinyhist_rollups (raw_table, time_column, value_column, rollup_table, bucket_column, hist_column, granularity) VALUES ('tinyhist_rollup_raw', 'ts', 'latency', 'tinyhist_rollup_hourly', 'bucket', 'hist', '1 hour');
+EXECUTE tinyhist_rollup_query;
+SET tinyhist.enable_rollup_routing = off;
+EXECUTE tinyhist_rollup_query;
+SET tinyhist.enable_rollup_routing = on;
+EXECUTE tinyhist_rollup_query;
+DEALLOCATE tinyhist_rollup_query;
+RESET plan_cache_mode;
+
+RESET tinyhist.enable_rollup_routing;
+DELETE FROM tinyhist_rollups;
+DROP TABLE tinyhist_rollup_hourly;
+DROP TABLE tinyhist_rollup_raw;
@@ -0,0 +1,34 @@
+CREATE TABLE tinyhist_scale_test (id int, h tinyhist, w double precision);
+
+INSERT INTO tinyhist_scale_test SELECT 1, tinyhist_agg(i), 1 FROM generate_series(1,10000) s(i);
+INSERT INTO tinyhist_scale_test SELECT 2, tinyhist_agg(i * 10), 4 FROM generate_series(1,1000) s(i);
+INSERT INTO tinyhist_scale_test SELECT 3, tinyhist_agg(i), 32 FROM generate_series(1,10000) s(i);
+INSERT INTO tinyhist_scale_test VALUES (4, NULL, 1);
+INSERT INTO tinyhist_scale_test VALUES (5, '{3, 2, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}', NULL);
+
+-- scaling by powers of two only changes the sample rate
+SELECT tinyhist_scale(h, 4) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_scale(h, 0.25) FROM tinyhist_scale_test WHERE id = 5;
+
+-- other factors thin the counters randomly, but the estimates stay close
+SELECT abs(tinyhist_count_estimate(tinyhist_scale(h, 100)) - 1000000) < 3000 FROM tinyhist_scale_test WHERE id = 1;
+SELECT abs(tinyhist_count_estimate(tinyhist_scale(h, 0.3)) - 3000) < 20 FROM tinyhist_scale_test WHERE id = 1;
+
+-- weighted aggregate (NULL histograms and weights are ignored)
+SELECT tinyhist_agg(h, w ORDER BY id) FROM tinyhist_scale_test;
+SELECT tinyhist_count_estimate(tinyhist_agg(h, w)) FROM tinyhist_scale_test;
+
+-- rebasing multiplies the values by a power of two
+SELECT tinyhist_rebase(h, 3) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_rebase(h, -2) FROM tinyhist_scale_test WHERE id = 5;
+SELECT tinyhist_rebase(h, -5) FROM tinyhist_scale_test WHERE id = 5;
+SELECT tinyhist_rebase(h, -10) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_rebase(h, -12) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_rebase(h, -100) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_rebase(h, 20) FROM tinyhist_scale_test WHERE id = 1;
+
+-- invalid scale factors
+SELECT tinyhist_scale(h, 0) FROM tinyhist_scale_test WHERE id = 1;
+SELECT tinyhist_scale(h, 65536) FROM tinyhist_scale_test WHERE id = 1;
+
+DROP TABLE tinyhist_scale_test;
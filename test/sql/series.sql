@@ -0,0 +1,30 @@
+CREATE TABLE tinyhist_series_test (slot int, h tinyhist);
+
+INSERT INTO tinyhist_series_test SELECT i, tinyhist_agg(j) FROM generate_series(1,20) s(i), generate_series(i * 10, i * 10 + 99) t(j) GROUP BY i;
+UPDATE tinyhist_series_test SET h = NULL WHERE slot = 7;
+
+CREATE TABLE tinyhist_series_agg_test AS SELECT tinyhist_series_agg(h ORDER BY slot) AS s FROM tinyhist_series_test;
+
+SELECT tinyhist_series_slots(s) FROM tinyhist_series_agg_test;
+
+-- ranges of slots (clamped to existing slots)
+SELECT f, t, tinyhist_series_range(s, f, t) FROM tinyhist_series_agg_test,
+  (VALUES (1, 20), (3, 17), (5, 5), (7, 7), (2, 13), (0, 100), (15, 30)) r(f, t);
+SELECT tinyhist_series_range(s, 10, 5) IS NULL AS empty FROM tinyhist_series_agg_test;
+
+-- same as merging the slots directly (no sample rate adjustments here)
+SELECT f, t, tinyhist_series_range(s, f, t)::text = (SELECT tinyhist_agg(h)::text FROM tinyhist_series_test WHERE slot BETWEEN f AND t) AS same
+  FROM tinyhist_series_agg_test, (VALUES (1, 20), (3, 17), (5, 5), (6, 8), (2, 13), (0, 100), (15, 30)) r(f, t);
+
+-- appending slots
+SELECT '[]'::tinyhist_series || '{0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist || NULL::tinyhist;
+SELECT tinyhist_series_append(NULL, '{1, 2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+WITH a AS (SELECT '[]'::tinyhist_series || '{0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist || '{1, 2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist || '{0, 0, 0, 0, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}'::tinyhist AS s)
+SELECT s::text = '[{0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {1, 2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}]' AS same, tinyhist_series_range(s, 1, 3), tinyhist_series_range(s, 2, 3) FROM a;
+
+-- input
+SELECT '[{0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {1, 2, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {0, 0, 0, 0, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}]'::tinyhist_series;
+SELECT '[{0, 0, 1}'::tinyhist_series;
+
+DROP TABLE tinyhist_series_test;
+DROP TABLE tinyhist_series_agg_test;
@@ -0,0 +1,56 @@
+-- declare boundaries
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{50, 100, 250, 500, 1000, 2500}') RETURNING id;
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{1, 10}') RETURNING id;
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{1,2,3,4,5,6,7,8,9,10,11,12,13,14,15}') RETURNING id;
+
+CREATE TABLE tinyhist_slo_test (id int, h tinyhist_slo(1));
+
+INSERT INTO tinyhist_slo_test SELECT 1, tinyhist_slo_agg(i, 1) FROM generate_series(1,3000) s(i);
+INSERT INTO tinyhist_slo_test SELECT 2, tinyhist_slo_agg(i, 1) FROM generate_series(2000,2200) s(i);
+
+SELECT * FROM tinyhist_slo_test ORDER BY id;
+SELECT id, tinyhist_slo_counts(h), tinyhist_slo_bounds(h) FROM tinyhist_slo_test ORDER BY id;
+
+-- SLO compliance is exact for the declared thresholds
+SELECT t, tinyhist_slo_compliance(h, t) FROM tinyhist_slo_test, unnest('{50, 100, 250, 500, 1000, 2500}'::float8[]) t
+  WHERE id = 1 ORDER BY t;
+SELECT tinyhist_slo_compliance(h, 300) FROM tinyhist_slo_test WHERE id = 1;
+
+-- merging
+SELECT tinyhist_slo_agg(h ORDER BY id) FROM tinyhist_slo_test;
+SELECT (SELECT h FROM tinyhist_slo_test WHERE id = 1) + (SELECT h FROM tinyhist_slo_test WHERE id = 2);
+SELECT tinyhist_slo_compliance(tinyhist_slo_agg(h), 250) FROM tinyhist_slo_test;
+SELECT (h + 10.0) + 3000.0 FROM tinyhist_slo_test WHERE id = 2;
+SELECT '{0, 3, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000}'::tinyhist_slo + '{2, 3, 1000, 2000, 3000, 4000, 5000, 6000, 7000, 8000, 9000, 10000, 11000, 12000, 13000, 14000, 15000, 16000}'::tinyhist_slo;
+SELECT h + '{0, 2, 1, 2, 3}'::tinyhist_slo FROM tinyhist_slo_test WHERE id = 1;
+
+-- input and type modifier
+SELECT '{0, 2, 1, 2, 3}'::tinyhist_slo;
+SELECT '{0, 2, 1, 2}'::tinyhist_slo;
+SELECT '{0, 4, 1, 2}'::tinyhist_slo;
+SELECT '{0, 2, 1, 2, 3'::tinyhist_slo;
+INSERT INTO tinyhist_slo_test VALUES (3, '{0, 2, 1, 2, 3}'::tinyhist_slo);
+CREATE TABLE tinyhist_slo_invalid (h tinyhist_slo(4));
+
+-- conversion from/to tinyhist
+SELECT tinyhist_agg(i)::tinyhist_slo(1) FROM generate_series(1,3000) s(i);
+SELECT tinyhist_agg(i)::tinyhist_slo FROM generate_series(1,3000) s(i);
+SELECT h::tinyhist FROM tinyhist_slo_test WHERE id = 1;
+
+-- explicit casts between boundaries redistribute the counts
+SELECT h::tinyhist_slo(2) FROM tinyhist_slo_test WHERE id = 1;
+SELECT h::tinyhist_slo(3) FROM tinyhist_slo_test WHERE id = 1;
+SELECT h::tinyhist_slo(1) FROM tinyhist_slo_test WHERE id = 1;
+SELECT '{0, 2, 1, 2, 3}'::tinyhist_slo::tinyhist_slo(1);
+
+-- the boundaries can't be modified
+UPDATE tinyhist_slo_boundaries SET bounds = '{1, 20}' WHERE id = 2;
+DELETE FROM tinyhist_slo_boundaries WHERE id = 2;
+
+-- invalid boundaries
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{}');
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{100, 50}');
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{0, 50}');
+INSERT INTO tinyhist_slo_boundaries (bounds) VALUES ('{1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16}');
+
+DROP TABLE tinyhist_slo_test;
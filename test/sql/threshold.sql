@@ -0,0 +1,23 @@
+CREATE TABLE tinyhist_threshold_test (g int, v double precision);
+
+INSERT INTO tinyhist_threshold_test SELECT i % 2, (i * 37) % 1000 FROM generate_series(1,2000) s(i);
+INSERT INTO tinyhist_threshold_test VALUES (0, NULL), (1, 'NaN');
+
+-- the thresholds don't need to be sorted (or unique)
+SELECT tinyhist_threshold_counts(v, '{100, 250, 50, 1000, 500, 250}') FROM tinyhist_threshold_test;
+
+-- same as counting with FILTER
+SELECT g, tinyhist_threshold_counts(v, '{50, 100, 250}') =
+          ARRAY[count(*) FILTER (WHERE v < 50), count(*) FILTER (WHERE v < 100), count(*) FILTER (WHERE v < 250)] AS same
+  FROM tinyhist_threshold_test GROUP BY g ORDER BY g;
+SELECT tinyhist_threshold_counts(v, '{-Infinity, 0, 999, Infinity}') FROM tinyhist_threshold_test;
+SELECT tinyhist_threshold_counts(v, '{}') FROM tinyhist_threshold_test;
+SELECT tinyhist_threshold_counts(v, '{10}') FROM tinyhist_threshold_test WHERE v IS NULL;
+
+-- invalid thresholds
+SELECT tinyhist_threshold_counts(v, NULL) FROM tinyhist_threshold_test;
+SELECT tinyhist_threshold_counts(v, '{10, NULL}') FROM tinyhist_threshold_test;
+SELECT tinyhist_threshold_counts(v, '{{10}, {20}}') FROM tinyhist_threshold_test;
+SELECT tinyhist_threshold_counts(v, ARRAY[g]) FROM tinyhist_threshold_test;
+
+DROP TABLE tinyhist_threshold_test;
@@ -0,0 +1,31 @@
+CREATE TABLE tinyhist_topk_test (key text, h tinyhist);
+
+INSERT INTO tinyhist_topk_test SELECT 'svc' || g, tinyhist_agg(i * least(g, 5)) FROM generate_series(1,1000) s(i), generate_series(1,6) g(g) GROUP BY g;
+
+-- an empty histogram and a NULL are ignored
+INSERT INTO tinyhist_topk_test VALUES ('svc7', '{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}');
+INSERT INTO tinyhist_topk_test VALUES ('svc8', NULL);
+
+-- percentiles of individual histograms
+SELECT key,
+       round(tinyhist_percentile(h, 0.5)::numeric, 2) AS p50,
+       round(tinyhist_percentile(h, 0.9)::numeric, 2) AS p90,
+       round(tinyhist_percentile(h, 0.99)::numeric, 2) AS p99
+  FROM tinyhist_topk_test WHERE key <= 'svc6' ORDER BY key;
+
+-- top-3 histograms by 99th percentile
+SELECT key, round(percentile::numeric, 2) AS percentile
+  FROM unnest((SELECT tinyhist_topk(key, h, 0.99, 3) FROM tinyhist_topk_test));
+
+-- k larger than the number of histograms (ties ordered by key)
+SELECT key, round(percentile::numeric, 2) AS percentile
+  FROM unnest((SELECT tinyhist_topk(key, h, 0.5, 10) FROM tinyhist_topk_test));
+
+-- no histograms
+SELECT tinyhist_topk(key, h, 0.99, 3) FROM tinyhist_topk_test WHERE key > 'svc6';
+
+-- invalid parameters
+SELECT tinyhist_percentile(h, 1.5) FROM tinyhist_topk_test WHERE key = 'svc1';
+SELECT tinyhist_topk(key, h, 0.99, 0) FROM tinyhist_topk_test;
+
+DROP TABLE tinyhist_topk_test;
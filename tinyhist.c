@@ -11,29 +11,142 @@
 #include <unistd.h>
 #include <limits.h>
 #include <float.h>
+#include <ctype.h>
+#include <sys/stat.h>
 
 #include "postgres.h"
 #include "access/htup_details.h"
+#include "access/stratnum.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_aggregate.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "commands/trigger.h"
+#include "common/hashfn.h"
+#include "common/int.h"
+#include "common/string.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
 #include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "miscadmin.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/planner.h"
+#include "optimizer/tlist.h"
+#include "parser/parse_func.h"
+#include "parser/parse_relation.h"
+#include "pgstat.h"
+#include "port/pg_bswap.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/syslogger.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
 #include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/float.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/resowner.h"
+#include "utils/rls.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+#include "utils/timestamp.h"
+#include "utils/tuplesort.h"
+#include "utils/typcache.h"
 #include "catalog/pg_type.h"
 #include "funcapi.h"
 
 PG_MODULE_MAGIC;
 
-#define HISTOGRAM_BUCKETS	16
-
-static int bucket_bits[]   = {8, 9, 10, 11, 12, 13, 14, 15, 16,  17,  18,  19,  20,  21,  22,  23};
-static int bucket_offset[] = {0, 8, 17, 27, 38, 50, 63, 77, 92, 108, 125, 143, 162, 182, 203, 225};
+/*
+ * Geometry of the histogram - index and size (in bits) of each bucket. The
+ * buckets are stored one after another, so the bit offsets are derived from
+ * the sizes (as offsets of char arrays in a struct with one array per bucket,
+ * each element standing for a bit). The number of buckets, the data size,
+ * the bucket_bits/bucket_offset arrays and the unrolled kernels packing and
+ * unpacking all buckets are generated from this list, so that the offsets
+ * and sizes are constants and the bit manipulation gets folded by the
+ * compiler. A different geometry only needs a different list (and a
+ * different INTERNALLENGTH of the type, if the size changes).
+ */
+#define HISTOGRAM_GEOMETRY(BUCKET) \
+	BUCKET( 0,  8) \
+	BUCKET( 1,  9) \
+	BUCKET( 2, 10) \
+	BUCKET( 3, 11) \
+	BUCKET( 4, 12) \
+	BUCKET( 5, 13) \
+	BUCKET( 6, 14) \
+	BUCKET( 7, 15) \
+	BUCKET( 8, 16) \
+	BUCKET( 9, 17) \
+	BUCKET(10, 18) \
+	BUCKET(11, 19) \
+	BUCKET(12, 20) \
+	BUCKET(13, 21) \
+	BUCKET(14, 22) \
+	BUCKET(15, 23)
+
+/* layout of the buckets (never instantiated, one char per bit) */
+#define HISTOGRAM_GEOMETRY_MEMBER(idx, bits)	char bucket_##idx[bits];
+
+typedef struct tinyhist_geometry_t {
+	HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_MEMBER)
+} tinyhist_geometry_t;
+
+#define HISTOGRAM_BUCKET_OFFSET(idx)	offsetof(tinyhist_geometry_t, bucket_##idx)
+
+/* number of buckets, and bytes needed to store them */
+#define HISTOGRAM_GEOMETRY_COUNT(idx, bits)		+ 1
+#define HISTOGRAM_BUCKETS	(0 HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_COUNT))
+#define HISTOGRAM_DATA_BYTES	((sizeof(tinyhist_geometry_t) + 7) / 8)
+
+/* sample and unit are stored in 4 bits */
+#define HISTOGRAM_MAX_SAMPLE	15
+#define HISTOGRAM_MAX_UNIT		15
+
+#define HISTOGRAM_GEOMETRY_BITS(idx, bits)		bits,
+#define HISTOGRAM_GEOMETRY_OFFSET(idx, bits)	HISTOGRAM_BUCKET_OFFSET(idx),
+
+static const int bucket_bits[]   = {HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_BITS)};
+static const int bucket_offset[] = {HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_OFFSET)};
 
 /* 32B */
 typedef struct tinyhist_t {
 	uint8		sample:4;		/* sampling rate for buckets (2^sample) */
 	uint8		unit:4;			/* size of the smallest large (2^unit) */
-	uint8		data[31];		/* buffer storing the buckets */
+	uint8		data[HISTOGRAM_DATA_BYTES];	/* buffer storing the buckets */
 } tinyhist_t;
 
+StaticAssertDecl(sizeof(tinyhist_t) == 32,
+				 "tinyhist_t has to match INTERNALLENGTH of the tinyhist type");
+
+/*
+ * Unpacked histogram, with counters stored as regular integers. Used when
+ * merging many histograms into the same state, so that we don't need to
+ * unpack/pack the counters for each merge.
+ */
+typedef struct tinyhist_unpacked_t {
+	int32		sample;			/* sampling rate for buckets (2^sample) */
+	int32		unit;			/* size of the smallest large (2^unit) */
+	int32		counts[HISTOGRAM_BUCKETS];	/* bucket counters */
+} tinyhist_unpacked_t;
+
 /* prototypes */
 PG_FUNCTION_INFO_V1(tinyhist_accum);
 PG_FUNCTION_INFO_V1(tinyhist_accum_hist);
@@ -42,6 +155,122 @@ PG_FUNCTION_INFO_V1(tinyhist_add_array);
 PG_FUNCTION_INFO_V1(tinyhist_add_hist);
 PG_FUNCTION_INFO_V1(tinyhist_buckets);
 PG_FUNCTION_INFO_V1(tinyhist_info);
+PG_FUNCTION_INFO_V1(tinyhist_mean);
+PG_FUNCTION_INFO_V1(tinyhist_mean_array);
+PG_FUNCTION_INFO_V1(tinyhist_stddev);
+PG_FUNCTION_INFO_V1(tinyhist_stddev_array);
+PG_FUNCTION_INFO_V1(tinyhist_sum_estimate);
+PG_FUNCTION_INFO_V1(tinyhist_sum_estimate_array);
+PG_FUNCTION_INFO_V1(tinyhist_count_estimate);
+PG_FUNCTION_INFO_V1(tinyhist_count_estimate_array);
+PG_FUNCTION_INFO_V1(tinyhist_compare);
+PG_FUNCTION_INFO_V1(tinyhist_compare_array);
+PG_FUNCTION_INFO_V1(tinyhist_percentile);
+PG_FUNCTION_INFO_V1(tinyhist_percentile_final);
+PG_FUNCTION_INFO_V1(tinyhist_percentile_array_final);
+PG_FUNCTION_INFO_V1(tinyhist_topk_accum);
+PG_FUNCTION_INFO_V1(tinyhist_topk_combine);
+PG_FUNCTION_INFO_V1(tinyhist_topk_serial);
+PG_FUNCTION_INFO_V1(tinyhist_topk_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_topk_final);
+PG_FUNCTION_INFO_V1(tinyhist_geometry);
+PG_FUNCTION_INFO_V1(tinyhist_budget_accum);
+PG_FUNCTION_INFO_V1(tinyhist_budget_combine);
+PG_FUNCTION_INFO_V1(tinyhist_budget_serial);
+PG_FUNCTION_INFO_V1(tinyhist_budget_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_budget_final);
+PG_FUNCTION_INFO_V1(tinyhist_scale);
+PG_FUNCTION_INFO_V1(tinyhist_rebase);
+PG_FUNCTION_INFO_V1(tinyhist_accum_hist_weighted);
+PG_FUNCTION_INFO_V1(tinyhist_counts);
+PG_FUNCTION_INFO_V1(tinyhist_bounds);
+PG_FUNCTION_INFO_V1(tinyhist_scaled_counts);
+PG_FUNCTION_INFO_V1(tinyhist_from_counts);
+PG_FUNCTION_INFO_V1(tinyhist_accum_hist_array);
+PG_FUNCTION_INFO_V1(tinyhist_array_combine);
+PG_FUNCTION_INFO_V1(tinyhist_array_serial);
+PG_FUNCTION_INFO_V1(tinyhist_array_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_array_final);
+PG_FUNCTION_INFO_V1(tinyhist_add_hist_array);
+PG_FUNCTION_INFO_V1(tinyhist_slo_check_bounds);
+PG_FUNCTION_INFO_V1(tinyhist_slo_in);
+PG_FUNCTION_INFO_V1(tinyhist_slo_out);
+PG_FUNCTION_INFO_V1(tinyhist_slo_send);
+PG_FUNCTION_INFO_V1(tinyhist_slo_recv);
+PG_FUNCTION_INFO_V1(tinyhist_slo_typmod_in);
+PG_FUNCTION_INFO_V1(tinyhist_slo_typmod_out);
+PG_FUNCTION_INFO_V1(tinyhist_slo_typmod_cast);
+PG_FUNCTION_INFO_V1(tinyhist_slo_from_tinyhist);
+PG_FUNCTION_INFO_V1(tinyhist_slo_to_tinyhist);
+PG_FUNCTION_INFO_V1(tinyhist_slo_add);
+PG_FUNCTION_INFO_V1(tinyhist_slo_add_hist);
+PG_FUNCTION_INFO_V1(tinyhist_slo_accum);
+PG_FUNCTION_INFO_V1(tinyhist_slo_accum_hist);
+PG_FUNCTION_INFO_V1(tinyhist_slo_combine);
+PG_FUNCTION_INFO_V1(tinyhist_slo_counts);
+PG_FUNCTION_INFO_V1(tinyhist_slo_bounds);
+PG_FUNCTION_INFO_V1(tinyhist_slo_compliance);
+PG_FUNCTION_INFO_V1(tinyhist_arrow_accum);
+PG_FUNCTION_INFO_V1(tinyhist_arrow_combine);
+PG_FUNCTION_INFO_V1(tinyhist_arrow_serial);
+PG_FUNCTION_INFO_V1(tinyhist_arrow_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_arrow_final);
+PG_FUNCTION_INFO_V1(tinyhist_series_in);
+PG_FUNCTION_INFO_V1(tinyhist_series_out);
+PG_FUNCTION_INFO_V1(tinyhist_series_append);
+PG_FUNCTION_INFO_V1(tinyhist_series_accum);
+PG_FUNCTION_INFO_V1(tinyhist_series_final);
+PG_FUNCTION_INFO_V1(tinyhist_series_range);
+PG_FUNCTION_INFO_V1(tinyhist_series_slots);
+PG_FUNCTION_INFO_V1(tinyhist_map_in);
+PG_FUNCTION_INFO_V1(tinyhist_map_out);
+PG_FUNCTION_INFO_V1(tinyhist_map_add);
+PG_FUNCTION_INFO_V1(tinyhist_map_add_map);
+PG_FUNCTION_INFO_V1(tinyhist_map_get);
+PG_FUNCTION_INFO_V1(tinyhist_map_range);
+PG_FUNCTION_INFO_V1(tinyhist_map_keys);
+PG_FUNCTION_INFO_V1(tinyhist_map_accum);
+PG_FUNCTION_INFO_V1(tinyhist_map_accum_map);
+PG_FUNCTION_INFO_V1(tinyhist_map_combine);
+PG_FUNCTION_INFO_V1(tinyhist_map_serial);
+PG_FUNCTION_INFO_V1(tinyhist_map_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_map_final);
+PG_FUNCTION_INFO_V1(tinyhist_threshold_accum);
+PG_FUNCTION_INFO_V1(tinyhist_threshold_combine);
+PG_FUNCTION_INFO_V1(tinyhist_threshold_serial);
+PG_FUNCTION_INFO_V1(tinyhist_threshold_deserial);
+PG_FUNCTION_INFO_V1(tinyhist_threshold_final);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_in);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_out);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_send);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_recv);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_layout);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_add);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_add_hist);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_accum);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_accum_hist);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_from_tinyhist);
+PG_FUNCTION_INFO_V1(tinyhist_adaptive_to_tinyhist);
+PG_FUNCTION_INFO_V1(tinyhist_counter_create);
+PG_FUNCTION_INFO_V1(tinyhist_counter_add);
+PG_FUNCTION_INFO_V1(tinyhist_counter_add_hist);
+PG_FUNCTION_INFO_V1(tinyhist_counter_merge);
+PG_FUNCTION_INFO_V1(tinyhist_counter_get);
+PG_FUNCTION_INFO_V1(tinyhist_counter_drop);
+PG_FUNCTION_INFO_V1(tinyhist_counter_worker_start);
+PG_FUNCTION_INFO_V1(tinyhist_convolve);
+PG_FUNCTION_INFO_V1(tinyhist_max_of);
+PG_FUNCTION_INFO_V1(tinyhist_export_create);
+PG_FUNCTION_INFO_V1(tinyhist_export_drop);
+PG_FUNCTION_INFO_V1(tinyhist_export_openmetrics);
+PG_FUNCTION_INFO_V1(tinyhist_export_worker_start);
+PG_FUNCTION_INFO_V1(tinyhist_log_parse);
+PG_FUNCTION_INFO_V1(tinyhist_log_records);
+PG_FUNCTION_INFO_V1(tinyhist_log_collect);
+PG_FUNCTION_INFO_V1(tinyhist_log_worker_start);
+PG_FUNCTION_INFO_V1(tinyhist_bench);
+PG_FUNCTION_INFO_V1(tinyhist_load);
+PG_FUNCTION_INFO_V1(tinyhist_rollups_invalidate);
 
 PG_FUNCTION_INFO_V1(tinyhist_in);
 PG_FUNCTION_INFO_V1(tinyhist_out);
@@ -56,6 +285,122 @@ Datum tinyhist_add_array(PG_FUNCTION_ARGS);
 Datum tinyhist_add_hist(PG_FUNCTION_ARGS);
 Datum tinyhist_buckets(PG_FUNCTION_ARGS);
 Datum tinyhist_info(PG_FUNCTION_ARGS);
+Datum tinyhist_mean(PG_FUNCTION_ARGS);
+Datum tinyhist_mean_array(PG_FUNCTION_ARGS);
+Datum tinyhist_stddev(PG_FUNCTION_ARGS);
+Datum tinyhist_stddev_array(PG_FUNCTION_ARGS);
+Datum tinyhist_sum_estimate(PG_FUNCTION_ARGS);
+Datum tinyhist_sum_estimate_array(PG_FUNCTION_ARGS);
+Datum tinyhist_count_estimate(PG_FUNCTION_ARGS);
+Datum tinyhist_count_estimate_array(PG_FUNCTION_ARGS);
+Datum tinyhist_compare(PG_FUNCTION_ARGS);
+Datum tinyhist_compare_array(PG_FUNCTION_ARGS);
+Datum tinyhist_percentile(PG_FUNCTION_ARGS);
+Datum tinyhist_percentile_final(PG_FUNCTION_ARGS);
+Datum tinyhist_percentile_array_final(PG_FUNCTION_ARGS);
+Datum tinyhist_topk_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_topk_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_topk_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_topk_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_topk_final(PG_FUNCTION_ARGS);
+Datum tinyhist_geometry(PG_FUNCTION_ARGS);
+Datum tinyhist_budget_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_budget_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_budget_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_budget_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_budget_final(PG_FUNCTION_ARGS);
+Datum tinyhist_scale(PG_FUNCTION_ARGS);
+Datum tinyhist_rebase(PG_FUNCTION_ARGS);
+Datum tinyhist_accum_hist_weighted(PG_FUNCTION_ARGS);
+Datum tinyhist_counts(PG_FUNCTION_ARGS);
+Datum tinyhist_bounds(PG_FUNCTION_ARGS);
+Datum tinyhist_scaled_counts(PG_FUNCTION_ARGS);
+Datum tinyhist_from_counts(PG_FUNCTION_ARGS);
+Datum tinyhist_accum_hist_array(PG_FUNCTION_ARGS);
+Datum tinyhist_array_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_array_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_array_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_array_final(PG_FUNCTION_ARGS);
+Datum tinyhist_add_hist_array(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_check_bounds(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_in(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_out(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_send(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_recv(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_typmod_in(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_typmod_out(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_typmod_cast(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_from_tinyhist(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_to_tinyhist(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_add(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_add_hist(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_accum_hist(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_counts(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_bounds(PG_FUNCTION_ARGS);
+Datum tinyhist_slo_compliance(PG_FUNCTION_ARGS);
+Datum tinyhist_arrow_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_arrow_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_arrow_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_arrow_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_arrow_final(PG_FUNCTION_ARGS);
+Datum tinyhist_series_in(PG_FUNCTION_ARGS);
+Datum tinyhist_series_out(PG_FUNCTION_ARGS);
+Datum tinyhist_series_append(PG_FUNCTION_ARGS);
+Datum tinyhist_series_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_series_final(PG_FUNCTION_ARGS);
+Datum tinyhist_series_range(PG_FUNCTION_ARGS);
+Datum tinyhist_series_slots(PG_FUNCTION_ARGS);
+Datum tinyhist_map_in(PG_FUNCTION_ARGS);
+Datum tinyhist_map_out(PG_FUNCTION_ARGS);
+Datum tinyhist_map_add(PG_FUNCTION_ARGS);
+Datum tinyhist_map_add_map(PG_FUNCTION_ARGS);
+Datum tinyhist_map_get(PG_FUNCTION_ARGS);
+Datum tinyhist_map_range(PG_FUNCTION_ARGS);
+Datum tinyhist_map_keys(PG_FUNCTION_ARGS);
+Datum tinyhist_map_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_map_accum_map(PG_FUNCTION_ARGS);
+Datum tinyhist_map_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_map_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_map_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_map_final(PG_FUNCTION_ARGS);
+Datum tinyhist_threshold_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_threshold_combine(PG_FUNCTION_ARGS);
+Datum tinyhist_threshold_serial(PG_FUNCTION_ARGS);
+Datum tinyhist_threshold_deserial(PG_FUNCTION_ARGS);
+Datum tinyhist_threshold_final(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_in(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_out(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_send(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_recv(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_layout(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_add(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_add_hist(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_accum(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_accum_hist(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_from_tinyhist(PG_FUNCTION_ARGS);
+Datum tinyhist_adaptive_to_tinyhist(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_create(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_add(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_add_hist(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_merge(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_get(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_drop(PG_FUNCTION_ARGS);
+Datum tinyhist_counter_worker_start(PG_FUNCTION_ARGS);
+Datum tinyhist_convolve(PG_FUNCTION_ARGS);
+Datum tinyhist_max_of(PG_FUNCTION_ARGS);
+Datum tinyhist_export_create(PG_FUNCTION_ARGS);
+Datum tinyhist_export_drop(PG_FUNCTION_ARGS);
+Datum tinyhist_export_openmetrics(PG_FUNCTION_ARGS);
+Datum tinyhist_export_worker_start(PG_FUNCTION_ARGS);
+Datum tinyhist_log_parse(PG_FUNCTION_ARGS);
+Datum tinyhist_log_records(PG_FUNCTION_ARGS);
+Datum tinyhist_log_collect(PG_FUNCTION_ARGS);
+Datum tinyhist_log_worker_start(PG_FUNCTION_ARGS);
+Datum tinyhist_bench(PG_FUNCTION_ARGS);
+Datum tinyhist_load(PG_FUNCTION_ARGS);
+Datum tinyhist_rollups_invalidate(PG_FUNCTION_ARGS);
 
 Datum tinyhist_in(PG_FUNCTION_ARGS);
 Datum tinyhist_out(PG_FUNCTION_ARGS);
@@ -64,62 +409,110 @@ Datum tinyhist_recv(PG_FUNCTION_ARGS);
 Datum tinyhist_combine(PG_FUNCTION_ARGS);
 
 /*
- * histogram_bucket_get
- *		returns the count for a specified histogram bucket
+ * bits_get
+ *		returns a counter stored at the given bit offset of a bitmap
  *
- * XXX Copy the appropriate bits from the bitmap. This implementation is rather
- * naive, working bit-by-bit. There probably is some smart way to do this by
- * manipulating larger bitstrings. Left as a future optimization.
+ * The counter is assembled from the bytes it spans (at most 5 bytes, for
+ * counters up to 32 bits), and then shifted and masked. With constant
+ * offset and size (as in the kernels generated from the geometry), the
+ * compiler folds this into a couple loads and shifts.
  */
-static int32
-bucket_get(tinyhist_t *hist, int bucket)
+static inline int32
+bits_get(const uint8 *data, int offset, int nbits)
 {
-	int		nbits = bucket_bits[bucket];
-	int		offset = bucket_offset[bucket];
-	int		value = 0;
+	uint64	value = 0;
+	int		first = offset / 8;
+	int		last = (offset + nbits - 1) / 8;
 
-	Assert((bucket >= 0) && (bucket < HISTOGRAM_BUCKETS));
+	if (nbits == 0)
+		return 0;
+
+	for (int i = last; i >= first; i--)
+		value = (value << 8) | data[i];
+
+	return (int32) ((value >> (offset % 8)) & ((UINT64CONST(1) << nbits) - 1));
+}
+
+/*
+ * bits_set
+ *		stores a counter at the given bit offset of a bitmap
+ *
+ * Only the nbits bits at the offset are modified (the counter is masked),
+ * the other bits in the first/last byte are preserved.
+ */
+static inline void
+bits_set(uint8 *data, int offset, int nbits, int32 count)
+{
+	uint64	mask = ((UINT64CONST(1) << nbits) - 1) << (offset % 8);
+	uint64	value = ((uint64) (uint32) count << (offset % 8)) & mask;
+	int		first = offset / 8;
+	int		last = (offset + nbits - 1) / 8;
+
+	if (nbits == 0)
+		return;
 
-	for (int i = 0; i < nbits; i++)
+	for (int i = first; i <= last; i++)
 	{
-		int	byte = (offset + i) / 8;
-		int	bit = (offset + i) % 8;
+		int		shift = (i - first) * 8;
 
-		if (hist->data[byte] & (0x1 << bit))
-			value |= (0x1 << i);
+		data[i] = (data[i] & ~(uint8) (mask >> shift)) | (uint8) (value >> shift);
 	}
+}
 
-	return value;
+/*
+ * hist_unpack_counts
+ *		unpack all bucket counters (unrolled, generated from the geometry)
+ */
+static void
+hist_unpack_counts(const tinyhist_t *hist, int32 *counts)
+{
+#define HISTOGRAM_GEOMETRY_UNPACK(idx, bits) \
+	counts[idx] = bits_get(hist->data, HISTOGRAM_BUCKET_OFFSET(idx), bits);
+
+	HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_UNPACK)
+
+#undef HISTOGRAM_GEOMETRY_UNPACK
+}
+
+/*
+ * hist_pack_counts
+ *		pack all bucket counters (unrolled, generated from the geometry)
+ */
+static void
+hist_pack_counts(tinyhist_t *hist, const int32 *counts)
+{
+#define HISTOGRAM_GEOMETRY_PACK(idx, bits) \
+	Assert(counts[idx] < (0x1 << (bits))); \
+	bits_set(hist->data, HISTOGRAM_BUCKET_OFFSET(idx), bits, counts[idx]);
+
+	HISTOGRAM_GEOMETRY(HISTOGRAM_GEOMETRY_PACK)
+
+#undef HISTOGRAM_GEOMETRY_PACK
+}
+
+/*
+ * histogram_bucket_get
+ *		returns the count for a specified histogram bucket
+ */
+static int32
+bucket_get(const tinyhist_t *hist, int bucket)
+{
+	Assert((bucket >= 0) && (bucket < HISTOGRAM_BUCKETS));
+
+	return bits_get(hist->data, bucket_offset[bucket], bucket_bits[bucket]);
 }
 
 /*
  * histogram_bucket_set
  *		stores the count into a given histogram bucket
- *
- * XXX Copy the appropriate bits to the bitmap. This implementation is rather
- * naive, working bit-by-bit. There probably is some smart way to do this by
- * manipulating larger bitstrings. Left as a future optimization.
  */
 static void
 bucket_set(tinyhist_t *hist, int bucket, int count)
 {
-	int		nbits = bucket_bits[bucket];
-	int		offset = bucket_offset[bucket];
-
 	Assert((bucket >= 0) && (bucket < HISTOGRAM_BUCKETS));
-	Assert(count < (0x1 << nbits));
+	Assert(count < (0x1 << bucket_bits[bucket]));
 
-	for (int i = 0; i < nbits; i++)
-	{
-		int	byte = (offset + i) / 8;
-		int	bit = (offset + i) % 8;
-
-		/* set or reset the bit (to overwrite the current value) */
-		if (count & (0x1 << i))
-			hist->data[byte] |= (0x1 << bit);
-		else
-			hist->data[byte] &= ~(0x1 << bit);
-	}
+	bits_set(hist->data, bucket_offset[bucket], bucket_bits[bucket], count);
 }
 
 static int32
@@ -150,13 +543,15 @@ hist_maxvalue(tinyhist_t *hist)
 static void
 hist_adjust_sample(tinyhist_t *hist)
 {
+	int32	counts[HISTOGRAM_BUCKETS];
+
 	/* cut all buckets in half */
+	hist_unpack_counts(hist, counts);
+
 	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
-	{
-		int32	cnt = bucket_get(hist, i);
+		counts[i] /= 2;
 
-		bucket_set(hist, i, cnt/2);
-	}
+	hist_pack_counts(hist, counts);
 
 	/* divide the sample rate by 2 */
 	hist->sample++;
@@ -169,89 +564,193 @@ hist_adjust_unit(tinyhist_t *hist)
 	 * We're ready to adjust the range - merge first buckets and then
 	 * shift the rest. And reset the last bucket.
 	 */
-	bucket_set(hist, 0, bucket_get(hist, 0) + bucket_get(hist, 1));
+	int32	counts[HISTOGRAM_BUCKETS];
+
+	hist_unpack_counts(hist, counts);
+
+	counts[0] += counts[1];
 
 	for (int i = 1; i < (HISTOGRAM_BUCKETS - 1); i++)
-	{
-		bucket_set(hist, i, bucket_get(hist, i + 1));
-	}
+		counts[i] = counts[i + 1];
 
-	bucket_set(hist, (HISTOGRAM_BUCKETS - 1), 0);
+	counts[HISTOGRAM_BUCKETS - 1] = 0;
+
+	hist_pack_counts(hist, counts);
 
 	hist->unit++;
 }
 
 static tinyhist_t *
-hist_copy(tinyhist_t *h)
+hist_copy(const tinyhist_t *h)
 {
 	tinyhist_t *r = palloc(sizeof(tinyhist_t));
 	memcpy(r, h, sizeof(tinyhist_t));
 	return r;
 }
 
-static tinyhist_t *
-hist_merge(tinyhist_t *hist1, tinyhist_t *hist2)
+/*
+ * hist_unpack_aligned
+ *		unpack bucket counters, aligned to the given sample rate and unit
+ *
+ * This produces the same counters as calling hist_adjust_sample and then
+ * hist_adjust_unit on the histogram, but the histogram is only read. The
+ * counters are unpacked to int32, so merging buckets can't overflow (the
+ * caller is responsible for checking the counters fit into buckets).
+ */
+static void
+hist_unpack_aligned(const tinyhist_t *hist, int sample, int unit, int32 *counts)
 {
-	int		sample,
-			unit;
+	int		sample_shift = sample - hist->sample;
+	int		unit_shift = unit - hist->unit;
+	int32	raw[HISTOGRAM_BUCKETS];
+
+	Assert((sample_shift >= 0) && (unit_shift >= 0));
+
+	/* no alignment needed */
+	if ((sample_shift == 0) && (unit_shift == 0))
+	{
+		hist_unpack_counts(hist, counts);
+		return;
+	}
+
+	hist_unpack_counts(hist, raw);
+
+	memset(counts, 0, sizeof(int32) * HISTOGRAM_BUCKETS);
 
 	/*
-	 * XXX Should we do this in a particular order? E.g. unit first and
-	 * then sample rate, or the other way around? Or it doesn't matter?
+	 * Halving the counters repeatedly is the same as a single shift. When
+	 * adjusting the unit, the first (unit_shift + 1) buckets get merged into
+	 * the first one, and the rest is shifted to the left.
 	 */
-	sample = Max(hist1->sample, hist2->sample);
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts[Max(0, i - unit_shift)] += (raw[i] >> sample_shift);
+}
+
+/*
+ * hist_unpack
+ *		unpack all bucket counters into an array
+ */
+static void
+hist_unpack(const tinyhist_t *hist, int32 *counts)
+{
+	hist_unpack_aligned(hist, hist->sample, hist->unit, counts);
+}
 
-	while (hist1->sample < sample)
-		hist_adjust_sample(hist1);
+/*
+ * hist_unpack_state
+ *		unpack histogram into an unpacked state
+ */
+static void
+hist_unpack_state(const tinyhist_t *hist, tinyhist_unpacked_t *state)
+{
+	state->sample = hist->sample;
+	state->unit = hist->unit;
 
-	while (hist2->sample < sample)
-		hist_adjust_sample(hist2);
+	hist_unpack(hist, state->counts);
+}
 
-	unit = Max(hist1->unit, hist2->unit);
+/*
+ * hist_pack_state
+ *		pack the unpacked state back into a histogram
+ */
+static void
+hist_pack_state(tinyhist_t *hist, const tinyhist_unpacked_t *state)
+{
+	hist_pack_counts(hist, state->counts);
 
-	while (hist1->unit < unit)
-		hist_adjust_unit(hist1);
+	hist->sample = state->sample;
+	hist->unit = state->unit;
+}
 
-	while (hist2->unit < unit)
-		hist_adjust_unit(hist2);
+/*
+ * hist_merge_state
+ *		merge a histogram into an unpacked state
+ *
+ * The histogram is only read, and only the state gets modified. We align
+ * both to the same sample rate and unit, and if the merged counts don't
+ * fit into the buckets, we keep reducing the sample rate until they do.
+ * The state is expected to fit into the buckets too, so that the result
+ * is the same as when merging two packed histograms.
+ */
+static void
+hist_merge_state(tinyhist_unpacked_t *state, const tinyhist_t *hist)
+{
+	int		sample,
+			unit,
+			shift;
+	int32	counts[HISTOGRAM_BUCKETS];
 
-	Assert(hist1->sample == hist2->sample);
-	Assert(hist1->unit == hist2->unit);
+	sample = Max(state->sample, hist->sample);
+	unit = Max(state->unit, hist->unit);
 
-	/*
-	 * Now check we can merge the histograms, with all counts fitting into
-	 * the buckets. If not, adjust the sample once more.
-	 */
+	/* align the state (in place), the same way hist_unpack_aligned does */
+	if ((state->sample < sample) || (state->unit < unit))
 	{
-		bool	adjust_sample = false;
+		int		sample_shift = sample - state->sample;
+		int		unit_shift = unit - state->unit;
+
+		memset(counts, 0, sizeof(counts));
 
 		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
-		{
-			int	cnt = bucket_get(hist1,i) + bucket_get(hist2,i);
+			counts[Max(0, i - unit_shift)] += (state->counts[i] >> sample_shift);
 
-			if (cnt > bucket_maxcount(i))
-			{
-				adjust_sample = true;
-				break;
-			}
-		}
+		memcpy(state->counts, counts, sizeof(counts));
+	}
 
-		if (adjust_sample)
-		{
-			hist_adjust_sample(hist1);
-			hist_adjust_sample(hist2);
-		}
+	hist_unpack_aligned(hist, sample, unit, counts);
+
+	/*
+	 * Now check we can merge the histograms, with all counts fitting into
+	 * the buckets. If not, adjust the sample (i.e. halve both inputs).
+	 */
+	shift = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		while ((state->counts[i] >> shift) + (counts[i] >> shift) > bucket_maxcount(i))
+			shift++;
 	}
 
+	if (sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("merged histogram sample rate out of range")));
+
 	/* OK, time to do the merge */
 	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
-	{
-		int	cnt = bucket_get(hist1,i) + bucket_get(hist2,i);
+		state->counts[i] = (state->counts[i] >> shift) + (counts[i] >> shift);
 
-		bucket_set(hist1, i, cnt);
-	}
+	state->sample = sample + shift;
+	state->unit = unit;
+}
+
+/*
+ * hist_merge_into
+ *		merge histograms hist1 and hist2, and store the result into dst
+ *
+ * The input histograms are only read (so it's safe to pass histograms
+ * from shared buffers etc.), and only dst gets modified. The dst may be
+ * the same as one of the inputs, as the inputs are unpacked first.
+ */
+static tinyhist_t *
+hist_merge_into(tinyhist_t *dst, const tinyhist_t *hist1, const tinyhist_t *hist2)
+{
+	tinyhist_unpacked_t state;
+
+	hist_unpack_state(hist1, &state);
+	hist_merge_state(&state, hist2);
+	hist_pack_state(dst, &state);
 
-	return hist1;
+	return dst;
+}
+
+/*
+ * hist_merge
+ *		merge histogram src into dst (src is not modified)
+ */
+static tinyhist_t *
+hist_merge(tinyhist_t *dst, const tinyhist_t *src)
+{
+	return hist_merge_into(dst, dst, src);
 }
 
 /*
@@ -327,6 +826,20 @@ bucket_index(tinyhist_t *hist, double value)
 	return idx;
 }
 
+/*
+ * random_sample
+ *		Randomly sample with 1/pow(2,sample) rate.
+ */
+static bool
+random_sample(int sample)
+{
+	int64	s = ((1L << sample) - 1);
+	int64	r = random();
+
+	/* sample if the lowest sample bits are 0 */
+	return ((r & s) == 0);
+}
+
 /*
  * hist_sample
  *		Determine if the next value should be added to the histgram.
@@ -336,11 +849,115 @@ bucket_index(tinyhist_t *hist, double value)
 static bool
 hist_sample(tinyhist_t *hist)
 {
-	int64	s = ((1L << hist->sample) - 1);
-	int64	r = random();
+	return random_sample(hist->sample);
+}
 
-	/* sample if the lowest hist->sample bits are 0 */
-	return ((r & s) == 0);
+/*
+ * hist_add
+ *		add a value to the histogram (if sampled)
+ *
+ * Adjusts the range of the histogram if needed, and reduces the sampling
+ * rate if the bucket is already full.
+ */
+static void
+hist_add(tinyhist_t *hist, double value)
+{
+	int		bucket;
+
+	/* sample this value? */
+	if (!hist_sample(hist))
+		return;
+
+	/* if needed, increase the range covered by the histogram */
+	hist_adjust_range(hist, value);
+
+	/* after ensuring sufficient range */
+	bucket = bucket_index(hist, value);
+
+	/* if the bucket is already full, reduce the sampling rate */
+	if (bucket_get(hist, bucket) == bucket_maxcount(bucket))
+		hist_adjust_sample(hist);
+
+	/*
+	 * increment the bucket
+	 *
+	 * XXX shouldn't we resample the value (if we adjusted the sample)?
+	 */
+	bucket_set(hist, bucket, bucket_get(hist, bucket) + 1);
+}
+
+/*
+ * hist_add_batch_aligned
+ *		add a batch of values by unpacking the histogram only once
+ *
+ * Only possible if all values get sampled (sample rate 1) and the counts
+ * fit into the buckets without reducing the sample rate. Then we can
+ * adjust the range to the maximum value, and increment the unpacked
+ * counts. That's the same result as adding the values one by one, as
+ * merging buckets when adjusting the range is exact. Returns false (and
+ * leaves the histogram unchanged) if not possible.
+ */
+static bool
+hist_add_batch_aligned(tinyhist_t *hist, const double *values, int nvalues)
+{
+	tinyhist_t	tmp;
+	int32		counts[HISTOGRAM_BUCKETS];
+	double		maxvalue = 0;
+
+	if (hist->sample != 0)
+		return false;
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (values[i] > maxvalue)
+			maxvalue = values[i];
+	}
+
+	/* the range the histogram would get adjusted to */
+	tmp = *hist;
+	while ((tmp.unit < HISTOGRAM_MAX_UNIT) && (hist_maxvalue(&tmp) < maxvalue))
+		tmp.unit++;
+
+	if (hist_maxvalue(&tmp) < maxvalue)
+		return false;
+
+	hist_unpack_aligned(hist, hist->sample, tmp.unit, counts);
+
+	for (int i = 0; i < nvalues; i++)
+		counts[bucket_index(&tmp, values[i])]++;
+
+	/*
+	 * The counts have to stay below the maximum, so that none of the checks
+	 * in hist_adjust_range or hist_add would reduce the sample rate.
+	 */
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (counts[i] >= bucket_maxcount(i))
+			return false;
+	}
+
+	hist_pack_counts(hist, counts);
+	hist->unit = tmp.unit;
+
+	return true;
+}
+
+/*
+ * hist_add_batch
+ *		add a batch of values to the histogram
+ *
+ * Same as calling hist_add for each value, but cheaper when the batch can
+ * be added to the unpacked counts at once (in which case no random numbers
+ * are consumed for sampling, as all values are sampled anyway).
+ */
+static void
+hist_add_batch(tinyhist_t *hist, const double *values, int nvalues)
+{
+	if (hist_add_batch_aligned(hist, values, nvalues))
+		return;
+
+	for (int i = 0; i < nvalues; i++)
+		hist_add(hist, values[i]);
 }
 
 /*
@@ -388,28 +1005,7 @@ tinyhist_accum(PG_FUNCTION_ARGS)
 
 	value = PG_GETARG_FLOAT8(1);
 
-	/* sample this value? */
-	if (hist_sample(state))
-	{
-		int	bucket;
-
-		/* if needed, increase the range covered by the histogram */
-		hist_adjust_range(state, value);
-
-		/* after ensuring sufficient range */
-		bucket = bucket_index(state, value);
-
-		/* if the bucket is already full, reduce the sampling rate */
-		if (bucket_get(state, bucket) == bucket_maxcount(bucket))
-			hist_adjust_sample(state);
-
-		/*
-		 * increment the bucket
-		 *
-		 * XXX shouldn't we resample the value (if we adjusted the sample)?
-		 */
-		bucket_set(state, bucket, bucket_get(state, bucket) + 1);
-	}
+	hist_add(state, value);
 
 	PG_RETURN_POINTER(state);
 }
@@ -497,27 +1093,7 @@ tinyhist_add(PG_FUNCTION_ARGS)
 
 	value = PG_GETARG_FLOAT8(1);
 
-	/* */
-	if (hist_sample(state))
-	{
-		int	bucket;
-
-		/* if needed, increase the range covered by the histogram */
-		hist_adjust_range(state, value);
-
-		bucket = bucket_index(state, value);
-
-		/* if the bucket is already full, reduce the sampling rate */
-		if (bucket_get(state, bucket) == bucket_maxcount(bucket))
-			hist_adjust_sample(state);
-
-		/*
-		 * increment the bucket
-		 *
-		 * XXX shouldn't we resample the value (if we adjusted the sample)?
-		 */
-		bucket_set(state, bucket, bucket_get(state, bucket) + 1);
-	}
+	hist_add(state, value);
 
 	PG_RETURN_POINTER(state);
 }
@@ -574,26 +1150,7 @@ tinyhist_add_array(PG_FUNCTION_ARGS)
 
 		value = DatumGetFloat8(values[i]);
 
-		if (hist_sample(state))
-		{
-			int bucket;
-
-			/* if needed, increase the range covered by the histogram */
-			hist_adjust_range(state, value);
-
-			bucket = bucket_index(state, value);
-
-			/* if the bucket is already full, reduce the sampling rate */
-			if (bucket_get(state, bucket) == bucket_maxcount(bucket))
-				hist_adjust_sample(state);
-
-			/*
-			 * increment the bucket
-			 *
-			 * XXX shouldn't we resample the value (if we adjusted the sample)?
-			 */
-			bucket_set(state, bucket, bucket_get(state, bucket) + 1);
-		}
+		hist_add(state, value);
 	}
 
 	PG_RETURN_POINTER(state);
@@ -617,7 +1174,7 @@ tinyhist_in(PG_FUNCTION_ARGS)
 			   &buckets[10], &buckets[11], &buckets[12], &buckets[13], &buckets[14],
 			   &buckets[15]);
 
-	if (r != 32)
+	if (r != (HISTOGRAM_BUCKETS + 2))
 		elog(ERROR, "failed to parse tinyhist value");
 
 	hist->sample = sample;
@@ -698,9 +1255,6 @@ tinyhist_combine(PG_FUNCTION_ARGS)
 	tinyhist_t	   *src;
 	tinyhist_t	   *dst;
 
-	int				unit;
-	int				sample;
-
 	MemoryContext aggcontext;
 	MemoryContext oldcontext;
 
@@ -729,64 +1283,8 @@ tinyhist_combine(PG_FUNCTION_ARGS)
 
 	dst = (tinyhist_t *) PG_GETARG_POINTER(0);
 
-	/*
-	 * Equalize the two histograms, i.e. make sure they have the same
-	 * unit and sample rate.
-	 *
-	 * XXX Should we do this in a particular order? E.g. unit first and
-	 * then sample rate, or the other way around? Or it doesn't matter?
-	 */
-	sample = Max(src->sample, dst->sample);
-
-	while (src->sample < sample)
-		hist_adjust_sample(src);
-
-	while (dst->sample < sample)
-		hist_adjust_sample(dst);
-
-	unit = Max(src->unit, dst->unit);
-
-	while (src->unit < unit)
-		hist_adjust_unit(src);
-
-	while (dst->unit < unit)
-		hist_adjust_unit(dst);
-
-	Assert(src->sample == dst->sample);
-	Assert(src->unit == dst->unit);
-
-	/*
-	 * Now check we can merge the histograms, with all counts fitting into
-	 * the buckets. If not, adjust the sample once more.
-	 */
-	{
-		bool	adjust_sample = false;
-
-		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
-		{
-			int	cnt = bucket_get(src,i) + bucket_get(dst,i);
-
-			if (cnt > bucket_maxcount(i))
-			{
-				adjust_sample = true;
-				break;
-			}
-		}
-
-		if (adjust_sample)
-		{
-			hist_adjust_sample(src);
-			hist_adjust_sample(dst);
-		}
-	}
-
-	/* OK, time to do the merge */
-	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
-	{
-		int	cnt = bucket_get(src,i) + bucket_get(dst,i);
-
-		bucket_set(dst, i, cnt);
-	}
+	/* merge the histograms into dst (src is not modified) */
+	hist_merge(dst, src);
 
 	PG_RETURN_POINTER(dst);
 }
@@ -796,6 +1294,7 @@ tinyhist_add_hist(PG_FUNCTION_ARGS)
 {
 	tinyhist_t	   *hist1;
 	tinyhist_t	   *hist2;
+	tinyhist_t	   *result;
 
 	/* If both are NULL, return NULL. Otherwise return the non-NULL one. */
 	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
@@ -809,24 +1308,16 @@ tinyhist_add_hist(PG_FUNCTION_ARGS)
 	}
 
 	/* both histograms are non-NULL */
-	hist1 = (tinyhist_t *) PG_GETARG_POINTER(1);
-	hist2 = (tinyhist_t *) PG_GETARG_POINTER(0);
+	hist1 = (tinyhist_t *) PG_GETARG_POINTER(0);
+	hist2 = (tinyhist_t *) PG_GETARG_POINTER(1);
 
 	/*
-	 * Copy the histograms, so that we can modify them when adjusting the
-	 * unit/sample rate. The copy of hist1 is used for the result.
-	 *
-	 * XXX We could try without the copy, and only do the copy if actually
-	 * needed.
+	 * The inputs are only read, so we don't need to copy them. We only
+	 * allocate the result, and merge the histograms directly into it.
 	 */
-	hist1 = hist_copy(hist1);
-	hist2 = hist_copy(hist2);
+	result = palloc0(sizeof(tinyhist_t));
 
-	/* merge histograms (into hist1) */
-	hist1 = hist_merge(hist1, hist2);
-
-	/* return hist1 */
-	PG_RETURN_POINTER(hist1);
+	PG_RETURN_POINTER(hist_merge_into(result, hist1, hist2));
 }
 
 static TupleDesc
@@ -952,3 +1443,10979 @@ tinyhist_buckets(PG_FUNCTION_ARGS)
 	else
 		SRF_RETURN_DONE(fctx);
 }
+
+/*
+ * hist_count
+ *		number of values in the histogram (raw counters, not scaled)
+ */
+static int64
+hist_count(tinyhist_t *hist)
+{
+	int64		count = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += bucket_get(hist, i);
+
+	return count;
+}
+
+/*
+ * hist_moments
+ *		accumulate estimated count, sum and sum of squares of values
+ *
+ * We don't know where exactly in the bucket the values are, so we have to
+ * pick a model. Either the values are distributed uniformly (so the bucket
+ * is represented by the midpoint), or log-uniformly (which is a better fit
+ * for the doubling buckets and data like latencies). The first bucket starts
+ * at 0, so it's always treated as uniform.
+ *
+ * The estimates are scaled by the sample rate, so that they represent the
+ * whole data set, not just the sampled values.
+ */
+static void
+hist_moments(tinyhist_t *hist, bool log_uniform,
+			 double *count, double *sum, double *sumsq)
+{
+	double		density = pow(2.0, hist->sample);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		int32		cnt = bucket_get(hist, i);
+		double		lower,
+					upper,
+					mean,
+					meansq;
+
+		if (cnt == 0)
+			continue;
+
+		lower = 0;
+		if (i > 0)
+			lower = pow(2.0, hist->unit + (i - 1));
+
+		upper = pow(2.0, hist->unit + i);
+
+		if (log_uniform && (i > 0))
+		{
+			/* the bucket upper boundary is 2x the lower, so log(upper/lower) = log(2) */
+			mean = (upper - lower) / log(2.0);
+			meansq = (upper * upper - lower * lower) / (2 * log(2.0));
+		}
+		else
+		{
+			mean = (lower + upper) / 2;
+			meansq = (lower * lower + lower * upper + upper * upper) / 3;
+		}
+
+		*count += cnt * density;
+		*sum += cnt * density * mean;
+		*sumsq += cnt * density * meansq;
+	}
+}
+
+/*
+ * hist_deconstruct_array
+ *		deconstruct an array of histograms
+ */
+static void
+hist_deconstruct_array(ArrayType *array, Datum **values, bool **nulls, int *nvalues)
+{
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+
+	deconstruct_array(array, ARR_ELEMTYPE(array),
+					  typlen, typbyval, typalign,
+					  values, nulls, nvalues);
+}
+
+/*
+ * hist_array_moments
+ *		accumulate moments for all histograms in an array
+ *
+ * NULL elements are ignored. The histograms are not merged (which might
+ * require adjusting the sample rate and lose some accuracy), we simply
+ * sum the estimates for each histogram.
+ */
+static void
+hist_array_moments(ArrayType *array, bool log_uniform,
+				   double *count, double *sum, double *sumsq)
+{
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+
+	hist_deconstruct_array(array, &values, &nulls, &nvalues);
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		/* ignore NULL values */
+		if (nulls[i])
+			continue;
+
+		hist_moments((tinyhist_t *) DatumGetPointer(values[i]), log_uniform,
+					 count, sum, sumsq);
+	}
+}
+
+/*
+ * hist_stddev
+ *		standard deviation calculated from the moments
+ *
+ * This is the population standard deviation, as we don't know the exact
+ * number of values anyway. The within-bucket model may produce slightly
+ * negative variance due to rounding errors, so clamp it to 0.
+ */
+static double
+hist_stddev(double count, double sum, double sumsq)
+{
+	double		mean = sum / count;
+	double		variance = sumsq / count - mean * mean;
+
+	return sqrt(Max(variance, 0.0));
+}
+
+/*
+ * hist_count_estimate
+ *		estimated number of values represented by the histogram
+ *
+ * The raw count of values in the buckets, scaled by the sample rate.
+ */
+static int64
+hist_count_estimate(tinyhist_t *hist)
+{
+	return (hist_count(hist) << hist->sample);
+}
+
+/*
+ * tinyhist_mean
+ *		estimate the mean of values represented by the histogram
+ */
+Datum
+tinyhist_mean(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_moments((tinyhist_t *) PG_GETARG_POINTER(0), PG_GETARG_BOOL(1),
+				 &count, &sum, &sumsq);
+
+	/* no values, no mean */
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(sum / count);
+}
+
+/*
+ * tinyhist_mean_array
+ *		estimate the mean of values represented by an array of histograms
+ */
+Datum
+tinyhist_mean_array(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_array_moments(PG_GETARG_ARRAYTYPE_P(0), PG_GETARG_BOOL(1),
+					   &count, &sum, &sumsq);
+
+	/* no values, no mean */
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(sum / count);
+}
+
+/*
+ * tinyhist_stddev
+ *		estimate the standard deviation of values represented by the histogram
+ */
+Datum
+tinyhist_stddev(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_moments((tinyhist_t *) PG_GETARG_POINTER(0), PG_GETARG_BOOL(1),
+				 &count, &sum, &sumsq);
+
+	/* no values, no standard deviation */
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(hist_stddev(count, sum, sumsq));
+}
+
+/*
+ * tinyhist_stddev_array
+ *		estimate the standard deviation of values represented by an array of
+ *		histograms
+ */
+Datum
+tinyhist_stddev_array(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_array_moments(PG_GETARG_ARRAYTYPE_P(0), PG_GETARG_BOOL(1),
+					   &count, &sum, &sumsq);
+
+	/* no values, no standard deviation */
+	if (count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(hist_stddev(count, sum, sumsq));
+}
+
+/*
+ * tinyhist_sum_estimate
+ *		estimate the sum of values represented by the histogram
+ */
+Datum
+tinyhist_sum_estimate(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_moments((tinyhist_t *) PG_GETARG_POINTER(0), PG_GETARG_BOOL(1),
+				 &count, &sum, &sumsq);
+
+	PG_RETURN_FLOAT8(sum);
+}
+
+/*
+ * tinyhist_sum_estimate_array
+ *		estimate the sum of values represented by an array of histograms
+ */
+Datum
+tinyhist_sum_estimate_array(PG_FUNCTION_ARGS)
+{
+	double		count = 0,
+				sum = 0,
+				sumsq = 0;
+
+	hist_array_moments(PG_GETARG_ARRAYTYPE_P(0), PG_GETARG_BOOL(1),
+					   &count, &sum, &sumsq);
+
+	PG_RETURN_FLOAT8(sum);
+}
+
+/*
+ * tinyhist_count_estimate
+ *		estimate the number of values represented by the histogram
+ */
+Datum
+tinyhist_count_estimate(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_INT64(hist_count_estimate(hist));
+}
+
+/*
+ * tinyhist_count_estimate_array
+ *		estimate the number of values represented by an array of histograms
+ */
+Datum
+tinyhist_count_estimate_array(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+	int64		count = 0;
+
+	hist_deconstruct_array(array, &values, &nulls, &nvalues);
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		/* ignore NULL values */
+		if (nulls[i])
+			continue;
+
+		count += hist_count_estimate((tinyhist_t *) DatumGetPointer(values[i]));
+	}
+
+	PG_RETURN_INT64(count);
+}
+
+/*
+ * hist_aligned_counts
+ *		bucket counts scaled by the sample rate, aligned to a given unit
+ *
+ * This is similar to what hist_adjust_unit/hist_adjust_sample do when
+ * merging histograms, except that we only read the histogram and store
+ * the result into an array of doubles. So there's no need to copy the
+ * histogram, and no precision is lost by halving the counters.
+ */
+static void
+hist_aligned_counts(tinyhist_t *hist, int unit, double *counts)
+{
+	int			shift = unit - hist->unit;
+	double		density = pow(2.0, hist->sample);
+
+	Assert(shift >= 0);
+
+	memset(counts, 0, sizeof(double) * HISTOGRAM_BUCKETS);
+
+	/* the first (shift+1) buckets get merged into the first one */
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts[Max(0, i - shift)] += bucket_get(hist, i) * density;
+}
+
+/*
+ * abs_linear_integral
+ *		integral of |f(x)| for f linear on an interval, given the endpoints
+ *
+ * If the function changes sign in the interval, the integral consists of
+ * two triangles, otherwise it's a trapezoid.
+ */
+static double
+abs_linear_integral(double f0, double f1, double width)
+{
+	if ((f0 >= 0 && f1 >= 0) || (f0 <= 0 && f1 <= 0))
+		return width * fabs(f0 + f1) / 2;
+
+	return width * (f0 * f0 + f1 * f1) / (2 * (fabs(f0) + fabs(f1)));
+}
+
+/*
+ * kolmogorov_pvalue
+ *		asymptotic p-value of the Kolmogorov-Smirnov statistic
+ *
+ * Evaluates Q(lambda) = 2 * sum_{j>=1} (-1)^(j-1) * exp(-2 j^2 lambda^2),
+ * until the terms get negligible. For small lambda the series does not
+ * converge, but then the p-value is (close to) 1.
+ */
+static double
+kolmogorov_pvalue(double lambda)
+{
+	double		a2 = -2.0 * lambda * lambda;
+	double		fac = 2.0;
+	double		sum = 0.0;
+	double		termbf = 0.0;
+
+	for (int j = 1; j <= 100; j++)
+	{
+		double		term = fac * exp(a2 * j * j);
+
+		sum += term;
+
+		if (fabs(term) <= 0.001 * termbf || fabs(term) <= 1.0e-8 * sum)
+			return Min(Max(sum, 0.0), 1.0);
+
+		fac = -fac;
+		termbf = fabs(term);
+	}
+
+	return 1.0;
+}
+
+/*
+ * hist_compare
+ *		compare distributions represented by two histograms
+ *
+ * Calculates the Kolmogorov-Smirnov statistic, the Wasserstein (earth
+ * mover's) distance and an approximate p-value for the KS test. The
+ * histograms are aligned to the same unit, and the counts are scaled by
+ * the sample rate, without modifying the histograms.
+ *
+ * The KS statistic is evaluated at bucket boundaries only, so it may be
+ * lower than for the raw data (and the p-value higher). The Wasserstein
+ * distance assumes values are distributed uniformly within buckets, i.e.
+ * the CDF is linear between bucket boundaries. The p-value uses the raw
+ * counters as the sample sizes, because that's how many values were
+ * actually sampled into the histograms.
+ *
+ * Returns false if either histogram is empty.
+ */
+static bool
+hist_compare(tinyhist_t *hist1, tinyhist_t *hist2,
+			 double *ks, double *wasserstein, double *pvalue)
+{
+	int			unit = Max(hist1->unit, hist2->unit);
+	double		counts1[HISTOGRAM_BUCKETS],
+				counts2[HISTOGRAM_BUCKETS];
+	double		total1 = 0,
+				total2 = 0;
+	int64		n1 = 0,
+				n2 = 0;
+	double		cdf1 = 0,
+				cdf2 = 0,
+				prev = 0;
+	double		n;
+
+	hist_aligned_counts(hist1, unit, counts1);
+	hist_aligned_counts(hist2, unit, counts2);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total1 += counts1[i];
+		total2 += counts2[i];
+
+		n1 += bucket_get(hist1, i);
+		n2 += bucket_get(hist2, i);
+	}
+
+	if ((total1 == 0) || (total2 == 0))
+		return false;
+
+	*ks = 0;
+	*wasserstein = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		double		lower,
+					upper,
+					diff;
+
+		lower = 0;
+		if (i > 0)
+			lower = pow(2.0, unit + (i - 1));
+
+		upper = pow(2.0, unit + i);
+
+		cdf1 += counts1[i] / total1;
+		cdf2 += counts2[i] / total2;
+
+		diff = cdf1 - cdf2;
+
+		*ks = Max(*ks, fabs(diff));
+		*wasserstein += abs_linear_integral(prev, diff, upper - lower);
+
+		prev = diff;
+	}
+
+	/* effective sample size, with the usual small-sample correction */
+	n = (double) n1 * n2 / (n1 + n2);
+	*pvalue = kolmogorov_pvalue((sqrt(n) + 0.12 + 0.11 / sqrt(n)) * (*ks));
+
+	return true;
+}
+
+/*
+ * tinyhist_compare
+ *		compare distributions represented by two histograms
+ */
+Datum
+tinyhist_compare(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist1 = (tinyhist_t *) PG_GETARG_POINTER(0);
+	tinyhist_t *hist2 = (tinyhist_t *) PG_GETARG_POINTER(1);
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {0};
+	double		ks,
+				wasserstein,
+				pvalue;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (hist_compare(hist1, hist2, &ks, &wasserstein, &pvalue))
+	{
+		values[0] = Float8GetDatum(ks);
+		values[1] = Float8GetDatum(wasserstein);
+		values[2] = Float8GetDatum(pvalue);
+	}
+	else
+		memset(nulls, 1, sizeof(nulls));
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* state for the tinyhist_compare_array SRF */
+typedef struct compare_state_t
+{
+	TupleDesc	tupdesc;
+	Datum	   *values1;
+	Datum	   *values2;
+	bool	   *nulls1;
+	bool	   *nulls2;
+} compare_state_t;
+
+/*
+ * tinyhist_compare_array
+ *		compare pairs of histograms from two arrays
+ *
+ * Returns one row per pair of histograms at the same position. Rows for
+ * pairs with a NULL or empty histogram have NULL statistics.
+ */
+Datum
+tinyhist_compare_array(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	compare_state_t *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext mctx;
+		int			nvalues1,
+					nvalues2;
+
+		fctx = SRF_FIRSTCALL_INIT();
+
+		mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+		state = palloc0(sizeof(compare_state_t));
+
+		/* Build a tuple descriptor for our result type */
+		if (get_call_result_type(fcinfo, NULL, &state->tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		state->tupdesc = BlessTupleDesc(state->tupdesc);
+
+		hist_deconstruct_array(PG_GETARG_ARRAYTYPE_P(0),
+							   &state->values1, &state->nulls1, &nvalues1);
+
+		hist_deconstruct_array(PG_GETARG_ARRAYTYPE_P(1),
+							   &state->values2, &state->nulls2, &nvalues2);
+
+		if (nvalues1 != nvalues2)
+			ereport(ERROR,
+					(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+					 errmsg("arrays of histograms must have the same length")));
+
+		fctx->user_fctx = state;
+		fctx->max_calls = nvalues1;
+
+		MemoryContextSwitchTo(mctx);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	state = (compare_state_t *) fctx->user_fctx;
+
+	if (fctx->call_cntr < fctx->max_calls)
+	{
+		int			i = fctx->call_cntr;
+		Datum		values[4];
+		bool		nulls[4] = {0};
+		double		ks,
+					wasserstein,
+					pvalue;
+
+		values[0] = Int32GetDatum(i + 1);
+
+		if (!state->nulls1[i] && !state->nulls2[i] &&
+			hist_compare((tinyhist_t *) DatumGetPointer(state->values1[i]),
+						 (tinyhist_t *) DatumGetPointer(state->values2[i]),
+						 &ks, &wasserstein, &pvalue))
+		{
+			values[1] = Float8GetDatum(ks);
+			values[2] = Float8GetDatum(wasserstein);
+			values[3] = Float8GetDatum(pvalue);
+		}
+		else
+			nulls[1] = nulls[2] = nulls[3] = true;
+
+		SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(heap_form_tuple(state->tupdesc, values, nulls)));
+	}
+	else
+		SRF_RETURN_DONE(fctx);
+}
+
+/*
+ * hist_percentile
+ *		approximate percentile of values represented by the histogram
+ *
+ * Finds the bucket containing the requested fraction of values, and then
+ * interpolates within the bucket, assuming the values are distributed
+ * uniformly. The sample rate does not matter, as it affects all buckets
+ * in the same way.
+ *
+ * XXX Should only be called for non-empty histograms.
+ */
+static double
+hist_percentile(tinyhist_t *hist, double fraction)
+{
+	int64		total = 0,
+				cumulative = 0;
+	double		target;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += bucket_get(hist, i);
+
+	Assert(total > 0);
+
+	target = fraction * total;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		int32		cnt = bucket_get(hist, i);
+		double		lower,
+					upper;
+
+		if ((cnt == 0) || (cumulative + cnt < target))
+		{
+			cumulative += cnt;
+			continue;
+		}
+
+		lower = 0;
+		if (i > 0)
+			lower = pow(2.0, hist->unit + (i - 1));
+
+		upper = pow(2.0, hist->unit + i);
+
+		return lower + (upper - lower) * (target - cumulative) / cnt;
+	}
+
+	/* not reachable for non-empty histograms */
+	return hist_maxvalue(hist);
+}
+
+static void
+check_fraction(double fraction)
+{
+	if ((fraction < 0.0) || (fraction > 1.0) || isnan(fraction))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("fraction %g is out of range [0.0, 1.0]", fraction)));
+}
+
+/*
+ * tinyhist_percentile
+ *		approximate percentile of values represented by the histogram
+ */
+Datum
+tinyhist_percentile(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+	double		fraction = PG_GETARG_FLOAT8(1);
+
+	check_fraction(fraction);
+
+	/* no values, no percentile */
+	if (hist_count(hist) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(hist_percentile(hist, fraction));
+}
+
+/*
+ * tinyhist_percentile_final
+ *		final function for the approx_percentile_cont ordered-set aggregate
+ *
+ * The values are not sorted, the transition function simply adds them to
+ * a histogram (the ORDER BY only determines the type of values). The
+ * remaining argument is the dummy one for the aggregated value.
+ */
+Datum
+tinyhist_percentile_final(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist;
+	double		fraction;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_percentile_final called in non-aggregate context");
+
+	/* same as percentile_cont, NULL fraction means NULL result */
+	if (PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	fraction = PG_GETARG_FLOAT8(1);
+
+	check_fraction(fraction);
+
+	/* no values, no percentile */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+
+	if (hist_count(hist) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(hist_percentile(hist, fraction));
+}
+
+/*
+ * tinyhist_percentile_array_final
+ *		final function for the approx_percentile_cont(fraction[]) aggregate
+ *
+ * Returns an array with the same dimensions as the array of fractions,
+ * with NULL fractions resulting in NULL elements.
+ */
+Datum
+tinyhist_percentile_array_final(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array;
+	tinyhist_t *hist;
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_percentile_array_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+
+	array = PG_GETARG_ARRAYTYPE_P(1);
+
+	deconstruct_array(array, FLOAT8OID,
+					  sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE,
+					  &values, &nulls, &nvalues);
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (!nulls[i])
+			check_fraction(DatumGetFloat8(values[i]));
+	}
+
+	/* no values, no percentiles */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+
+	if (hist_count(hist) == 0)
+		PG_RETURN_NULL();
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (!nulls[i])
+			values[i] = Float8GetDatum(hist_percentile(hist, DatumGetFloat8(values[i])));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(values, nulls,
+											 ARR_NDIM(array), ARR_DIMS(array),
+											 ARR_LBOUND(array), FLOAT8OID,
+											 sizeof(float8), FLOAT8PASSBYVAL,
+											 TYPALIGN_DOUBLE));
+}
+
+/*
+ * State for the tinyhist_topk aggregate.
+ *
+ * The items are kept in a binary min-heap (ordered by percentile), so the
+ * item with the lowest percentile is always at the root, and we can decide
+ * if a new item makes it into the top-k in O(1), and replace the root in
+ * O(log k). The heap is allocated lazily, as k may be fairly large while
+ * there are only few groups.
+ */
+typedef struct topk_item_t
+{
+	double		value;			/* percentile of the histogram */
+	char	   *key;			/* key identifying the histogram */
+} topk_item_t;
+
+typedef struct topk_state_t
+{
+	double		fraction;		/* requested percentile */
+	int32		k;				/* number of items to keep */
+	int32		nitems;			/* number of items in the heap */
+	int32		nallocated;		/* allocated number of items */
+	topk_item_t *items;			/* heap of items */
+} topk_state_t;
+
+/*
+ * topk_item_cmp
+ *		compare two items by the percentile value (and key for ties)
+ *
+ * For equal percentiles we prefer the lower key, so that the result does
+ * not depend on the order of input rows.
+ */
+static int
+topk_item_cmp(const topk_item_t *a, const topk_item_t *b)
+{
+	if (a->value < b->value)
+		return -1;
+	else if (a->value > b->value)
+		return 1;
+
+	return -strcmp(a->key, b->key);
+}
+
+static topk_state_t *
+topk_state_create(MemoryContext context, double fraction, int32 k)
+{
+	topk_state_t *state;
+
+	check_fraction(fraction);
+
+	if (k <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of items must be positive")));
+
+	state = MemoryContextAllocZero(context, sizeof(topk_state_t));
+
+	state->fraction = fraction;
+	state->k = k;
+
+	return state;
+}
+
+/*
+ * topk_sift_down
+ *		restore the heap property after replacing the root
+ */
+static void
+topk_sift_down(topk_state_t *state)
+{
+	int			i = 0;
+
+	while (true)
+	{
+		int			left = 2 * i + 1,
+					right = 2 * i + 2,
+					smallest = i;
+		topk_item_t tmp;
+
+		if ((left < state->nitems) &&
+			(topk_item_cmp(&state->items[left], &state->items[smallest]) < 0))
+			smallest = left;
+
+		if ((right < state->nitems) &&
+			(topk_item_cmp(&state->items[right], &state->items[smallest]) < 0))
+			smallest = right;
+
+		if (smallest == i)
+			break;
+
+		tmp = state->items[i];
+		state->items[i] = state->items[smallest];
+		state->items[smallest] = tmp;
+
+		i = smallest;
+	}
+}
+
+/*
+ * topk_add
+ *		add an item to the heap, if it makes it into the top-k
+ *
+ * The key is copied into the context only if the item gets added.
+ */
+static void
+topk_add(MemoryContext context, topk_state_t *state, double value, const char *key)
+{
+	topk_item_t item;
+
+	item.value = value;
+	item.key = (char *) key;
+
+	/* heap is full, and the item is not better than the current minimum */
+	if ((state->nitems == state->k) &&
+		(topk_item_cmp(&item, &state->items[0]) <= 0))
+		return;
+
+	item.key = MemoryContextStrdup(context, key);
+
+	/* heap is full, replace the root and sift it down */
+	if (state->nitems == state->k)
+	{
+		pfree(state->items[0].key);
+		state->items[0] = item;
+		topk_sift_down(state);
+		return;
+	}
+
+	/* make sure there's space for one more item */
+	if (state->nitems == state->nallocated)
+	{
+		state->nallocated = Min(state->k, Max(16, 2 * state->nallocated));
+
+		if (state->items == NULL)
+			state->items = MemoryContextAlloc(context,
+											  state->nallocated * sizeof(topk_item_t));
+		else
+			state->items = repalloc(state->items,
+									state->nallocated * sizeof(topk_item_t));
+	}
+
+	/* add the item at the end, and sift it up */
+	{
+		int			i = state->nitems++;
+
+		while (i > 0)
+		{
+			int			parent = (i - 1) / 2;
+
+			if (topk_item_cmp(&state->items[parent], &item) <= 0)
+				break;
+
+			state->items[i] = state->items[parent];
+			i = parent;
+		}
+
+		state->items[i] = item;
+	}
+}
+
+/*
+ * tinyhist_topk_accum
+ *		transition function for the tinyhist_topk aggregate
+ *
+ * Calculates the percentile for the histogram, and adds it into the heap.
+ * Rows with NULL key or histogram are ignored, as are empty histograms.
+ * The fraction and k are taken from the first row.
+ */
+Datum
+tinyhist_topk_accum(PG_FUNCTION_ARGS)
+{
+	topk_state_t *state;
+	tinyhist_t *hist;
+	char	   *key;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_topk_accum called in non-aggregate context");
+
+	/* if there's no aggstate allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		if (PG_ARGISNULL(3) || PG_ARGISNULL(4))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("fraction and number of items must not be NULL")));
+
+		state = topk_state_create(aggcontext, PG_GETARG_FLOAT8(3), PG_GETARG_INT32(4));
+	}
+	else
+		state = (topk_state_t *) PG_GETARG_POINTER(0);
+
+	/* skip NULL keys and histograms */
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		PG_RETURN_POINTER(state);
+
+	hist = (tinyhist_t *) PG_GETARG_POINTER(2);
+
+	/* skip empty histograms, there's no percentile */
+	if (hist_count(hist) == 0)
+		PG_RETURN_POINTER(state);
+
+	key = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	topk_add(aggcontext, state, hist_percentile(hist, state->fraction), key);
+
+	pfree(key);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_topk_combine
+ *		combine function for the tinyhist_topk aggregate
+ *
+ * Adds all items from the second state into the first one. If the first
+ * state is NULL, it's created in the aggregate context first (the second
+ * state may live in a short-lived context, so we can't just return it).
+ */
+Datum
+tinyhist_topk_combine(PG_FUNCTION_ARGS)
+{
+	topk_state_t *src;
+	topk_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_topk_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (topk_state_t *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		dst = topk_state_create(aggcontext, src->fraction, src->k);
+	else
+		dst = (topk_state_t *) PG_GETARG_POINTER(0);
+
+	for (int i = 0; i < src->nitems; i++)
+		topk_add(aggcontext, dst, src->items[i].value, src->items[i].key);
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_topk_serial
+ *		serialize the tinyhist_topk state (for parallel aggregation)
+ */
+Datum
+tinyhist_topk_serial(PG_FUNCTION_ARGS)
+{
+	topk_state_t *state = (topk_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendfloat8(&buf, state->fraction);
+	pq_sendint32(&buf, state->k);
+	pq_sendint32(&buf, state->nitems);
+
+	for (int i = 0; i < state->nitems; i++)
+	{
+		int			len = strlen(state->items[i].key);
+
+		pq_sendfloat8(&buf, state->items[i].value);
+		pq_sendint32(&buf, len);
+		pq_sendbytes(&buf, state->items[i].key, len);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_topk_deserial
+ *		deserialize the tinyhist_topk state (for parallel aggregation)
+ */
+Datum
+tinyhist_topk_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	topk_state_t *state;
+	StringInfoData buf;
+	double		fraction;
+	int32		k,
+				nitems;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_topk_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	fraction = pq_getmsgfloat8(&buf);
+	k = pq_getmsgint(&buf, 4);
+	nitems = pq_getmsgint(&buf, 4);
+
+	state = topk_state_create(CurrentMemoryContext, fraction, k);
+
+	for (int i = 0; i < nitems; i++)
+	{
+		double		value = pq_getmsgfloat8(&buf);
+		int			len = pq_getmsgint(&buf, 4);
+		char	   *key = pnstrdup(pq_getmsgbytes(&buf, len), len);
+
+		topk_add(CurrentMemoryContext, state, value, key);
+
+		pfree(key);
+	}
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+static int
+topk_item_cmp_desc(const void *a, const void *b)
+{
+	return topk_item_cmp((const topk_item_t *) b, (const topk_item_t *) a);
+}
+
+/*
+ * tinyhist_topk_final
+ *		final function for the tinyhist_topk aggregate
+ *
+ * Returns an array of (key, percentile) items, sorted by the percentile in
+ * descending order. The state is not modified, we sort a copy of the heap.
+ */
+Datum
+tinyhist_topk_final(PG_FUNCTION_ARGS)
+{
+	topk_state_t *state;
+	topk_item_t *items;
+	Oid			elemtype;
+	TupleDesc	tupdesc;
+	Datum	   *elems;
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_topk_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (topk_state_t *) PG_GETARG_POINTER(0);
+
+	if (state->nitems == 0)
+		PG_RETURN_NULL();
+
+	items = palloc(state->nitems * sizeof(topk_item_t));
+	memcpy(items, state->items, state->nitems * sizeof(topk_item_t));
+
+	qsort(items, state->nitems, sizeof(topk_item_t), topk_item_cmp_desc);
+
+	/* the aggregate returns an array of tinyhist_topk_item */
+	elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	tupdesc = TypeGetTupleDesc(elemtype, NIL);
+
+	elems = palloc(state->nitems * sizeof(Datum));
+
+	for (int i = 0; i < state->nitems; i++)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {0};
+
+		values[0] = PointerGetDatum(cstring_to_text(items[i].key));
+		values[1] = Float8GetDatum(items[i].value);
+
+		elems[i] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+	}
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, state->nitems, elemtype,
+										  typlen, typbyval, typalign));
+}
+
+/*
+ * Maximum number of sub-buckets per doubling the geometry recommendation
+ * is willing to consider (i.e. relative error ~0.0001%).
+ */
+#define GEOMETRY_MAX_SUB_BUCKETS	(1 << 20)
+
+/*
+ * geometry_bucket_bits
+ *		number of bits needed to store a count without sampling
+ */
+static int
+geometry_bucket_bits(double count)
+{
+	return Max(1, (int) ceil(log2(count + 1)));
+}
+
+/*
+ * tinyhist_geometry
+ *		recommend the smallest histogram geometry meeting the error target
+ *
+ * The geometry is a generalization of tinyhist - the first bucket covers
+ * [0, min_value], and each doubling of the range is split into the same
+ * number of sub-buckets. With values represented by the bucket midpoint,
+ * the worst relative error for a quantile is for values at the lower end
+ * of the first sub-bucket of a doubling, i.e. 1/(2*S+1) for S sub-buckets.
+ * The number of sub-buckets is a power of two, so that the bucket index
+ * can be calculated cheaply.
+ *
+ * The bucket sizes are calculated the same way tinyhist sizes the buckets,
+ * i.e. assuming uniformly distributed values. Each bucket needs enough bits
+ * to store the expected count without having to reduce the sample rate.
+ * With sub-buckets, all sub-buckets in a doubling get the same number of
+ * bits, so we don't need to iterate over them.
+ *
+ * We also check if the regular tinyhist is sufficient, i.e. if the error
+ * target can be met without sub-buckets, the range fits into the histogram,
+ * and the bucket_bits are large enough to keep the counts exact.
+ */
+Datum
+tinyhist_geometry(PG_FUNCTION_ARGS)
+{
+	double		error = PG_GETARG_FLOAT8(0);
+	int64		count = PG_GETARG_INT64(1);
+	double		minval = PG_GETARG_FLOAT8(2);
+	double		maxval = PG_GETARG_FLOAT8(3);
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7] = {0};
+	int64		sub_buckets;
+	int			doublings;
+	int			min_bits,
+				max_bits;
+	int64		total_bits;
+	double		range;
+	bool		sufficient;
+
+	if (!(error > 0.0 && error < 1.0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("relative error must be between 0.0 and 1.0")));
+
+	if (count <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("expected count must be positive")));
+
+	if (!(minval > 0.0 && maxval > minval) || isinf(maxval))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("value range must satisfy 0 < min_value < max_value")));
+
+	/* number of sub-buckets needed to meet the error target */
+	sub_buckets = 1;
+	while (1.0 / (2 * sub_buckets + 1) > error)
+	{
+		sub_buckets *= 2;
+
+		if (sub_buckets > GEOMETRY_MAX_SUB_BUCKETS)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("relative error %g is too small", error)));
+	}
+
+	/* number of doublings to cover the range, and the resulting range */
+	doublings = Max(1, (int) ceil(log2(maxval / minval)));
+	range = minval * pow(2.0, doublings);
+
+	/* the first bucket [0, min_value] */
+	min_bits = max_bits = geometry_bucket_bits(count * minval / range);
+	total_bits = min_bits;
+
+	/* the tinyhist range is limited by the number of buckets and unit */
+	sufficient = (sub_buckets == 1) &&
+		(doublings <= (HISTOGRAM_BUCKETS - 1)) &&
+		(maxval <= (double) (1L << 15) * (1L << (HISTOGRAM_BUCKETS - 1))) &&
+		(min_bits <= bucket_bits[0]);
+
+	for (int i = 1; i <= doublings; i++)
+	{
+		double		width = minval * pow(2.0, i - 1) / sub_buckets;
+		int			bits = geometry_bucket_bits(count * width / range);
+
+		min_bits = Min(min_bits, bits);
+		max_bits = Max(max_bits, bits);
+		total_bits += bits * sub_buckets;
+
+		if ((i < HISTOGRAM_BUCKETS) && (bits > bucket_bits[i]))
+			sufficient = false;
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	values[0] = Int32GetDatum((int32) sub_buckets);
+	values[1] = Int64GetDatum(1 + doublings * sub_buckets);
+	values[2] = Int32GetDatum(min_bits);
+	values[3] = Int32GetDatum(max_bits);
+	/* the sample rate and unit are stored in a separate byte */
+	values[4] = Int64GetDatum(1 + (total_bits + 7) / 8);
+	values[5] = Float8GetDatum(1.0 / (2 * sub_buckets + 1));
+	values[6] = BoolGetDatum(sufficient);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * State for the tinyhist_error_budget aggregate. We build a regular
+ * histogram, and track the exact count and range of values, so that we
+ * can tell how accurate the histogram is for the data set.
+ */
+typedef struct budget_state_t
+{
+	int64		count;			/* number of (non-NULL) values */
+	double		minval;			/* minimum value */
+	double		maxval;			/* maximum value */
+	tinyhist_t	hist;			/* histogram built from the values */
+} budget_state_t;
+
+/*
+ * tinyhist_budget_accum
+ *		transition function for the tinyhist_error_budget aggregate
+ */
+Datum
+tinyhist_budget_accum(PG_FUNCTION_ARGS)
+{
+	budget_state_t *state;
+	double		value;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_budget_accum called in non-aggregate context");
+
+	/* skip NULL values */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (PG_ARGISNULL(0))
+		state = MemoryContextAllocZero(aggcontext, sizeof(budget_state_t));
+	else
+		state = (budget_state_t *) PG_GETARG_POINTER(0);
+
+	value = PG_GETARG_FLOAT8(1);
+
+	if ((state->count == 0) || (value < state->minval))
+		state->minval = value;
+
+	if ((state->count == 0) || (value > state->maxval))
+		state->maxval = value;
+
+	state->count++;
+
+	hist_add(&state->hist, value);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_budget_combine
+ *		combine function for the tinyhist_error_budget aggregate
+ */
+Datum
+tinyhist_budget_combine(PG_FUNCTION_ARGS)
+{
+	budget_state_t *src;
+	budget_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_budget_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (budget_state_t *) PG_GETARG_POINTER(1);
+
+	/* copy the state into the right long-lived memory context */
+	if (PG_ARGISNULL(0))
+	{
+		dst = MemoryContextAlloc(aggcontext, sizeof(budget_state_t));
+		memcpy(dst, src, sizeof(budget_state_t));
+
+		PG_RETURN_POINTER(dst);
+	}
+
+	dst = (budget_state_t *) PG_GETARG_POINTER(0);
+
+	dst->minval = Min(dst->minval, src->minval);
+	dst->maxval = Max(dst->maxval, src->maxval);
+	dst->count += src->count;
+
+	hist_merge(&dst->hist, &src->hist);
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_budget_serial
+ *		serialize the tinyhist_error_budget state (for parallel aggregation)
+ */
+Datum
+tinyhist_budget_serial(PG_FUNCTION_ARGS)
+{
+	budget_state_t *state = (budget_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint64(&buf, state->count);
+	pq_sendfloat8(&buf, state->minval);
+	pq_sendfloat8(&buf, state->maxval);
+	pq_sendbytes(&buf, (char *) &state->hist, sizeof(tinyhist_t));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_budget_deserial
+ *		deserialize the tinyhist_error_budget state (for parallel aggregation)
+ */
+Datum
+tinyhist_budget_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	budget_state_t *state;
+	StringInfoData buf;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_budget_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	state = palloc(sizeof(budget_state_t));
+
+	state->count = pq_getmsgint64(&buf);
+	state->minval = pq_getmsgfloat8(&buf);
+	state->maxval = pq_getmsgfloat8(&buf);
+	pq_copymsgbytes(&buf, (char *) &state->hist, sizeof(tinyhist_t));
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_budget_final
+ *		final function for the tinyhist_error_budget aggregate
+ *
+ * The maximum relative error is the worst error of a quantile estimate
+ * (using bucket midpoints) for buckets with any values. The buckets are
+ * clamped to the range of values, as we know there are no values outside
+ * it. A bucket starting at 0 has relative error 1.0, as the values may be
+ * arbitrarily close to 0.
+ */
+Datum
+tinyhist_budget_final(PG_FUNCTION_ARGS)
+{
+	budget_state_t *state;
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6] = {0};
+	double		max_error = 0;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_budget_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (budget_state_t *) PG_GETARG_POINTER(0);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		double		lower,
+					upper;
+
+		if (bucket_get(&state->hist, i) == 0)
+			continue;
+
+		lower = 0;
+		if (i > 0)
+			lower = pow(2.0, state->hist.unit + (i - 1));
+
+		upper = pow(2.0, state->hist.unit + i);
+
+		lower = Max(lower, state->minval);
+		upper = Min(upper, state->maxval);
+
+		if ((upper + lower) > 0)
+			max_error = Max(max_error, (upper - lower) / (upper + lower));
+	}
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	values[0] = Int64GetDatum(state->count);
+	values[1] = Float8GetDatum(state->minval);
+	values[2] = Float8GetDatum(state->maxval);
+	values[3] = Int32GetDatum(1 << state->hist.unit);
+	values[4] = Int32GetDatum(1 << state->hist.sample);
+	values[5] = Float8GetDatum(max_error);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * hist_scale
+ *		scale the histogram to represent factor-times more values
+ *
+ * The weight of each counter increment is (2^sample), so scaling the
+ * histogram means changing the weight to (factor * 2^sample). We pick the
+ * smallest sample rate with weight at least that high, so the counters
+ * never need to grow (and always fit into the buckets). If the weight is
+ * not a power of two, the counters are thinned by the remaining ratio,
+ * using randomized rounding (so that the counts are correct on average).
+ */
+static void
+hist_scale(tinyhist_t *hist, double factor)
+{
+	int			sample;
+	double		ratio;
+
+	Assert(factor > 0);
+
+	/* weight = ratio * 2^sample, with ratio in [0.5, 1) */
+	ratio = frexp(factor * pow(2.0, hist->sample), &sample);
+
+	/* exact power of two, no need to thin the counters */
+	if (ratio == 0.5)
+	{
+		ratio = 1.0;
+		sample--;
+	}
+
+	/* can't go below sample rate 1, thin the counters even more */
+	if (sample < 0)
+	{
+		ratio = ldexp(ratio, sample);
+		sample = 0;
+	}
+
+	if (sample > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("scaled histogram sample rate out of range")));
+
+	if (ratio < 1.0)
+	{
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			double		cnt = bucket_get(hist, i) * ratio;
+			double		r = (double) random() / ((double) PG_INT32_MAX + 1);
+
+			/* round up with probability equal to the fractional part */
+			bucket_set(hist, i, (int32) floor(cnt) + ((cnt - floor(cnt)) > r));
+		}
+	}
+
+	hist->sample = sample;
+}
+
+static void
+check_factor(double factor)
+{
+	if (!(factor > 0.0) || isinf(factor))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("scale factor must be a positive number")));
+}
+
+/*
+ * tinyhist_scale
+ *		scale the histogram to represent factor-times more values
+ */
+Datum
+tinyhist_scale(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist;
+	double		factor = PG_GETARG_FLOAT8(1);
+
+	check_factor(factor);
+
+	hist = hist_copy((tinyhist_t *) PG_GETARG_POINTER(0));
+
+	hist_scale(hist, factor);
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * hist_rebase
+ *		multiply all values in the histogram by 2^shift
+ *
+ * Only the unit gets adjusted, the counters stay the same. If the unit would
+ * get negative, the first buckets get merged into the first one (the same
+ * way hist_adjust_unit does it), and if the counters do not fit into the
+ * buckets, the sample rate is reduced.
+ */
+static void
+hist_rebase(tinyhist_t *hist, int shift)
+{
+	int32		counts[HISTOGRAM_BUCKETS];
+	int			unit = hist->unit + shift;
+	int			sample_shift = 0;
+
+	if (unit > HISTOGRAM_MAX_UNIT)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("rebased histogram unit out of range")));
+
+	if (unit >= 0)
+	{
+		hist->unit = unit;
+		return;
+	}
+
+	/*
+	 * Values below the unit end up in the first bucket, the other buckets
+	 * move to smaller buckets (with fewer bits), so check all of them.
+	 */
+	hist_unpack_aligned(hist, hist->sample, hist->unit - unit, counts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		while ((counts[i] >> sample_shift) > bucket_maxcount(i))
+			sample_shift++;
+	}
+
+	if (hist->sample + sample_shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("rebased histogram sample rate out of range")));
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bucket_set(hist, i, counts[i] >> sample_shift);
+
+	hist->sample += sample_shift;
+	hist->unit = 0;
+}
+
+/*
+ * tinyhist_rebase
+ *		multiply values in the histogram by 2^shift (e.g. to change units)
+ */
+Datum
+tinyhist_rebase(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = hist_copy((tinyhist_t *) PG_GETARG_POINTER(0));
+	int32		shift = PG_GETARG_INT32(1);
+
+	/* larger shifts either overflow the unit or merge all buckets */
+	shift = Max(-HISTOGRAM_BUCKETS - HISTOGRAM_MAX_UNIT, Min(shift, HISTOGRAM_MAX_UNIT + 1));
+
+	hist_rebase(hist, shift);
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * Merge a weighted histogram into the aggregate state. Transition function
+ * for the weighted tinyhist aggregate. Each histogram is scaled by the
+ * weight before merging it into the state.
+ */
+Datum
+tinyhist_accum_hist_weighted(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *state;
+	tinyhist_t	value;
+	double		weight;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_accum_hist_weighted called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values (and weights) altogether - we return either
+	 * the existing histogram (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	weight = PG_GETARG_FLOAT8(2);
+
+	check_factor(weight);
+
+	/* if there's no histogram aggstate allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		state = palloc0(sizeof(tinyhist_t));
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tinyhist_t *) PG_GETARG_POINTER(0);
+
+	/* scale a local copy of the histogram, then merge it into state */
+	memcpy(&value, PG_GETARG_POINTER(1), sizeof(tinyhist_t));
+
+	hist_scale(&value, weight);
+
+	state = hist_merge(state, &value);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_counts
+ *		bucket counters of the histogram (raw, not scaled)
+ */
+Datum
+tinyhist_counts(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+	int32		counts[HISTOGRAM_BUCKETS];
+	Datum		values[HISTOGRAM_BUCKETS];
+
+	hist_unpack(hist, counts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		values[i] = Int32GetDatum(counts[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, HISTOGRAM_BUCKETS, INT4OID,
+										  sizeof(int32), true, TYPALIGN_INT));
+}
+
+/*
+ * tinyhist_bounds
+ *		upper boundaries of histogram buckets
+ *
+ * The lower boundary of a bucket is the upper boundary of the preceding
+ * bucket (or 0 for the first bucket).
+ */
+Datum
+tinyhist_bounds(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+	Datum		values[HISTOGRAM_BUCKETS];
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		values[i] = Float8GetDatum(pow(2.0, hist->unit + i));
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, HISTOGRAM_BUCKETS, FLOAT8OID,
+										  sizeof(float8), FLOAT8PASSBYVAL,
+										  TYPALIGN_DOUBLE));
+}
+
+/*
+ * tinyhist_scaled_counts
+ *		bucket counters of the histogram, scaled by the sample rate
+ */
+Datum
+tinyhist_scaled_counts(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+	double		density = pow(2.0, hist->sample);
+	int32		counts[HISTOGRAM_BUCKETS];
+	Datum		values[HISTOGRAM_BUCKETS];
+
+	hist_unpack(hist, counts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		values[i] = Float8GetDatum(counts[i] * density);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, HISTOGRAM_BUCKETS, FLOAT8OID,
+										  sizeof(float8), FLOAT8PASSBYVAL,
+										  TYPALIGN_DOUBLE));
+}
+
+/*
+ * tinyhist_from_counts
+ *		build a histogram from sample rate, unit and bucket counters
+ *
+ * The sample rate and unit are exponents (as in the text representation),
+ * and there has to be one counter for each bucket, fitting into the bucket.
+ */
+Datum
+tinyhist_from_counts(PG_FUNCTION_ARGS)
+{
+	int32		sample = PG_GETARG_INT32(0);
+	int32		unit = PG_GETARG_INT32(1);
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(2);
+	tinyhist_t *hist;
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+
+	if ((sample < 0) || (sample > HISTOGRAM_MAX_SAMPLE))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample rate exponent %d out of range [0, %d]",
+						sample, HISTOGRAM_MAX_SAMPLE)));
+
+	if ((unit < 0) || (unit > HISTOGRAM_MAX_UNIT))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unit exponent %d out of range [0, %d]",
+						unit, HISTOGRAM_MAX_UNIT)));
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array of counts must be one-dimensional")));
+
+	deconstruct_array(array, INT4OID,
+	/* hard-wired info on type int4 */
+					  sizeof(int32), true, TYPALIGN_INT,
+					  &values,
+					  &nulls,
+					  &nvalues);
+
+	if (nvalues != HISTOGRAM_BUCKETS)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array of counts must have %d elements", HISTOGRAM_BUCKETS)));
+
+	hist = palloc0(sizeof(tinyhist_t));
+
+	hist->sample = sample;
+	hist->unit = unit;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		int32		cnt;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("array of counts must not contain NULL values")));
+
+		cnt = DatumGetInt32(values[i]);
+
+		if ((cnt < 0) || (cnt > bucket_maxcount(i)))
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("count %d out of range for bucket %d (max %d)",
+							cnt, i, bucket_maxcount(i))));
+
+		bucket_set(hist, i, cnt);
+	}
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * State of the element-wise tinyhist_agg(tinyhist[]) aggregate.
+ *
+ * Each position is merged into an unpacked histogram, so that we don't
+ * need to unpack/pack the counters for each row. Positions not seen in
+ * any non-NULL input element are NULL.
+ */
+typedef struct hist_array_state_t {
+	int32		nelems;			/* number of positions */
+	bool	   *isnull;			/* no non-NULL element at this position */
+	tinyhist_unpacked_t *elems;	/* merged histograms */
+} hist_array_state_t;
+
+static hist_array_state_t *
+hist_array_state_create(MemoryContext context)
+{
+	return MemoryContextAllocZero(context, sizeof(hist_array_state_t));
+}
+
+/*
+ * hist_array_state_extend
+ *		make sure the state has at least nelems positions
+ *
+ * The new positions are NULL, until a histogram gets merged into them.
+ */
+static void
+hist_array_state_extend(MemoryContext context, hist_array_state_t *state,
+						int nelems)
+{
+	if (nelems <= state->nelems)
+		return;
+
+	if (state->nelems == 0)
+	{
+		state->isnull = MemoryContextAlloc(context, nelems * sizeof(bool));
+		state->elems = MemoryContextAlloc(context, nelems * sizeof(tinyhist_unpacked_t));
+	}
+	else
+	{
+		state->isnull = repalloc(state->isnull, nelems * sizeof(bool));
+		state->elems = repalloc(state->elems, nelems * sizeof(tinyhist_unpacked_t));
+	}
+
+	for (int i = state->nelems; i < nelems; i++)
+		state->isnull[i] = true;
+
+	state->nelems = nelems;
+}
+
+/*
+ * hist_array_state_merge
+ *		merge histogram into the state at the given position
+ */
+static void
+hist_array_state_merge(hist_array_state_t *state, int idx, const tinyhist_t *hist)
+{
+	Assert(idx < state->nelems);
+
+	if (state->isnull[idx])
+	{
+		hist_unpack_state(hist, &state->elems[idx]);
+		state->isnull[idx] = false;
+	}
+	else
+		hist_merge_state(&state->elems[idx], hist);
+}
+
+/*
+ * tinyhist_accum_hist_array
+ *		merge an array of histograms into the state, element-wise
+ *
+ * NULL arrays and NULL elements are ignored. Arrays of different lengths
+ * are allowed, the result has as many elements as the longest one.
+ */
+Datum
+tinyhist_accum_hist_array(PG_FUNCTION_ARGS)
+{
+	hist_array_state_t *state;
+	ArrayType  *array;
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_accum_hist_array called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		state = hist_array_state_create(aggcontext);
+	else
+		state = (hist_array_state_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	array = PG_GETARG_ARRAYTYPE_P(1);
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array of histograms must be one-dimensional")));
+
+	hist_deconstruct_array(array, &values, &nulls, &nvalues);
+
+	hist_array_state_extend(aggcontext, state, nvalues);
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (nulls[i])
+			continue;
+
+		hist_array_state_merge(state, i, (tinyhist_t *) DatumGetPointer(values[i]));
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_array_combine
+ *		combine two tinyhist_agg(tinyhist[]) states
+ *
+ * If the first state is NULL, it's created in the aggregate context first
+ * (the second state may live in a short-lived context).
+ */
+Datum
+tinyhist_array_combine(PG_FUNCTION_ARGS)
+{
+	hist_array_state_t *src;
+	hist_array_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_array_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (hist_array_state_t *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		dst = hist_array_state_create(aggcontext);
+	else
+		dst = (hist_array_state_t *) PG_GETARG_POINTER(0);
+
+	hist_array_state_extend(aggcontext, dst, src->nelems);
+
+	for (int i = 0; i < src->nelems; i++)
+	{
+		tinyhist_t	hist;
+
+		if (src->isnull[i])
+			continue;
+
+		/* the unpacked counters always fit into the buckets */
+		memset(&hist, 0, sizeof(tinyhist_t));
+		hist_pack_state(&hist, &src->elems[i]);
+
+		hist_array_state_merge(dst, i, &hist);
+	}
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_array_serial
+ *		serialize the tinyhist_agg(tinyhist[]) state (for parallel aggregation)
+ */
+Datum
+tinyhist_array_serial(PG_FUNCTION_ARGS)
+{
+	hist_array_state_t *state = (hist_array_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint32(&buf, state->nelems);
+
+	for (int i = 0; i < state->nelems; i++)
+	{
+		pq_sendbyte(&buf, state->isnull[i]);
+
+		if (state->isnull[i])
+			continue;
+
+		pq_sendint32(&buf, state->elems[i].sample);
+		pq_sendint32(&buf, state->elems[i].unit);
+
+		for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+			pq_sendint32(&buf, state->elems[i].counts[j]);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_array_deserial
+ *		deserialize the tinyhist_agg(tinyhist[]) state (for parallel aggregation)
+ */
+Datum
+tinyhist_array_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	hist_array_state_t *state;
+	StringInfoData buf;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_array_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	state = hist_array_state_create(CurrentMemoryContext);
+	hist_array_state_extend(CurrentMemoryContext, state, pq_getmsgint(&buf, 4));
+
+	for (int i = 0; i < state->nelems; i++)
+	{
+		state->isnull[i] = pq_getmsgbyte(&buf);
+
+		if (state->isnull[i])
+			continue;
+
+		state->elems[i].sample = pq_getmsgint(&buf, 4);
+		state->elems[i].unit = pq_getmsgint(&buf, 4);
+
+		for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+			state->elems[i].counts[j] = pq_getmsgint(&buf, 4);
+	}
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_array_final
+ *		final function for the tinyhist_agg(tinyhist[]) aggregate
+ *
+ * Packs the merged histograms into an array, with NULL at positions with
+ * no non-NULL input elements. Returns NULL if there were no input arrays.
+ */
+Datum
+tinyhist_array_final(PG_FUNCTION_ARGS)
+{
+	hist_array_state_t *state;
+	Oid			elemtype;
+	Datum	   *elems;
+	int			dims[1];
+	int			lbs[1];
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_array_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (hist_array_state_t *) PG_GETARG_POINTER(0);
+
+	if (state->nelems == 0)
+		PG_RETURN_NULL();
+
+	elems = palloc(state->nelems * sizeof(Datum));
+
+	for (int i = 0; i < state->nelems; i++)
+	{
+		tinyhist_t *hist;
+
+		if (state->isnull[i])
+		{
+			elems[i] = (Datum) 0;
+			continue;
+		}
+
+		hist = palloc0(sizeof(tinyhist_t));
+		hist_pack_state(hist, &state->elems[i]);
+
+		elems[i] = PointerGetDatum(hist);
+	}
+
+	/* the aggregate returns an array of tinyhist */
+	elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	dims[0] = state->nelems;
+	lbs[0] = 1;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, state->isnull, 1, dims, lbs,
+											 elemtype, typlen, typbyval, typalign));
+}
+
+/*
+ * tinyhist_add_hist_array
+ *		merge two arrays of histograms, element-wise
+ *
+ * If one of the arrays is NULL, the other one is returned. Arrays of
+ * different lengths are allowed, missing elements are treated as NULL,
+ * and NULL elements are ignored (the result is NULL only if both elements
+ * are NULL).
+ */
+Datum
+tinyhist_add_hist_array(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array1;
+	ArrayType  *array2;
+	Datum	   *values1,
+			   *values2,
+			   *elems;
+	bool	   *nulls1,
+			   *nulls2,
+			   *nulls;
+	int			nvalues1,
+				nvalues2,
+				nelems;
+	int			dims[1];
+	int			lbs[1];
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	/* If both are NULL, return NULL. Otherwise return the non-NULL one. */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		if (!PG_ARGISNULL(0))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+		else if (!PG_ARGISNULL(1))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(1));
+		else
+			PG_RETURN_NULL();
+	}
+
+	array1 = PG_GETARG_ARRAYTYPE_P(0);
+	array2 = PG_GETARG_ARRAYTYPE_P(1);
+
+	if ((ARR_NDIM(array1) > 1) || (ARR_NDIM(array2) > 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array of histograms must be one-dimensional")));
+
+	hist_deconstruct_array(array1, &values1, &nulls1, &nvalues1);
+	hist_deconstruct_array(array2, &values2, &nulls2, &nvalues2);
+
+	nelems = Max(nvalues1, nvalues2);
+
+	if (nelems == 0)
+		PG_RETURN_ARRAYTYPE_P(array1);
+
+	elems = palloc(nelems * sizeof(Datum));
+	nulls = palloc(nelems * sizeof(bool));
+
+	for (int i = 0; i < nelems; i++)
+	{
+		bool		isnull1 = (i >= nvalues1) || nulls1[i];
+		bool		isnull2 = (i >= nvalues2) || nulls2[i];
+
+		nulls[i] = (isnull1 && isnull2);
+
+		if (nulls[i])
+			elems[i] = (Datum) 0;
+		else if (isnull2)
+			elems[i] = values1[i];
+		else if (isnull1)
+			elems[i] = values2[i];
+		else
+		{
+			tinyhist_t *result = palloc0(sizeof(tinyhist_t));
+
+			hist_merge_into(result,
+							(tinyhist_t *) DatumGetPointer(values1[i]),
+							(tinyhist_t *) DatumGetPointer(values2[i]));
+
+			elems[i] = PointerGetDatum(result);
+		}
+	}
+
+	get_typlenbyvalalign(ARR_ELEMTYPE(array1), &typlen, &typbyval, &typalign);
+
+	dims[0] = nelems;
+	lbs[0] = 1;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(elems, nulls, 1, dims, lbs,
+											 ARR_ELEMTYPE(array1),
+											 typlen, typbyval, typalign));
+}
+
+/*
+ * Histograms with fixed (user-defined) bucket boundaries, e.g. matching
+ * SLO thresholds. The boundaries are declared once in the
+ * tinyhist_slo_boundaries table, and the histogram references them by id
+ * (which is also used as a typmod, e.g. tinyhist_slo(1)).
+ *
+ * The counters are packed the same way as in tinyhist, except that all
+ * buckets have the same size (determined by the number of buckets), and
+ * the sampling works the same way too.
+ */
+#define SLO_MAX_BUCKETS		16
+#define SLO_MAX_BOUNDS		(SLO_MAX_BUCKETS - 1)
+#define SLO_MAX_BOUNDS_ID	PG_UINT16_MAX
+
+/* keep counters below 2^30, so that adding two counters can't overflow */
+#define SLO_MAX_BUCKET_BITS	30
+
+/* 32B */
+typedef struct tinyhist_slo_t {
+	uint8		sample;			/* sampling rate for buckets (2^sample) */
+	uint8		nbuckets;		/* number of buckets (boundaries + 1) */
+	uint16		bounds;			/* boundaries (id in tinyhist_slo_boundaries) */
+	uint8		data[28];		/* buffer storing the buckets */
+} tinyhist_slo_t;
+
+/*
+ * Boundaries of a SLO histogram. Unused boundaries are set to infinity,
+ * so that we can always search all SLO_MAX_BOUNDS boundaries.
+ */
+typedef struct slo_bounds_t {
+	int32		id;
+	int			nbounds;
+	double		bounds[SLO_MAX_BOUNDS];
+} slo_bounds_t;
+
+/*
+ * Boundaries loaded from the catalog table. The boundaries can't be
+ * modified once declared, so we can cache them for the whole backend.
+ */
+static slo_bounds_t **slo_bounds_cache = NULL;
+static int	slo_bounds_ncached = 0;
+static int	slo_bounds_maxcached = 0;
+
+static int
+slo_bucket_bits(const tinyhist_slo_t *hist)
+{
+	return Min(SLO_MAX_BUCKET_BITS, (sizeof(hist->data) * 8) / hist->nbuckets);
+}
+
+static int32
+slo_bucket_maxcount(const tinyhist_slo_t *hist)
+{
+	return (1L << slo_bucket_bits(hist)) - 1;
+}
+
+static int32
+slo_bucket_get(const tinyhist_slo_t *hist, int bucket)
+{
+	int		nbits = slo_bucket_bits(hist);
+
+	Assert((bucket >= 0) && (bucket < hist->nbuckets));
+
+	return bits_get(hist->data, bucket * nbits, nbits);
+}
+
+static void
+slo_bucket_set(tinyhist_slo_t *hist, int bucket, int32 count)
+{
+	int		nbits = slo_bucket_bits(hist);
+
+	Assert((bucket >= 0) && (bucket < hist->nbuckets));
+	Assert(count <= slo_bucket_maxcount(hist));
+
+	bits_set(hist->data, bucket * nbits, nbits, count);
+}
+
+/*
+ * slo_bounds_deconstruct
+ *		extract boundaries from a float8 array, and check they're valid
+ *
+ * The boundaries have to be positive, finite and strictly increasing.
+ */
+static void
+slo_bounds_deconstruct(ArrayType *array, double *bounds, int *nbounds)
+{
+	Datum	   *values;
+	bool	   *nulls;
+	int			nvalues;
+
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array of histogram boundaries must be one-dimensional")));
+
+	deconstruct_array(array, FLOAT8OID,
+	/* hard-wired info on type float8 */
+					  sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE,
+					  &values,
+					  &nulls,
+					  &nvalues);
+
+	if ((nvalues < 1) || (nvalues > SLO_MAX_BOUNDS))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of histogram boundaries must be between 1 and %d",
+						SLO_MAX_BOUNDS)));
+
+	for (int i = 0; i < nvalues; i++)
+	{
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("histogram boundaries must not contain NULL values")));
+
+		bounds[i] = DatumGetFloat8(values[i]);
+
+		if (!(bounds[i] > 0) || isinf(bounds[i]))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("histogram boundaries must be positive finite values")));
+
+		if ((i > 0) && (bounds[i] <= bounds[i-1]))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("histogram boundaries must be strictly increasing")));
+	}
+
+	*nbounds = nvalues;
+}
+
+/*
+ * slo_bounds_lookup
+ *		get boundaries with the given id
+ *
+ * The boundaries are loaded from the tinyhist_slo_boundaries table (in the
+ * same schema as the calling function), and cached for the backend.
+ */
+static const slo_bounds_t *
+slo_bounds_lookup(FunctionCallInfo fcinfo, int32 id)
+{
+	slo_bounds_t *entry;
+	double		bounds[SLO_MAX_BOUNDS];
+	int			nbounds;
+	char	   *query;
+	Oid			argtypes[1] = {INT4OID};
+	Datum		args[1];
+	Datum		value;
+	bool		isnull;
+	int			ret;
+
+	for (int i = 0; i < slo_bounds_ncached; i++)
+	{
+		if (slo_bounds_cache[i]->id == id)
+			return slo_bounds_cache[i];
+	}
+
+	query = psprintf("SELECT bounds FROM %s.tinyhist_slo_boundaries WHERE id = $1",
+					 quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid))));
+
+	args[0] = Int32GetDatum(id);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	ret = SPI_execute_with_args(query, 1, argtypes, args, NULL, true, 1);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to look up histogram boundaries: %s",
+			 SPI_result_code_string(ret));
+
+	if (SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("histogram boundaries %d do not exist", id)));
+
+	value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+	Assert(!isnull);
+
+	/* the table has a CHECK constraint, but let's not rely on it */
+	slo_bounds_deconstruct(DatumGetArrayTypeP(value), bounds, &nbounds);
+
+	SPI_finish();
+
+	entry = MemoryContextAlloc(TopMemoryContext, sizeof(slo_bounds_t));
+
+	entry->id = id;
+	entry->nbounds = nbounds;
+
+	for (int i = 0; i < SLO_MAX_BOUNDS; i++)
+		entry->bounds[i] = (i < nbounds) ? bounds[i] : get_float8_infinity();
+
+	if (slo_bounds_ncached == slo_bounds_maxcached)
+	{
+		int			maxcached = Max(8, 2 * slo_bounds_maxcached);
+		slo_bounds_t **cache;
+
+		cache = MemoryContextAlloc(TopMemoryContext, maxcached * sizeof(slo_bounds_t *));
+
+		if (slo_bounds_ncached > 0)
+		{
+			memcpy(cache, slo_bounds_cache, slo_bounds_ncached * sizeof(slo_bounds_t *));
+			pfree(slo_bounds_cache);
+		}
+
+		slo_bounds_cache = cache;
+		slo_bounds_maxcached = maxcached;
+	}
+
+	slo_bounds_cache[slo_bounds_ncached++] = entry;
+
+	return entry;
+}
+
+/*
+ * slo_bucket_index
+ *		calculate bucket index for the value
+ *
+ * The bucket index is the number of boundaries below the value (bucket i
+ * covers values in (bounds[i-1], bounds[i]]). We always check all the
+ * boundaries (the unused ones are infinite), and sum the comparisons,
+ * so the loop is branchless and can be vectorized by the compiler.
+ */
+static int
+slo_bucket_index(const slo_bounds_t *bounds, double value)
+{
+	int			idx = 0;
+
+	for (int i = 0; i < SLO_MAX_BOUNDS; i++)
+		idx += (value > bounds->bounds[i]);
+
+	return idx;
+}
+
+static tinyhist_slo_t *
+slo_create(const slo_bounds_t *bounds)
+{
+	tinyhist_slo_t *hist = palloc0(sizeof(tinyhist_slo_t));
+
+	hist->nbuckets = bounds->nbounds + 1;
+	hist->bounds = bounds->id;
+
+	return hist;
+}
+
+/*
+ * slo_adjust_sample
+ *		reduce the sampling frequency (to 1/2^shift of the current value)
+ */
+static void
+slo_adjust_sample(tinyhist_slo_t *hist, int shift)
+{
+	if (hist->sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("histogram sample rate out of range")));
+
+	for (int i = 0; i < hist->nbuckets; i++)
+		slo_bucket_set(hist, i, slo_bucket_get(hist, i) >> shift);
+
+	hist->sample += shift;
+}
+
+/*
+ * slo_add
+ *		add a value to the histogram (if sampled)
+ */
+static void
+slo_add(tinyhist_slo_t *hist, const slo_bounds_t *bounds, double value)
+{
+	int		bucket;
+
+	Assert(hist->bounds == bounds->id);
+
+	/* sample this value? */
+	if (!random_sample(hist->sample))
+		return;
+
+	bucket = slo_bucket_index(bounds, value);
+
+	/* if the bucket is already full, reduce the sampling rate */
+	if (slo_bucket_get(hist, bucket) == slo_bucket_maxcount(hist))
+		slo_adjust_sample(hist, 1);
+
+	slo_bucket_set(hist, bucket, slo_bucket_get(hist, bucket) + 1);
+}
+
+/*
+ * slo_merge_into
+ *		merge histograms hist1 and hist2, and store the result into dst
+ *
+ * Only histograms with the same boundaries can be merged. The inputs are
+ * only read, and dst may be the same as one of the inputs.
+ */
+static tinyhist_slo_t *
+slo_merge_into(tinyhist_slo_t *dst, const tinyhist_slo_t *hist1,
+			   const tinyhist_slo_t *hist2)
+{
+	int		sample,
+			shift;
+	int32	counts1[SLO_MAX_BUCKETS],
+			counts2[SLO_MAX_BUCKETS];
+
+	if (hist1->bounds != hist2->bounds)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histograms with different boundaries (%d and %d) can't be merged",
+						hist1->bounds, hist2->bounds)));
+
+	Assert(hist1->nbuckets == hist2->nbuckets);
+
+	sample = Max(hist1->sample, hist2->sample);
+
+	for (int i = 0; i < hist1->nbuckets; i++)
+	{
+		counts1[i] = slo_bucket_get(hist1, i) >> (sample - hist1->sample);
+		counts2[i] = slo_bucket_get(hist2, i) >> (sample - hist2->sample);
+	}
+
+	/* reduce the sample rate until all the counts fit */
+	shift = 0;
+	for (int i = 0; i < hist1->nbuckets; i++)
+	{
+		while ((counts1[i] >> shift) + (counts2[i] >> shift) > slo_bucket_maxcount(hist1))
+			shift++;
+	}
+
+	if (sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("merged histogram sample rate out of range")));
+
+	dst->nbuckets = hist1->nbuckets;
+	dst->bounds = hist1->bounds;
+	dst->sample = sample + shift;
+
+	for (int i = 0; i < dst->nbuckets; i++)
+		slo_bucket_set(dst, i, (counts1[i] >> shift) + (counts2[i] >> shift));
+
+	return dst;
+}
+
+/*
+ * counts_shift
+ *		how much to shift (rounded) counts, so that they fit into buckets
+ */
+static int
+counts_shift(const double *counts, const int32 *maxcounts, int ncounts)
+{
+	int			shift = 0;
+
+	for (int i = 0; i < ncounts; i++)
+	{
+		while (floor(ldexp(counts[i], -shift) + 0.5) > maxcounts[i])
+			shift++;
+	}
+
+	return shift;
+}
+
+/*
+ * interval_overlap
+ *		fraction of interval (lower1, upper1] overlapping with (lower2, upper2]
+ */
+static double
+interval_overlap(double lower1, double upper1, double lower2, double upper2)
+{
+	double		overlap = Min(upper1, upper2) - Max(lower1, lower2);
+
+	if (overlap <= 0)
+		return 0.0;
+
+	return overlap / (upper1 - lower1);
+}
+
+/*
+ * slo_from_hist
+ *		convert a tinyhist histogram into a SLO histogram
+ *
+ * The values are assumed to be uniformly distributed in each tinyhist
+ * bucket, and each bucket is split between the overlapping SLO buckets.
+ * The sample rate is kept, unless the counts don't fit into the buckets.
+ */
+static tinyhist_slo_t *
+slo_from_hist(const tinyhist_t *hist, const slo_bounds_t *bounds)
+{
+	tinyhist_slo_t *result = slo_create(bounds);
+	double		counts[SLO_MAX_BUCKETS] = {0};
+	int32		maxcounts[SLO_MAX_BUCKETS] = {0};
+	int			shift;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		double		lower = (i == 0) ? 0.0 : ldexp(1.0, hist->unit + i - 1);
+		double		upper = ldexp(1.0, hist->unit + i);
+		int32		cnt = bucket_get(hist, i);
+
+		if (cnt == 0)
+			continue;
+
+		for (int j = 0; j < result->nbuckets; j++)
+		{
+			double		slo_lower = (j == 0) ? -get_float8_infinity() : bounds->bounds[j-1];
+			double		slo_upper = (j == bounds->nbounds) ? get_float8_infinity() : bounds->bounds[j];
+
+			counts[j] += cnt * interval_overlap(lower, upper, slo_lower, slo_upper);
+		}
+	}
+
+	for (int j = 0; j < result->nbuckets; j++)
+		maxcounts[j] = slo_bucket_maxcount(result);
+
+	shift = counts_shift(counts, maxcounts, result->nbuckets);
+
+	if (hist->sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("histogram sample rate out of range")));
+
+	result->sample = hist->sample + shift;
+
+	for (int j = 0; j < result->nbuckets; j++)
+		slo_bucket_set(result, j, (int32) floor(ldexp(counts[j], -shift) + 0.5));
+
+	return result;
+}
+
+/*
+ * slo_to_hist
+ *		convert a SLO histogram into a tinyhist histogram
+ *
+ * The unit is the smallest one covering all the boundaries. The values are
+ * assumed to be uniformly distributed in each SLO bucket (the first one
+ * starts at 0), except for the last (open-ended) bucket, which is added to
+ * the tinyhist bucket right above the last boundary.
+ */
+static tinyhist_t *
+slo_to_hist(const tinyhist_slo_t *slo, const slo_bounds_t *bounds)
+{
+	tinyhist_t *result = palloc0(sizeof(tinyhist_t));
+	double		counts[HISTOGRAM_BUCKETS] = {0};
+	int32		maxcounts[HISTOGRAM_BUCKETS];
+	double		last = bounds->bounds[bounds->nbounds - 1];
+	int			shift;
+	int			idx;
+
+	while (hist_maxvalue(result) < last)
+	{
+		if (result->unit == HISTOGRAM_MAX_UNIT)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("histogram boundaries exceed the tinyhist range")));
+
+		result->unit++;
+	}
+
+	for (int j = 0; j < bounds->nbounds; j++)
+	{
+		double		slo_lower = (j == 0) ? 0.0 : bounds->bounds[j-1];
+		double		slo_upper = bounds->bounds[j];
+		int32		cnt = slo_bucket_get(slo, j);
+
+		if (cnt == 0)
+			continue;
+
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			double		lower = (i == 0) ? 0.0 : ldexp(1.0, result->unit + i - 1);
+			double		upper = ldexp(1.0, result->unit + i);
+
+			counts[i] += cnt * interval_overlap(slo_lower, slo_upper, lower, upper);
+		}
+	}
+
+	/* the last bucket goes right above the last boundary */
+	idx = 0;
+	while ((idx < HISTOGRAM_BUCKETS - 1) && (ldexp(1.0, result->unit + idx) <= last))
+		idx++;
+
+	counts[idx] += slo_bucket_get(slo, bounds->nbounds);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		maxcounts[i] = bucket_maxcount(i);
+
+	shift = counts_shift(counts, maxcounts, HISTOGRAM_BUCKETS);
+
+	if (slo->sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("histogram sample rate out of range")));
+
+	result->sample = slo->sample + shift;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bucket_set(result, i, (int32) floor(ldexp(counts[i], -shift) + 0.5));
+
+	return result;
+}
+
+/*
+ * slo_from_slo
+ *		convert a SLO histogram to different boundaries
+ *
+ * Same as converting the histogram to tinyhist and back, except that the
+ * counts are redistributed in a single pass (so the error is not doubled).
+ * The first bucket starts at 0, the last (open-ended) bucket is added to
+ * the open-ended bucket of the result.
+ */
+static tinyhist_slo_t *
+slo_from_slo(const tinyhist_slo_t *slo, const slo_bounds_t *from,
+			 const slo_bounds_t *to)
+{
+	tinyhist_slo_t *result = slo_create(to);
+	double		counts[SLO_MAX_BUCKETS] = {0};
+	int32		maxcounts[SLO_MAX_BUCKETS] = {0};
+	int			shift;
+
+	for (int i = 0; i < from->nbounds; i++)
+	{
+		double		lower = (i == 0) ? 0.0 : from->bounds[i-1];
+		double		upper = from->bounds[i];
+		int32		cnt = slo_bucket_get(slo, i);
+
+		if (cnt == 0)
+			continue;
+
+		for (int j = 0; j < result->nbuckets; j++)
+		{
+			double		slo_lower = (j == 0) ? -get_float8_infinity() : to->bounds[j-1];
+			double		slo_upper = (j == to->nbounds) ? get_float8_infinity() : to->bounds[j];
+
+			counts[j] += cnt * interval_overlap(lower, upper, slo_lower, slo_upper);
+		}
+	}
+
+	/*
+	 * The values in the open-ended bucket may be arbitrarily high, so the
+	 * pessimistic choice is the open-ended bucket of the result.
+	 */
+	counts[to->nbounds] += slo_bucket_get(slo, from->nbounds);
+
+	for (int j = 0; j < result->nbuckets; j++)
+		maxcounts[j] = slo_bucket_maxcount(result);
+
+	shift = counts_shift(counts, maxcounts, result->nbuckets);
+
+	if (slo->sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("histogram sample rate out of range")));
+
+	result->sample = slo->sample + shift;
+
+	for (int j = 0; j < result->nbuckets; j++)
+		slo_bucket_set(result, j, (int32) floor(ldexp(counts[j], -shift) + 0.5));
+
+	return result;
+}
+
+/*
+ * slo_check_typmod
+ *		check the histogram boundaries match the typmod (if any)
+ */
+static void
+slo_check_typmod(const tinyhist_slo_t *hist, int32 typmod)
+{
+	if ((typmod >= 0) && (hist->bounds != typmod))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("histogram boundaries %d do not match type boundaries %d",
+						hist->bounds, typmod)));
+}
+
+/*
+ * tinyhist_slo_check_bounds
+ *		validate boundaries (used in a CHECK constraint on the catalog)
+ */
+Datum
+tinyhist_slo_check_bounds(PG_FUNCTION_ARGS)
+{
+	double		bounds[SLO_MAX_BOUNDS];
+	int			nbounds;
+
+	slo_bounds_deconstruct(PG_GETARG_ARRAYTYPE_P(0), bounds, &nbounds);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * tinyhist_slo_in
+ *		parse the text representation {sample, bounds, count, ...}
+ */
+Datum
+tinyhist_slo_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	int32		typmod = PG_GETARG_INT32(2);
+	char	   *ptr = str;
+	int64		values[SLO_MAX_BUCKETS + 2];
+	int			nvalues = 0;
+	const slo_bounds_t *bounds;
+	tinyhist_slo_t *hist;
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr++ != '{')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_slo: \"%s\"", str)));
+
+	while (true)
+	{
+		char	   *end;
+
+		if (nvalues == SLO_MAX_BUCKETS + 2)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_slo: \"%s\"", str)));
+
+		values[nvalues++] = strtol(ptr, &end, 10);
+
+		if (end == ptr)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_slo: \"%s\"", str)));
+
+		ptr = end;
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (*ptr == ',')
+		{
+			ptr++;
+			continue;
+		}
+
+		if (*ptr++ == '}')
+			break;
+
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_slo: \"%s\"", str)));
+	}
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if ((*ptr != '\0') || (nvalues < 3))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_slo: \"%s\"", str)));
+
+	if ((values[0] < 0) || (values[0] > HISTOGRAM_MAX_SAMPLE))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample rate exponent %ld out of range [0, %d]",
+						(long) values[0], HISTOGRAM_MAX_SAMPLE)));
+
+	if ((values[1] < 1) || (values[1] > SLO_MAX_BOUNDS_ID))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram boundaries %ld out of range [1, %d]",
+						(long) values[1], SLO_MAX_BOUNDS_ID)));
+
+	bounds = slo_bounds_lookup(fcinfo, (int32) values[1]);
+
+	if (nvalues != bounds->nbounds + 3)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("histogram with boundaries %d must have %d counts",
+						bounds->id, bounds->nbounds + 1)));
+
+	hist = slo_create(bounds);
+	hist->sample = values[0];
+
+	for (int i = 0; i < hist->nbuckets; i++)
+	{
+		int64		cnt = values[i + 2];
+
+		if ((cnt < 0) || (cnt > slo_bucket_maxcount(hist)))
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("count %ld out of range for bucket %d (max %d)",
+							(long) cnt, i, slo_bucket_maxcount(hist))));
+
+		slo_bucket_set(hist, i, (int32) cnt);
+	}
+
+	slo_check_typmod(hist, typmod);
+
+	PG_RETURN_POINTER(hist);
+}
+
+Datum
+tinyhist_slo_out(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	StringInfoData	str;
+
+	initStringInfo(&str);
+
+	appendStringInfo(&str, "{%d, %d", hist->sample, hist->bounds);
+
+	for (int i = 0; i < hist->nbuckets; i++)
+		appendStringInfo(&str, ", %d", slo_bucket_get(hist, i));
+
+	appendStringInfoChar(&str, '}');
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+Datum
+tinyhist_slo_send(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendbyte(&buf, hist->sample);
+	pq_sendint16(&buf, hist->bounds);
+	pq_sendbyte(&buf, hist->nbuckets);
+
+	for (int i = 0; i < hist->nbuckets; i++)
+		pq_sendint32(&buf, slo_bucket_get(hist, i));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+tinyhist_slo_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	int32		typmod = PG_GETARG_INT32(2);
+	const slo_bounds_t *bounds;
+	tinyhist_slo_t *hist;
+	int			sample,
+				nbuckets;
+
+	sample = pq_getmsgbyte(buf);
+	bounds = slo_bounds_lookup(fcinfo, pq_getmsgint(buf, 2));
+	nbuckets = pq_getmsgbyte(buf);
+
+	if ((sample > HISTOGRAM_MAX_SAMPLE) || (nbuckets != bounds->nbounds + 1))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid tinyhist_slo value")));
+
+	hist = slo_create(bounds);
+	hist->sample = sample;
+
+	for (int i = 0; i < hist->nbuckets; i++)
+	{
+		int32		cnt = pq_getmsgint(buf, 4);
+
+		if ((cnt < 0) || (cnt > slo_bucket_maxcount(hist)))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid tinyhist_slo value")));
+
+		slo_bucket_set(hist, i, cnt);
+	}
+
+	slo_check_typmod(hist, typmod);
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * tinyhist_slo_typmod_in
+ *		the typmod is the id of the histogram boundaries
+ */
+Datum
+tinyhist_slo_typmod_in(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	int32	   *typmods;
+	int			ntypmods;
+
+	typmods = ArrayGetIntegerTypmods(array, &ntypmods);
+
+	if (ntypmods != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid type modifier for tinyhist_slo")));
+
+	if ((typmods[0] < 1) || (typmods[0] > SLO_MAX_BOUNDS_ID))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram boundaries %d out of range [1, %d]",
+						typmods[0], SLO_MAX_BOUNDS_ID)));
+
+	/* make sure the boundaries exist */
+	slo_bounds_lookup(fcinfo, typmods[0]);
+
+	PG_RETURN_INT32(typmods[0]);
+}
+
+Datum
+tinyhist_slo_typmod_out(PG_FUNCTION_ARGS)
+{
+	int32		typmod = PG_GETARG_INT32(0);
+
+	if (typmod < 0)
+		PG_RETURN_CSTRING(pstrdup(""));
+
+	PG_RETURN_CSTRING(psprintf("(%d)", typmod));
+}
+
+/*
+ * tinyhist_slo_typmod_cast
+ *		check the histogram matches the typmod (length coercion cast)
+ *
+ * Explicit casts to different boundaries redistribute the counts, for
+ * implicit casts (e.g. assignments) the boundaries have to match.
+ */
+Datum
+tinyhist_slo_typmod_cast(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	int32		typmod = PG_GETARG_INT32(1);
+
+	if (PG_GETARG_BOOL(2) && (typmod >= 0) && (hist->bounds != typmod))
+		PG_RETURN_POINTER(slo_from_slo(hist,
+									   slo_bounds_lookup(fcinfo, hist->bounds),
+									   slo_bounds_lookup(fcinfo, typmod)));
+
+	slo_check_typmod(hist, typmod);
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * tinyhist_slo_from_tinyhist
+ *		cast tinyhist to tinyhist_slo, with boundaries determined by typmod
+ */
+Datum
+tinyhist_slo_from_tinyhist(PG_FUNCTION_ARGS)
+{
+	tinyhist_t *hist = (tinyhist_t *) PG_GETARG_POINTER(0);
+	int32		typmod = PG_GETARG_INT32(1);
+
+	if (typmod < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram boundaries have to be specified as a type modifier")));
+
+	PG_RETURN_POINTER(slo_from_hist(hist, slo_bounds_lookup(fcinfo, typmod)));
+}
+
+/*
+ * tinyhist_slo_to_tinyhist
+ *		cast tinyhist_slo to tinyhist
+ */
+Datum
+tinyhist_slo_to_tinyhist(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(slo_to_hist(hist, slo_bounds_lookup(fcinfo, hist->bounds)));
+}
+
+/*
+ * tinyhist_slo_add
+ *		add a value to the histogram, returning a modified copy
+ */
+Datum
+tinyhist_slo_add(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	tinyhist_slo_t *result;
+
+	result = palloc(sizeof(tinyhist_slo_t));
+	memcpy(result, hist, sizeof(tinyhist_slo_t));
+
+	slo_add(result, slo_bounds_lookup(fcinfo, hist->bounds), PG_GETARG_FLOAT8(1));
+
+	PG_RETURN_POINTER(result);
+}
+
+Datum
+tinyhist_slo_add_hist(PG_FUNCTION_ARGS)
+{
+	/* If both are NULL, return NULL. Otherwise return the non-NULL one. */
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		if (!PG_ARGISNULL(0))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+		else if (!PG_ARGISNULL(1))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(1));
+		else
+			PG_RETURN_NULL();
+	}
+
+	PG_RETURN_POINTER(slo_merge_into(palloc0(sizeof(tinyhist_slo_t)),
+									 (tinyhist_slo_t *) PG_GETARG_POINTER(0),
+									 (tinyhist_slo_t *) PG_GETARG_POINTER(1)));
+}
+
+/*
+ * Add a value to the histogram (create one if needed). Transition function
+ * for tinyhist_slo_agg aggregate.
+ */
+Datum
+tinyhist_slo_accum(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *state;
+	const slo_bounds_t *bounds;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_slo_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(2))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("histogram boundaries must not be NULL")));
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * histogram (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	bounds = slo_bounds_lookup(fcinfo, PG_GETARG_INT32(2));
+
+	/* if there's no histogram aggstate allocated, create it now */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		state = slo_create(bounds);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		state = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+
+	if (state->bounds != bounds->id)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram boundaries must be the same for all rows")));
+
+	slo_add(state, bounds, PG_GETARG_FLOAT8(1));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Merge a histogram into the state (create one if needed). Transition
+ * function for tinyhist_slo_agg aggregate.
+ */
+Datum
+tinyhist_slo_accum_hist(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *state;
+	tinyhist_slo_t *value;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_slo_accum_hist called in non-aggregate context");
+
+	/*
+	 * We want to skip NULL values altogether - we return either the existing
+	 * histogram (if it already exists) or NULL.
+	 */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		/* if there already is a state accumulated, don't forget it */
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	value = (tinyhist_slo_t *) PG_GETARG_POINTER(1);
+
+	/* if there's no histogram aggstate allocated, copy the first one */
+	if (PG_ARGISNULL(0))
+	{
+		state = MemoryContextAlloc(aggcontext, sizeof(tinyhist_slo_t));
+		memcpy(state, value, sizeof(tinyhist_slo_t));
+
+		PG_RETURN_POINTER(state);
+	}
+
+	state = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(slo_merge_into(state, state, value));
+}
+
+Datum
+tinyhist_slo_combine(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *src;
+	tinyhist_slo_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_slo_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (tinyhist_slo_t *) PG_GETARG_POINTER(1);
+
+	/* when NULL in the first parameter, just return a copy of the second one */
+	if (PG_ARGISNULL(0))
+	{
+		dst = MemoryContextAlloc(aggcontext, sizeof(tinyhist_slo_t));
+		memcpy(dst, src, sizeof(tinyhist_slo_t));
+
+		PG_RETURN_POINTER(dst);
+	}
+
+	dst = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(slo_merge_into(dst, dst, src));
+}
+
+/*
+ * tinyhist_slo_counts
+ *		bucket counters of the histogram, as an array
+ */
+Datum
+tinyhist_slo_counts(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	Datum		values[SLO_MAX_BUCKETS];
+
+	for (int i = 0; i < hist->nbuckets; i++)
+		values[i] = Int32GetDatum(slo_bucket_get(hist, i));
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, hist->nbuckets, INT4OID,
+										  sizeof(int32), true, TYPALIGN_INT));
+}
+
+/*
+ * tinyhist_slo_bounds
+ *		upper boundaries of the histogram buckets (the last is infinite)
+ */
+Datum
+tinyhist_slo_bounds(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	const slo_bounds_t *bounds = slo_bounds_lookup(fcinfo, hist->bounds);
+	Datum		values[SLO_MAX_BUCKETS];
+
+	for (int i = 0; i < bounds->nbounds; i++)
+		values[i] = Float8GetDatum(bounds->bounds[i]);
+
+	values[bounds->nbounds] = Float8GetDatum(get_float8_infinity());
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, hist->nbuckets, FLOAT8OID,
+										  sizeof(float8), FLOAT8PASSBYVAL,
+										  TYPALIGN_DOUBLE));
+}
+
+/*
+ * tinyhist_slo_compliance
+ *		fraction of values not exceeding the threshold
+ *
+ * The threshold has to be one of the boundaries, so the result is exact
+ * (except for the sampling). Returns NULL for empty histograms.
+ */
+Datum
+tinyhist_slo_compliance(PG_FUNCTION_ARGS)
+{
+	tinyhist_slo_t *hist = (tinyhist_slo_t *) PG_GETARG_POINTER(0);
+	double		threshold = PG_GETARG_FLOAT8(1);
+	const slo_bounds_t *bounds = slo_bounds_lookup(fcinfo, hist->bounds);
+	int			idx;
+	int64		below = 0,
+				total = 0;
+
+	idx = slo_bucket_index(bounds, threshold);
+
+	if ((idx == bounds->nbounds) || (bounds->bounds[idx] != threshold))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("threshold %g is not a boundary of the histogram", threshold)));
+
+	for (int i = 0; i < hist->nbuckets; i++)
+	{
+		int32		cnt = slo_bucket_get(hist, i);
+
+		if (i <= idx)
+			below += cnt;
+
+		total += cnt;
+	}
+
+	if (total == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8((double) below / total);
+}
+
+/*
+ * Export of histograms as an Arrow IPC stream.
+ *
+ * The Arrow metadata (schema, record batch) are flatbuffers, which we
+ * build using a minimal builder, prepending data from the end of the
+ * buffer (the same way the flatbuffers library does). Only features needed
+ * by the Arrow messages are supported (no vtable deduplication etc.).
+ */
+#define ARROW_METADATA_V5			4
+
+#define ARROW_HEADER_SCHEMA			1
+#define ARROW_HEADER_RECORD_BATCH	3
+
+#define ARROW_TYPE_INT				2
+#define ARROW_TYPE_UTF8				5
+#define ARROW_TYPE_FIXED_SIZE_LIST	16
+
+#define ARROW_CONTINUATION			0xFFFFFFFF
+
+#ifdef WORDS_BIGENDIAN
+#define ARROW_ENDIANNESS			1
+#else
+#define ARROW_ENDIANNESS			0
+#endif
+
+/* key, sample, unit, counts (fixed-size list) and counts item */
+#define ARROW_NODES		5
+#define ARROW_BUFFERS	10
+
+#define FB_MAX_FIELDS	8
+
+typedef struct fb_builder_t {
+	uint8	   *buf;			/* data are at the end of the buffer */
+	int			size;			/* allocated size */
+	int			used;			/* bytes used (at the end) */
+	int			minalign;		/* largest alignment used */
+	int			table_start;	/* start of the current table */
+	int			nslots;			/* fields of the current table */
+	int			slots[FB_MAX_FIELDS];
+} fb_builder_t;
+
+static void
+fb_init(fb_builder_t *b)
+{
+	b->size = 1024;
+	b->buf = palloc0(b->size);
+	b->used = 0;
+	b->minalign = 1;
+}
+
+static void
+fb_grow(fb_builder_t *b, int needed)
+{
+	uint8	   *buf;
+	int			size = b->size;
+
+	if (b->used + needed <= b->size)
+		return;
+
+	while (b->used + needed > size)
+		size *= 2;
+
+	buf = palloc0(size);
+	memcpy(buf + size - b->used, b->buf + b->size - b->used, b->used);
+
+	pfree(b->buf);
+
+	b->buf = buf;
+	b->size = size;
+}
+
+static void
+fb_pad(fb_builder_t *b, int n)
+{
+	fb_grow(b, n);
+
+	for (int i = 0; i < n; i++)
+		b->buf[b->size - (++b->used)] = 0;
+}
+
+/*
+ * fb_prep
+ *		align so that after prepending additional bytes, the data are
+ *		aligned to size bytes
+ */
+static void
+fb_prep(fb_builder_t *b, int size, int additional)
+{
+	b->minalign = Max(b->minalign, size);
+
+	fb_pad(b, (~(b->used + additional) + 1) & (size - 1));
+}
+
+/* prepend little-endian value of nbytes (after aligning) */
+static void
+fb_put(fb_builder_t *b, uint64 value, int nbytes)
+{
+	fb_prep(b, nbytes, 0);
+	fb_grow(b, nbytes);
+
+	b->used += nbytes;
+
+	for (int i = 0; i < nbytes; i++)
+		b->buf[b->size - b->used + i] = (value >> (8 * i)) & 0xFF;
+}
+
+/* prepend offset to an object created earlier */
+static void
+fb_put_offset(fb_builder_t *b, int offset)
+{
+	fb_prep(b, 4, 0);
+
+	Assert(offset <= b->used);
+
+	fb_put(b, b->used - offset + 4, 4);
+}
+
+static int
+fb_string(fb_builder_t *b, const char *str)
+{
+	int			len = strlen(str);
+
+	fb_prep(b, 4, len + 1);
+	fb_pad(b, 1);
+
+	fb_grow(b, len);
+	b->used += len;
+	memcpy(b->buf + b->size - b->used, str, len);
+
+	fb_put(b, len, 4);
+
+	return b->used;
+}
+
+static int
+fb_offset_vector(fb_builder_t *b, const int *offsets, int n)
+{
+	fb_prep(b, 4, 4 * n);
+
+	for (int i = n - 1; i >= 0; i--)
+		fb_put_offset(b, offsets[i]);
+
+	fb_put(b, n, 4);
+
+	return b->used;
+}
+
+/* vector of structs with two int64 fields (FieldNode, Buffer) */
+static int
+fb_struct_vector(fb_builder_t *b, const int64 *values, int n)
+{
+	fb_prep(b, 4, 16 * n);
+	fb_prep(b, 8, 16 * n);
+
+	for (int i = n - 1; i >= 0; i--)
+	{
+		fb_put(b, values[2 * i + 1], 8);
+		fb_put(b, values[2 * i], 8);
+	}
+
+	fb_put(b, n, 4);
+
+	return b->used;
+}
+
+static void
+fb_table_start(fb_builder_t *b, int nslots)
+{
+	Assert(nslots <= FB_MAX_FIELDS);
+
+	b->table_start = b->used;
+	b->nslots = nslots;
+	memset(b->slots, 0, sizeof(b->slots));
+}
+
+static void
+fb_table_scalar(fb_builder_t *b, int slot, uint64 value, int nbytes)
+{
+	fb_put(b, value, nbytes);
+	b->slots[slot] = b->used;
+}
+
+static void
+fb_table_offset(fb_builder_t *b, int slot, int offset)
+{
+	fb_put_offset(b, offset);
+	b->slots[slot] = b->used;
+}
+
+static int
+fb_table_end(fb_builder_t *b)
+{
+	int			table;
+	int			nslots = b->nslots;
+
+	/* placeholder for the vtable offset */
+	fb_put(b, 0, 4);
+	table = b->used;
+
+	/* trailing empty slots may be omitted */
+	while ((nslots > 0) && (b->slots[nslots - 1] == 0))
+		nslots--;
+
+	for (int i = nslots - 1; i >= 0; i--)
+		fb_put(b, (b->slots[i] == 0) ? 0 : (table - b->slots[i]), 2);
+
+	fb_put(b, table - b->table_start, 2);
+	fb_put(b, 2 * (nslots + 2), 2);
+
+	/* the vtable precedes the table, soffset is table - vtable */
+	for (int i = 0; i < 4; i++)
+		b->buf[b->size - table + i] = ((uint32) (b->used - table) >> (8 * i)) & 0xFF;
+
+	return table;
+}
+
+/* returns pointer to the finished buffer (and it's length) */
+static uint8 *
+fb_finish(fb_builder_t *b, int root, int *len)
+{
+	fb_prep(b, b->minalign, 4);
+	fb_put_offset(b, root);
+
+	*len = b->used;
+
+	return b->buf + b->size - b->used;
+}
+
+/*
+ * arrow_field
+ *		build Field table (with Int, Utf8 or FixedSizeList type)
+ */
+static int
+arrow_field(fb_builder_t *b, const char *name, bool nullable, int type,
+			int param, int child)
+{
+	int			name_offset = fb_string(b, name);
+	int			children = fb_offset_vector(b, &child, (child > 0) ? 1 : 0);
+	int			type_offset;
+
+	/* type table (Int has bitWidth and is_signed, FixedSizeList listSize) */
+	if (type == ARROW_TYPE_INT)
+	{
+		fb_table_start(b, 2);
+		fb_table_scalar(b, 1, 1, 1);
+		fb_table_scalar(b, 0, param, 4);
+	}
+	else if (type == ARROW_TYPE_FIXED_SIZE_LIST)
+	{
+		fb_table_start(b, 1);
+		fb_table_scalar(b, 0, param, 4);
+	}
+	else
+		fb_table_start(b, 0);
+
+	type_offset = fb_table_end(b);
+
+	/* Field: name, nullable, type_type, type, dictionary, children */
+	fb_table_start(b, 6);
+	fb_table_offset(b, 5, children);
+	fb_table_offset(b, 3, type_offset);
+	fb_table_offset(b, 0, name_offset);
+	fb_table_scalar(b, 2, type, 1);
+	fb_table_scalar(b, 1, nullable, 1);
+
+	return fb_table_end(b);
+}
+
+/*
+ * arrow_message
+ *		build Message table, and append it to the stream (with the prefix)
+ */
+static void
+arrow_message(StringInfo out, fb_builder_t *b, int header_type, int header,
+			  int64 body_length)
+{
+	uint8	   *data;
+	int			len;
+	int			padded;
+	uint32		prefix[2];
+
+	/* Message: version, header_type, header, bodyLength */
+	fb_table_start(b, 4);
+	fb_table_scalar(b, 3, body_length, 8);
+	fb_table_offset(b, 2, header);
+	fb_table_scalar(b, 0, ARROW_METADATA_V5, 2);
+	fb_table_scalar(b, 1, header_type, 1);
+
+	data = fb_finish(b, fb_table_end(b), &len);
+
+	/* the prefix is 8B, so the metadata have to be padded to 8B too */
+	padded = TYPEALIGN(8, len);
+
+	prefix[0] = ARROW_CONTINUATION;
+	prefix[1] = padded;
+
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 4; j++)
+			appendStringInfoChar(out, (prefix[i] >> (8 * j)) & 0xFF);
+
+	appendBinaryStringInfo(out, data, len);
+
+	while (len++ < padded)
+		appendStringInfoChar(out, '\0');
+}
+
+/*
+ * State of the tinyhist_arrow aggregate.
+ *
+ * The histograms are unpacked right when added to the state, into arrays
+ * laid out the same way as the Arrow buffers, so the final function only
+ * has to copy the arrays into the stream.
+ */
+typedef struct arrow_state_t {
+	int32		nrows;			/* number of rows */
+	int32		maxrows;		/* allocated rows */
+	int32		nnulls;			/* number of NULL keys */
+	bool	   *keynulls;		/* NULL keys */
+	int32	   *offsets;		/* offsets of keys (nrows + 1) */
+	StringInfoData keys;		/* concatenated keys */
+	int8	   *samples;		/* sample rates */
+	int8	   *units;			/* units */
+	int32	   *counts;			/* bucket counters (16 per row) */
+} arrow_state_t;
+
+static arrow_state_t *
+arrow_state_create(MemoryContext context)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(context);
+	arrow_state_t *state = palloc0(sizeof(arrow_state_t));
+
+	state->maxrows = 64;
+	state->keynulls = palloc(state->maxrows * sizeof(bool));
+	state->offsets = palloc((state->maxrows + 1) * sizeof(int32));
+	state->samples = palloc(state->maxrows * sizeof(int8));
+	state->units = palloc(state->maxrows * sizeof(int8));
+	state->counts = palloc(state->maxrows * HISTOGRAM_BUCKETS * sizeof(int32));
+
+	state->offsets[0] = 0;
+
+	initStringInfo(&state->keys);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return state;
+}
+
+/*
+ * arrow_state_add
+ *		add a row to the state (key may be NULL)
+ */
+static void
+arrow_state_add(arrow_state_t *state, const char *key, int keylen,
+				int sample, int unit, const int32 *counts)
+{
+	int			row = state->nrows;
+
+	if (state->nrows == state->maxrows)
+	{
+		state->maxrows *= 2;
+
+		state->keynulls = repalloc(state->keynulls, state->maxrows * sizeof(bool));
+		state->offsets = repalloc(state->offsets, (state->maxrows + 1) * sizeof(int32));
+		state->samples = repalloc(state->samples, state->maxrows * sizeof(int8));
+		state->units = repalloc(state->units, state->maxrows * sizeof(int8));
+		state->counts = repalloc(state->counts,
+								 state->maxrows * HISTOGRAM_BUCKETS * sizeof(int32));
+	}
+
+	state->keynulls[row] = (key == NULL);
+	state->nnulls += (key == NULL);
+
+	if (key != NULL)
+		appendBinaryStringInfo(&state->keys, key, keylen);
+
+	state->offsets[row + 1] = state->keys.len;
+	state->samples[row] = sample;
+	state->units[row] = unit;
+
+	memcpy(&state->counts[row * HISTOGRAM_BUCKETS], counts,
+		   HISTOGRAM_BUCKETS * sizeof(int32));
+
+	state->nrows++;
+}
+
+/* append buffer to the body, padded to 8B, and remember offset/length */
+static void
+arrow_body_buffer(StringInfo body, int64 *buffers, int *nbuffers,
+				  const void *data, int len)
+{
+	buffers[2 * (*nbuffers)] = body->len;
+	buffers[2 * (*nbuffers) + 1] = len;
+	(*nbuffers)++;
+
+	if (len > 0)
+		appendBinaryStringInfo(body, data, len);
+
+	while (body->len % 8 != 0)
+		appendStringInfoChar(body, '\0');
+}
+
+/*
+ * arrow_stream
+ *		build the Arrow IPC stream (schema, one record batch, end marker)
+ *
+ * Columns are key (utf8), sample (int8), unit (int8) and counts (fixed
+ * size list of 16 int32 values). The buffers are copied in native byte
+ * order, and the schema says so.
+ */
+static bytea *
+arrow_stream(arrow_state_t *state)
+{
+	StringInfoData out;
+	StringInfoData body;
+	fb_builder_t b;
+	int			fields[4];
+	int			offset;
+	int64		nodes[2 * ARROW_NODES];
+	int64		buffers[2 * ARROW_BUFFERS];
+	int			nbuffers = 0;
+	uint8	   *validity = NULL;
+	bytea	   *result;
+
+	initStringInfo(&out);
+
+	/* reserve space for the varlena header */
+	appendStringInfoSpaces(&out, VARHDRSZ);
+
+	/* schema message */
+	fb_init(&b);
+
+	offset = arrow_field(&b, "item", false, ARROW_TYPE_INT, 32, 0);
+
+	fields[0] = arrow_field(&b, "key", true, ARROW_TYPE_UTF8, 0, 0);
+	fields[1] = arrow_field(&b, "sample", false, ARROW_TYPE_INT, 8, 0);
+	fields[2] = arrow_field(&b, "unit", false, ARROW_TYPE_INT, 8, 0);
+	fields[3] = arrow_field(&b, "counts", false, ARROW_TYPE_FIXED_SIZE_LIST,
+							HISTOGRAM_BUCKETS, offset);
+
+	offset = fb_offset_vector(&b, fields, 4);
+
+	/* Schema: endianness, fields */
+	fb_table_start(&b, 2);
+	fb_table_offset(&b, 1, offset);
+	fb_table_scalar(&b, 0, ARROW_ENDIANNESS, 2);
+
+	arrow_message(&out, &b, ARROW_HEADER_SCHEMA, fb_table_end(&b), 0);
+
+	pfree(b.buf);
+
+	/* record batch body (validity buffers are omitted without NULLs) */
+	initStringInfo(&body);
+
+	if (state->nnulls > 0)
+	{
+		validity = palloc0((state->nrows + 7) / 8);
+
+		for (int i = 0; i < state->nrows; i++)
+		{
+			if (!state->keynulls[i])
+				validity[i / 8] |= (1 << (i % 8));
+		}
+	}
+
+	arrow_body_buffer(&body, buffers, &nbuffers, validity,
+					  (validity) ? (state->nrows + 7) / 8 : 0);
+	arrow_body_buffer(&body, buffers, &nbuffers, state->offsets,
+					  (state->nrows + 1) * sizeof(int32));
+	arrow_body_buffer(&body, buffers, &nbuffers, state->keys.data, state->keys.len);
+
+	arrow_body_buffer(&body, buffers, &nbuffers, NULL, 0);
+	arrow_body_buffer(&body, buffers, &nbuffers, state->samples, state->nrows);
+
+	arrow_body_buffer(&body, buffers, &nbuffers, NULL, 0);
+	arrow_body_buffer(&body, buffers, &nbuffers, state->units, state->nrows);
+
+	arrow_body_buffer(&body, buffers, &nbuffers, NULL, 0);
+
+	arrow_body_buffer(&body, buffers, &nbuffers, NULL, 0);
+	arrow_body_buffer(&body, buffers, &nbuffers, state->counts,
+					  state->nrows * HISTOGRAM_BUCKETS * sizeof(int32));
+
+	Assert(nbuffers == ARROW_BUFFERS);
+
+	for (int i = 0; i < ARROW_NODES; i++)
+	{
+		/* the last node is the list item, with 16 values per row */
+		nodes[2 * i] = state->nrows * ((i == ARROW_NODES - 1) ? HISTOGRAM_BUCKETS : 1);
+		nodes[2 * i + 1] = (i == 0) ? state->nnulls : 0;
+	}
+
+	/* record batch message */
+	fb_init(&b);
+
+	fields[0] = fb_struct_vector(&b, nodes, ARROW_NODES);
+	fields[1] = fb_struct_vector(&b, buffers, ARROW_BUFFERS);
+
+	/* RecordBatch: length, nodes, buffers */
+	fb_table_start(&b, 3);
+	fb_table_scalar(&b, 0, state->nrows, 8);
+	fb_table_offset(&b, 2, fields[1]);
+	fb_table_offset(&b, 1, fields[0]);
+
+	arrow_message(&out, &b, ARROW_HEADER_RECORD_BATCH, fb_table_end(&b), body.len);
+
+	appendBinaryStringInfo(&out, body.data, body.len);
+
+	/* end-of-stream marker */
+	for (int i = 0; i < 8; i++)
+		appendStringInfoChar(&out, (i < 4) ? 0xFF : 0x00);
+
+	pfree(b.buf);
+	pfree(body.data);
+
+	result = (bytea *) out.data;
+	SET_VARSIZE(result, out.len);
+
+	return result;
+}
+
+/*
+ * tinyhist_arrow_accum
+ *		add a histogram (with a key) to the tinyhist_arrow state
+ *
+ * Rows with NULL histograms are ignored, NULL keys are allowed.
+ */
+Datum
+tinyhist_arrow_accum(PG_FUNCTION_ARGS)
+{
+	arrow_state_t *state;
+	tinyhist_t *hist;
+	int32		counts[HISTOGRAM_BUCKETS];
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_arrow_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		state = arrow_state_create(aggcontext);
+	else
+		state = (arrow_state_t *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(2))
+		PG_RETURN_POINTER(state);
+
+	hist = (tinyhist_t *) PG_GETARG_POINTER(2);
+
+	hist_unpack(hist, counts);
+
+	if (PG_ARGISNULL(1))
+		arrow_state_add(state, NULL, 0, hist->sample, hist->unit, counts);
+	else
+	{
+		text	   *key = PG_GETARG_TEXT_PP(1);
+
+		arrow_state_add(state, VARDATA_ANY(key), VARSIZE_ANY_EXHDR(key),
+						hist->sample, hist->unit, counts);
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_arrow_combine
+ *		combine two tinyhist_arrow states (rows from src are appended)
+ */
+Datum
+tinyhist_arrow_combine(PG_FUNCTION_ARGS)
+{
+	arrow_state_t *src;
+	arrow_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_arrow_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (arrow_state_t *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		dst = arrow_state_create(aggcontext);
+	else
+		dst = (arrow_state_t *) PG_GETARG_POINTER(0);
+
+	for (int i = 0; i < src->nrows; i++)
+	{
+		int			start = src->offsets[i];
+
+		arrow_state_add(dst,
+						src->keynulls[i] ? NULL : (src->keys.data + start),
+						src->offsets[i + 1] - start,
+						src->samples[i], src->units[i],
+						&src->counts[i * HISTOGRAM_BUCKETS]);
+	}
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_arrow_serial
+ *		serialize the tinyhist_arrow state (for parallel aggregation)
+ */
+Datum
+tinyhist_arrow_serial(PG_FUNCTION_ARGS)
+{
+	arrow_state_t *state = (arrow_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint32(&buf, state->nrows);
+
+	for (int i = 0; i < state->nrows; i++)
+	{
+		int			start = state->offsets[i];
+		int			len = state->offsets[i + 1] - start;
+
+		pq_sendbyte(&buf, state->keynulls[i]);
+		pq_sendint32(&buf, len);
+		pq_sendbytes(&buf, state->keys.data + start, len);
+
+		pq_sendbyte(&buf, state->samples[i]);
+		pq_sendbyte(&buf, state->units[i]);
+
+		for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+			pq_sendint32(&buf, state->counts[i * HISTOGRAM_BUCKETS + j]);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_arrow_deserial
+ *		deserialize the tinyhist_arrow state (for parallel aggregation)
+ */
+Datum
+tinyhist_arrow_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	arrow_state_t *state;
+	StringInfoData buf;
+	int32		nrows;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_arrow_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	state = arrow_state_create(CurrentMemoryContext);
+
+	nrows = pq_getmsgint(&buf, 4);
+
+	for (int i = 0; i < nrows; i++)
+	{
+		bool		isnull = pq_getmsgbyte(&buf);
+		int			len = pq_getmsgint(&buf, 4);
+		const char *key = pq_getmsgbytes(&buf, len);
+		int			sample = pq_getmsgbyte(&buf);
+		int			unit = pq_getmsgbyte(&buf);
+		int32		counts[HISTOGRAM_BUCKETS];
+
+		for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+			counts[j] = pq_getmsgint(&buf, 4);
+
+		arrow_state_add(state, isnull ? NULL : key, len, sample, unit, counts);
+	}
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_arrow_final
+ *		final function for the tinyhist_arrow aggregate
+ */
+Datum
+tinyhist_arrow_final(PG_FUNCTION_ARGS)
+{
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_arrow_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	PG_RETURN_BYTEA_P(arrow_stream((arrow_state_t *) PG_GETARG_POINTER(0)));
+}
+
+/*
+ * Series of histograms (e.g. one per minute), stored as a segment tree so
+ * that any contiguous range of slots can be merged from O(log n) nodes.
+ *
+ * The nodes are stored level by level. Level 0 are the slots themselves,
+ * node i on level k is a merge of nodes 2i and 2i+1 on level (k-1). Only
+ * complete nodes are stored, i.e. there are floor(n / 2^k) nodes on level
+ * k, so there are less than 2n nodes in total. Appending a slot adds at
+ * most one node on each level, the existing nodes are not modified.
+ */
+typedef struct tinyhist_series_t {
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int32		nslots;			/* number of slots */
+	tinyhist_t	nodes[FLEXIBLE_ARRAY_MEMBER];	/* levels of the tree */
+} tinyhist_series_t;
+
+#define PG_GETARG_TINYHIST_SERIES(n) \
+	((tinyhist_series_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+/* maximum number of nodes merged for a range (two per level) */
+#define SERIES_MAX_RANGE_NODES	64
+
+/*
+ * series_nnodes
+ *		total number of nodes for a series with nslots
+ */
+static int
+series_nnodes(int nslots)
+{
+	int			nnodes = 0;
+
+	for (int n = nslots; n > 0; n /= 2)
+		nnodes += n;
+
+	return nnodes;
+}
+
+/*
+ * series_node
+ *		get node on the given level
+ */
+static const tinyhist_t *
+series_node(const tinyhist_series_t *series, int level, int idx)
+{
+	int			offset = 0;
+	int			n = series->nslots;
+
+	for (int k = 0; k < level; k++)
+	{
+		offset += n;
+		n /= 2;
+	}
+
+	Assert(idx < n);
+
+	return &series->nodes[offset + idx];
+}
+
+/*
+ * series_extend
+ *		build a new series by appending histograms to an existing one
+ *
+ * The series may be NULL, in which case we build a new one. The nodes
+ * of the existing series are copied, and only the new nodes (completed
+ * by the appended histograms) are merged.
+ */
+static tinyhist_series_t *
+series_extend(const tinyhist_series_t *series, const tinyhist_t *hists, int nhists)
+{
+	tinyhist_series_t *result;
+	int			oldslots = (series) ? series->nslots : 0;
+	int			nslots;
+	int			oldoffset = 0,
+				offset = 0,
+				prevoffset = 0;
+	Size		len;
+
+	if (oldslots > (MaxAllocSize / (2 * sizeof(tinyhist_t))) - nhists)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many slots in a histogram series")));
+
+	nslots = oldslots + nhists;
+
+	len = offsetof(tinyhist_series_t, nodes) + series_nnodes(nslots) * sizeof(tinyhist_t);
+
+	result = palloc0(len);
+	SET_VARSIZE(result, len);
+
+	result->nslots = nslots;
+
+	for (int n = nslots, oldn = oldslots; n > 0; n /= 2, oldn /= 2)
+	{
+		/* copy the existing nodes on this level */
+		if (oldn > 0)
+			memcpy(&result->nodes[offset], &series->nodes[oldoffset],
+				   oldn * sizeof(tinyhist_t));
+
+		for (int i = oldn; i < n; i++)
+		{
+			/* level 0 are the new slots, otherwise merge two child nodes */
+			if (offset == 0)
+				memcpy(&result->nodes[i], &hists[i - oldslots], sizeof(tinyhist_t));
+			else
+				hist_merge_into(&result->nodes[offset + i],
+								&result->nodes[prevoffset + 2 * i],
+								&result->nodes[prevoffset + 2 * i + 1]);
+		}
+
+		prevoffset = offset;
+		offset += n;
+		oldoffset += oldn;
+	}
+
+	return result;
+}
+
+/*
+ * series_range
+ *		merge slots [from, to) of the series
+ *
+ * Walks the levels bottom-up, collecting nodes covering the range from the
+ * left and right, and then merges them from left to right.
+ */
+static void
+series_range(const tinyhist_series_t *series, int from, int to, tinyhist_t *result)
+{
+	const tinyhist_t *left[SERIES_MAX_RANGE_NODES] = {0};
+	const tinyhist_t *right[SERIES_MAX_RANGE_NODES] = {0};
+	int			nleft = 0,
+				nright = 0;
+	tinyhist_unpacked_t state;
+
+	Assert((0 <= from) && (from < to) && (to <= series->nslots));
+
+	for (int level = 0; from < to; level++)
+	{
+		if (from & 1)
+			left[nleft++] = series_node(series, level, from++);
+
+		if (to & 1)
+			right[nright++] = series_node(series, level, --to);
+
+		from /= 2;
+		to /= 2;
+	}
+
+	/* the right nodes were collected from the end */
+	while (nright > 0)
+		left[nleft++] = right[--nright];
+
+	hist_unpack_state(left[0], &state);
+
+	for (int i = 1; i < nleft; i++)
+		hist_merge_state(&state, left[i]);
+
+	hist_pack_state(result, &state);
+}
+
+/*
+ * tinyhist_series_in
+ *		parse list of histograms [{...}, {...}, ...]
+ */
+Datum
+tinyhist_series_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	char	   *ptr = str;
+	int			nhists = 0,
+				maxhists = 64;
+	tinyhist_t *hists = palloc(maxhists * sizeof(tinyhist_t));
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr++ != '[')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_series: \"%s\"", str)));
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	while (*ptr != ']')
+	{
+		char	   *end = strchr(ptr, '}');
+		char	   *hist;
+
+		if ((*ptr != '{') || (end == NULL))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_series: \"%s\"", str)));
+
+		hist = pnstrdup(ptr, end - ptr + 1);
+
+		if (nhists == maxhists)
+		{
+			maxhists *= 2;
+			hists = repalloc(hists, maxhists * sizeof(tinyhist_t));
+		}
+
+		memcpy(&hists[nhists++],
+			   DatumGetPointer(DirectFunctionCall1(tinyhist_in, CStringGetDatum(hist))),
+			   sizeof(tinyhist_t));
+
+		ptr = end + 1;
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (*ptr == ',')
+		{
+			ptr++;
+			while (isspace((unsigned char) *ptr))
+				ptr++;
+		}
+		else if (*ptr != ']')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_series: \"%s\"", str)));
+	}
+
+	ptr++;
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr != '\0')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_series: \"%s\"", str)));
+
+	PG_RETURN_POINTER(series_extend(NULL, hists, nhists));
+}
+
+/*
+ * tinyhist_series_out
+ *		print the slots (the internal nodes are not printed)
+ */
+Datum
+tinyhist_series_out(PG_FUNCTION_ARGS)
+{
+	tinyhist_series_t *series = PG_GETARG_TINYHIST_SERIES(0);
+	StringInfoData str;
+
+	initStringInfo(&str);
+
+	appendStringInfoChar(&str, '[');
+
+	for (int i = 0; i < series->nslots; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(&str, ", ");
+
+		appendStringInfoString(&str,
+							   DatumGetCString(DirectFunctionCall1(tinyhist_out,
+																   PointerGetDatum(&series->nodes[i]))));
+	}
+
+	appendStringInfoChar(&str, ']');
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+/*
+ * tinyhist_series_append
+ *		append a histogram to the series (NULL means an empty histogram)
+ *
+ * If the series is NULL, a new one is created.
+ */
+Datum
+tinyhist_series_append(PG_FUNCTION_ARGS)
+{
+	tinyhist_series_t *series = NULL;
+	tinyhist_t	empty;
+	tinyhist_t *hist = &empty;
+
+	memset(&empty, 0, sizeof(tinyhist_t));
+
+	if (!PG_ARGISNULL(0))
+		series = PG_GETARG_TINYHIST_SERIES(0);
+
+	if (!PG_ARGISNULL(1))
+		hist = (tinyhist_t *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_POINTER(series_extend(series, hist, 1));
+}
+
+/*
+ * State of the tinyhist_series_agg aggregate - histograms for all slots,
+ * the tree is only built in the final function.
+ */
+typedef struct series_state_t {
+	int32		nhists;
+	int32		maxhists;
+	tinyhist_t *hists;
+} series_state_t;
+
+/*
+ * tinyhist_series_accum
+ *		add a histogram to the tinyhist_series_agg state (as the next slot)
+ */
+Datum
+tinyhist_series_accum(PG_FUNCTION_ARGS)
+{
+	series_state_t *state;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_series_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+	{
+		state = MemoryContextAllocZero(aggcontext, sizeof(series_state_t));
+
+		state->maxhists = 64;
+		state->hists = MemoryContextAlloc(aggcontext, state->maxhists * sizeof(tinyhist_t));
+	}
+	else
+		state = (series_state_t *) PG_GETARG_POINTER(0);
+
+	if (state->nhists == state->maxhists)
+	{
+		state->maxhists *= 2;
+		state->hists = repalloc(state->hists, state->maxhists * sizeof(tinyhist_t));
+	}
+
+	/* NULL histograms are empty slots */
+	if (PG_ARGISNULL(1))
+		memset(&state->hists[state->nhists++], 0, sizeof(tinyhist_t));
+	else
+		memcpy(&state->hists[state->nhists++], PG_GETARG_POINTER(1), sizeof(tinyhist_t));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_series_final
+ *		build the series from histograms accumulated in the state
+ */
+Datum
+tinyhist_series_final(PG_FUNCTION_ARGS)
+{
+	series_state_t *state;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_series_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (series_state_t *) PG_GETARG_POINTER(0);
+
+	PG_RETURN_POINTER(series_extend(NULL, state->hists, state->nhists));
+}
+
+/*
+ * tinyhist_series_range
+ *		merge histograms for slots [from, to] (numbered from 1)
+ *
+ * The range is clamped to the existing slots, and for empty ranges the
+ * result is NULL.
+ */
+Datum
+tinyhist_series_range(PG_FUNCTION_ARGS)
+{
+	tinyhist_series_t *series = PG_GETARG_TINYHIST_SERIES(0);
+	int32		from = PG_GETARG_INT32(1);
+	int32		to = PG_GETARG_INT32(2);
+	tinyhist_t *result;
+
+	from = Max(from, 1);
+	to = Min(to, series->nslots);
+
+	if (from > to)
+		PG_RETURN_NULL();
+
+	result = palloc0(sizeof(tinyhist_t));
+
+	series_range(series, from - 1, to, result);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * tinyhist_series_slots
+ *		number of slots in the series
+ */
+Datum
+tinyhist_series_slots(PG_FUNCTION_ARGS)
+{
+	tinyhist_series_t *series = PG_GETARG_TINYHIST_SERIES(0);
+
+	PG_RETURN_INT32(series->nslots);
+}
+
+/*
+ * Map of histograms, keyed by int8 (e.g. one histogram per customer), so
+ * that a single row may store histograms for the whole population.
+ *
+ * The keys are stored sorted (and unique) in an array, followed by an
+ * array of histograms in the same order. Lookups use a binary search.
+ */
+typedef struct tinyhist_map_t {
+	int32		vl_len_;		/* varlena header (do not touch directly!) */
+	int32		nkeys;			/* number of keys */
+	int64		keys[FLEXIBLE_ARRAY_MEMBER];	/* sorted keys */
+	/* followed by nkeys histograms */
+} tinyhist_map_t;
+
+#define MAP_HISTS(map)	((tinyhist_t *) &(map)->keys[(map)->nkeys])
+
+#define PG_GETARG_TINYHIST_MAP(n) \
+	((tinyhist_map_t *) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
+
+/* maximum number of keys, so that the map fits into a varlena */
+#define MAP_MAX_KEYS \
+	((int) ((MaxAllocSize - offsetof(tinyhist_map_t, keys)) / (sizeof(int64) + sizeof(tinyhist_t))))
+
+/*
+ * map_check_nkeys
+ *		make sure a map with nkeys keys can be allocated
+ */
+static void
+map_check_nkeys(int64 nkeys)
+{
+	if (nkeys > MAP_MAX_KEYS)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("too many keys in a histogram map")));
+}
+
+/*
+ * map_allocate
+ *		allocate a map with space for nkeys keys and histograms
+ */
+static tinyhist_map_t *
+map_allocate(int64 nkeys)
+{
+	tinyhist_map_t *map;
+	Size		len;
+
+	map_check_nkeys(nkeys);
+
+	len = offsetof(tinyhist_map_t, keys) + nkeys * (sizeof(int64) + sizeof(tinyhist_t));
+
+	map = palloc0(len);
+	SET_VARSIZE(map, len);
+
+	map->nkeys = nkeys;
+
+	return map;
+}
+
+/*
+ * map_truncate
+ *		shrink the map to the first nkeys keys (moving the histograms)
+ *
+ * The histograms are expected to be at the position for the original
+ * number of keys, i.e. before adjusting map->nkeys.
+ */
+static void
+map_truncate(tinyhist_map_t *map, int nkeys)
+{
+	tinyhist_t *hists = MAP_HISTS(map);
+
+	Assert(nkeys <= map->nkeys);
+
+	map->nkeys = nkeys;
+
+	memmove(MAP_HISTS(map), hists, nkeys * sizeof(tinyhist_t));
+
+	SET_VARSIZE(map, offsetof(tinyhist_map_t, keys) + nkeys * (sizeof(int64) + sizeof(tinyhist_t)));
+}
+
+/*
+ * map_lower_bound
+ *		index of the first key not less than the given key
+ */
+static int
+map_lower_bound(const int64 *keys, int nkeys, int64 key)
+{
+	int			lo = 0;
+
+	while (nkeys > 0)
+	{
+		int			half = nkeys / 2;
+
+		if (keys[lo + half] < key)
+		{
+			lo += half + 1;
+			nkeys -= half + 1;
+		}
+		else
+			nkeys = half;
+	}
+
+	return lo;
+}
+
+/*
+ * map_merge
+ *		merge two sorted sequences of keys and histograms
+ *
+ * Histograms for keys present in both inputs are merged. The output arrays
+ * need to have space for (nkeys1 + nkeys2) items, and the number of keys
+ * in the result is returned.
+ */
+static int
+map_merge(const int64 *keys1, const tinyhist_t *hists1, int nkeys1,
+		  const int64 *keys2, const tinyhist_t *hists2, int nkeys2,
+		  int64 *keys, tinyhist_t *hists)
+{
+	int			i = 0,
+				j = 0,
+				n = 0;
+
+	while ((i < nkeys1) || (j < nkeys2))
+	{
+		if ((j == nkeys2) || ((i < nkeys1) && (keys1[i] < keys2[j])))
+		{
+			keys[n] = keys1[i];
+			memcpy(&hists[n++], &hists1[i++], sizeof(tinyhist_t));
+		}
+		else if ((i == nkeys1) || (keys2[j] < keys1[i]))
+		{
+			keys[n] = keys2[j];
+			memcpy(&hists[n++], &hists2[j++], sizeof(tinyhist_t));
+		}
+		else
+		{
+			keys[n] = keys1[i];
+			hist_merge_into(&hists[n++], &hists1[i++], &hists2[j++]);
+		}
+	}
+
+	return n;
+}
+
+typedef struct map_item_t {
+	int64		key;
+	tinyhist_t	hist;
+} map_item_t;
+
+static int
+map_item_cmp(const void *a, const void *b)
+{
+	int64		ka = ((const map_item_t *) a)->key;
+	int64		kb = ((const map_item_t *) b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * tinyhist_map_in
+ *		parse map of histograms {key: {...}, key: {...}, ...}
+ *
+ * The keys may be in arbitrary order, but have to be unique.
+ */
+Datum
+tinyhist_map_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	char	   *ptr = str;
+	int			nitems = 0,
+				maxitems = 64;
+	map_item_t *items = palloc(maxitems * sizeof(map_item_t));
+	tinyhist_map_t *map;
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr++ != '{')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	while (*ptr != '}')
+	{
+		char	   *end;
+		char	   *hist;
+		long long	key;
+
+		/* strtoi64 is not available before PostgreSQL 15 */
+		errno = 0;
+		key = strtoll(ptr, &end, 10);
+
+		if ((errno != 0) || (end == ptr) ||
+			(key < PG_INT64_MIN) || (key > PG_INT64_MAX))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+
+		ptr = end;
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (*ptr++ != ':')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		end = strchr(ptr, '}');
+
+		if ((*ptr != '{') || (end == NULL))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+
+		hist = pnstrdup(ptr, end - ptr + 1);
+
+		if (nitems == maxitems)
+		{
+			map_check_nkeys((int64) maxitems * 2);
+			maxitems *= 2;
+			items = repalloc(items, maxitems * sizeof(map_item_t));
+		}
+
+		items[nitems].key = key;
+		memcpy(&items[nitems++].hist,
+			   DatumGetPointer(DirectFunctionCall1(tinyhist_in, CStringGetDatum(hist))),
+			   sizeof(tinyhist_t));
+
+		ptr = end + 1;
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+
+		if (*ptr == ',')
+		{
+			ptr++;
+			while (isspace((unsigned char) *ptr))
+				ptr++;
+		}
+		else if (*ptr != '}')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+	}
+
+	ptr++;
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr != '\0')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_map: \"%s\"", str)));
+
+	qsort(items, nitems, sizeof(map_item_t), map_item_cmp);
+
+	map = map_allocate(nitems);
+
+	for (int i = 0; i < nitems; i++)
+	{
+		if ((i > 0) && (items[i].key == items[i - 1].key))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("duplicate key " INT64_FORMAT " in tinyhist_map", items[i].key)));
+
+		map->keys[i] = items[i].key;
+		memcpy(&MAP_HISTS(map)[i], &items[i].hist, sizeof(tinyhist_t));
+	}
+
+	PG_RETURN_POINTER(map);
+}
+
+/*
+ * tinyhist_map_out
+ *		print the map as {key: {...}, key: {...}, ...} (sorted by key)
+ */
+Datum
+tinyhist_map_out(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map = PG_GETARG_TINYHIST_MAP(0);
+	tinyhist_t *hists = MAP_HISTS(map);
+	StringInfoData str;
+
+	initStringInfo(&str);
+
+	appendStringInfoChar(&str, '{');
+
+	for (int i = 0; i < map->nkeys; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(&str, ", ");
+
+		appendStringInfo(&str, INT64_FORMAT ": %s", map->keys[i],
+						 DatumGetCString(DirectFunctionCall1(tinyhist_out,
+															 PointerGetDatum(&hists[i]))));
+	}
+
+	appendStringInfoChar(&str, '}');
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+/*
+ * tinyhist_map_add
+ *		add a value to the histogram for the given key
+ *
+ * NULL map is treated as empty, NULL keys and values are ignored (same as
+ * for tinyhist_add). The input map is not modified.
+ */
+Datum
+tinyhist_map_add(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map;
+	tinyhist_map_t *result;
+	int64		key;
+	int			idx;
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	key = PG_GETARG_INT64(1);
+
+	if (PG_ARGISNULL(0))
+		map = map_allocate(0);
+	else
+		map = PG_GETARG_TINYHIST_MAP(0);
+
+	idx = map_lower_bound(map->keys, map->nkeys, key);
+
+	if ((idx < map->nkeys) && (map->keys[idx] == key))
+	{
+		result = palloc(VARSIZE(map));
+		memcpy(result, map, VARSIZE(map));
+	}
+	else
+	{
+		/* insert an empty histogram for the new key */
+		result = map_allocate(map->nkeys + 1);
+
+		memcpy(result->keys, map->keys, idx * sizeof(int64));
+		memcpy(&result->keys[idx + 1], &map->keys[idx],
+			   (map->nkeys - idx) * sizeof(int64));
+		result->keys[idx] = key;
+
+		memcpy(MAP_HISTS(result), MAP_HISTS(map), idx * sizeof(tinyhist_t));
+		memcpy(&MAP_HISTS(result)[idx + 1], &MAP_HISTS(map)[idx],
+			   (map->nkeys - idx) * sizeof(tinyhist_t));
+	}
+
+	hist_add(&MAP_HISTS(result)[idx], PG_GETARG_FLOAT8(2));
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * tinyhist_map_add_map
+ *		merge two maps (histograms for the same key are merged)
+ *
+ * If one of the maps is NULL, the other one is returned.
+ */
+Datum
+tinyhist_map_add_map(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map1;
+	tinyhist_map_t *map2;
+	tinyhist_map_t *result;
+	int			nkeys;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		if (!PG_ARGISNULL(0))
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		else if (!PG_ARGISNULL(1))
+			PG_RETURN_DATUM(PG_GETARG_DATUM(1));
+		else
+			PG_RETURN_NULL();
+	}
+
+	map1 = PG_GETARG_TINYHIST_MAP(0);
+	map2 = PG_GETARG_TINYHIST_MAP(1);
+
+	result = map_allocate((int64) map1->nkeys + map2->nkeys);
+
+	nkeys = map_merge(map1->keys, MAP_HISTS(map1), map1->nkeys,
+					  map2->keys, MAP_HISTS(map2), map2->nkeys,
+					  result->keys, MAP_HISTS(result));
+
+	map_truncate(result, nkeys);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * tinyhist_map_get
+ *		histogram for the given key (NULL if there's no such key)
+ */
+Datum
+tinyhist_map_get(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map = PG_GETARG_TINYHIST_MAP(0);
+	int64		key = PG_GETARG_INT64(1);
+	int			idx = map_lower_bound(map->keys, map->nkeys, key);
+
+	if ((idx == map->nkeys) || (map->keys[idx] != key))
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(hist_copy(&MAP_HISTS(map)[idx]));
+}
+
+/*
+ * tinyhist_map_range
+ *		merge histograms for keys in [from, to]
+ *
+ * Returns NULL if there are no keys in the range.
+ */
+Datum
+tinyhist_map_range(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map = PG_GETARG_TINYHIST_MAP(0);
+	int64		from = PG_GETARG_INT64(1);
+	int64		to = PG_GETARG_INT64(2);
+	tinyhist_t *hists = MAP_HISTS(map);
+	tinyhist_unpacked_t state;
+	tinyhist_t *result;
+	int			start,
+				end;
+
+	start = map_lower_bound(map->keys, map->nkeys, from);
+	end = start + map_lower_bound(&map->keys[start], map->nkeys - start, to);
+
+	/* the upper bound is inclusive */
+	if ((end < map->nkeys) && (map->keys[end] == to))
+		end++;
+
+	if (start >= end)
+		PG_RETURN_NULL();
+
+	hist_unpack_state(&hists[start], &state);
+
+	for (int i = start + 1; i < end; i++)
+		hist_merge_state(&state, &hists[i]);
+
+	result = palloc0(sizeof(tinyhist_t));
+	hist_pack_state(result, &state);
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * tinyhist_map_keys
+ *		sorted array of keys in the map
+ */
+Datum
+tinyhist_map_keys(PG_FUNCTION_ARGS)
+{
+	tinyhist_map_t *map = PG_GETARG_TINYHIST_MAP(0);
+	Datum	   *values = palloc(Max(1, map->nkeys) * sizeof(Datum));
+
+	for (int i = 0; i < map->nkeys; i++)
+		values[i] = Int64GetDatum(map->keys[i]);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, map->nkeys, INT8OID,
+										  sizeof(int64), FLOAT8PASSBYVAL,
+										  TYPALIGN_DOUBLE));
+}
+
+/*
+ * State of the tinyhist_map_agg aggregates.
+ *
+ * The histograms are kept in sorted arrays, same as in tinyhist_map. Values
+ * for existing keys are added directly (after a binary search), values for
+ * new keys are buffered in an unsorted array, and merged into the sorted
+ * arrays once the buffer gets as large as the sorted part. That makes the
+ * cost of adding a value O(log n) on average.
+ */
+typedef struct map_pending_t {
+	int64		key;
+	double		value;
+} map_pending_t;
+
+typedef struct map_state_t {
+	int32		nkeys;
+	int64	   *keys;			/* sorted keys */
+	tinyhist_t *hists;			/* histograms for keys */
+	int32		npending;
+	int32		maxpending;
+	map_pending_t *pending;		/* values for keys not in the sorted part */
+} map_state_t;
+
+/* minimum size of the buffer for values with new keys */
+#define MAP_MIN_PENDING		1024
+
+static map_state_t *
+map_state_create(MemoryContext context)
+{
+	map_state_t *state = MemoryContextAllocZero(context, sizeof(map_state_t));
+
+	state->maxpending = MAP_MIN_PENDING;
+	state->pending = MemoryContextAlloc(context, state->maxpending * sizeof(map_pending_t));
+
+	return state;
+}
+
+static int
+map_pending_cmp(const void *a, const void *b)
+{
+	int64		ka = ((const map_pending_t *) a)->key;
+	int64		kb = ((const map_pending_t *) b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * map_state_replace
+ *		replace the sorted part of the state with new arrays
+ *
+ * Merges the sorted part with the given (sorted) keys and histograms, into
+ * arrays allocated in the aggregate context.
+ */
+static void
+map_state_replace(MemoryContext context, map_state_t *state,
+				  const int64 *keys, const tinyhist_t *hists, int nkeys)
+{
+	int64	   *newkeys;
+	tinyhist_t *newhists;
+	int64		maxkeys = (int64) state->nkeys + nkeys;
+
+	map_check_nkeys(maxkeys);
+
+	newkeys = MemoryContextAlloc(context, Max(1, maxkeys) * sizeof(int64));
+	newhists = MemoryContextAlloc(context, Max(1, maxkeys) * sizeof(tinyhist_t));
+
+	nkeys = map_merge(state->keys, state->hists, state->nkeys,
+					  keys, hists, nkeys, newkeys, newhists);
+
+	if (state->nkeys > 0)
+	{
+		pfree(state->keys);
+		pfree(state->hists);
+	}
+
+	state->nkeys = nkeys;
+	state->keys = newkeys;
+	state->hists = newhists;
+}
+
+/*
+ * map_pending_build
+ *		build sorted keys and histograms from the pending values
+ *
+ * The pending values get sorted by key, but are otherwise not modified.
+ * Returns the number of distinct keys.
+ */
+static int
+map_pending_build(map_state_t *state, int64 **keys, tinyhist_t **hists)
+{
+	int			nkeys = 0;
+
+	*keys = palloc(Max(1, state->npending) * sizeof(int64));
+	*hists = palloc0(Max(1, state->npending) * sizeof(tinyhist_t));
+
+	qsort(state->pending, state->npending, sizeof(map_pending_t), map_pending_cmp);
+
+	for (int i = 0; i < state->npending; i++)
+	{
+		if ((nkeys == 0) || ((*keys)[nkeys - 1] != state->pending[i].key))
+			(*keys)[nkeys++] = state->pending[i].key;
+
+		hist_add(&(*hists)[nkeys - 1], state->pending[i].value);
+	}
+
+	return nkeys;
+}
+
+/*
+ * map_state_flush
+ *		merge the pending values into the sorted part of the state
+ */
+static void
+map_state_flush(MemoryContext context, map_state_t *state)
+{
+	int64	   *keys;
+	tinyhist_t *hists;
+	int			nkeys;
+
+	if (state->npending == 0)
+		return;
+
+	nkeys = map_pending_build(state, &keys, &hists);
+
+	map_state_replace(context, state, keys, hists, nkeys);
+
+	state->npending = 0;
+
+	pfree(keys);
+	pfree(hists);
+}
+
+/*
+ * map_state_add
+ *		add a value to the state
+ */
+static void
+map_state_add(MemoryContext context, map_state_t *state, int64 key, double value)
+{
+	int			idx = map_lower_bound(state->keys, state->nkeys, key);
+
+	if ((idx < state->nkeys) && (state->keys[idx] == key))
+	{
+		hist_add(&state->hists[idx], value);
+		return;
+	}
+
+	state->pending[state->npending].key = key;
+	state->pending[state->npending++].value = value;
+
+	if (state->npending < state->maxpending)
+		return;
+
+	map_state_flush(context, state);
+
+	/* keep the buffer about as large as the sorted part */
+	if (state->nkeys > state->maxpending)
+	{
+		state->maxpending = Min(state->nkeys, MaxAllocSize / sizeof(map_pending_t));
+		state->pending = repalloc(state->pending, state->maxpending * sizeof(map_pending_t));
+	}
+}
+
+/*
+ * tinyhist_map_accum
+ *		transition function for tinyhist_map_agg(key, value)
+ *
+ * NULL keys and values are ignored.
+ */
+Datum
+tinyhist_map_accum(PG_FUNCTION_ARGS)
+{
+	map_state_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_map_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (PG_ARGISNULL(0))
+		state = map_state_create(aggcontext);
+	else
+		state = (map_state_t *) PG_GETARG_POINTER(0);
+
+	map_state_add(aggcontext, state, PG_GETARG_INT64(1), PG_GETARG_FLOAT8(2));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_map_accum_map
+ *		transition function for tinyhist_map_agg(map)
+ *
+ * NULL maps are ignored.
+ */
+Datum
+tinyhist_map_accum_map(PG_FUNCTION_ARGS)
+{
+	map_state_t *state;
+	tinyhist_map_t *map;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_map_accum_map called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (PG_ARGISNULL(0))
+		state = map_state_create(aggcontext);
+	else
+		state = (map_state_t *) PG_GETARG_POINTER(0);
+
+	map = PG_GETARG_TINYHIST_MAP(1);
+
+	map_state_replace(aggcontext, state, map->keys, MAP_HISTS(map), map->nkeys);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_map_combine
+ *		combine function for the tinyhist_map_agg aggregates
+ *
+ * Merges the sorted part of the second state, and adds the pending values
+ * one by one. The second state is not modified.
+ */
+Datum
+tinyhist_map_combine(PG_FUNCTION_ARGS)
+{
+	map_state_t *src;
+	map_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_map_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (map_state_t *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		dst = map_state_create(aggcontext);
+	else
+		dst = (map_state_t *) PG_GETARG_POINTER(0);
+
+	if (src->nkeys > 0)
+		map_state_replace(aggcontext, dst, src->keys, src->hists, src->nkeys);
+
+	for (int i = 0; i < src->npending; i++)
+		map_state_add(aggcontext, dst, src->pending[i].key, src->pending[i].value);
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_map_serial
+ *		serialize the tinyhist_map_agg state (for parallel aggregation)
+ */
+Datum
+tinyhist_map_serial(PG_FUNCTION_ARGS)
+{
+	map_state_t *state = (map_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint32(&buf, state->nkeys);
+
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		pq_sendint64(&buf, state->keys[i]);
+		pq_sendbytes(&buf, (char *) &state->hists[i], sizeof(tinyhist_t));
+	}
+
+	pq_sendint32(&buf, state->npending);
+
+	for (int i = 0; i < state->npending; i++)
+	{
+		pq_sendint64(&buf, state->pending[i].key);
+		pq_sendfloat8(&buf, state->pending[i].value);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_map_deserial
+ *		deserialize the tinyhist_map_agg state (for parallel aggregation)
+ */
+Datum
+tinyhist_map_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	map_state_t *state;
+	StringInfoData buf;
+	int32		npending;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_map_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	state = map_state_create(CurrentMemoryContext);
+
+	state->nkeys = pq_getmsgint(&buf, 4);
+
+	if (state->nkeys > 0)
+	{
+		state->keys = palloc(state->nkeys * sizeof(int64));
+		state->hists = palloc(state->nkeys * sizeof(tinyhist_t));
+	}
+
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		state->keys[i] = pq_getmsgint64(&buf);
+		memcpy(&state->hists[i], pq_getmsgbytes(&buf, sizeof(tinyhist_t)),
+			   sizeof(tinyhist_t));
+	}
+
+	npending = pq_getmsgint(&buf, 4);
+
+	for (int i = 0; i < npending; i++)
+	{
+		int64		key = pq_getmsgint64(&buf);
+		double		value = pq_getmsgfloat8(&buf);
+
+		map_state_add(CurrentMemoryContext, state, key, value);
+	}
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_map_final
+ *		final function for the tinyhist_map_agg aggregates
+ *
+ * Merges the pending values and the sorted part directly into the result,
+ * the sorted part of the state is not modified.
+ */
+Datum
+tinyhist_map_final(PG_FUNCTION_ARGS)
+{
+	map_state_t *state;
+	tinyhist_map_t *map;
+	int64	   *keys;
+	tinyhist_t *hists;
+	int			nkeys;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_map_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (map_state_t *) PG_GETARG_POINTER(0);
+
+	nkeys = map_pending_build(state, &keys, &hists);
+
+	map = map_allocate((int64) state->nkeys + nkeys);
+
+	nkeys = map_merge(state->keys, state->hists, state->nkeys,
+					  keys, hists, nkeys, map->keys, MAP_HISTS(map));
+
+	map_truncate(map, nkeys);
+
+	PG_RETURN_POINTER(map);
+}
+
+/*
+ * State of the tinyhist_threshold_counts aggregate.
+ *
+ * The thresholds split the values into (nthresholds + 1) intervals, and we
+ * only count values in each interval. The counts for thresholds (values
+ * less than the threshold) are calculated in the final function, as sums
+ * of the preceding intervals.
+ */
+typedef struct threshold_state_t
+{
+	int32		nthresholds;	/* number of thresholds */
+	double	   *thresholds;		/* thresholds (in the original order) */
+	double	   *sorted;			/* thresholds (sorted) */
+	int32	   *order;			/* original position of sorted thresholds */
+	int64	   *counts;			/* counts for intervals between thresholds */
+	ArrayType  *array;			/* array the thresholds were built from */
+} threshold_state_t;
+
+typedef struct threshold_item_t
+{
+	double		value;
+	int32		index;
+} threshold_item_t;
+
+static int
+threshold_item_cmp(const void *a, const void *b)
+{
+	const threshold_item_t *ia = (const threshold_item_t *) a;
+	const threshold_item_t *ib = (const threshold_item_t *) b;
+
+	if (ia->value != ib->value)
+		return (ia->value < ib->value) ? -1 : 1;
+
+	return (ia->index > ib->index) - (ia->index < ib->index);
+}
+
+/*
+ * threshold_state_create
+ *		create the state for the given thresholds (in the original order)
+ */
+static threshold_state_t *
+threshold_state_create(MemoryContext context, const double *thresholds,
+					   int nthresholds)
+{
+	threshold_state_t *state;
+	threshold_item_t *items;
+
+	state = MemoryContextAllocZero(context, sizeof(threshold_state_t));
+
+	state->nthresholds = nthresholds;
+	state->thresholds = MemoryContextAlloc(context, Max(1, nthresholds) * sizeof(double));
+	state->sorted = MemoryContextAlloc(context, Max(1, nthresholds) * sizeof(double));
+	state->order = MemoryContextAlloc(context, Max(1, nthresholds) * sizeof(int32));
+	state->counts = MemoryContextAllocZero(context, (nthresholds + 1) * sizeof(int64));
+
+	memcpy(state->thresholds, thresholds, nthresholds * sizeof(double));
+
+	items = palloc(Max(1, nthresholds) * sizeof(threshold_item_t));
+
+	for (int i = 0; i < nthresholds; i++)
+	{
+		items[i].value = thresholds[i];
+		items[i].index = i;
+	}
+
+	qsort(items, nthresholds, sizeof(threshold_item_t), threshold_item_cmp);
+
+	for (int i = 0; i < nthresholds; i++)
+	{
+		state->sorted[i] = items[i].value;
+		state->order[i] = items[i].index;
+	}
+
+	pfree(items);
+
+	return state;
+}
+
+/*
+ * threshold_index
+ *		number of thresholds not exceeding the value
+ *
+ * A branchless binary search - the comparison only decides how the base
+ * moves, which compiles into a conditional move. NaN values are greater
+ * than all thresholds (as in PostgreSQL), so they are not below any of
+ * them.
+ */
+static inline int
+threshold_index(const double *sorted, int nthresholds, double value)
+{
+	const double *base = sorted;
+	int			n = nthresholds;
+
+	if (isnan(value))
+		return nthresholds;
+
+	if (n == 0)
+		return 0;
+
+	while (n > 1)
+	{
+		int			half = n / 2;
+
+		base = (base[half] <= value) ? base + half : base;
+		n -= half;
+	}
+
+	return (base - sorted) + (*base <= value);
+}
+
+/*
+ * tinyhist_threshold_accum
+ *		transition function for the tinyhist_threshold_counts aggregate
+ *
+ * The thresholds have to be the same for all rows. NULL values are ignored.
+ */
+Datum
+tinyhist_threshold_accum(PG_FUNCTION_ARGS)
+{
+	threshold_state_t *state;
+	ArrayType  *array;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_threshold_accum called in non-aggregate context");
+
+	if (PG_ARGISNULL(2))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("thresholds must not be NULL")));
+
+	array = PG_GETARG_ARRAYTYPE_P(2);
+
+	if (PG_ARGISNULL(0))
+	{
+		Datum	   *values;
+		bool	   *nulls;
+		int			nvalues;
+		double	   *thresholds;
+
+		if (ARR_NDIM(array) > 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+					 errmsg("array of thresholds must be one-dimensional")));
+
+		deconstruct_array(array, FLOAT8OID,
+						  sizeof(float8), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE,
+						  &values, &nulls, &nvalues);
+
+		thresholds = palloc(Max(1, nvalues) * sizeof(double));
+
+		for (int i = 0; i < nvalues; i++)
+		{
+			if (nulls[i] || isnan(DatumGetFloat8(values[i])))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("thresholds must not be NULL or NaN")));
+
+			thresholds[i] = DatumGetFloat8(values[i]);
+		}
+
+		state = threshold_state_create(aggcontext, thresholds, nvalues);
+
+		/* remember the array, to cheaply check the following rows */
+		state->array = MemoryContextAlloc(aggcontext, VARSIZE(array));
+		memcpy(state->array, array, VARSIZE(array));
+	}
+	else
+	{
+		state = (threshold_state_t *) PG_GETARG_POINTER(0);
+
+		if ((VARSIZE(array) != VARSIZE(state->array)) ||
+			(memcmp(array, state->array, VARSIZE(array)) != 0))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("thresholds must be the same for all rows")));
+	}
+
+	if (!PG_ARGISNULL(1))
+		state->counts[threshold_index(state->sorted, state->nthresholds,
+									  PG_GETARG_FLOAT8(1))]++;
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_threshold_combine
+ *		combine function for the tinyhist_threshold_counts aggregate
+ */
+Datum
+tinyhist_threshold_combine(PG_FUNCTION_ARGS)
+{
+	threshold_state_t *src;
+	threshold_state_t *dst;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_threshold_combine called in non-aggregate context");
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+	}
+
+	src = (threshold_state_t *) PG_GETARG_POINTER(1);
+
+	if (PG_ARGISNULL(0))
+		dst = threshold_state_create(aggcontext, src->thresholds, src->nthresholds);
+	else
+	{
+		dst = (threshold_state_t *) PG_GETARG_POINTER(0);
+
+		if ((dst->nthresholds != src->nthresholds) ||
+			(memcmp(dst->thresholds, src->thresholds, src->nthresholds * sizeof(double)) != 0))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("thresholds must be the same for all rows")));
+	}
+
+	for (int i = 0; i <= src->nthresholds; i++)
+		dst->counts[i] += src->counts[i];
+
+	PG_RETURN_POINTER(dst);
+}
+
+/*
+ * tinyhist_threshold_serial
+ *		serialize the tinyhist_threshold_counts state (parallel aggregation)
+ */
+Datum
+tinyhist_threshold_serial(PG_FUNCTION_ARGS)
+{
+	threshold_state_t *state = (threshold_state_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint32(&buf, state->nthresholds);
+
+	for (int i = 0; i < state->nthresholds; i++)
+		pq_sendfloat8(&buf, state->thresholds[i]);
+
+	for (int i = 0; i <= state->nthresholds; i++)
+		pq_sendint64(&buf, state->counts[i]);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/*
+ * tinyhist_threshold_deserial
+ *		deserialize the tinyhist_threshold_counts state (parallel aggregation)
+ */
+Datum
+tinyhist_threshold_deserial(PG_FUNCTION_ARGS)
+{
+	bytea	   *data = PG_GETARG_BYTEA_PP(0);
+	threshold_state_t *state;
+	StringInfoData buf;
+	int32		nthresholds;
+	double	   *thresholds;
+
+	MemoryContext aggcontext;
+
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_threshold_deserial called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf, VARDATA_ANY(data), VARSIZE_ANY_EXHDR(data));
+
+	nthresholds = pq_getmsgint(&buf, 4);
+	thresholds = palloc(Max(1, nthresholds) * sizeof(double));
+
+	for (int i = 0; i < nthresholds; i++)
+		thresholds[i] = pq_getmsgfloat8(&buf);
+
+	state = threshold_state_create(CurrentMemoryContext, thresholds, nthresholds);
+
+	for (int i = 0; i <= nthresholds; i++)
+		state->counts[i] = pq_getmsgint64(&buf);
+
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_threshold_final
+ *		final function for the tinyhist_threshold_counts aggregate
+ *
+ * Returns the number of values less than each threshold, in the same order
+ * as the thresholds.
+ */
+Datum
+tinyhist_threshold_final(PG_FUNCTION_ARGS)
+{
+	threshold_state_t *state;
+	Datum	   *values;
+	int64		count = 0;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "tinyhist_threshold_final called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (threshold_state_t *) PG_GETARG_POINTER(0);
+
+	values = palloc(Max(1, state->nthresholds) * sizeof(Datum));
+
+	for (int i = 0; i < state->nthresholds; i++)
+	{
+		count += state->counts[i];
+		values[state->order[i]] = Int64GetDatum(count);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, state->nthresholds, INT8OID,
+										  sizeof(int64), FLOAT8PASSBYVAL,
+										  TYPALIGN_DOUBLE));
+}
+
+/*
+ * Histograms with adaptive bucket sizes. The buckets are the same as in
+ * tinyhist, but instead of the static bucket_bits[] sizes, each histogram
+ * stores its own layout - the number of bits for each bucket. Busy buckets
+ * get more bits, empty buckets get no bits at all.
+ *
+ * When a counter does not fit into its bucket anymore, the histogram gets
+ * repacked with a new layout, based on the current counters. Each bucket
+ * gets the bits it needs, and the remaining bits are distributed among
+ * the non-empty buckets (the busiest buckets first). Only when the counters
+ * don't fit even with the new layout, the sample rate is reduced.
+ *
+ * The layout uses 4 bits per bucket, with the bucket size in multiples of
+ * two bits (so 0 - 30 bits), which leaves 184 bits for the counters.
+ */
+#define ADAPTIVE_LAYOUT_BYTES	(HISTOGRAM_BUCKETS / 2)
+#define ADAPTIVE_DATA_BYTES		23
+#define ADAPTIVE_DATA_BITS		(ADAPTIVE_DATA_BYTES * 8)
+#define ADAPTIVE_MAX_BITS		30
+
+/* 32B */
+typedef struct tinyhist_adaptive_t {
+	uint8		sample:4;		/* sampling rate for buckets (2^sample) */
+	uint8		unit:4;			/* size of the smallest bucket (2^unit) */
+	uint8		layout[ADAPTIVE_LAYOUT_BYTES];	/* bucket sizes (in 2-bit units) */
+	uint8		data[ADAPTIVE_DATA_BYTES];	/* buffer storing the buckets */
+} tinyhist_adaptive_t;
+
+/*
+ * adaptive_bits
+ *		number of bits for the bucket
+ */
+static int
+adaptive_bits(const tinyhist_adaptive_t *hist, int bucket)
+{
+	return 2 * ((hist->layout[bucket / 2] >> (4 * (bucket % 2))) & 0x0F);
+}
+
+/*
+ * adaptive_offset
+ *		bit offset of the bucket (sum of sizes of the preceding buckets)
+ */
+static int
+adaptive_offset(const tinyhist_adaptive_t *hist, int bucket)
+{
+	int			offset = 0;
+
+	for (int i = 0; i < bucket; i++)
+		offset += adaptive_bits(hist, i);
+
+	return offset;
+}
+
+static int32
+adaptive_maxcount(const tinyhist_adaptive_t *hist, int bucket)
+{
+	return (1 << adaptive_bits(hist, bucket)) - 1;
+}
+
+static int32
+adaptive_get(const tinyhist_adaptive_t *hist, int bucket)
+{
+	return bits_get(hist->data, adaptive_offset(hist, bucket),
+					adaptive_bits(hist, bucket));
+}
+
+static void
+adaptive_set(tinyhist_adaptive_t *hist, int bucket, int32 count)
+{
+	Assert(count <= adaptive_maxcount(hist, bucket));
+
+	bits_set(hist->data, adaptive_offset(hist, bucket),
+			 adaptive_bits(hist, bucket), count);
+}
+
+/*
+ * adaptive_unpack_aligned
+ *		unpack bucket counters, aligned to the given sample rate and unit
+ *
+ * Same as hist_unpack_aligned, but the counters are int64 (the sum of two
+ * 30-bit counters may not fit into int32 after merging buckets).
+ */
+static void
+adaptive_unpack_aligned(const tinyhist_adaptive_t *hist, int sample, int unit,
+						int64 *counts)
+{
+	int			sample_shift = sample - hist->sample;
+	int			unit_shift = unit - hist->unit;
+	int			offset = 0;
+
+	Assert((sample_shift >= 0) && (unit_shift >= 0));
+
+	memset(counts, 0, sizeof(int64) * HISTOGRAM_BUCKETS);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		int			nbits = adaptive_bits(hist, i);
+
+		counts[Max(0, i - unit_shift)] += (bits_get(hist->data, offset, nbits) >> sample_shift);
+		offset += nbits;
+	}
+}
+
+/*
+ * adaptive_needed_bits
+ *		number of bits needed to store the counter (rounded to 2 bits)
+ */
+static int
+adaptive_needed_bits(int64 count)
+{
+	int			nbits = 0;
+
+	while (count > 0)
+	{
+		nbits++;
+		count >>= 1;
+	}
+
+	return (nbits + 1) & ~1;
+}
+
+/*
+ * adaptive_pack
+ *		pack counters into the histogram, with a layout suitable for them
+ *
+ * Determines the bits needed for each counter, and if they don't fit into
+ * the histogram, reduces the sample rate until they do. The remaining bits
+ * are distributed among the non-empty buckets, in rounds of two bits per
+ * bucket, starting with the busiest buckets.
+ */
+static void
+adaptive_pack(tinyhist_adaptive_t *hist, int sample, int unit, int64 *counts)
+{
+	int			nbits[HISTOGRAM_BUCKETS];
+	int			order[HISTOGRAM_BUCKETS];
+	int			norder = 0;
+	int			spare;
+	int			offset;
+
+	while (true)
+	{
+		int			total = 0;
+		bool		fits = true;
+
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		{
+			nbits[i] = adaptive_needed_bits(counts[i]);
+			total += nbits[i];
+
+			if (nbits[i] > ADAPTIVE_MAX_BITS)
+				fits = false;
+		}
+
+		if (fits && (total <= ADAPTIVE_DATA_BITS))
+		{
+			spare = ADAPTIVE_DATA_BITS - total;
+			break;
+		}
+
+		if (sample == HISTOGRAM_MAX_SAMPLE)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("histogram sample rate out of range")));
+
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+			counts[i] >>= 1;
+
+		sample++;
+	}
+
+	/* non-empty buckets, sorted by count (descending) using insertion sort */
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		int			j = norder++;
+
+		if (counts[i] == 0)
+		{
+			norder--;
+			continue;
+		}
+
+		while ((j > 0) && (counts[order[j - 1]] < counts[i]))
+		{
+			order[j] = order[j - 1];
+			j--;
+		}
+
+		order[j] = i;
+	}
+
+	while (spare >= 2)
+	{
+		bool		assigned = false;
+
+		for (int i = 0; (i < norder) && (spare >= 2); i++)
+		{
+			if (nbits[order[i]] < ADAPTIVE_MAX_BITS)
+			{
+				nbits[order[i]] += 2;
+				spare -= 2;
+				assigned = true;
+			}
+		}
+
+		if (!assigned)
+			break;
+	}
+
+	memset(hist, 0, sizeof(tinyhist_adaptive_t));
+
+	hist->sample = sample;
+	hist->unit = unit;
+
+	offset = 0;
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		hist->layout[i / 2] |= ((nbits[i] / 2) << (4 * (i % 2)));
+
+		bits_set(hist->data, offset, nbits[i], (int32) counts[i]);
+		offset += nbits[i];
+	}
+}
+
+/*
+ * adaptive_add
+ *		add a value to the histogram (if sampled)
+ *
+ * If the value is outside the range, or the bucket is full, the counters
+ * are unpacked, adjusted and packed with a new layout.
+ */
+static void
+adaptive_add(tinyhist_adaptive_t *hist, double value)
+{
+	int64		counts[HISTOGRAM_BUCKETS];
+	int			unit = hist->unit;
+	int			bucket;
+
+	/* sample this value? */
+	if (!random_sample(hist->sample))
+		return;
+
+	/* fast path - the value fits into the range, and the bucket has space */
+	if (ldexp(1.0, unit + HISTOGRAM_BUCKETS - 1) >= value)
+	{
+		int32		count;
+
+		bucket = 0;
+		while (ldexp(1.0, unit + bucket) < value)
+			bucket++;
+
+		count = adaptive_get(hist, bucket);
+
+		if (count < adaptive_maxcount(hist, bucket))
+		{
+			adaptive_set(hist, bucket, count + 1);
+			return;
+		}
+	}
+
+	adaptive_unpack_aligned(hist, hist->sample, unit, counts);
+
+	/* merge the first two buckets and shift the rest, until the value fits */
+	while (ldexp(1.0, unit + HISTOGRAM_BUCKETS - 1) < value)
+	{
+		if (unit == HISTOGRAM_MAX_UNIT)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("value %g out of range for tinyhist_adaptive", value)));
+
+		counts[0] += counts[1];
+		memmove(&counts[1], &counts[2], (HISTOGRAM_BUCKETS - 2) * sizeof(int64));
+		counts[HISTOGRAM_BUCKETS - 1] = 0;
+
+		unit++;
+	}
+
+	bucket = 0;
+	while (ldexp(1.0, unit + bucket) < value)
+		bucket++;
+
+	counts[bucket]++;
+
+	adaptive_pack(hist, hist->sample, unit, counts);
+}
+
+/*
+ * adaptive_merge_into
+ *		merge histograms hist1 and hist2 into dst
+ *
+ * The layouts of the inputs may be different, both are unpacked (aligned
+ * to the same sample rate and unit), and the sum is packed with a new
+ * layout. The dst may be the same as one of the inputs.
+ */
+static tinyhist_adaptive_t *
+adaptive_merge_into(tinyhist_adaptive_t *dst, const tinyhist_adaptive_t *hist1,
+					const tinyhist_adaptive_t *hist2)
+{
+	int			sample = Max(hist1->sample, hist2->sample);
+	int			unit = Max(hist1->unit, hist2->unit);
+	int64		counts1[HISTOGRAM_BUCKETS];
+	int64		counts2[HISTOGRAM_BUCKETS];
+
+	adaptive_unpack_aligned(hist1, sample, unit, counts1);
+	adaptive_unpack_aligned(hist2, sample, unit, counts2);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts1[i] += counts2[i];
+
+	adaptive_pack(dst, sample, unit, counts1);
+
+	return dst;
+}
+
+/*
+ * adaptive_from_hist
+ *		convert tinyhist to an adaptive histogram (same buckets)
+ */
+static tinyhist_adaptive_t *
+adaptive_from_hist(const tinyhist_t *hist)
+{
+	tinyhist_adaptive_t *result = palloc0(sizeof(tinyhist_adaptive_t));
+	int32		counts[HISTOGRAM_BUCKETS];
+	int64		counts64[HISTOGRAM_BUCKETS];
+
+	hist_unpack(hist, counts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts64[i] = counts[i];
+
+	adaptive_pack(result, hist->sample, hist->unit, counts64);
+
+	return result;
+}
+
+/*
+ * adaptive_to_hist
+ *		convert an adaptive histogram to tinyhist (same buckets)
+ *
+ * The counters may not fit into the static tinyhist buckets, in which case
+ * the sample rate gets reduced.
+ */
+static tinyhist_t *
+adaptive_to_hist(const tinyhist_adaptive_t *hist)
+{
+	tinyhist_t *result = palloc0(sizeof(tinyhist_t));
+	int64		counts[HISTOGRAM_BUCKETS];
+	int			shift = 0;
+
+	adaptive_unpack_aligned(hist, hist->sample, hist->unit, counts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		while ((counts[i] >> shift) > bucket_maxcount(i))
+			shift++;
+	}
+
+	if (hist->sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("histogram sample rate out of range")));
+
+	result->sample = hist->sample + shift;
+	result->unit = hist->unit;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bucket_set(result, i, (int32) (counts[i] >> shift));
+
+	return result;
+}
+
+/*
+ * tinyhist_adaptive_in
+ *		parse the text representation {sample, unit, counts...}
+ *
+ * The layout is not part of the text representation, it's determined
+ * from the counters.
+ */
+Datum
+tinyhist_adaptive_in(PG_FUNCTION_ARGS)
+{
+	char	   *str = PG_GETARG_CSTRING(0);
+	tinyhist_adaptive_t *hist = palloc0(sizeof(tinyhist_adaptive_t));
+	int64		counts[HISTOGRAM_BUCKETS];
+	int			buckets[HISTOGRAM_BUCKETS];
+	int			sample;
+	int			unit;
+	int			r;
+
+	r = sscanf(str, "{%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, "
+					 "%d, %d, %d, %d, %d, %d, %d, %d}",
+			   &sample, &unit,
+			   &buckets[0],  &buckets[1],  &buckets[2],  &buckets[3],  &buckets[4],
+			   &buckets[5],  &buckets[6],  &buckets[7],  &buckets[8],  &buckets[9],
+			   &buckets[10], &buckets[11], &buckets[12], &buckets[13], &buckets[14],
+			   &buckets[15]);
+
+	if (r != (HISTOGRAM_BUCKETS + 2))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("invalid input syntax for type tinyhist_adaptive: \"%s\"", str)));
+
+	if ((sample < 0) || (sample > HISTOGRAM_MAX_SAMPLE))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample rate exponent %d out of range [0, %d]",
+						sample, HISTOGRAM_MAX_SAMPLE)));
+
+	if ((unit < 0) || (unit > HISTOGRAM_MAX_UNIT))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unit exponent %d out of range [0, %d]",
+						unit, HISTOGRAM_MAX_UNIT)));
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (buckets[i] < 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("count %d out of range for bucket %d", buckets[i], i)));
+
+		counts[i] = buckets[i];
+	}
+
+	adaptive_pack(hist, sample, unit, counts);
+
+	/* the counters have to fit without reducing the sample rate */
+	if (hist->sample != sample)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("counts do not fit into tinyhist_adaptive")));
+
+	PG_RETURN_POINTER(hist);
+}
+
+Datum
+tinyhist_adaptive_out(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *hist = (tinyhist_adaptive_t *) PG_GETARG_POINTER(0);
+	StringInfoData	str;
+
+	initStringInfo(&str);
+
+	appendStringInfo(&str, "{%d, %d", hist->sample, hist->unit);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		appendStringInfo(&str, ", %d", adaptive_get(hist, i));
+
+	appendStringInfoChar(&str, '}');
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+Datum
+tinyhist_adaptive_send(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *hist = (tinyhist_adaptive_t *) PG_GETARG_POINTER(0);
+	StringInfoData buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendbyte(&buf, hist->sample);
+	pq_sendbyte(&buf, hist->unit);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		pq_sendint32(&buf, adaptive_get(hist, i));
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+tinyhist_adaptive_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo	buf = (StringInfo) PG_GETARG_POINTER(0);
+	tinyhist_adaptive_t *hist = palloc0(sizeof(tinyhist_adaptive_t));
+	int64		counts[HISTOGRAM_BUCKETS];
+	int			sample;
+	int			unit;
+
+	sample = pq_getmsgbyte(buf);
+	unit = pq_getmsgbyte(buf);
+
+	if ((sample > HISTOGRAM_MAX_SAMPLE) || (unit > HISTOGRAM_MAX_UNIT))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid sample rate or unit in external tinyhist_adaptive value")));
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		counts[i] = (uint32) pq_getmsgint(buf, 4);
+
+	adaptive_pack(hist, sample, unit, counts);
+
+	if (hist->sample != sample)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid counts in external tinyhist_adaptive value")));
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * tinyhist_adaptive_layout
+ *		number of bits allocated to each bucket
+ */
+Datum
+tinyhist_adaptive_layout(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *hist = (tinyhist_adaptive_t *) PG_GETARG_POINTER(0);
+	Datum		values[HISTOGRAM_BUCKETS];
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		values[i] = Int32GetDatum(adaptive_bits(hist, i));
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(values, HISTOGRAM_BUCKETS, INT4OID,
+										  sizeof(int32), true, TYPALIGN_INT));
+}
+
+/*
+ * tinyhist_adaptive_add
+ *		add a value to the histogram, returning a modified copy
+ *
+ * NULL values are ignored, NULL histogram is treated as empty.
+ */
+Datum
+tinyhist_adaptive_add(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *result = palloc0(sizeof(tinyhist_adaptive_t));
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (!PG_ARGISNULL(0))
+		memcpy(result, PG_GETARG_POINTER(0), sizeof(tinyhist_adaptive_t));
+
+	adaptive_add(result, PG_GETARG_FLOAT8(1));
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * tinyhist_adaptive_add_hist
+ *		merge two histograms (if one of them is NULL, return the other)
+ */
+Datum
+tinyhist_adaptive_add_hist(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+	{
+		if (!PG_ARGISNULL(0))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(0));
+		else if (!PG_ARGISNULL(1))
+			PG_RETURN_POINTER(PG_GETARG_POINTER(1));
+		else
+			PG_RETURN_NULL();
+	}
+
+	PG_RETURN_POINTER(adaptive_merge_into(palloc0(sizeof(tinyhist_adaptive_t)),
+										  (tinyhist_adaptive_t *) PG_GETARG_POINTER(0),
+										  (tinyhist_adaptive_t *) PG_GETARG_POINTER(1)));
+}
+
+/*
+ * Add a value to the histogram (create one if needed). Transition function
+ * for tinyhist_adaptive_agg aggregate.
+ */
+Datum
+tinyhist_adaptive_accum(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *state;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_adaptive_accum called in non-aggregate context");
+
+	/* skip NULL values, return the existing state (if any) */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	if (PG_ARGISNULL(0))
+		state = MemoryContextAllocZero(aggcontext, sizeof(tinyhist_adaptive_t));
+	else
+		state = (tinyhist_adaptive_t *) PG_GETARG_POINTER(0);
+
+	adaptive_add(state, PG_GETARG_FLOAT8(1));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Merge a histogram into the state (create one if needed). Transition
+ * function for tinyhist_adaptive_agg aggregate, and also the combine
+ * function (the input histogram is not modified).
+ */
+Datum
+tinyhist_adaptive_accum_hist(PG_FUNCTION_ARGS)
+{
+	tinyhist_adaptive_t *state;
+	tinyhist_adaptive_t *hist;
+
+	MemoryContext aggcontext;
+
+	/* cannot be called directly because of internal-type argument */
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "tinyhist_adaptive_accum_hist called in non-aggregate context");
+
+	/* skip NULL histograms, return the existing state (if any) */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	hist = (tinyhist_adaptive_t *) PG_GETARG_POINTER(1);
+
+	/* copy the histogram into the aggregate context */
+	if (PG_ARGISNULL(0))
+	{
+		state = MemoryContextAlloc(aggcontext, sizeof(tinyhist_adaptive_t));
+		memcpy(state, hist, sizeof(tinyhist_adaptive_t));
+
+		PG_RETURN_POINTER(state);
+	}
+
+	state = (tinyhist_adaptive_t *) PG_GETARG_POINTER(0);
+
+	adaptive_merge_into(state, state, hist);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * tinyhist_adaptive_from_tinyhist
+ *		cast tinyhist to tinyhist_adaptive
+ */
+Datum
+tinyhist_adaptive_from_tinyhist(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(adaptive_from_hist((tinyhist_t *) PG_GETARG_POINTER(0)));
+}
+
+/*
+ * tinyhist_adaptive_to_tinyhist
+ *		cast tinyhist_adaptive to tinyhist
+ */
+Datum
+tinyhist_adaptive_to_tinyhist(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(adaptive_to_hist((tinyhist_adaptive_t *) PG_GETARG_POINTER(0)));
+}
+
+/*
+ * Histogram counters, maintained as a base table with one histogram per key,
+ * and a table of deltas (histograms to be added to the base table).
+ *
+ * Updating a histogram in place (UPDATE t SET h = h + x) serializes writers
+ * on the row lock, and each update creates a new row version. Instead, the
+ * writers only append deltas, and those get periodically merged into the
+ * base table (all deltas for a key are merged at once, and then added to
+ * the base histogram). Reads merge the base histogram with pending deltas.
+ *
+ * The counters are registered in the tinyhist_counters table. The merging
+ * may be done explicitly (tinyhist_counter_merge), or by a background worker
+ * started by tinyhist_counter_worker_start.
+ */
+typedef struct counter_tables_t {
+	char	   *schema;			/* quoted schema of the extension */
+	char	   *base;			/* qualified name of the base table */
+	char	   *deltas;			/* qualified name of the delta table */
+} counter_tables_t;
+
+/*
+ * counter_table_name
+ *		quoted qualified name of a counter table (by OID)
+ *
+ * The tables are registered as regclass, so renaming them does not break
+ * the counter. If the table was dropped, fails (or returns NULL with
+ * missing_ok).
+ */
+static char *
+counter_table_name(const char *name, Oid relid, bool missing_ok)
+{
+	char	   *relname = get_rel_name(relid);
+
+	if (relname == NULL)
+	{
+		if (missing_ok)
+			return NULL;
+
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("table of histogram counter \"%s\" does not exist", name),
+				 errdetail("The table with OID %u was dropped.", relid)));
+	}
+
+	return quote_qualified_identifier(get_namespace_name(get_rel_namespace(relid)),
+									  relname);
+}
+
+/*
+ * counter_tables_from_tuple
+ *		qualified names of the tables from a tinyhist_counters tuple
+ *
+ * The base_table and delta_table are expected at attnum and attnum + 1.
+ */
+static void
+counter_tables_from_tuple(const char *name, HeapTuple tuple, TupleDesc tupdesc,
+						  int attnum, bool missing_ok, counter_tables_t *tables)
+{
+	bool		isnull;
+	Oid			base = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, attnum, &isnull));
+	Oid			deltas = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, attnum + 1, &isnull));
+
+	tables->base = counter_table_name(name, base, missing_ok);
+	tables->deltas = counter_table_name(name, deltas, missing_ok);
+}
+
+/*
+ * counter_extension_schema
+ *		quoted name of the schema with the extension objects
+ */
+static char *
+counter_extension_schema(FunctionCallInfo fcinfo)
+{
+	return (char *) quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+}
+
+/*
+ * counter_lookup
+ *		lookup tables for a histogram counter (in an existing SPI connection)
+ *
+ * With missing_ok, dropped tables are returned as NULL.
+ */
+static void
+counter_lookup(FunctionCallInfo fcinfo, text *name, bool missing_ok,
+			   counter_tables_t *tables)
+{
+	char	   *query;
+	Oid			argtypes[1] = {TEXTOID};
+	Datum		args[1];
+	int			ret;
+
+	tables->schema = counter_extension_schema(fcinfo);
+
+	query = psprintf("SELECT base_table, delta_table FROM %s.tinyhist_counters WHERE name = $1",
+					 tables->schema);
+
+	args[0] = PointerGetDatum(name);
+
+	ret = SPI_execute_with_args(query, 1, argtypes, args, NULL, true, 1);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to look up histogram counter: %s",
+			 SPI_result_code_string(ret));
+
+	if (SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("histogram counter \"%s\" does not exist",
+						text_to_cstring(name))));
+
+	counter_tables_from_tuple(text_to_cstring(name), SPI_tuptable->vals[0],
+							  SPI_tuptable->tupdesc, 1, missing_ok, tables);
+}
+
+/*
+ * tinyhist_counter_create
+ *		create tables for a new histogram counter, and register it
+ *
+ * The tables are created in the current schema, the delta table may be
+ * unlogged (faster writes, but pending deltas are lost after a crash).
+ */
+Datum
+tinyhist_counter_create(PG_FUNCTION_ARGS)
+{
+	text	   *name = PG_GETARG_TEXT_PP(0);
+	bool		unlogged = PG_GETARG_BOOL(1);
+	char	   *cname = text_to_cstring(name);
+	char	   *dname = psprintf("%s_deltas", cname);
+	char	   *schema;
+	char	   *creation_schema;
+	char	   *base;
+	char	   *deltas;
+	Oid			argtypes[3] = {TEXTOID, TEXTOID, TEXTOID};
+	Datum		args[3];
+	int			ret;
+
+	if (strlen(dname) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("histogram counter name \"%s\" is too long", cname)));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	ret = SPI_execute("SELECT current_schema()", true, 1);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to determine current schema: %s",
+			 SPI_result_code_string(ret));
+
+	creation_schema = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+	if (creation_schema == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("no schema has been selected to create in")));
+
+	schema = counter_extension_schema(fcinfo);
+	base = quote_qualified_identifier(creation_schema, cname);
+	deltas = quote_qualified_identifier(creation_schema, dname);
+
+	ret = SPI_execute(psprintf("CREATE TABLE %s (key bigint PRIMARY KEY, hist %s.tinyhist NOT NULL)",
+							   base, schema), false, 0);
+
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "failed to create histogram counter table: %s",
+			 SPI_result_code_string(ret));
+
+	ret = SPI_execute(psprintf("CREATE %s TABLE %s (key bigint NOT NULL, hist %s.tinyhist NOT NULL)",
+							   (unlogged ? "UNLOGGED" : ""), deltas, schema), false, 0);
+
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "failed to create histogram counter table: %s",
+			 SPI_result_code_string(ret));
+
+	ret = SPI_execute(psprintf("CREATE INDEX ON %s (key)", deltas), false, 0);
+
+	if (ret != SPI_OK_UTILITY)
+		elog(ERROR, "failed to create histogram counter index: %s",
+			 SPI_result_code_string(ret));
+
+	args[0] = PointerGetDatum(name);
+	args[1] = CStringGetTextDatum(base);
+	args[2] = CStringGetTextDatum(deltas);
+
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.tinyhist_counters "
+										 "VALUES ($1, $2::pg_catalog.regclass, $3::pg_catalog.regclass)",
+										 schema),
+								3, argtypes, args, NULL, false, 0);
+
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "failed to register histogram counter: %s",
+			 SPI_result_code_string(ret));
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * counter_append
+ *		append a delta (a value or a histogram) for the key
+ *
+ * The value is the third argument of the function, with the type determined
+ * from the call. Values are turned into a histogram by the INSERT itself.
+ */
+static void
+counter_append(FunctionCallInfo fcinfo, bool is_hist)
+{
+	counter_tables_t tables;
+	char	   *value;
+	Oid			argtypes[2];
+	Datum		args[2];
+	int			ret;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	counter_lookup(fcinfo, PG_GETARG_TEXT_PP(0), false, &tables);
+
+	if (is_hist)
+		value = "$2";
+	else
+		value = psprintf("%s.tinyhist_add(NULL::%s.tinyhist, $2)",
+						 tables.schema, tables.schema);
+
+	argtypes[0] = INT8OID;
+	argtypes[1] = get_fn_expr_argtype(fcinfo->flinfo, 2);
+
+	args[0] = PG_GETARG_DATUM(1);
+	args[1] = PG_GETARG_DATUM(2);
+
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s VALUES ($1, %s)", tables.deltas, value),
+								2, argtypes, args, NULL, false, 0);
+
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "failed to add histogram counter delta: %s",
+			 SPI_result_code_string(ret));
+
+	SPI_finish();
+}
+
+/*
+ * tinyhist_counter_add
+ *		append a delta (a single value) for the key
+ */
+Datum
+tinyhist_counter_add(PG_FUNCTION_ARGS)
+{
+	counter_append(fcinfo, false);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * tinyhist_counter_add_hist
+ *		append a delta (a histogram) for the key
+ */
+Datum
+tinyhist_counter_add_hist(PG_FUNCTION_ARGS)
+{
+	counter_append(fcinfo, true);
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * counter_merge
+ *		merge pending deltas into the base table (in an existing SPI connection)
+ *
+ * Deltas for each key are merged first (using the tinyhist_agg aggregate),
+ * and then added to the base histogram in a single INSERT ... ON CONFLICT.
+ * Deltas appended concurrently are not visible to the DELETE, and will be
+ * merged later. Returns the number of merged deltas.
+ */
+static int64
+counter_merge(counter_tables_t *tables)
+{
+	char	   *query;
+	Datum		value;
+	bool		isnull;
+	int			ret;
+
+	query = psprintf("WITH deltas AS (DELETE FROM %s RETURNING key, hist), "
+					 "merged AS (INSERT INTO %s AS b "
+					 "SELECT key, %s.tinyhist_agg(hist) FROM deltas GROUP BY key "
+					 "ON CONFLICT (key) DO UPDATE SET hist = b.hist OPERATOR(%s.+) excluded.hist) "
+					 "SELECT count(*) FROM deltas",
+					 tables->deltas, tables->base, tables->schema, tables->schema);
+
+	ret = SPI_execute(query, false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to merge histogram counter deltas: %s",
+			 SPI_result_code_string(ret));
+
+	value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+	Assert(!isnull);
+
+	return DatumGetInt64(value);
+}
+
+/*
+ * tinyhist_counter_merge
+ *		merge pending deltas into the base table
+ */
+Datum
+tinyhist_counter_merge(PG_FUNCTION_ARGS)
+{
+	counter_tables_t tables;
+	int64		count;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	counter_lookup(fcinfo, PG_GETARG_TEXT_PP(0), false, &tables);
+
+	count = counter_merge(&tables);
+
+	SPI_finish();
+
+	PG_RETURN_INT64(count);
+}
+
+/*
+ * tinyhist_counter_get
+ *		histogram for the key, including pending deltas
+ */
+Datum
+tinyhist_counter_get(PG_FUNCTION_ARGS)
+{
+	counter_tables_t tables;
+	tinyhist_t *result = NULL;
+	char	   *query;
+	Oid			argtypes[1] = {INT8OID};
+	Datum		args[1];
+	Datum		value;
+	bool		isnull;
+	int			ret;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	counter_lookup(fcinfo, PG_GETARG_TEXT_PP(0), false, &tables);
+
+	query = psprintf("SELECT %s.tinyhist_agg(hist) FROM ("
+					 "SELECT hist FROM %s WHERE key = $1 UNION ALL "
+					 "SELECT hist FROM %s WHERE key = $1) h",
+					 tables.schema, tables.base, tables.deltas);
+
+	args[0] = PG_GETARG_DATUM(1);
+
+	ret = SPI_execute_with_args(query, 1, argtypes, args, NULL, true, 1);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to read histogram counter: %s",
+			 SPI_result_code_string(ret));
+
+	value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+	/* copy the histogram to the caller's memory context */
+	if (!isnull)
+	{
+		result = SPI_palloc(sizeof(tinyhist_t));
+		memcpy(result, DatumGetPointer(value), sizeof(tinyhist_t));
+	}
+
+	SPI_finish();
+
+	if (result == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(result);
+}
+
+/*
+ * Information passed to the background worker (in bgw_extra).
+ */
+typedef struct counter_worker_extra_t {
+	Oid			database;
+	Oid			role;
+	char		schema[NAMEDATALEN];	/* extension schema (unquoted) */
+} counter_worker_extra_t;
+
+PGDLLEXPORT void tinyhist_counter_worker_main(Datum main_arg);
+
+/*
+ * tinyhist_counter_worker_start
+ *		start a background worker merging deltas for all counters
+ *
+ * The worker connects to the current database as the current user, and
+ * merges deltas of all registered counters every interval milliseconds
+ * (all counters in a single transaction, each merged in a subtransaction so
+ * that a failing counter does not affect the others). It runs until
+ * terminated (e.g. by pg_terminate_backend), and is not restarted after
+ * a failure.
+ */
+Datum
+tinyhist_counter_worker_start(PG_FUNCTION_ARGS)
+{
+	int32		interval = PG_GETARG_INT32(0);
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	counter_worker_extra_t extra;
+	pid_t		pid;
+
+	StaticAssertStmt(sizeof(counter_worker_extra_t) <= BGW_EXTRALEN,
+					 "counter worker info does not fit into bgw_extra");
+
+	if (interval <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("merge interval must be positive")));
+
+	memset(&extra, 0, sizeof(extra));
+	extra.database = MyDatabaseId;
+	extra.role = GetUserId();
+	strlcpy(extra.schema, get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)),
+			NAMEDATALEN);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "tinyhist");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "tinyhist_counter_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "tinyhist counter merge worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "tinyhist counter merge worker");
+	worker.bgw_main_arg = Int32GetDatum(interval);
+	worker.bgw_notify_pid = MyProcPid;
+	memcpy(worker.bgw_extra, &extra, sizeof(extra));
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background worker"),
+				 errhint("Consider increasing max_worker_processes.")));
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+
+	if (status != BGWH_STARTED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start background worker")));
+
+	PG_RETURN_INT32(pid);
+}
+
+/*
+ * tinyhist_counter_worker_main
+ *		main loop of the worker merging counter deltas
+ */
+void
+tinyhist_counter_worker_main(Datum main_arg)
+{
+	int32		interval = DatumGetInt32(main_arg);
+	counter_worker_extra_t extra;
+	char	   *query;
+	SPITupleTable *counters;
+	uint64		ncounters;
+
+	memcpy(&extra, MyBgworkerEntry->bgw_extra, sizeof(extra));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(extra.database, extra.role, 0);
+
+	query = psprintf("SELECT name, base_table, delta_table FROM %s.tinyhist_counters ORDER BY name",
+					 quote_identifier(extra.schema));
+
+	while (true)
+	{
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 interval, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		CHECK_FOR_INTERRUPTS();
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, query);
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		if (SPI_execute(query, true, 0) != SPI_OK_SELECT)
+			elog(ERROR, "failed to look up histogram counters");
+
+		/* each merge replaces SPI_tuptable, so remember the list of counters */
+		counters = SPI_tuptable;
+		ncounters = SPI_processed;
+
+		for (uint64 i = 0; i < ncounters; i++)
+		{
+			counter_tables_t tables;
+			char	   *name = SPI_getvalue(counters->vals[i], counters->tupdesc, 1);
+			MemoryContext oldcontext = CurrentMemoryContext;
+			ResourceOwner oldowner = CurrentResourceOwner;
+
+			tables.schema = (char *) quote_identifier(extra.schema);
+
+			/* a failing merge (e.g. a dropped table) must not stop the others */
+			BeginInternalSubTransaction(NULL);
+			MemoryContextSwitchTo(oldcontext);
+
+			PG_TRY();
+			{
+				int64		count;
+
+				counter_tables_from_tuple(name, counters->vals[i], counters->tupdesc,
+										  2, false, &tables);
+
+				count = counter_merge(&tables);
+
+				elog(DEBUG1, "merged " INT64_FORMAT " deltas for histogram counter \"%s\"",
+					 count, name);
+
+				ReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(oldcontext);
+				CurrentResourceOwner = oldowner;
+			}
+			PG_CATCH();
+			{
+				ErrorData  *edata;
+
+				MemoryContextSwitchTo(oldcontext);
+				edata = CopyErrorData();
+				FlushErrorState();
+
+				RollbackAndReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(oldcontext);
+				CurrentResourceOwner = oldowner;
+
+				ereport(WARNING,
+						(errcode(edata->sqlerrcode),
+						 errmsg("could not merge histogram counter \"%s\": %s",
+								name, edata->message)));
+
+				FreeErrorData(edata);
+			}
+			PG_END_TRY();
+		}
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+	}
+}
+
+/*
+ * tinyhist_counter_drop
+ *		drop tables of a histogram counter (including pending deltas)
+ */
+Datum
+tinyhist_counter_drop(PG_FUNCTION_ARGS)
+{
+	counter_tables_t tables;
+	Oid			argtypes[1] = {TEXTOID};
+	Datum		args[1];
+	int			ret;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	/* tables dropped manually are ignored, so that the counter can be dropped */
+	counter_lookup(fcinfo, PG_GETARG_TEXT_PP(0), true, &tables);
+
+	if (tables.base != NULL)
+	{
+		ret = SPI_execute(psprintf("DROP TABLE %s", tables.base), false, 0);
+
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "failed to drop histogram counter table: %s",
+				 SPI_result_code_string(ret));
+	}
+
+	if (tables.deltas != NULL)
+	{
+		ret = SPI_execute(psprintf("DROP TABLE %s", tables.deltas), false, 0);
+
+		if (ret != SPI_OK_UTILITY)
+			elog(ERROR, "failed to drop histogram counter table: %s",
+				 SPI_result_code_string(ret));
+	}
+
+	args[0] = PG_GETARG_DATUM(0);
+
+	ret = SPI_execute_with_args(psprintf("DELETE FROM %s.tinyhist_counters WHERE name = $1", tables.schema),
+								1, argtypes, args, NULL, false, 0);
+
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "failed to unregister histogram counter: %s",
+			 SPI_result_code_string(ret));
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Custom scan aggregating tinyhist_agg directly from a table.
+ *
+ * For simple queries like
+ *
+ *     SELECT g, tinyhist_agg(v) FROM t GROUP BY g
+ *
+ * the regular plan calls the transition function for each row through
+ * fmgr, with the aggregate node pulling tuples from a scan node, and
+ * evaluating arguments and group keys as expressions. The custom scan
+ * reads the table directly, deforms only the attributes it needs, and
+ * adds the values to per-group histograms.
+ *
+ * The custom scan is used only when tinyhist.enable_custom_agg is enabled,
+ * and for queries on a single table (no inheritance, no restrictions)
+ * with only tinyhist_agg aggregates on plain columns, and grouping by
+ * plain columns with by-value integer types (for which equality is the
+ * same as binary equality). Other queries use the regular plan.
+ *
+ * Values are not added to the histograms one by one, but collected in a
+ * small per-group buffer, and added in batches (see hist_add_batch). When
+ * the groups use more than work_mem, the partial histograms are written
+ * into a sort (by the grouping keys), and the hash table starts empty. At
+ * the end, the sorted partial histograms of each group get merged.
+ */
+#define CUSTOM_AGG_MAX_KEYS		4
+
+/* number of values buffered for each group and aggregate */
+#define CUSTOM_AGG_BATCH		32
+
+/* kinds of output columns */
+#define CUSTOM_AGG_KEY			0	/* grouping key */
+#define CUSTOM_AGG_VALUES		1	/* tinyhist_agg(double precision) */
+#define CUSTOM_AGG_HISTS		2	/* tinyhist_agg(tinyhist) */
+
+void		_PG_init(void);
+
+static bool custom_agg_enabled = false;
+
+static create_upper_paths_hook_type prev_create_upper_paths_hook = NULL;
+
+/* routing of queries to rollups (see rollup_planner) */
+static bool rollup_routing_enabled = false;
+static bool rollup_routing_active = false;
+
+static planner_hook_type prev_planner_hook = NULL;
+
+static PlannedStmt *rollup_planner(Query *parse, const char *query_string,
+								   int cursorOptions, ParamListInfo boundParams);
+static void rollup_routing_assign(bool newval, void *extra);
+
+/* hash table key - values of the grouping keys */
+typedef struct custom_agg_key_t {
+	Datum		values[CUSTOM_AGG_MAX_KEYS];
+	bool		isnull[CUSTOM_AGG_MAX_KEYS];
+} custom_agg_key_t;
+
+/* hash table entry - histogram for each aggregate */
+typedef struct custom_agg_entry_t {
+	custom_agg_key_t key;
+	bool	   *isnull;			/* no non-NULL values yet */
+	tinyhist_t *hists;
+	int		   *nvalues;		/* number of buffered values (per aggregate) */
+	double	   *values;			/* buffered values (CUSTOM_AGG_BATCH each) */
+} custom_agg_entry_t;
+
+typedef struct custom_agg_state_t {
+	CustomScanState css;
+
+	/* grouping keys (attnums in the table) */
+	int			nkeys;
+	AttrNumber	keys[CUSTOM_AGG_MAX_KEYS];
+
+	/* output columns (kind, and attnum or index of the grouping key) */
+	int			ncolumns;
+	int		   *kinds;
+	AttrNumber *attnums;
+
+	/* buffer index for tinyhist_agg(double precision) columns, or -1 */
+	int		   *batches;
+	int			nbatches;
+
+	/* highest attnum to deform */
+	AttrNumber	maxattnum;
+
+	MemoryContext context;
+	HTAB	   *groups;
+	HASH_SEQ_STATUS iter;
+	bool		aggregated;
+	bool		iterating;
+
+	/* spilled groups (keys and partial histograms), sorted by the keys */
+	Tuplesortstate *sort;
+	TupleTableSlot *sortslot;
+	custom_agg_entry_t *group;	/* group being merged from the sort */
+	bool		pending;		/* sortslot has the first tuple of a group */
+} custom_agg_state_t;
+
+static Plan *custom_agg_plan(PlannerInfo *root, RelOptInfo *rel,
+							 CustomPath *best_path, List *tlist,
+							 List *clauses, List *custom_plans);
+static Node *custom_agg_create_state(CustomScan *cscan);
+static void custom_agg_begin(CustomScanState *node, EState *estate, int eflags);
+static TupleTableSlot *custom_agg_exec(CustomScanState *node);
+static void custom_agg_end(CustomScanState *node);
+static void custom_agg_rescan(CustomScanState *node);
+
+static const CustomPathMethods custom_agg_path_methods = {
+	.CustomName = "TinyhistAgg",
+	.PlanCustomPath = custom_agg_plan,
+};
+
+static const CustomScanMethods custom_agg_scan_methods = {
+	.CustomName = "TinyhistAgg",
+	.CreateCustomScanState = custom_agg_create_state,
+};
+
+static const CustomExecMethods custom_agg_exec_methods = {
+	.CustomName = "TinyhistAgg",
+	.BeginCustomScan = custom_agg_begin,
+	.ExecCustomScan = custom_agg_exec,
+	.EndCustomScan = custom_agg_end,
+	.ReScanCustomScan = custom_agg_rescan,
+};
+
+/*
+ * custom_agg_column_var
+ *		is the expression a plain column of the relation?
+ */
+static bool
+custom_agg_column_var(Expr *expr, RelOptInfo *rel)
+{
+	Var		   *var = (Var *) expr;
+
+	return (IsA(expr, Var) &&
+			(var->varno == rel->relid) &&
+			(var->varlevelsup == 0) &&
+			(var->varattno > 0));
+}
+
+/*
+ * tinyhist_agg_arg
+ *		argument of a plain tinyhist_agg call (NULL for other aggregates)
+ *
+ * Only plain tinyhist_agg calls are accepted, i.e. without DISTINCT, ORDER
+ * BY or FILTER, and with the tinyhist result type from the same schema.
+ */
+static Expr *
+tinyhist_agg_arg(Aggref *aggref)
+{
+	HeapTuple	tuple;
+	Form_pg_type typform;
+	bool		match;
+
+	if ((aggref->aggorder != NIL) || (aggref->aggdistinct != NIL) ||
+		(aggref->aggfilter != NULL) || aggref->aggstar || aggref->aggvariadic ||
+		(aggref->aggkind != AGGKIND_NORMAL) || (aggref->agglevelsup != 0) ||
+		(aggref->aggsplit != AGGSPLIT_SIMPLE) || (list_length(aggref->args) != 1))
+		return NULL;
+
+	if (strcmp(get_func_name(aggref->aggfnoid), "tinyhist_agg") != 0)
+		return NULL;
+
+	/* the result has to be the tinyhist type from the same schema */
+	tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(aggref->aggtype));
+
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", aggref->aggtype);
+
+	typform = (Form_pg_type) GETSTRUCT(tuple);
+
+	match = ((strcmp(NameStr(typform->typname), "tinyhist") == 0) &&
+			 (typform->typnamespace == get_func_namespace(aggref->aggfnoid)));
+
+	ReleaseSysCache(tuple);
+
+	if (!match)
+		return NULL;
+
+	return ((TargetEntry *) linitial(aggref->args))->expr;
+}
+
+/*
+ * custom_agg_kind
+ *		determine if the aggregate is a supported tinyhist_agg call
+ *
+ * Only plain tinyhist_agg calls on a column are supported.
+ */
+static int
+custom_agg_kind(Aggref *aggref, RelOptInfo *rel)
+{
+	Expr	   *arg = tinyhist_agg_arg(aggref);
+
+	if ((arg == NULL) || !custom_agg_column_var(arg, rel))
+		return -1;
+
+	if (exprType((Node *) arg) == FLOAT8OID)
+		return CUSTOM_AGG_VALUES;
+	else if (exprType((Node *) arg) == aggref->aggtype)
+		return CUSTOM_AGG_HISTS;
+
+	return -1;
+}
+
+/*
+ * custom_agg_key_type
+ *		types supported as grouping keys (by-value, binary equality)
+ */
+static bool
+custom_agg_key_type(Oid typid)
+{
+	switch (typid)
+	{
+		case BOOLOID:
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case DATEOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * custom_agg_upper_paths
+ *		add the custom aggregate path for supported queries
+ *
+ * The custom_private of the path is a list of integers - relid, number of
+ * grouping keys, their attnums, and then a (kind, attnum/key index) pair
+ * for each output column.
+ */
+static void
+custom_agg_upper_paths(PlannerInfo *root, UpperRelationKind stage,
+					   RelOptInfo *input_rel, RelOptInfo *output_rel,
+					   void *extra)
+{
+	Query	   *parse = root->parse;
+	RangeTblEntry *rte;
+	CustomPath *cpath;
+	List	   *keys = NIL;
+	List	   *columns = NIL;
+	ListCell   *lc;
+	int			naggs = 0;
+	double		nrows = 1;
+
+	if (prev_create_upper_paths_hook)
+		prev_create_upper_paths_hook(root, stage, input_rel, output_rel, extra);
+
+	if (!custom_agg_enabled || (stage != UPPERREL_GROUP_AGG))
+		return;
+
+	/* simple aggregate queries only */
+	if (!parse->hasAggs || (parse->groupingSets != NIL) ||
+		(parse->havingQual != NULL) || parse->hasTargetSRFs ||
+		(parse->rowMarks != NIL) ||
+		(list_length(parse->groupClause) > CUSTOM_AGG_MAX_KEYS))
+		return;
+
+	/* a plain table, without restrictions */
+	if ((input_rel->reloptkind != RELOPT_BASEREL) ||
+		(input_rel->rtekind != RTE_RELATION) ||
+		(input_rel->baserestrictinfo != NIL))
+		return;
+
+	rte = root->simple_rte_array[input_rel->relid];
+
+	if (rte->inh || (rte->tablesample != NULL) ||
+		((rte->relkind != RELKIND_RELATION) && (rte->relkind != RELKIND_MATVIEW)))
+		return;
+
+	/* grouping keys have to be plain columns with supported types */
+	foreach(lc, parse->groupClause)
+	{
+		SortGroupClause *sgc = (SortGroupClause *) lfirst(lc);
+		Expr	   *expr = (Expr *) get_sortgroupclause_expr(sgc, parse->targetList);
+
+		if (!custom_agg_column_var(expr, input_rel) ||
+			!custom_agg_key_type(exprType((Node *) expr)))
+			return;
+
+		keys = lappend_int(keys, ((Var *) expr)->varattno);
+	}
+
+	/* output columns have to be grouping keys or tinyhist_agg calls */
+	foreach(lc, output_rel->reltarget->exprs)
+	{
+		Expr	   *expr = (Expr *) lfirst(lc);
+
+		if (IsA(expr, Aggref))
+		{
+			int			kind = custom_agg_kind((Aggref *) expr, input_rel);
+			TargetEntry *arg = (TargetEntry *) linitial(((Aggref *) expr)->args);
+
+			if (kind < 0)
+				return;
+
+			columns = lappend_int(columns, kind);
+			columns = lappend_int(columns, ((Var *) arg->expr)->varattno);
+			naggs++;
+		}
+		else if (custom_agg_column_var(expr, input_rel) &&
+				 list_member_int(keys, ((Var *) expr)->varattno))
+		{
+			int			idx = 0;
+
+			/* index of the grouping key */
+			while (list_nth_int(keys, idx) != ((Var *) expr)->varattno)
+				idx++;
+
+			columns = lappend_int(columns, CUSTOM_AGG_KEY);
+			columns = lappend_int(columns, idx);
+		}
+		else
+			return;
+	}
+
+	/* use the number of groups estimated for the regular paths */
+	if (output_rel->pathlist != NIL)
+		nrows = ((Path *) linitial(output_rel->pathlist))->rows;
+
+	cpath = makeNode(CustomPath);
+	cpath->path.pathtype = T_CustomScan;
+	cpath->path.parent = output_rel;
+	cpath->path.pathtarget = output_rel->reltarget;
+	cpath->path.param_info = NULL;
+	cpath->path.parallel_aware = false;
+	cpath->path.parallel_safe = false;
+	cpath->path.parallel_workers = 0;
+	cpath->path.rows = nrows;
+
+	/*
+	 * Scanning the table costs the same as the sequential scan, but the
+	 * aggregation is cheaper than calling the transition function (and
+	 * evaluating the group keys) for each row.
+	 */
+	cpath->path.startup_cost = input_rel->cheapest_total_path->total_cost +
+		0.5 * cpu_operator_cost * naggs * input_rel->rows;
+	cpath->path.total_cost = cpath->path.startup_cost + cpu_tuple_cost * nrows;
+	cpath->path.pathkeys = NIL;
+
+	cpath->flags = 0;
+	cpath->custom_paths = NIL;
+	/* the number of keys has to be added before appending columns to keys */
+	cpath->custom_private = list_make2_int(input_rel->relid, list_length(keys));
+	cpath->custom_private = list_concat(cpath->custom_private, keys);
+	cpath->custom_private = list_concat(cpath->custom_private, columns);
+	cpath->methods = &custom_agg_path_methods;
+
+	add_path(output_rel, &cpath->path);
+}
+
+/*
+ * custom_agg_plan
+ *		build the custom scan plan for the custom aggregate path
+ *
+ * The scan tuple has the same expressions as the target list (grouping
+ * keys and aggregates), so that setrefs matches the aggregates in the
+ * target list to the scan tuple.
+ */
+static Plan *
+custom_agg_plan(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+				List *tlist, List *clauses, List *custom_plans)
+{
+	CustomScan *cscan = makeNode(CustomScan);
+
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = NIL;
+	cscan->scan.scanrelid = linitial_int(best_path->custom_private);
+	cscan->flags = best_path->flags;
+	cscan->custom_plans = NIL;
+	cscan->custom_exprs = NIL;
+	cscan->custom_private = best_path->custom_private;
+	cscan->custom_scan_tlist = copyObject(tlist);
+	cscan->methods = &custom_agg_scan_methods;
+
+	return &cscan->scan.plan;
+}
+
+static Node *
+custom_agg_create_state(CustomScan *cscan)
+{
+	custom_agg_state_t *state = palloc0(sizeof(custom_agg_state_t));
+
+	NodeSetTag(state, T_CustomScanState);
+	state->css.flags = cscan->flags;
+	state->css.methods = &custom_agg_exec_methods;
+
+	return (Node *) state;
+}
+
+static void
+custom_agg_begin(CustomScanState *node, EState *estate, int eflags)
+{
+	custom_agg_state_t *state = (custom_agg_state_t *) node;
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+	List	   *private = cscan->custom_private;
+	int			idx = 1;
+
+	state->nkeys = list_nth_int(private, idx++);
+	state->maxattnum = 0;
+
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		state->keys[i] = list_nth_int(private, idx++);
+		state->maxattnum = Max(state->maxattnum, state->keys[i]);
+	}
+
+	state->ncolumns = (list_length(private) - idx) / 2;
+	state->kinds = palloc(sizeof(int) * state->ncolumns);
+	state->attnums = palloc(sizeof(AttrNumber) * state->ncolumns);
+
+	for (int i = 0; i < state->ncolumns; i++)
+	{
+		state->kinds[i] = list_nth_int(private, idx++);
+		state->attnums[i] = list_nth_int(private, idx++);
+
+		if (state->kinds[i] != CUSTOM_AGG_KEY)
+			state->maxattnum = Max(state->maxattnum, state->attnums[i]);
+	}
+
+	state->batches = palloc(sizeof(int) * state->ncolumns);
+	state->nbatches = 0;
+
+	for (int i = 0; i < state->ncolumns; i++)
+		state->batches[i] = (state->kinds[i] == CUSTOM_AGG_VALUES) ? state->nbatches++ : -1;
+
+	state->context = AllocSetContextCreate(estate->es_query_cxt,
+										   "tinyhist custom aggregate",
+										   ALLOCSET_DEFAULT_SIZES);
+	state->groups = NULL;
+	state->aggregated = false;
+	state->iterating = false;
+	state->sort = NULL;
+	state->sortslot = NULL;
+	state->group = NULL;
+	state->pending = false;
+}
+
+/*
+ * custom_agg_create_groups
+ *		create an empty hash table for the groups
+ */
+static void
+custom_agg_create_groups(custom_agg_state_t *state)
+{
+	HASHCTL		ctl;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(custom_agg_key_t);
+	ctl.entrysize = sizeof(custom_agg_entry_t);
+	ctl.hcxt = state->context;
+
+	state->groups = hash_create("tinyhist custom aggregate groups", 1024, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * custom_agg_init_entry
+ *		initialize a new group (no values yet, empty buffers)
+ */
+static void
+custom_agg_init_entry(custom_agg_state_t *state, custom_agg_entry_t *entry)
+{
+	entry->isnull = MemoryContextAlloc(state->context, sizeof(bool) * state->ncolumns);
+	entry->hists = MemoryContextAllocZero(state->context, sizeof(tinyhist_t) * state->ncolumns);
+	entry->nvalues = MemoryContextAllocZero(state->context, sizeof(int) * state->nbatches);
+	entry->values = MemoryContextAlloc(state->context,
+									   sizeof(double) * CUSTOM_AGG_BATCH * state->nbatches);
+
+	for (int i = 0; i < state->ncolumns; i++)
+		entry->isnull[i] = true;
+}
+
+/*
+ * custom_agg_flush
+ *		add the buffered values of a group to its histograms
+ */
+static void
+custom_agg_flush(custom_agg_state_t *state, custom_agg_entry_t *entry)
+{
+	for (int i = 0; i < state->ncolumns; i++)
+	{
+		int			batch = state->batches[i];
+
+		if ((batch < 0) || (entry->nvalues[batch] == 0))
+			continue;
+
+		hist_add_batch(&entry->hists[i], &entry->values[batch * CUSTOM_AGG_BATCH],
+					   entry->nvalues[batch]);
+		entry->nvalues[batch] = 0;
+	}
+}
+
+/*
+ * custom_agg_begin_sort
+ *		start the sort for spilled groups
+ *
+ * The sorted tuples have the grouping keys first (sorted with NULLs first),
+ * followed by the output columns (grouping keys in the output columns are
+ * left NULL, the histograms are in the matching columns).
+ */
+static void
+custom_agg_begin_sort(custom_agg_state_t *state)
+{
+	EState	   *estate = state->css.ss.ps.state;
+	TupleDesc	reldesc = RelationGetDescr(state->css.ss.ss_currentRelation);
+	TupleDesc	scandesc = state->css.ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+	TupleDesc	desc;
+	AttrNumber	attnums[CUSTOM_AGG_MAX_KEYS];
+	Oid			sortops[CUSTOM_AGG_MAX_KEYS];
+	Oid			collations[CUSTOM_AGG_MAX_KEYS];
+	bool		nullsfirst[CUSTOM_AGG_MAX_KEYS];
+	MemoryContext oldcontext;
+
+	oldcontext = MemoryContextSwitchTo(estate->es_query_cxt);
+
+	desc = CreateTemplateTupleDesc(state->nkeys + state->ncolumns);
+
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		Oid			typid = TupleDescAttr(reldesc, state->keys[i] - 1)->atttypid;
+		TypeCacheEntry *typentry = lookup_type_cache(typid, TYPECACHE_LT_OPR);
+
+		if (!OidIsValid(typentry->lt_opr))
+			elog(ERROR, "could not find ordering operator for type %u", typid);
+
+		TupleDescInitEntry(desc, i + 1, NULL, typid, -1, 0);
+
+		attnums[i] = i + 1;
+		sortops[i] = typentry->lt_opr;
+		collations[i] = InvalidOid;
+		nullsfirst[i] = true;
+	}
+
+	for (int i = 0; i < state->ncolumns; i++)
+		TupleDescCopyEntry(desc, state->nkeys + i + 1, scandesc, i + 1);
+
+	state->sort = tuplesort_begin_heap(desc, state->nkeys, attnums, sortops,
+									   collations, nullsfirst, work_mem, NULL,
+#if PG_VERSION_NUM >= 150000
+									   TUPLESORT_NONE);
+#else
+									   false);
+#endif
+
+	state->sortslot = MakeSingleTupleTableSlot(desc, &TTSOpsMinimalTuple);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * custom_agg_spill
+ *		write all groups into the sort, and start with an empty hash table
+ */
+static void
+custom_agg_spill(custom_agg_state_t *state)
+{
+	TupleTableSlot *slot;
+	HASH_SEQ_STATUS iter;
+	custom_agg_entry_t *entry;
+
+	if (state->sort == NULL)
+		custom_agg_begin_sort(state);
+
+	slot = state->sortslot;
+
+	hash_seq_init(&iter, state->groups);
+
+	while ((entry = (custom_agg_entry_t *) hash_seq_search(&iter)) != NULL)
+	{
+		custom_agg_flush(state, entry);
+
+		ExecClearTuple(slot);
+
+		for (int i = 0; i < state->nkeys; i++)
+		{
+			slot->tts_values[i] = entry->key.values[i];
+			slot->tts_isnull[i] = entry->key.isnull[i];
+		}
+
+		for (int i = 0; i < state->ncolumns; i++)
+		{
+			bool		isnull = ((state->kinds[i] == CUSTOM_AGG_KEY) || entry->isnull[i]);
+
+			slot->tts_values[state->nkeys + i] = PointerGetDatum(&entry->hists[i]);
+			slot->tts_isnull[state->nkeys + i] = isnull;
+		}
+
+		ExecStoreVirtualTuple(slot);
+
+		tuplesort_puttupleslot(state->sort, slot);
+	}
+
+	MemoryContextReset(state->context);
+	custom_agg_create_groups(state);
+}
+
+/*
+ * custom_agg_aggregate
+ *		scan the whole table and build histograms for all groups
+ */
+static void
+custom_agg_aggregate(custom_agg_state_t *state)
+{
+	EState	   *estate = state->css.ss.ps.state;
+	Relation	rel = state->css.ss.ss_currentRelation;
+	TableScanDesc scan;
+	TupleTableSlot *slot;
+	custom_agg_key_t key;
+	custom_agg_entry_t *entry;
+	bool		found;
+	Size		limit = work_mem * (Size) 1024;
+
+	custom_agg_create_groups(state);
+
+	slot = table_slot_create(rel, NULL);
+	scan = table_beginscan(rel, estate->es_snapshot, 0, NULL);
+
+	/* the key has to be zeroed, as it's hashed/compared as binary */
+	memset(&key, 0, sizeof(key));
+
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* deform only the attributes we need */
+		slot_getsomeattrs(slot, state->maxattnum);
+
+		for (int i = 0; i < state->nkeys; i++)
+		{
+			int			attidx = state->keys[i] - 1;
+
+			key.isnull[i] = slot->tts_isnull[attidx];
+			key.values[i] = (key.isnull[i] ? (Datum) 0 : slot->tts_values[attidx]);
+		}
+
+		entry = (custom_agg_entry_t *) hash_search(state->groups, &key,
+												   HASH_ENTER, &found);
+
+		if (!found)
+			custom_agg_init_entry(state, entry);
+
+		for (int i = 0; i < state->ncolumns; i++)
+		{
+			int			attidx = state->attnums[i] - 1;
+			int			batch = state->batches[i];
+
+			if ((state->kinds[i] == CUSTOM_AGG_KEY) || slot->tts_isnull[attidx])
+				continue;
+
+			if (state->kinds[i] == CUSTOM_AGG_VALUES)
+			{
+				entry->values[batch * CUSTOM_AGG_BATCH + entry->nvalues[batch]++] =
+					DatumGetFloat8(slot->tts_values[attidx]);
+
+				if (entry->nvalues[batch] == CUSTOM_AGG_BATCH)
+				{
+					hist_add_batch(&entry->hists[i], &entry->values[batch * CUSTOM_AGG_BATCH],
+								   CUSTOM_AGG_BATCH);
+					entry->nvalues[batch] = 0;
+				}
+			}
+			else
+				hist_merge(&entry->hists[i], (tinyhist_t *) DatumGetPointer(slot->tts_values[attidx]));
+
+			entry->isnull[i] = false;
+		}
+
+		/* the groups only grow with new groups, spill if over work_mem */
+		if (!found && (state->nkeys > 0) &&
+			(MemoryContextMemAllocated(state->context, true) > limit))
+			custom_agg_spill(state);
+	}
+
+	table_endscan(scan);
+	ExecDropSingleTupleTableSlot(slot);
+
+	/* without grouping keys, there's always one group */
+	if ((state->nkeys == 0) && (hash_get_num_entries(state->groups) == 0))
+	{
+		entry = (custom_agg_entry_t *) hash_search(state->groups, &key,
+												   HASH_ENTER, &found);
+
+		custom_agg_init_entry(state, entry);
+	}
+
+	state->aggregated = true;
+	state->iterating = true;
+
+	/* if some groups were spilled, spill the rest too and merge them sorted */
+	if (state->sort != NULL)
+	{
+		custom_agg_spill(state);
+		tuplesort_performsort(state->sort);
+
+		state->group = MemoryContextAlloc(state->context, sizeof(custom_agg_entry_t));
+		custom_agg_init_entry(state, state->group);
+		return;
+	}
+
+	hash_seq_init(&state->iter, state->groups);
+
+	while ((entry = (custom_agg_entry_t *) hash_seq_search(&state->iter)) != NULL)
+		custom_agg_flush(state, entry);
+
+	hash_seq_init(&state->iter, state->groups);
+}
+
+/*
+ * custom_agg_same_keys
+ *		does the sorted tuple belong to the group?
+ */
+static bool
+custom_agg_same_keys(custom_agg_state_t *state, custom_agg_key_t *key,
+					 TupleTableSlot *slot)
+{
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		if (key->isnull[i] != slot->tts_isnull[i])
+			return false;
+
+		if (!key->isnull[i] && (key->values[i] != slot->tts_values[i]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * custom_agg_next_sorted
+ *		merge the partial histograms of the next group from the sort
+ *
+ * The first tuple of the group may have been read already, when looking
+ * for the end of the preceding group.
+ */
+static custom_agg_entry_t *
+custom_agg_next_sorted(custom_agg_state_t *state)
+{
+	custom_agg_entry_t *group = state->group;
+	TupleTableSlot *slot = state->sortslot;
+
+	if (!state->pending &&
+		!tuplesort_gettupleslot(state->sort, true, false, slot, NULL))
+		return NULL;
+
+	slot_getallattrs(slot);
+
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		group->key.values[i] = slot->tts_values[i];
+		group->key.isnull[i] = slot->tts_isnull[i];
+	}
+
+	for (int i = 0; i < state->ncolumns; i++)
+		group->isnull[i] = true;
+
+	do
+	{
+		for (int i = 0; i < state->ncolumns; i++)
+		{
+			tinyhist_t *hist;
+
+			if (slot->tts_isnull[state->nkeys + i])
+				continue;
+
+			hist = (tinyhist_t *) DatumGetPointer(slot->tts_values[state->nkeys + i]);
+
+			if (group->isnull[i])
+				memcpy(&group->hists[i], hist, sizeof(tinyhist_t));
+			else
+				hist_merge(&group->hists[i], hist);
+
+			group->isnull[i] = false;
+		}
+
+		state->pending = tuplesort_gettupleslot(state->sort, true, false, slot, NULL);
+
+		if (state->pending)
+			slot_getallattrs(slot);
+
+	} while (state->pending && custom_agg_same_keys(state, &group->key, slot));
+
+	return group;
+}
+
+/*
+ * custom_agg_next
+ *		return the next group (aggregate the table on the first call)
+ */
+static TupleTableSlot *
+custom_agg_next(ScanState *node)
+{
+	custom_agg_state_t *state = (custom_agg_state_t *) node;
+	TupleTableSlot *slot = node->ss_ScanTupleSlot;
+	custom_agg_entry_t *entry;
+
+	if (!state->aggregated)
+		custom_agg_aggregate(state);
+
+	ExecClearTuple(slot);
+
+	if (!state->iterating)
+		return slot;
+
+	if (state->sort != NULL)
+		entry = custom_agg_next_sorted(state);
+	else
+		entry = (custom_agg_entry_t *) hash_seq_search(&state->iter);
+
+	if (entry == NULL)
+	{
+		state->iterating = false;
+		return slot;
+	}
+
+	for (int i = 0; i < state->ncolumns; i++)
+	{
+		if (state->kinds[i] == CUSTOM_AGG_KEY)
+		{
+			slot->tts_values[i] = entry->key.values[state->attnums[i]];
+			slot->tts_isnull[i] = entry->key.isnull[state->attnums[i]];
+		}
+		else
+		{
+			slot->tts_values[i] = PointerGetDatum(&entry->hists[i]);
+			slot->tts_isnull[i] = entry->isnull[i];
+		}
+	}
+
+	return ExecStoreVirtualTuple(slot);
+}
+
+static bool
+custom_agg_recheck(ScanState *node, TupleTableSlot *slot)
+{
+	return true;
+}
+
+static TupleTableSlot *
+custom_agg_exec(CustomScanState *node)
+{
+	return ExecScan(&node->ss, custom_agg_next, custom_agg_recheck);
+}
+
+static void
+custom_agg_end(CustomScanState *node)
+{
+	custom_agg_state_t *state = (custom_agg_state_t *) node;
+
+	if (state->iterating && (state->sort == NULL))
+		hash_seq_term(&state->iter);
+
+	if (state->sort != NULL)
+	{
+		tuplesort_end(state->sort);
+		ExecDropSingleTupleTableSlot(state->sortslot);
+	}
+
+	MemoryContextDelete(state->context);
+}
+
+static void
+custom_agg_rescan(CustomScanState *node)
+{
+	custom_agg_state_t *state = (custom_agg_state_t *) node;
+
+	if (state->iterating && (state->sort == NULL))
+		hash_seq_term(&state->iter);
+
+	if (state->sort != NULL)
+	{
+		tuplesort_end(state->sort);
+		ExecDropSingleTupleTableSlot(state->sortslot);
+	}
+
+	MemoryContextReset(state->context);
+
+	state->groups = NULL;
+	state->aggregated = false;
+	state->iterating = false;
+	state->sort = NULL;
+	state->sortslot = NULL;
+	state->group = NULL;
+	state->pending = false;
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("tinyhist.enable_custom_agg",
+							 "Enables the custom scan aggregating tinyhist_agg directly from a table.",
+							 NULL,
+							 &custom_agg_enabled,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("tinyhist.enable_rollup_routing",
+							 "Enables routing of tinyhist_agg queries to registered rollup tables.",
+							 NULL,
+							 &rollup_routing_enabled,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, rollup_routing_assign, NULL);
+
+	RegisterCustomScanMethods(&custom_agg_scan_methods);
+
+	prev_create_upper_paths_hook = create_upper_paths_hook;
+	create_upper_paths_hook = custom_agg_upper_paths;
+
+	prev_planner_hook = planner_hook;
+	planner_hook = rollup_planner;
+}
+
+/*
+ * Distribution algebra - histograms for a sum of independent values, or
+ * for a maximum of independent values, each from the input histograms.
+ */
+
+/*
+ * hist_bucket_lower / hist_bucket_upper
+ *		boundaries of a bucket (with the given unit)
+ */
+static double
+hist_bucket_lower(int unit, int bucket)
+{
+	return (bucket == 0) ? 0.0 : ldexp(1.0, unit + bucket - 1);
+}
+
+static double
+hist_bucket_upper(int unit, int bucket)
+{
+	return ldexp(1.0, unit + bucket);
+}
+
+/*
+ * hist_from_double_counts
+ *		build a histogram from (fractional) counts at the given sample rate
+ *
+ * The counts are rounded, and if they don't fit into the buckets, the
+ * sample rate is reduced.
+ */
+static tinyhist_t *
+hist_from_double_counts(const double *counts, int sample, int unit,
+						const char *what)
+{
+	tinyhist_t *result = palloc0(sizeof(tinyhist_t));
+	int32		maxcounts[HISTOGRAM_BUCKETS];
+	int			shift;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		maxcounts[i] = bucket_maxcount(i);
+
+	shift = counts_shift(counts, maxcounts, HISTOGRAM_BUCKETS);
+
+	if (sample + shift > HISTOGRAM_MAX_SAMPLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("%s histogram sample rate out of range", what)));
+
+	result->sample = sample + shift;
+	result->unit = unit;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		bucket_set(result, i, (int32) floor(ldexp(counts[i], -shift) + 0.5));
+
+	return result;
+}
+
+/*
+ * hist_convolve
+ *		histogram of a sum of two independent values, one from each input
+ *
+ * For each pair of buckets, the sum is in the interval between the sums
+ * of lower and upper boundaries. The probability of the pair is spread
+ * uniformly over this interval, and split between the overlapping result
+ * buckets. The unit is increased until the result can hold the sum of
+ * the largest values. The result has the same number of values as the
+ * larger input.
+ */
+static tinyhist_t *
+hist_convolve(const tinyhist_t *hist1, const tinyhist_t *hist2)
+{
+	int32		counts1[HISTOGRAM_BUCKETS];
+	int32		counts2[HISTOGRAM_BUCKETS];
+	double		counts[HISTOGRAM_BUCKETS] = {0};
+	double		total1 = 0,
+				total2 = 0,
+				max1 = 0,
+				max2 = 0,
+				nvalues;
+	int			sample = Max(hist1->sample, hist2->sample);
+	int			unit = Max(hist1->unit, hist2->unit);
+
+	hist_unpack(hist1, counts1);
+	hist_unpack(hist2, counts2);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		total1 += counts1[i];
+		total2 += counts2[i];
+
+		if (counts1[i] > 0)
+			max1 = hist_bucket_upper(hist1->unit, i);
+
+		if (counts2[i] > 0)
+			max2 = hist_bucket_upper(hist2->unit, i);
+	}
+
+	/* the result has to cover the sum of the largest values */
+	while (hist_bucket_upper(unit, HISTOGRAM_BUCKETS - 1) < max1 + max2)
+		unit++;
+
+	if (unit > HISTOGRAM_MAX_UNIT)
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("convolved histogram unit out of range")));
+
+	/* empty input means empty result */
+	if ((total1 == 0) || (total2 == 0))
+		return hist_from_double_counts(counts, sample, unit, "convolved");
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		if (counts1[i] == 0)
+			continue;
+
+		for (int j = 0; j < HISTOGRAM_BUCKETS; j++)
+		{
+			double		lower,
+						upper,
+						weight;
+
+			if (counts2[j] == 0)
+				continue;
+
+			lower = hist_bucket_lower(hist1->unit, i) + hist_bucket_lower(hist2->unit, j);
+			upper = hist_bucket_upper(hist1->unit, i) + hist_bucket_upper(hist2->unit, j);
+			weight = (double) counts1[i] * counts2[j];
+
+			for (int k = 0; k < HISTOGRAM_BUCKETS; k++)
+				counts[k] += weight * interval_overlap(lower, upper,
+													   hist_bucket_lower(unit, k),
+													   hist_bucket_upper(unit, k));
+		}
+	}
+
+	/* number of values (at the result sample rate) */
+	nvalues = ldexp(Max(ldexp(total1, hist1->sample), ldexp(total2, hist2->sample)), -sample);
+
+	for (int k = 0; k < HISTOGRAM_BUCKETS; k++)
+		counts[k] = counts[k] * nvalues / (total1 * total2);
+
+	return hist_from_double_counts(counts, sample, unit, "convolved");
+}
+
+/*
+ * hist_max_of
+ *		histogram of a maximum of n independent values from the histogram
+ *
+ * The maximum is at most the upper boundary of a bucket if all the values
+ * are, so the cumulative distribution of the maximum is F(x)^n. This is
+ * exact at the bucket boundaries, so the result uses the same buckets.
+ */
+static tinyhist_t *
+hist_max_of(const tinyhist_t *hist, int32 n)
+{
+	int32		hcounts[HISTOGRAM_BUCKETS];
+	double		counts[HISTOGRAM_BUCKETS];
+	double		total = 0,
+				cumulative = 0,
+				prev = 0;
+
+	hist_unpack(hist, hcounts);
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+		total += hcounts[i];
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		double		fraction;
+
+		if (total == 0)
+		{
+			counts[i] = 0;
+			continue;
+		}
+
+		cumulative += hcounts[i];
+		fraction = pow(cumulative / total, n);
+
+		counts[i] = total * (fraction - prev);
+		prev = fraction;
+	}
+
+	return hist_from_double_counts(counts, hist->sample, hist->unit, "maximum");
+}
+
+/*
+ * tinyhist_convolve
+ *		histogram of a sum of two independent values, one from each histogram
+ */
+Datum
+tinyhist_convolve(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_POINTER(hist_convolve((tinyhist_t *) PG_GETARG_POINTER(0),
+									(tinyhist_t *) PG_GETARG_POINTER(1)));
+}
+
+/*
+ * tinyhist_max_of
+ *		histogram of a maximum of n independent values from the histogram
+ */
+Datum
+tinyhist_max_of(PG_FUNCTION_ARGS)
+{
+	int32		n = PG_GETARG_INT32(1);
+
+	if (n < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of values %d must be at least 1", n)));
+
+	PG_RETURN_POINTER(hist_max_of((tinyhist_t *) PG_GETARG_POINTER(0), n));
+}
+
+/*
+ * Export of histograms in the OpenMetrics text format, e.g. for the textfile
+ * collector of node_exporter (so that metrics don't need SQL scrapes).
+ *
+ * The exported metrics are registered in the tinyhist_exports table, each
+ * with a query returning the histograms (optionally with a key, exported as
+ * a label). The tinyhist_export_openmetrics function renders all metrics,
+ * and a background worker started by tinyhist_export_worker_start writes
+ * them into a file every interval (the file is replaced by a rename, so
+ * the collector never sees a partially written file).
+ */
+
+/*
+ * export_metric_name_valid
+ *		check the metric name matches [a-zA-Z_:][a-zA-Z0-9_:]*
+ */
+static bool
+export_metric_name_valid(const char *name)
+{
+	if (!isalpha((unsigned char) name[0]) && (name[0] != '_') && (name[0] != ':'))
+		return false;
+
+	for (const char *c = name; *c; c++)
+	{
+		if (!isalnum((unsigned char) *c) && (*c != '_') && (*c != ':'))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * export_append_escaped
+ *		append a label value (or help text), with escaped special characters
+ */
+static void
+export_append_escaped(StringInfo buf, const char *value, bool quotes)
+{
+	for (const char *c = value; *c; c++)
+	{
+		if (*c == '\\')
+			appendStringInfoString(buf, "\\\\");
+		else if (*c == '\n')
+			appendStringInfoString(buf, "\\n");
+		else if ((*c == '"') && quotes)
+			appendStringInfoString(buf, "\\\"");
+		else
+			appendStringInfoChar(buf, *c);
+	}
+}
+
+/*
+ * export_append_labels
+ *		append labels of a sample (the key, and the bucket boundary)
+ */
+static void
+export_append_labels(StringInfo buf, const char *key, const char *le)
+{
+	if ((key == NULL) && (le == NULL))
+		return;
+
+	appendStringInfoChar(buf, '{');
+
+	if (key != NULL)
+	{
+		appendStringInfoString(buf, "key=\"");
+		export_append_escaped(buf, key, true);
+		appendStringInfoChar(buf, '"');
+	}
+
+	if (le != NULL)
+		appendStringInfo(buf, "%sle=\"%s\"", (key != NULL) ? "," : "", le);
+
+	appendStringInfoChar(buf, '}');
+}
+
+/*
+ * export_append_hist
+ *		append samples for a single histogram (cumulative buckets and count)
+ *
+ * The counts are unpacked in one pass, and scaled by the sample rate.
+ *
+ * The bucket boundaries depend on the unit of the histogram, so the samples
+ * use fixed boundaries instead - all powers of two up to the largest bucket
+ * of a histogram with the maximum unit. Otherwise histograms with different
+ * units could not be aggregated (e.g. by sum by (le) in Prometheus). The
+ * boundaries below the first bucket of the histogram have zero counts.
+ */
+static void
+export_append_hist(StringInfo buf, const char *metric, const char *key,
+				   const tinyhist_t *hist)
+{
+	int32		counts[HISTOGRAM_BUCKETS];
+	int64		cumulative = 0;
+
+	hist_unpack(hist, counts);
+
+	for (int i = 0; i < HISTOGRAM_MAX_UNIT + HISTOGRAM_BUCKETS; i++)
+	{
+		char		le[32];
+		int			bucket = i - hist->unit;
+
+		if ((bucket >= 0) && (bucket < HISTOGRAM_BUCKETS))
+			cumulative += ((int64) counts[bucket] << hist->sample);
+
+		snprintf(le, sizeof(le), "%.1f", hist_bucket_upper(0, i));
+
+		appendStringInfo(buf, "%s_bucket", metric);
+		export_append_labels(buf, key, le);
+		appendStringInfo(buf, " " INT64_FORMAT "\n", cumulative);
+	}
+
+	appendStringInfo(buf, "%s_bucket", metric);
+	export_append_labels(buf, key, "+Inf");
+	appendStringInfo(buf, " " INT64_FORMAT "\n", cumulative);
+
+	appendStringInfo(buf, "%s_count", metric);
+	export_append_labels(buf, key, NULL);
+	appendStringInfo(buf, " " INT64_FORMAT "\n", cumulative);
+}
+
+/*
+ * export_is_hist_type
+ *		check the type is the tinyhist type from the extension schema
+ */
+static bool
+export_is_hist_type(Oid typid, Oid nspid)
+{
+	HeapTuple	tuple;
+	Form_pg_type typform;
+	bool		match;
+
+	tuple = SearchSysCache1(TYPEOID, ObjectIdGetDatum(typid));
+
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for type %u", typid);
+
+	typform = (Form_pg_type) GETSTRUCT(tuple);
+
+	match = ((strcmp(NameStr(typform->typname), "tinyhist") == 0) &&
+			 (typform->typnamespace == nspid));
+
+	ReleaseSysCache(tuple);
+
+	return match;
+}
+
+/*
+ * export_check_result
+ *		check the query result is (hist) or (key, hist)
+ */
+static void
+export_check_result(const char *metric, TupleDesc tupdesc, Oid nspid)
+{
+	if (((tupdesc->natts != 1) && (tupdesc->natts != 2)) ||
+		!export_is_hist_type(SPI_gettypeid(tupdesc, tupdesc->natts), nspid))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("query for metric \"%s\" has to return (hist) or (key, hist)", metric),
+				 errdetail("The histogram has to be the last column, of type tinyhist.")));
+}
+
+/*
+ * export_render_metric
+ *		render a single metric (in an existing SPI connection)
+ */
+static void
+export_render_metric(StringInfo buf, const char *metric, const char *query,
+					 const char *help, Oid nspid)
+{
+	int			ret;
+
+	if ((help != NULL) && (help[0] != '\0'))
+	{
+		appendStringInfo(buf, "# HELP %s ", metric);
+		export_append_escaped(buf, help, false);
+		appendStringInfoChar(buf, '\n');
+	}
+
+	appendStringInfo(buf, "# TYPE %s histogram\n", metric);
+
+	ret = SPI_execute(query, true, 0);
+
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("query for metric \"%s\" is not a SELECT", metric)));
+
+	export_check_result(metric, SPI_tuptable->tupdesc, nspid);
+
+	for (uint64 j = 0; j < SPI_processed; j++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[j];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		char	   *key = NULL;
+		Datum		value;
+		bool		isnull;
+
+		value = SPI_getbinval(tuple, tupdesc, tupdesc->natts, &isnull);
+
+		/* NULL histograms are not exported */
+		if (isnull)
+			continue;
+
+		if (tupdesc->natts == 2)
+			key = SPI_getvalue(tuple, tupdesc, 1);
+
+		export_append_hist(buf, metric, key, (tinyhist_t *) DatumGetPointer(value));
+	}
+}
+
+/*
+ * export_render
+ *		render all registered metrics (in an existing SPI connection)
+ *
+ * With isolate, each metric is rendered in a subtransaction, and a metric
+ * that fails (e.g. because of an error in the query) is left out with
+ * a warning, instead of failing all the metrics. The worker relies on this,
+ * so that a single broken metric does not terminate it.
+ */
+static void
+export_render(StringInfo buf, Oid nspid, bool isolate)
+{
+	char	   *query;
+	SPITupleTable *exports;
+	uint64		nexports;
+
+	query = psprintf("SELECT metric, query, help FROM %s.tinyhist_exports ORDER BY metric",
+					 quote_identifier(get_namespace_name(nspid)));
+
+	if (SPI_execute(query, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "failed to look up exported metrics");
+
+	/* each query replaces SPI_tuptable, so remember the list of metrics */
+	exports = SPI_tuptable;
+	nexports = SPI_processed;
+
+	for (uint64 i = 0; i < nexports; i++)
+	{
+		char	   *metric = SPI_getvalue(exports->vals[i], exports->tupdesc, 1);
+		char	   *mquery = SPI_getvalue(exports->vals[i], exports->tupdesc, 2);
+		char	   *help = SPI_getvalue(exports->vals[i], exports->tupdesc, 3);
+		MemoryContext oldcontext = CurrentMemoryContext;
+		ResourceOwner oldowner = CurrentResourceOwner;
+		int			len = buf->len;
+
+		if (!isolate)
+		{
+			export_render_metric(buf, metric, mquery, help, nspid);
+			continue;
+		}
+
+		BeginInternalSubTransaction(NULL);
+		MemoryContextSwitchTo(oldcontext);
+
+		PG_TRY();
+		{
+			export_render_metric(buf, metric, mquery, help, nspid);
+
+			ReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+		}
+		PG_CATCH();
+		{
+			ErrorData  *edata;
+
+			MemoryContextSwitchTo(oldcontext);
+			edata = CopyErrorData();
+			FlushErrorState();
+
+			RollbackAndReleaseCurrentSubTransaction();
+			MemoryContextSwitchTo(oldcontext);
+			CurrentResourceOwner = oldowner;
+
+			/* discard the partially rendered metric */
+			buf->len = len;
+			buf->data[len] = '\0';
+
+			ereport(WARNING,
+					(errcode(edata->sqlerrcode),
+					 errmsg("could not export metric \"%s\": %s", metric, edata->message)));
+
+			FreeErrorData(edata);
+		}
+		PG_END_TRY();
+	}
+
+	appendStringInfoString(buf, "# EOF\n");
+}
+
+/*
+ * tinyhist_export_create
+ *		register a metric exported in the OpenMetrics format
+ *
+ * The query is executed once (with no rows returned), to check the result
+ * has the expected columns.
+ */
+Datum
+tinyhist_export_create(PG_FUNCTION_ARGS)
+{
+	char	   *metric = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	Oid			nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid			argtypes[3] = {TEXTOID, TEXTOID, TEXTOID};
+	Datum		args[3];
+	int			ret;
+
+	if (!export_metric_name_valid(metric))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid metric name \"%s\"", metric)));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	ret = SPI_execute(psprintf("SELECT * FROM (%s) q LIMIT 0", query), true, 0);
+
+	if (ret != SPI_OK_SELECT)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("query for metric \"%s\" is not a SELECT", metric)));
+
+	export_check_result(metric, SPI_tuptable->tupdesc, nspid);
+
+	args[0] = PG_GETARG_DATUM(0);
+	args[1] = PG_GETARG_DATUM(1);
+	args[2] = PG_GETARG_DATUM(2);
+
+	ret = SPI_execute_with_args(psprintf("INSERT INTO %s.tinyhist_exports VALUES ($1, $2, $3)",
+										 quote_identifier(get_namespace_name(nspid))),
+								3, argtypes, args, NULL, false, 0);
+
+	if (ret != SPI_OK_INSERT)
+		elog(ERROR, "failed to register exported metric: %s",
+			 SPI_result_code_string(ret));
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * tinyhist_export_drop
+ *		unregister an exported metric
+ */
+Datum
+tinyhist_export_drop(PG_FUNCTION_ARGS)
+{
+	Oid			nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid			argtypes[1] = {TEXTOID};
+	Datum		args[1];
+	int			ret;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	args[0] = PG_GETARG_DATUM(0);
+
+	ret = SPI_execute_with_args(psprintf("DELETE FROM %s.tinyhist_exports WHERE metric = $1",
+										 quote_identifier(get_namespace_name(nspid))),
+								1, argtypes, args, NULL, false, 0);
+
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "failed to unregister exported metric: %s",
+			 SPI_result_code_string(ret));
+
+	if (SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("exported metric \"%s\" does not exist",
+						text_to_cstring(PG_GETARG_TEXT_PP(0)))));
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * tinyhist_export_openmetrics
+ *		render all registered metrics in the OpenMetrics text format
+ */
+Datum
+tinyhist_export_openmetrics(PG_FUNCTION_ARGS)
+{
+	StringInfoData buf;
+
+	/* allocated before connecting, so that it survives SPI_finish */
+	initStringInfo(&buf);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	export_render(&buf, get_func_namespace(fcinfo->flinfo->fn_oid), false);
+
+	SPI_finish();
+
+	PG_RETURN_TEXT_P(cstring_to_text_with_len(buf.data, buf.len));
+}
+
+/*
+ * Information passed to the background worker (in bgw_extra). The schema
+ * is passed as OID, to leave as much space as possible for the path.
+ */
+typedef struct export_worker_extra_t {
+	Oid			database;
+	Oid			role;
+	Oid			nspid;				/* extension schema */
+	char		path[BGW_EXTRALEN - 3 * sizeof(Oid)];
+} export_worker_extra_t;
+
+PGDLLEXPORT void tinyhist_export_worker_main(Datum main_arg);
+
+/*
+ * tinyhist_export_worker_start
+ *		start a background worker writing metrics into a file
+ *
+ * The worker connects to the current database as the current user, and
+ * writes all registered metrics into the file every interval milliseconds.
+ * It runs until terminated (e.g. by pg_terminate_backend), and is not
+ * restarted after a failure.
+ */
+Datum
+tinyhist_export_worker_start(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	int32		interval = PG_GETARG_INT32(1);
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	export_worker_extra_t extra;
+	pid_t		pid;
+
+	StaticAssertStmt(sizeof(export_worker_extra_t) <= BGW_EXTRALEN,
+					 "export worker info does not fit into bgw_extra");
+
+	if (interval <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("export interval must be positive")));
+
+	if (!is_absolute_path(path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("export file path \"%s\" is not absolute", path)));
+
+	/* leave space for the suffix of the temporary file */
+	if (strlen(path) + strlen(".tmp") >= sizeof(extra.path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("export file path \"%s\" is too long", path)));
+
+	memset(&extra, 0, sizeof(extra));
+	extra.database = MyDatabaseId;
+	extra.role = GetUserId();
+	extra.nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	strlcpy(extra.path, path, sizeof(extra.path));
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "tinyhist");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "tinyhist_export_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "tinyhist export worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "tinyhist export worker");
+	worker.bgw_main_arg = Int32GetDatum(interval);
+	worker.bgw_notify_pid = MyProcPid;
+	memcpy(worker.bgw_extra, &extra, sizeof(extra));
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background worker"),
+				 errhint("Consider increasing max_worker_processes.")));
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+
+	if (status != BGWH_STARTED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start background worker")));
+
+	PG_RETURN_INT32(pid);
+}
+
+/*
+ * export_write_file
+ *		write the rendered metrics into a temporary file, and rename it
+ */
+static void
+export_write_file(const char *path, StringInfo buf)
+{
+	char	   *tmppath = psprintf("%s.tmp", path);
+	FILE	   *file;
+
+	file = AllocateFile(tmppath, PG_BINARY_W);
+
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", tmppath)));
+
+	if (fwrite(buf->data, 1, buf->len, file) != buf->len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+
+	if (FreeFile(file) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+
+	if (rename(tmppath, path) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						tmppath, path)));
+}
+
+/*
+ * tinyhist_export_worker_main
+ *		main loop of the worker writing metrics into a file
+ *
+ * The metrics are rendered in a transaction, and the file is written after
+ * the commit (so the transaction is not kept open during the I/O).
+ */
+void
+tinyhist_export_worker_main(Datum main_arg)
+{
+	int32		interval = DatumGetInt32(main_arg);
+	export_worker_extra_t extra;
+	MemoryContext context;
+
+	memcpy(&extra, MyBgworkerEntry->bgw_extra, sizeof(extra));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(extra.database, extra.role, 0);
+
+	context = AllocSetContextCreate(TopMemoryContext,
+									"tinyhist export",
+									ALLOCSET_DEFAULT_SIZES);
+
+	while (true)
+	{
+		StringInfoData buf;
+		MemoryContext oldcontext;
+
+		CHECK_FOR_INTERRUPTS();
+
+		MemoryContextReset(context);
+
+		oldcontext = MemoryContextSwitchTo(context);
+		initStringInfo(&buf);
+		MemoryContextSwitchTo(oldcontext);
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "tinyhist export");
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		export_render(&buf, extra.nspid, true);
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		export_write_file(extra.path, &buf);
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 interval, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * Durations collected from the server log, i.e. from messages written by
+ * log_min_duration_statement, auto_explain, log_autovacuum_min_duration and
+ * log_checkpoints into csvlog/jsonlog files.
+ *
+ * The new data in the log files is parsed incrementally, the durations are
+ * accumulated into histograms in memory (one per kind and key), and then
+ * added to histograms in the tinyhist_log_durations table. The amount of
+ * data processed for each file is tracked in the tinyhist_log_files table,
+ * updated in the same transaction, so that the processing resumes where
+ * it stopped (without reading the files again). The inode of the file is
+ * tracked too, so that a file replaced by a different one (with the same
+ * name) gets processed from the beginning.
+ *
+ * Concurrent collections (e.g. the worker and a manual call) would read
+ * the same data and add it twice, so the collection is serialized by an
+ * advisory lock (keyed by the OID of tinyhist_log_files), and the rows in
+ * tinyhist_log_files are locked too (which fails with a serialization
+ * error if a concurrent collection updated them under REPEATABLE READ).
+ */
+#define LOG_MAX_KIND	16					/* longest kind (with terminator) */
+#define LOG_MAX_KEY		1024				/* longest key (normalized statement) */
+#define LOG_MAX_READ	(64 * 1024 * 1024)	/* data read from a file in one round */
+
+/* csvlog field with the message */
+#define LOG_CSV_MESSAGE	13
+
+typedef struct log_entry_key_t {
+	char		kind[LOG_MAX_KIND];
+	char		key[LOG_MAX_KEY + 1];
+} log_entry_key_t;
+
+typedef struct log_entry_t {
+	log_entry_key_t key;
+	tinyhist_t	hist;
+} log_entry_t;
+
+/*
+ * log_normalize
+ *		normalize a statement into a key (literals replaced by '?')
+ *
+ * String and numeric literals are replaced, and whitespace is collapsed,
+ * so that executions with different parameters get the same key. The key
+ * is truncated to LOG_MAX_KEY bytes.
+ */
+static void
+log_normalize(StringInfo buf, const char *query, const char *end)
+{
+	const char *p = query;
+	bool		space = false;
+
+	while ((p < end) && (buf->len < LOG_MAX_KEY))
+	{
+		char		prev;
+
+		if (isspace((unsigned char) *p))
+		{
+			space = true;
+			p++;
+			continue;
+		}
+
+		if (space && (buf->len > 0))
+			appendStringInfoChar(buf, ' ');
+
+		space = false;
+		prev = (buf->len > 0) ? buf->data[buf->len - 1] : '\0';
+
+		if (*p == '\'')
+		{
+			/* string literal (with quotes escaped by doubling) */
+			p++;
+			while (p < end)
+			{
+				if ((*p == '\'') && (p + 1 < end) && (p[1] == '\''))
+					p += 2;
+				else if (*p++ == '\'')
+					break;
+			}
+
+			appendStringInfoChar(buf, '?');
+		}
+		else if (isdigit((unsigned char) *p) &&
+				 !isalnum((unsigned char) prev) && (prev != '_') && (prev != '$'))
+		{
+			/* numeric literal (digits in identifiers and parameters are kept) */
+			while ((p < end) && (isdigit((unsigned char) *p) || (*p == '.')))
+				p++;
+
+			if ((p < end) && ((*p == 'e') || (*p == 'E')))
+			{
+				p++;
+				if ((p < end) && ((*p == '+') || (*p == '-')))
+					p++;
+				while ((p < end) && isdigit((unsigned char) *p))
+					p++;
+			}
+
+			appendStringInfoChar(buf, '?');
+		}
+		else
+			appendStringInfoChar(buf, *p++);
+	}
+
+	/* the loop may stop in the middle of a multibyte character */
+	buf->len = Min(buf->len, pg_mbcliplen(buf->data, buf->len, LOG_MAX_KEY));
+	buf->data[buf->len] = '\0';
+}
+
+/*
+ * log_parse_seconds
+ *		parse duration in seconds after the prefix, and return it in ms
+ */
+static bool
+log_parse_seconds(const char *message, const char *prefix, double *duration)
+{
+	const char *str = strstr(message, prefix);
+	char	   *end;
+
+	if (str == NULL)
+		return false;
+
+	str += strlen(prefix);
+	*duration = strtod(str, &end) * 1000.0;
+
+	return (end != str) && (strncmp(end, " s", 2) == 0);
+}
+
+/*
+ * log_parse_message
+ *		extract duration (in ms) with a kind and key from a log message
+ *
+ * Recognizes these messages (returns false for all other messages):
+ *
+ * - log_min_duration_statement (kind "statement", the statement as key)
+ * - auto_explain (kind "auto_explain", first line of the query as key)
+ * - autovacuum/autoanalyze (kind "autovacuum" or "autoanalyze", the table
+ *   as key)
+ * - checkpoints and restartpoints (kind "checkpoint", key "checkpoint" or
+ *   "restartpoint")
+ */
+static bool
+log_parse_message(const char *message, const char **kind, StringInfo key,
+				  double *duration)
+{
+	resetStringInfo(key);
+
+	if (strncmp(message, "duration: ", 10) == 0)
+	{
+		const char *str = message + 10;
+		const char *query;
+		char	   *end;
+
+		*duration = strtod(str, &end);
+
+		if ((end == str) || (strncmp(end, " ms  ", 5) != 0))
+			return false;
+
+		str = end + 5;
+
+		if (strncmp(str, "statement: ", 11) == 0)
+		{
+			*kind = "statement";
+			query = str + 11;
+		}
+		else if ((strncmp(str, "execute ", 8) == 0) &&
+				 ((query = strstr(str, ": ")) != NULL))
+		{
+			*kind = "statement";
+			query += 2;
+		}
+		else if ((strncmp(str, "plan:", 5) == 0) &&
+				 ((query = strstr(str, "Query Text: ")) != NULL))
+		{
+			*kind = "auto_explain";
+			query += 12;
+
+			/* the plan follows the query, so use only the first line */
+			log_normalize(key, query, query + strcspn(query, "\n"));
+			return true;
+		}
+		else
+			return false;
+
+		log_normalize(key, query, query + strlen(query));
+		return true;
+	}
+	else if (strncmp(message, "automatic ", 10) == 0)
+	{
+		const char *table = strstr(message, " of table \"");
+
+		if ((table == NULL) || !log_parse_seconds(message, "elapsed: ", duration))
+			return false;
+
+		table += 11;
+
+		*kind = (strncmp(message + 10, "analyze", 7) == 0) ? "autoanalyze" : "autovacuum";
+		appendBinaryStringInfo(key, table, Min(strcspn(table, "\""), LOG_MAX_KEY));
+		return true;
+	}
+	else if ((strncmp(message, "checkpoint complete: ", 21) == 0) ||
+			 (strncmp(message, "restartpoint complete: ", 23) == 0))
+	{
+		if (!log_parse_seconds(message, "total=", duration))
+			return false;
+
+		*kind = "checkpoint";
+		appendBinaryStringInfo(key, message, strcspn(message, " "));
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * log_csv_record
+ *		extract message from a csvlog record, returns start of the next one
+ *
+ * Returns NULL if the record is incomplete (not fully written yet).
+ */
+static const char *
+log_csv_record(const char *start, const char *end, StringInfo message)
+{
+	int			field = 0;
+	bool		quoted = false;
+
+	resetStringInfo(message);
+
+	for (const char *p = start; p < end; p++)
+	{
+		if (quoted)
+		{
+			if (*p != '"')
+			{
+				if (field == LOG_CSV_MESSAGE)
+					appendStringInfoChar(message, *p);
+			}
+			else if (p + 1 == end)
+				return NULL;	/* can't tell if it's an escaped quote yet */
+			else if (p[1] == '"')
+			{
+				if (field == LOG_CSV_MESSAGE)
+					appendStringInfoChar(message, '"');
+				p++;
+			}
+			else
+				quoted = false;
+		}
+		else if (*p == '"')
+			quoted = true;
+		else if (*p == ',')
+			field++;
+		else if (*p == '\n')
+			return p + 1;
+		else if (field == LOG_CSV_MESSAGE)
+			appendStringInfoChar(message, *p);
+	}
+
+	return NULL;
+}
+
+/*
+ * log_json_record
+ *		extract message from a jsonlog record, returns start of the next one
+ *
+ * Each record is a JSON object on a single line. Returns NULL if the line
+ * is incomplete (not fully written yet).
+ */
+static const char *
+log_json_record(const char *start, const char *end, StringInfo message)
+{
+	const char *eol = memchr(start, '\n', end - start);
+	const char *p;
+	char	   *line;
+
+	resetStringInfo(message);
+
+	if (eol == NULL)
+		return NULL;
+
+	line = pnstrdup(start, eol - start);
+
+	/* escaped quotes in values can't match the key (including the quotes) */
+	if ((p = strstr(line, "\"message\":\"")) == NULL)
+	{
+		pfree(line);
+		return eol + 1;
+	}
+
+	for (p += 11; *p && (*p != '"'); p++)
+	{
+		if (*p != '\\')
+		{
+			appendStringInfoChar(message, *p);
+			continue;
+		}
+
+		switch (*++p)
+		{
+			case 'b':
+				appendStringInfoChar(message, '\b');
+				break;
+			case 'f':
+				appendStringInfoChar(message, '\f');
+				break;
+			case 'n':
+				appendStringInfoChar(message, '\n');
+				break;
+			case 'r':
+				appendStringInfoChar(message, '\r');
+				break;
+			case 't':
+				appendStringInfoChar(message, '\t');
+				break;
+			case 'u':
+				{
+					/* only control characters are escaped this way */
+					char		hex[5] = {0};
+					long		code;
+
+					strlcpy(hex, p + 1, sizeof(hex));
+					code = strtol(hex, NULL, 16);
+					appendStringInfoChar(message, (code < 0x80) ? (char) code : '?');
+					p += strlen(hex);
+					break;
+				}
+			case '\0':
+				p--;
+				break;
+			default:
+				appendStringInfoChar(message, *p);
+				break;
+		}
+	}
+
+	pfree(line);
+
+	return eol + 1;
+}
+
+/*
+ * log_collect_file
+ *		collect durations from new data in a log file
+ *
+ * Starts at the position, and advances it to the end of the last complete
+ * record. If the inode does not match, it's a different file, and it's
+ * processed from the beginning (the inode gets updated). Returns the number
+ * of collected durations.
+ */
+static int64
+log_collect_file(const char *path, bool json, int64 *position, int64 *inode,
+				 HTAB *entries)
+{
+	struct stat st;
+	FILE	   *file;
+	char	   *data;
+	size_t		len;
+	const char *p;
+	const char *end;
+	StringInfoData message;
+	StringInfoData key;
+	int64		count = 0;
+
+	if (stat(path, &st) != 0)
+	{
+		/* the file may have been removed since reading the directory */
+		if (errno == ENOENT)
+			return 0;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+	}
+
+	/* a different file with the same name (e.g. after a rotation), start over */
+	if ((int64) st.st_ino != *inode)
+	{
+		*position = 0;
+		*inode = (int64) st.st_ino;
+	}
+
+	/* the file got truncated (e.g. reused after a rotation), start over */
+	if (st.st_size < *position)
+		*position = 0;
+
+	len = Min(st.st_size - *position, LOG_MAX_READ);
+
+	if (len == 0)
+		return 0;
+
+	file = AllocateFile(path, PG_BINARY_R);
+
+	if ((file == NULL) && (errno == ENOENT))
+		return 0;
+
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m", path)));
+
+	if (fseeko(file, *position, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m", path)));
+
+	data = palloc(len + 1);
+	len = fread(data, 1, len, file);
+	data[len] = '\0';
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+
+	FreeFile(file);
+
+	initStringInfo(&message);
+	initStringInfo(&key);
+
+	p = data;
+	end = data + len;
+
+	while (p < end)
+	{
+		const char *next;
+		const char *kind;
+		double		duration;
+
+		if (json)
+			next = log_json_record(p, end, &message);
+		else
+			next = log_csv_record(p, end, &message);
+
+		if (next == NULL)
+			break;
+
+		/* keys with invalid data in the database encoding are ignored */
+		if (log_parse_message(message.data, &kind, &key, &duration) &&
+			pg_verifymbstr(key.data, key.len, true))
+		{
+			log_entry_key_t entry_key;
+			log_entry_t *entry;
+			bool		found;
+
+			memset(&entry_key, 0, sizeof(entry_key));
+			strlcpy(entry_key.kind, kind, LOG_MAX_KIND);
+			strlcpy(entry_key.key, key.data, LOG_MAX_KEY + 1);
+
+			entry = hash_search(entries, &entry_key, HASH_ENTER, &found);
+
+			if (!found)
+				memset(&entry->hist, 0, sizeof(tinyhist_t));
+
+			/* durations beyond the largest bucket go to the last one */
+			hist_add(&entry->hist, Min(duration, ldexp(1.0, HISTOGRAM_MAX_UNIT + HISTOGRAM_BUCKETS - 1)));
+			count++;
+		}
+
+		p = next;
+	}
+
+	/* a record longer than the read limit would block the file forever */
+	if ((p == data) && (len == LOG_MAX_READ))
+	{
+		ereport(WARNING,
+				(errmsg("skipping incomplete record in file \"%s\" longer than %d bytes",
+						path, LOG_MAX_READ)));
+		p = end;
+	}
+
+	*position += (p - data);
+
+	pfree(data);
+
+	return count;
+}
+
+/*
+ * log_file_cmp
+ *		compare log file names (names with timestamps sort chronologically)
+ */
+static int
+log_file_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * log_collect
+ *		collect durations from all log files (in an existing SPI connection)
+ *
+ * Returns the number of collected durations.
+ */
+static int64
+log_collect(Oid nspid)
+{
+	const char *schema = quote_identifier(get_namespace_name(nspid));
+	HASHCTL		ctl;
+	HTAB	   *entries;
+	HASH_SEQ_STATUS status;
+	log_entry_t *entry;
+	DIR		   *dir;
+	struct dirent *de;
+	char	  **files = NULL;
+	Datum	   *paths;
+	int			nfiles = 0;
+	int64		count = 0;
+	Oid			file_types[3] = {TEXTOID, INT8OID, INT8OID};
+	Oid			paths_types[1] = {TEXTARRAYOID};
+	Oid			hist_types[3] = {TEXTOID, TEXTOID, TEXTOID};
+	Datum		args[3];
+	int			ret;
+
+	if (!Logging_collector)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("durations can be collected only with logging_collector enabled")));
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(log_entry_key_t);
+	ctl.entrysize = sizeof(log_entry_t);
+	ctl.hcxt = CurrentMemoryContext;
+
+	entries = hash_create("tinyhist log durations", 256, &ctl,
+						  HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	/* serialize with concurrent collections (held until the end of transaction) */
+	ret = SPI_execute(psprintf("SELECT pg_catalog.pg_advisory_xact_lock('%s.tinyhist_log_files'::pg_catalog.regclass::pg_catalog.oid::pg_catalog.int8)",
+							   schema),
+					  false, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to lock log files: %s",
+			 SPI_result_code_string(ret));
+
+	/* csvlog and jsonlog files, in chronological order */
+	dir = AllocateDir(Log_directory);
+
+	while ((de = ReadDir(dir, Log_directory)) != NULL)
+	{
+		if (!pg_str_endswith(de->d_name, ".csv") && !pg_str_endswith(de->d_name, ".json"))
+			continue;
+
+		files = (files == NULL) ? palloc(sizeof(char *)) :
+			repalloc(files, (nfiles + 1) * sizeof(char *));
+
+		files[nfiles++] = psprintf("%s/%s", Log_directory, de->d_name);
+	}
+
+	FreeDir(dir);
+
+	if (nfiles > 0)
+		qsort(files, nfiles, sizeof(char *), log_file_cmp);
+
+	paths = palloc((nfiles + 1) * sizeof(Datum));
+
+	for (int i = 0; i < nfiles; i++)
+	{
+		int64		position = 0;
+		int64		inode = 0;
+		bool		isnull;
+
+		paths[i] = CStringGetTextDatum(files[i]);
+		args[0] = paths[i];
+
+		ret = SPI_execute_with_args(psprintf("SELECT bytes_processed, inode FROM %s.tinyhist_log_files WHERE file = $1 FOR UPDATE", schema),
+									1, file_types, args, NULL, false, 1);
+
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "failed to look up log file: %s",
+				 SPI_result_code_string(ret));
+
+		if (SPI_processed == 1)
+		{
+			position = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+												   SPI_tuptable->tupdesc, 1, &isnull));
+			inode = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+												SPI_tuptable->tupdesc, 2, &isnull));
+		}
+
+		count += log_collect_file(files[i], pg_str_endswith(files[i], ".json"),
+								  &position, &inode, entries);
+
+		args[1] = Int64GetDatum(position);
+		args[2] = Int64GetDatum(inode);
+
+		ret = SPI_execute_with_args(psprintf("INSERT INTO %s.tinyhist_log_files VALUES ($1, $2, $3) "
+											 "ON CONFLICT (file) DO UPDATE SET bytes_processed = excluded.bytes_processed, "
+											 "inode = excluded.inode",
+											 schema),
+									3, file_types, args, NULL, false, 0);
+
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "failed to update log file: %s",
+				 SPI_result_code_string(ret));
+	}
+
+	/* forget files removed from the log directory */
+	args[0] = PointerGetDatum(construct_array(paths, nfiles, TEXTOID, -1, false, TYPALIGN_INT));
+
+	ret = SPI_execute_with_args(psprintf("DELETE FROM %s.tinyhist_log_files WHERE file <> ALL ($1)", schema),
+								1, paths_types, args, NULL, false, 0);
+
+	if (ret != SPI_OK_DELETE)
+		elog(ERROR, "failed to remove log files: %s",
+			 SPI_result_code_string(ret));
+
+	/* add the collected histograms to the stored ones */
+	hash_seq_init(&status, entries);
+
+	while ((entry = (log_entry_t *) hash_seq_search(&status)) != NULL)
+	{
+		args[0] = CStringGetTextDatum(entry->key.kind);
+		args[1] = CStringGetTextDatum(entry->key.key);
+		args[2] = CStringGetTextDatum(DatumGetCString(DirectFunctionCall1(tinyhist_out,
+																		   PointerGetDatum(&entry->hist))));
+
+		ret = SPI_execute_with_args(psprintf("INSERT INTO %s.tinyhist_log_durations AS d VALUES ($1, $2, $3::%s.tinyhist) "
+											 "ON CONFLICT (kind, key) DO UPDATE SET hist = d.hist OPERATOR(%s.+) excluded.hist",
+											 schema, schema, schema),
+									3, hist_types, args, NULL, false, 0);
+
+		if (ret != SPI_OK_INSERT)
+			elog(ERROR, "failed to add log durations: %s",
+				 SPI_result_code_string(ret));
+	}
+
+	hash_destroy(entries);
+
+	return count;
+}
+
+/*
+ * tinyhist_log_parse
+ *		extract the kind, key and duration (in ms) from a log message
+ */
+Datum
+tinyhist_log_parse(PG_FUNCTION_ARGS)
+{
+	char	   *message = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {0};
+	const char *kind;
+	StringInfoData key;
+	double		duration;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	initStringInfo(&key);
+
+	if (!log_parse_message(message, &kind, &key, &duration))
+		PG_RETURN_NULL();
+
+	values[0] = CStringGetTextDatum(kind);
+	values[1] = CStringGetTextDatum(key.data);
+	values[2] = Float8GetDatum(duration);
+
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* state for the tinyhist_log_records SRF */
+typedef struct log_records_state_t
+{
+	TupleDesc	tupdesc;
+	char	   *data;
+	int64		len;
+	int64		position;		/* start of the next record */
+	bool		json;
+} log_records_state_t;
+
+/*
+ * tinyhist_log_records
+ *		extract messages from csvlog/jsonlog data
+ *
+ * Returns one row per complete record, with the message and the amount of
+ * data processed after the record (i.e. the position the collection would
+ * resume from). An incomplete record at the end is not returned.
+ */
+Datum
+tinyhist_log_records(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	log_records_state_t *state;
+	StringInfoData message;
+	const char *next;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext mctx;
+		text	   *data = PG_GETARG_TEXT_PP(0);
+		char	   *format = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+		fctx = SRF_FIRSTCALL_INIT();
+
+		mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+		state = palloc0(sizeof(log_records_state_t));
+
+		if (get_call_result_type(fcinfo, NULL, &state->tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		state->tupdesc = BlessTupleDesc(state->tupdesc);
+
+		if (strcmp(format, "csvlog") == 0)
+			state->json = false;
+		else if (strcmp(format, "jsonlog") == 0)
+			state->json = true;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid log format \"%s\"", format),
+					 errhint("Valid formats are \"csvlog\" and \"jsonlog\".")));
+
+		state->len = VARSIZE_ANY_EXHDR(data);
+		state->data = pnstrdup(VARDATA_ANY(data), state->len);
+
+		fctx->user_fctx = state;
+
+		MemoryContextSwitchTo(mctx);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	state = (log_records_state_t *) fctx->user_fctx;
+
+	initStringInfo(&message);
+
+	if (state->json)
+		next = log_json_record(state->data + state->position,
+							   state->data + state->len, &message);
+	else
+		next = log_csv_record(state->data + state->position,
+							  state->data + state->len, &message);
+
+	if (next != NULL)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {0};
+
+		state->position = (next - state->data);
+
+		values[0] = CStringGetTextDatum(message.data);
+		values[1] = Int64GetDatum(state->position);
+
+		SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(heap_form_tuple(state->tupdesc, values, nulls)));
+	}
+	else
+		SRF_RETURN_DONE(fctx);
+}
+
+/*
+ * tinyhist_log_collect
+ *		collect durations from new data in the log files
+ */
+Datum
+tinyhist_log_collect(PG_FUNCTION_ARGS)
+{
+	int64		count;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	count = log_collect(get_func_namespace(fcinfo->flinfo->fn_oid));
+
+	SPI_finish();
+
+	PG_RETURN_INT64(count);
+}
+
+/*
+ * Information passed to the background worker (in bgw_extra).
+ */
+typedef struct log_worker_extra_t {
+	Oid			database;
+	Oid			role;
+	Oid			nspid;				/* extension schema */
+} log_worker_extra_t;
+
+PGDLLEXPORT void tinyhist_log_worker_main(Datum main_arg);
+
+/*
+ * tinyhist_log_worker_start
+ *		start a background worker collecting durations from the log files
+ *
+ * The worker connects to the current database as the current user, and
+ * collects durations from new data in the log files every interval
+ * milliseconds. It runs until terminated (e.g. by pg_terminate_backend),
+ * and is not restarted after a failure.
+ */
+Datum
+tinyhist_log_worker_start(PG_FUNCTION_ARGS)
+{
+	int32		interval = PG_GETARG_INT32(0);
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	log_worker_extra_t extra;
+	pid_t		pid;
+
+	StaticAssertStmt(sizeof(log_worker_extra_t) <= BGW_EXTRALEN,
+					 "log worker info does not fit into bgw_extra");
+
+	if (interval <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("collection interval must be positive")));
+
+	memset(&extra, 0, sizeof(extra));
+	extra.database = MyDatabaseId;
+	extra.role = GetUserId();
+	extra.nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "tinyhist");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "tinyhist_log_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "tinyhist log worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "tinyhist log worker");
+	worker.bgw_main_arg = Int32GetDatum(interval);
+	worker.bgw_notify_pid = MyProcPid;
+	memcpy(worker.bgw_extra, &extra, sizeof(extra));
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONFIGURATION_LIMIT_EXCEEDED),
+				 errmsg("could not register background worker"),
+				 errhint("Consider increasing max_worker_processes.")));
+
+	status = WaitForBackgroundWorkerStartup(handle, &pid);
+
+	if (status != BGWH_STARTED)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+				 errmsg("could not start background worker")));
+
+	PG_RETURN_INT32(pid);
+}
+
+/*
+ * tinyhist_log_worker_main
+ *		main loop of the worker collecting durations from the log files
+ */
+void
+tinyhist_log_worker_main(Datum main_arg)
+{
+	int32		interval = DatumGetInt32(main_arg);
+	log_worker_extra_t extra;
+
+	memcpy(&extra, MyBgworkerEntry->bgw_extra, sizeof(extra));
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(extra.database, extra.role, 0);
+
+	while (true)
+	{
+		int64		count;
+
+		CHECK_FOR_INTERRUPTS();
+
+		SetCurrentStatementStartTimestamp();
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		pgstat_report_activity(STATE_RUNNING, "tinyhist log collection");
+
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		count = log_collect(extra.nspid);
+
+		elog(DEBUG1, "collected " INT64_FORMAT " durations from log files", count);
+
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		pgstat_report_activity(STATE_IDLE, NULL);
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 interval, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
+
+/*
+ * Routing of tinyhist_agg queries to rollup tables.
+ *
+ * Rollup tables store histograms for intervals of a time column of a raw
+ * table (with the same grouping columns), registered in tinyhist_rollups.
+ * For a query like
+ *
+ *     SELECT g, tinyhist_agg(v) FROM raw
+ *      WHERE ts >= '...' AND ts < '...' GROUP BY g
+ *
+ * the planner hook plans this query instead
+ *
+ *     SELECT r.g, tinyhist_agg(r.h)
+ *       FROM (SELECT g, hist FROM rollup
+ *              WHERE bucket >= lower_full AND bucket < upper_full
+ *             UNION ALL
+ *             SELECT g, tinyhist_agg(v) FROM raw
+ *              WHERE ts >= '...' AND ts < '...'
+ *                AND (ts < lower_full OR ts >= upper_full)
+ *              GROUP BY g) r(g, h)
+ *      GROUP BY r.g
+ *
+ * i.e. the full intervals are merged from the rollup, and only the partial
+ * intervals at the edges are read from the raw table. The rollup buckets
+ * are expected to be date_bin(granularity, ts, origin), and the rollup has
+ * to be complete for the intervals.
+ *
+ * Only queries on a single table with tinyhist_agg of a single column,
+ * grouping by plain columns, and a range condition on the time column (of
+ * type timestamptz, with constant boundaries) are routed. ORDER BY output
+ * columns is allowed. Other queries are planned as usual.
+ */
+typedef struct rollup_query_t {
+	Oid			relid;			/* raw table */
+	bool		inh;			/* include child tables? */
+	Oid			nspid;			/* schema of tinyhist_agg */
+	AttrNumber	timeattr;		/* time column */
+	AttrNumber	valueattr;		/* aggregated column */
+	Datum		lower;			/* time >= lower */
+	Datum		upper;			/* time < upper */
+	List	   *keys;			/* attnums of grouping keys */
+	Aggref	   *aggref;			/* tinyhist_agg call (first one) */
+} rollup_query_t;
+
+/*
+ * rollup_column_var
+ *		attnum of a plain column of the (only) relation, or 0
+ */
+static AttrNumber
+rollup_column_var(Expr *expr)
+{
+	Var		   *var = (Var *) expr;
+
+	if (!IsA(expr, Var) || (var->varno != 1) || (var->varlevelsup != 0) ||
+		(var->varattno <= 0))
+		return 0;
+
+	return var->varattno;
+}
+
+/*
+ * rollup_match_range
+ *		match the WHERE clause "time >= lower AND time < upper"
+ */
+static bool
+rollup_match_range(Node *quals, rollup_query_t *rq)
+{
+	TypeCacheEntry *typentry = lookup_type_cache(TIMESTAMPTZOID, TYPECACHE_BTREE_OPFAMILY);
+	ListCell   *lc;
+	bool		has_lower = false;
+	bool		has_upper = false;
+
+	if (quals == NULL)
+		return false;
+
+	foreach(lc, make_ands_implicit((Expr *) quals))
+	{
+		OpExpr	   *opexpr = (OpExpr *) lfirst(lc);
+		Const	   *value;
+		AttrNumber	attnum;
+		int			strategy;
+
+		if (!IsA(opexpr, OpExpr) || (list_length(opexpr->args) != 2) ||
+			!IsA(lsecond(opexpr->args), Const))
+			return false;
+
+		attnum = rollup_column_var((Expr *) linitial(opexpr->args));
+		value = (Const *) lsecond(opexpr->args);
+
+		if ((attnum == 0) || value->constisnull ||
+			(exprType(linitial(opexpr->args)) != TIMESTAMPTZOID) ||
+			(value->consttype != TIMESTAMPTZOID))
+			return false;
+
+		if ((rq->timeattr != 0) && (rq->timeattr != attnum))
+			return false;
+
+		rq->timeattr = attnum;
+
+		/* only the regular timestamptz comparison operators */
+		strategy = get_op_opfamily_strategy(opexpr->opno, typentry->btree_opf);
+
+		if ((strategy == BTGreaterEqualStrategyNumber) && !has_lower)
+		{
+			rq->lower = value->constvalue;
+			has_lower = true;
+		}
+		else if ((strategy == BTLessStrategyNumber) && !has_upper)
+		{
+			rq->upper = value->constvalue;
+			has_upper = true;
+		}
+		else
+			return false;
+	}
+
+	return has_lower && has_upper;
+}
+
+/*
+ * rollup_match
+ *		check the query can be routed to a rollup, and extract the details
+ */
+static bool
+rollup_match(Query *parse, rollup_query_t *rq)
+{
+	RangeTblEntry *rte;
+	ListCell   *lc;
+
+	memset(rq, 0, sizeof(rollup_query_t));
+
+	/* simple aggregate queries only */
+	if ((parse->commandType != CMD_SELECT) || (parse->utilityStmt != NULL) ||
+		!parse->hasAggs || parse->hasWindowFuncs || parse->hasTargetSRFs ||
+		parse->hasSubLinks || parse->hasDistinctOn || parse->hasForUpdate ||
+		parse->hasRowSecurity || (parse->cteList != NIL) ||
+		(parse->groupingSets != NIL) || (parse->havingQual != NULL) ||
+		(parse->distinctClause != NIL) || (parse->setOperations != NULL) ||
+		(parse->limitCount != NULL) || (parse->limitOffset != NULL) ||
+		(parse->rowMarks != NIL))
+		return false;
+
+	/* a single plain table */
+	if ((list_length(parse->rtable) != 1) ||
+		(list_length(parse->jointree->fromlist) != 1) ||
+		!IsA(linitial(parse->jointree->fromlist), RangeTblRef))
+		return false;
+
+	rte = (RangeTblEntry *) linitial(parse->rtable);
+
+	if ((rte->rtekind != RTE_RELATION) || (rte->tablesample != NULL) ||
+		(rte->securityQuals != NIL) ||
+		((rte->relkind != RELKIND_RELATION) &&
+		 (rte->relkind != RELKIND_PARTITIONED_TABLE) &&
+		 (rte->relkind != RELKIND_MATVIEW)))
+		return false;
+
+	rq->relid = rte->relid;
+	rq->inh = rte->inh;
+
+	/* grouping keys have to be plain columns */
+	foreach(lc, parse->groupClause)
+	{
+		SortGroupClause *sgc = (SortGroupClause *) lfirst(lc);
+		AttrNumber	attnum;
+
+		attnum = rollup_column_var((Expr *) get_sortgroupclause_expr(sgc, parse->targetList));
+
+		if (attnum == 0)
+			return false;
+
+		rq->keys = lappend_int(rq->keys, attnum);
+	}
+
+	/* output columns have to be grouping keys or tinyhist_agg calls */
+	foreach(lc, parse->targetList)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		AttrNumber	attnum = rollup_column_var(tle->expr);
+
+		if (tle->resjunk)
+			return false;
+
+		if ((attnum != 0) && list_member_int(rq->keys, attnum))
+			continue;
+		else if (IsA(tle->expr, Aggref))
+		{
+			Expr	   *arg = tinyhist_agg_arg((Aggref *) tle->expr);
+
+			if ((arg == NULL) || (exprType((Node *) arg) != FLOAT8OID))
+				return false;
+
+			/* the value may be implicitly cast to double precision */
+			if (IsA(arg, FuncExpr) &&
+				(((FuncExpr *) arg)->funcformat == COERCE_IMPLICIT_CAST) &&
+				(list_length(((FuncExpr *) arg)->args) == 1))
+				arg = (Expr *) linitial(((FuncExpr *) arg)->args);
+
+			attnum = rollup_column_var(arg);
+
+			/* all aggregates have to be on the same column */
+			if ((attnum == 0) || ((rq->valueattr != 0) && (rq->valueattr != attnum)))
+				return false;
+
+			rq->valueattr = attnum;
+			rq->nspid = get_func_namespace(((Aggref *) tle->expr)->aggfnoid);
+
+			if (rq->aggref == NULL)
+				rq->aggref = (Aggref *) tle->expr;
+		}
+		else
+			return false;
+	}
+
+	if (rq->valueattr == 0)
+		return false;
+
+	return rollup_match_range(parse->jointree->quals, rq);
+}
+
+/*
+ * rollup_bin
+ *		start of the interval (with the stride in microseconds) containing
+ *		the timestamp, same as date_bin (not available before PG14)
+ *
+ * Returns false if the result (or an intermediate value) is out of range.
+ */
+static bool
+rollup_bin(int64 stride, TimestampTz value, TimestampTz origin,
+		   TimestampTz *result)
+{
+	int64		diff;
+	int64		delta;
+
+	if (pg_sub_s64_overflow(value, origin, &diff))
+		return false;
+
+	delta = diff - diff % stride;
+
+	/* round towards minus infinity for timestamps before the origin */
+	if ((diff < 0) && (diff % stride != 0) &&
+		pg_sub_s64_overflow(delta, stride, &delta))
+		return false;
+
+	if (pg_add_s64_overflow(origin, delta, result))
+		return false;
+
+	return IS_VALID_TIMESTAMP(*result);
+}
+
+/*
+ * rollup_time_cond
+ *		condition comparing a timestamptz expression with a constant, using
+ *		the btree operator with the given strategy
+ */
+static Expr *
+rollup_time_cond(Expr *expr, int strategy, TimestampTz value)
+{
+	TypeCacheEntry *typentry = lookup_type_cache(TIMESTAMPTZOID, TYPECACHE_BTREE_OPFAMILY);
+	OpExpr	   *opexpr;
+	Oid			opno;
+
+	opno = get_opfamily_member(typentry->btree_opf, TIMESTAMPTZOID,
+							   TIMESTAMPTZOID, strategy);
+
+	if (!OidIsValid(opno))
+		elog(ERROR, "missing operator %d for type %u", strategy, TIMESTAMPTZOID);
+
+	opexpr = (OpExpr *) make_opclause(opno, BOOLOID, false, expr,
+									  (Expr *) makeConst(TIMESTAMPTZOID, -1, InvalidOid,
+														 sizeof(TimestampTz),
+														 TimestampTzGetDatum(value),
+														 false, FLOAT8PASSBYVAL),
+									  InvalidOid, InvalidOid);
+	set_opfuncid(opexpr);
+
+	return (Expr *) opexpr;
+}
+
+/*
+ * rollup_build_query
+ *		build the query using a rollup (returns NULL if the rollup can't be
+ *		used for the query)
+ *
+ * The rollup has to have columns with the same names and types as the
+ * grouping keys, and there has to be at least one full interval.
+ *
+ * The query is built directly as a Query tree (as produced by the parser
+ * and rewriter), with the union of the rollup and raw table subqueries as
+ * the only range table entry of the outer query. The outer query is a copy
+ * of the original one, so the output columns, grouping and sorting remain
+ * the same, only referencing the subquery instead of the raw table.
+ */
+static Query *
+rollup_build_query(Query *parse, rollup_query_t *rq, Oid rollup,
+				   const char *bucket, const char *hist,
+				   Datum granularity, Datum origin)
+{
+	Interval   *interval = DatumGetIntervalP(granularity);
+	AttrNumber	attnum;
+	Oid			histtype;
+	Oid			aggfnoid;
+	int64		stride;
+	TimestampTz lower;
+	TimestampTz upper;
+	int			nkeys = list_length(rq->keys);
+	ParseState *pstate;
+	ParseNamespaceItem *nsitem;
+	Relation	rel;
+	RangeTblRef *rtr;
+	SetOperationStmt *setop;
+	Query	   *rollup_query;
+	Query	   *raw_query;
+	Query	   *union_query;
+	Query	   *query;
+	List	   *colnames = NIL;
+	List	   *quals;
+	Var		   *var;
+	Aggref	   *aggref;
+	ListCell   *lc;
+	int			idx;
+
+	if (pg_class_aclcheck(rollup, GetUserId(), ACL_SELECT) != ACLCHECK_OK)
+		return NULL;
+
+	/*
+	 * The query is not rewritten, so the rollup has to be a plain table
+	 * without row level security.
+	 */
+	if (((get_rel_relkind(rollup) != RELKIND_RELATION) &&
+		 (get_rel_relkind(rollup) != RELKIND_PARTITIONED_TABLE) &&
+		 (get_rel_relkind(rollup) != RELKIND_MATVIEW)) ||
+		(check_enable_rls(rollup, InvalidOid, true) != RLS_NONE))
+		return NULL;
+
+	/* bucket and histogram columns */
+	attnum = get_attnum(rollup, bucket);
+
+	if ((attnum == InvalidAttrNumber) || (get_atttype(rollup, attnum) != TIMESTAMPTZOID))
+		return NULL;
+
+	attnum = get_attnum(rollup, hist);
+
+	if (attnum == InvalidAttrNumber)
+		return NULL;
+
+	histtype = get_atttype(rollup, attnum);
+
+	if (!export_is_hist_type(histtype, rq->nspid))
+		return NULL;
+
+	/* tinyhist_agg merging the histograms */
+	aggfnoid = LookupFuncName(list_make2(makeString(get_namespace_name(rq->nspid)),
+										 makeString("tinyhist_agg")),
+							  1, &histtype, true);
+
+	if (!OidIsValid(aggfnoid))
+		return NULL;
+
+	/* full intervals within the range (days are 24h, as in date_bin) */
+	if ((interval->month != 0) ||
+		pg_mul_s64_overflow(interval->day, USECS_PER_DAY, &stride) ||
+		pg_add_s64_overflow(stride, interval->time, &stride) ||
+		(stride <= 0) ||
+		TIMESTAMP_NOT_FINITE(DatumGetTimestampTz(rq->lower)) ||
+		TIMESTAMP_NOT_FINITE(DatumGetTimestampTz(rq->upper)))
+		return NULL;
+
+	if (!rollup_bin(stride, DatumGetTimestampTz(rq->lower), DatumGetTimestampTz(origin), &lower))
+		return NULL;
+
+	if ((lower != DatumGetTimestampTz(rq->lower)) &&
+		pg_add_s64_overflow(lower, stride, &lower))
+		return NULL;
+
+	if (!rollup_bin(stride, DatumGetTimestampTz(rq->upper), DatumGetTimestampTz(origin), &upper))
+		return NULL;
+
+	if (upper <= lower)
+		return NULL;
+
+	/* full intervals from the rollup */
+	pstate = make_parsestate(NULL);
+
+	rel = table_open(rollup, AccessShareLock);
+	nsitem = addRangeTableEntryForRelation(pstate, rel, AccessShareLock,
+										   NULL, true, true);
+	table_close(rel, NoLock);
+
+	rollup_query = makeNode(Query);
+	rollup_query->commandType = CMD_SELECT;
+	rollup_query->querySource = QSRC_ORIGINAL;
+	rollup_query->canSetTag = true;
+	rollup_query->rtable = pstate->p_rtable;
+#if PG_VERSION_NUM >= 160000
+	rollup_query->rteperminfos = pstate->p_rteperminfos;
+#endif
+
+	/* the grouping keys have to match columns of the rollup */
+	idx = 0;
+	foreach(lc, rq->keys)
+	{
+		char	   *name = get_attname(rq->relid, lfirst_int(lc), false);
+		Oid			typid;
+		int32		typmod;
+		Oid			collid;
+
+		if (get_attnum(rollup, name) == InvalidAttrNumber)
+			return NULL;
+
+		/* same type and collation, so that the groups are the same */
+		get_atttypetypmodcoll(rq->relid, lfirst_int(lc), &typid, &typmod, &collid);
+
+		var = (Var *) scanNSItemForColumn(pstate, nsitem, 0, name, -1);
+
+		if ((var->vartype != typid) || (var->varcollid != collid))
+			return NULL;
+
+		/* the subquery columns are named k0, ..., h (to not clash) */
+		colnames = lappend(colnames, makeString(psprintf("k%d", idx)));
+
+		rollup_query->targetList = lappend(rollup_query->targetList,
+										   makeTargetEntry((Expr *) var, idx + 1,
+														   strVal(llast(colnames)),
+														   false));
+		idx++;
+	}
+
+	colnames = lappend(colnames, makeString("h"));
+
+	rollup_query->targetList = lappend(rollup_query->targetList,
+									   makeTargetEntry((Expr *) scanNSItemForColumn(pstate, nsitem, 0, hist, -1),
+													   nkeys + 1, "h", false));
+
+	var = (Var *) scanNSItemForColumn(pstate, nsitem, 0, bucket, -1);
+
+	quals = list_make2(rollup_time_cond((Expr *) var, BTGreaterEqualStrategyNumber, lower),
+					   rollup_time_cond((Expr *) copyObject(var), BTLessStrategyNumber, upper));
+
+	rtr = makeNode(RangeTblRef);
+	rtr->rtindex = 1;
+
+	rollup_query->jointree = makeFromExpr(list_make1(rtr), (Node *) make_ands_explicit(quals));
+
+	/*
+	 * Partial intervals from the raw table. This is the original query,
+	 * with the grouping keys and tinyhist_agg as output columns, and with
+	 * the full intervals excluded.
+	 */
+	raw_query = copyObject(parse);
+	raw_query->canSetTag = true;
+	raw_query->targetList = NIL;
+	raw_query->groupClause = NIL;
+	raw_query->sortClause = NIL;
+
+	idx = 0;
+	foreach(lc, parse->groupClause)
+	{
+		SortGroupClause *sgc = copyObject(lfirst_node(SortGroupClause, lc));
+		TargetEntry *tle;
+
+		tle = makeTargetEntry((Expr *) copyObject(get_sortgroupclause_expr(sgc, parse->targetList)),
+							  idx + 1, strVal(list_nth(colnames, idx)), false);
+
+		tle->ressortgroupref = idx + 1;
+		sgc->tleSortGroupRef = idx + 1;
+
+		raw_query->targetList = lappend(raw_query->targetList, tle);
+		raw_query->groupClause = lappend(raw_query->groupClause, sgc);
+		idx++;
+	}
+
+	raw_query->targetList = lappend(raw_query->targetList,
+									makeTargetEntry((Expr *) copyObject(rq->aggref),
+													nkeys + 1, "h", false));
+
+	var = makeVar(1, rq->timeattr, TIMESTAMPTZOID, -1, InvalidOid, 0);
+
+	quals = list_make2(copyObject(parse->jointree->quals),
+					   make_orclause(list_make2(rollup_time_cond((Expr *) var, BTLessStrategyNumber, lower),
+												rollup_time_cond((Expr *) copyObject(var), BTGreaterEqualStrategyNumber, upper))));
+
+	raw_query->jointree->quals = (Node *) make_ands_explicit(quals);
+
+	/* UNION ALL of the two subqueries */
+	pstate = make_parsestate(NULL);
+
+	addRangeTableEntryForSubquery(pstate, rollup_query, makeAlias("*SELECT* 1", NIL),
+								  false, false);
+	addRangeTableEntryForSubquery(pstate, raw_query, makeAlias("*SELECT* 2", NIL),
+								  false, false);
+
+	setop = makeNode(SetOperationStmt);
+	setop->op = SETOP_UNION;
+	setop->all = true;
+	setop->larg = (Node *) makeNode(RangeTblRef);
+	((RangeTblRef *) setop->larg)->rtindex = 1;
+	setop->rarg = (Node *) makeNode(RangeTblRef);
+	((RangeTblRef *) setop->rarg)->rtindex = 2;
+
+	union_query = makeNode(Query);
+	union_query->commandType = CMD_SELECT;
+	union_query->querySource = QSRC_ORIGINAL;
+	union_query->canSetTag = true;
+	union_query->rtable = pstate->p_rtable;
+	union_query->jointree = makeFromExpr(NIL, NULL);
+	union_query->setOperations = (Node *) setop;
+
+	/* the typmods may differ, like in a union of columns built by the parser */
+	idx = 0;
+	foreach(lc, rollup_query->targetList)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+		TargetEntry *raw_tle = list_nth_node(TargetEntry, raw_query->targetList, idx);
+		Oid			typid = exprType((Node *) tle->expr);
+		int32		typmod = exprTypmod((Node *) tle->expr);
+		Oid			collid = exprCollation((Node *) tle->expr);
+
+		if (typmod != exprTypmod((Node *) raw_tle->expr))
+			typmod = -1;
+
+		setop->colTypes = lappend_oid(setop->colTypes, typid);
+		setop->colTypmods = lappend_int(setop->colTypmods, typmod);
+		setop->colCollations = lappend_oid(setop->colCollations, collid);
+
+		union_query->targetList = lappend(union_query->targetList,
+										  makeTargetEntry((Expr *) makeVar(1, tle->resno, typid, typmod, collid, 0),
+														  tle->resno, tle->resname, false));
+		idx++;
+	}
+
+	/* the outer query, merging the histograms for each group */
+	pstate = make_parsestate(NULL);
+
+	addRangeTableEntryForSubquery(pstate, union_query, makeAlias("r", colnames),
+								  false, true);
+
+	rtr = makeNode(RangeTblRef);
+	rtr->rtindex = 1;
+
+	query = copyObject(parse);
+	query->rtable = pstate->p_rtable;
+#if PG_VERSION_NUM >= 160000
+	query->rteperminfos = NIL;
+#endif
+	query->jointree = makeFromExpr(list_make1(rtr), NULL);
+
+	foreach(lc, query->targetList)
+	{
+		TargetEntry *tle = lfirst_node(TargetEntry, lc);
+
+		if (IsA(tle->expr, Var))
+		{
+			int			key = 0;
+			TargetEntry *union_tle;
+
+			while (list_nth_int(rq->keys, key) != ((Var *) tle->expr)->varattno)
+				key++;
+
+			union_tle = list_nth_node(TargetEntry, union_query->targetList, key);
+
+			tle->expr = (Expr *) copyObject(union_tle->expr);
+			continue;
+		}
+
+		/* tinyhist_agg of the histograms from the subquery */
+		aggref = (Aggref *) tle->expr;
+
+		var = makeVar(1, nkeys + 1, histtype, -1, InvalidOid, 0);
+
+		aggref->aggfnoid = aggfnoid;
+		aggref->aggtranstype = InvalidOid;
+		aggref->aggargtypes = list_make1_oid(histtype);
+		aggref->args = list_make1(makeTargetEntry((Expr *) var, 1, NULL, false));
+		aggref->inputcollid = InvalidOid;
+	}
+
+	return query;
+}
+
+/*
+ * rollup_route
+ *		build the query using a registered rollup (NULL if none can be used)
+ *
+ * Rollups with larger intervals are tried first.
+ */
+static Query *
+rollup_route(Query *parse, rollup_query_t *rq)
+{
+	MemoryContext oldcxt = CurrentMemoryContext;
+	Oid			argtypes[3] = {OIDOID, TEXTOID, TEXTOID};
+	Datum		args[3];
+	int			ret;
+	Query	   *query = NULL;
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	args[0] = ObjectIdGetDatum(rq->relid);
+	args[1] = CStringGetTextDatum(get_attname(rq->relid, rq->timeattr, false));
+	args[2] = CStringGetTextDatum(get_attname(rq->relid, rq->valueattr, false));
+
+	ret = SPI_execute_with_args(psprintf("SELECT rollup_table::oid, bucket_column::text, hist_column::text, granularity, origin "
+										 "FROM %s.tinyhist_rollups "
+										 "WHERE raw_table::oid = $1 AND time_column::text = $2 AND value_column::text = $3 "
+										 "ORDER BY granularity DESC",
+										 quote_identifier(get_namespace_name(rq->nspid))),
+								3, argtypes, args, NULL, true, 0);
+
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "failed to look up rollups: %s",
+			 SPI_result_code_string(ret));
+
+	for (uint64 i = 0; (i < SPI_processed) && (query == NULL); i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		MemoryContext spicxt;
+		bool		isnull;
+
+		/* the query has to survive SPI_finish */
+		spicxt = MemoryContextSwitchTo(oldcxt);
+
+		query = rollup_build_query(parse, rq,
+								   DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull)),
+								   SPI_getvalue(tuple, tupdesc, 2),
+								   SPI_getvalue(tuple, tupdesc, 3),
+								   SPI_getbinval(tuple, tupdesc, 4, &isnull),
+								   SPI_getbinval(tuple, tupdesc, 5, &isnull));
+
+		MemoryContextSwitchTo(spicxt);
+	}
+
+	SPI_finish();
+
+	return query;
+}
+
+/*
+ * rollup_planner
+ *		planner hook, routing tinyhist_agg queries to rollups
+ *
+ * The lookup of rollups runs queries, so the hook is disabled while doing
+ * that (otherwise it would recurse).
+ *
+ * The plan of a query that might be routed depends on the contents of
+ * tinyhist_rollups, so the table is added to the relations of the plan.
+ * Cached plans get invalidated by the trigger on tinyhist_rollups (which
+ * invalidates the relcache entry), or by changing the GUC.
+ */
+static PlannedStmt *
+rollup_planner(Query *parse, const char *query_string, int cursorOptions,
+			   ParamListInfo boundParams)
+{
+	rollup_query_t rq;
+	Oid			rollups = InvalidOid;
+	PlannedStmt *result;
+
+	if (rollup_routing_enabled && !rollup_routing_active &&
+		rollup_match(parse, &rq))
+	{
+		Query	   *query = NULL;
+
+		rollup_routing_active = true;
+
+		PG_TRY();
+		{
+			query = rollup_route(parse, &rq);
+		}
+		PG_FINALLY();
+		{
+			rollup_routing_active = false;
+		}
+		PG_END_TRY();
+
+		rollups = get_relname_relid("tinyhist_rollups", rq.nspid);
+
+		if (query != NULL)
+			parse = query;
+	}
+
+	if (prev_planner_hook)
+		result = prev_planner_hook(parse, query_string, cursorOptions, boundParams);
+	else
+		result = standard_planner(parse, query_string, cursorOptions, boundParams);
+
+	if (OidIsValid(rollups))
+		result->relationOids = lappend_oid(result->relationOids, rollups);
+
+	return result;
+}
+
+/*
+ * rollup_routing_assign
+ *		GUC assign hook, invalidating cached plans when routing is toggled
+ */
+static void
+rollup_routing_assign(bool newval, void *extra)
+{
+	if (newval != rollup_routing_enabled)
+		ResetPlanCache();
+}
+
+/*
+ * tinyhist_rollups_invalidate
+ *		trigger on tinyhist_rollups, invalidating plans routed to rollups
+ *
+ * Invalidating the relcache entry of tinyhist_rollups invalidates cached
+ * plans depending on the table (in all backends, after commit).
+ */
+Datum
+tinyhist_rollups_invalidate(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "tinyhist_rollups_invalidate: not called by trigger manager");
+
+	CacheInvalidateRelcache(trigdata->tg_relation);
+
+	PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * In-database benchmark of a query. The query is executed repeatedly (after
+ * a number of warmup iterations), and the duration of each iteration (in
+ * microseconds) is added to a histogram.
+ *
+ * The phase determines what gets measured in each iteration:
+ *
+ * - execution - The query is prepared once, and the plan is reused by all
+ *   the iterations (a query without parameters always uses the generic plan
+ *   in the plan cache), so this measures just the execution.
+ *
+ * - planning - The query is parsed and analyzed once, and each iteration
+ *   plans a copy of the query tree (the planner may scribble on it). The
+ *   plans are not executed.
+ *
+ * - total - The query is parsed, analyzed, planned and executed in each
+ *   iteration, i.e. what a client executing it repeatedly would see.
+ *
+ * The query is executed in read-write mode, with a new snapshot for each
+ * iteration, so that changes made by an iteration are visible to the next
+ * iterations (which matters for queries modifying data).
+ */
+typedef enum bench_phase_t {
+	BENCH_EXECUTION,
+	BENCH_PLANNING,
+	BENCH_TOTAL
+} bench_phase_t;
+
+typedef struct bench_state_t {
+	bench_phase_t	phase;
+	char		   *query;
+	SPIPlanPtr		plan;			/* prepared query (execution) */
+	List		   *querytrees;		/* analyzed query trees (planning) */
+	MemoryContext	context;		/* reset after each iteration */
+} bench_state_t;
+
+static bench_phase_t
+bench_parse_phase(const char *phase)
+{
+	if (strcmp(phase, "execution") == 0)
+		return BENCH_EXECUTION;
+	else if (strcmp(phase, "planning") == 0)
+		return BENCH_PLANNING;
+	else if (strcmp(phase, "total") == 0)
+		return BENCH_TOTAL;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid benchmark phase \"%s\"", phase),
+			 errhint("Valid phases are \"execution\", \"planning\" and \"total\".")));
+
+	return BENCH_EXECUTION;		/* keep compiler quiet */
+}
+
+/*
+ * bench_prepare
+ *		prepare the query for the iterations, depending on the phase
+ */
+static void
+bench_prepare(bench_state_t *state)
+{
+	if (state->phase == BENCH_EXECUTION)
+	{
+		state->plan = SPI_prepare(state->query, 0, NULL);
+
+		if (state->plan == NULL)
+			elog(ERROR, "SPI_prepare failed: %s",
+				 SPI_result_code_string(SPI_result));
+	}
+	else if (state->phase == BENCH_PLANNING)
+	{
+		ListCell   *lc;
+
+		foreach(lc, pg_parse_query(state->query))
+		{
+			RawStmt    *raw = lfirst_node(RawStmt, lc);
+			List	   *querytrees;
+
+#if PG_VERSION_NUM >= 150000
+			querytrees = pg_analyze_and_rewrite_fixedparams(raw, state->query,
+															 NULL, 0, NULL);
+#else
+			querytrees = pg_analyze_and_rewrite(raw, state->query,
+												NULL, 0, NULL);
+#endif
+
+			state->querytrees = list_concat(state->querytrees, querytrees);
+		}
+	}
+}
+
+/*
+ * bench_iteration
+ *		run one iteration of the benchmark, return the duration (in us)
+ */
+static double
+bench_iteration(bench_state_t *state)
+{
+	instr_time	start,
+				duration;
+	List	   *querytrees = NIL;
+	int			ret = 0;
+	MemoryContext oldcontext;
+
+	CHECK_FOR_INTERRUPTS();
+
+	oldcontext = MemoryContextSwitchTo(state->context);
+
+	/* copy the query trees before starting the timer */
+	if (state->phase == BENCH_PLANNING)
+		querytrees = copyObject(state->querytrees);
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	if (state->phase == BENCH_EXECUTION)
+		ret = SPI_execute_plan(state->plan, NULL, NULL, false, 0);
+	else if (state->phase == BENCH_PLANNING)
+		(void) pg_plan_queries(querytrees, state->query, CURSOR_OPT_PARALLEL_OK, NULL);
+	else
+		ret = SPI_execute(state->query, false, 0);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+
+	if (ret < 0)
+		elog(ERROR, "SPI_execute failed: %s", SPI_result_code_string(ret));
+
+	SPI_freetuptable(SPI_tuptable);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(state->context);
+
+	return (double) INSTR_TIME_GET_MICROSEC(duration);
+}
+
+/*
+ * tinyhist_bench
+ *		histogram of durations of repeated executions of a query
+ */
+Datum
+tinyhist_bench(PG_FUNCTION_ARGS)
+{
+	int32		iterations = PG_GETARG_INT32(1);
+	int32		warmup = PG_GETARG_INT32(2);
+	tinyhist_t *hist;
+	bench_state_t state;
+
+	if (iterations < 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of iterations %d must be at least 1", iterations)));
+
+	if (warmup < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of warmup iterations %d must not be negative", warmup)));
+
+	memset(&state, 0, sizeof(bench_state_t));
+
+	state.query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	state.phase = bench_parse_phase(text_to_cstring(PG_GETARG_TEXT_PP(3)));
+	state.context = AllocSetContextCreate(CurrentMemoryContext,
+										  "tinyhist bench iteration",
+										  ALLOCSET_DEFAULT_SIZES);
+
+	/* allocate the result before SPI_connect, in the caller's context */
+	hist = palloc0(sizeof(tinyhist_t));
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	bench_prepare(&state);
+
+	for (int i = 0; i < warmup; i++)
+		(void) bench_iteration(&state);
+
+	for (int i = 0; i < iterations; i++)
+	{
+		double		duration = bench_iteration(&state);
+
+		/* durations beyond the largest bucket (~18 minutes) go to the last one */
+		hist_add(hist, Min(duration, ldexp(1.0, HISTOGRAM_MAX_UNIT + HISTOGRAM_BUCKETS - 1)));
+	}
+
+	SPI_finish();
+
+	MemoryContextDelete(state.context);
+
+	PG_RETURN_POINTER(hist);
+}
+
+/*
+ * Loading histograms directly from server-side files, so that backfilling
+ * raw data does not need to COPY it into a staging table first (with all
+ * the WAL, heap writes and vacuuming) only to aggregate and truncate it.
+ *
+ * The file is streamed, parsing only the key and value columns, and the
+ * values are added to a histogram for each key (in a hash table, so the
+ * memory needed depends only on the number of distinct keys). Two formats
+ * are supported:
+ *
+ * - csv - The CSV format, as written by COPY (FORMAT csv), i.e. comma as
+ *   a delimiter, fields optionally quoted by double quotes (doubled inside
+ *   the quoted field), and unquoted empty fields meaning NULL. Optionally
+ *   with a header line.
+ *
+ * - binary - The binary format, as written by COPY (FORMAT binary). The
+ *   format does not include the types of the columns, so the value has to
+ *   be a double precision column, and the key is used as bytes of a text
+ *   value (so it should be text too).
+ *
+ * Rows with a NULL value are skipped, rows with a NULL key are added to a
+ * separate histogram (returned with a NULL key). Without a key column, all
+ * values are added to that histogram.
+ *
+ * The file is read with the privileges of the server, so the caller has to
+ * be a superuser or have privileges of pg_read_server_files (just like for
+ * COPY FROM a file), even if EXECUTE was granted to other roles.
+ */
+
+/* renamed in PostgreSQL 14 */
+#if PG_VERSION_NUM < 140000
+#define ROLE_PG_READ_SERVER_FILES	DEFAULT_ROLE_READ_SERVER_FILES
+#endif
+
+/* binary COPY file signature (including the trailing zero byte) */
+static const char load_binary_signature[11] = "PGCOPY\n\377\r\n\0";
+
+/*
+ * The keys have arbitrary length, so the hash table key is a pointer to a
+ * string (copied into the entry when inserting a new key).
+ */
+typedef struct load_entry_t {
+	char	   *key;
+	tinyhist_t	hist;
+} load_entry_t;
+
+typedef struct load_state_t {
+	const char *path;
+	int			key_column;		/* 0 without a key column */
+	int			value_column;
+	int64		record;			/* current record (for errors) */
+	HTAB	   *entries;		/* histograms for non-NULL keys */
+	tinyhist_t *null_hist;		/* histogram for NULL keys (if any) */
+
+	/* result, built after the whole file was processed */
+	TupleDesc	tupdesc;
+	int			nresults;
+	char	  **keys;
+	tinyhist_t **hists;
+} load_state_t;
+
+/*
+ * load_add
+ *		add a value to the histogram for a key (NULL key if key is NULL)
+ *
+ * Values have to fit into the range of a histogram, otherwise adjusting
+ * the range would never finish.
+ */
+static void
+load_add(load_state_t *state, StringInfo key, double value)
+{
+	tinyhist_t *hist;
+
+	if (isnan(value) || (value > ldexp(1.0, HISTOGRAM_MAX_UNIT + HISTOGRAM_BUCKETS - 1)))
+		ereport(ERROR,
+				(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+				 errmsg("value in record %lld of file \"%s\" is out of range",
+						(long long) state->record, state->path),
+				 errdetail("Values must not be NaN or greater than %.0f.",
+						   ldexp(1.0, HISTOGRAM_MAX_UNIT + HISTOGRAM_BUCKETS - 1))));
+
+	if ((state->key_column == 0) || (key == NULL))
+	{
+		if (state->null_hist == NULL)
+			state->null_hist = palloc0(sizeof(tinyhist_t));
+
+		hist = state->null_hist;
+	}
+	else
+	{
+		load_entry_t *entry;
+		bool		found;
+		char	   *str = key->data;
+
+		/* the keys are returned as text, so check the encoding */
+		if (!pg_verify_mbstr(GetDatabaseEncoding(), key->data, key->len, true))
+			ereport(ERROR,
+					(errcode(ERRCODE_CHARACTER_NOT_IN_REPERTOIRE),
+					 errmsg("key in record %lld of file \"%s\" is not valid in the database encoding",
+							(long long) state->record, state->path)));
+
+		entry = (load_entry_t *) hash_search(state->entries, &str, HASH_ENTER, &found);
+
+		/* the key points to the buffer, make a copy */
+		if (!found)
+		{
+			entry->key = pnstrdup(key->data, key->len);
+			memset(&entry->hist, 0, sizeof(tinyhist_t));
+		}
+
+		hist = &entry->hist;
+	}
+
+	hist_add(hist, value);
+}
+
+/*
+ * load_key_hash / load_key_match
+ *		hash and compare keys of the hash table (pointers to strings)
+ */
+static uint32
+load_key_hash(const void *key, Size keysize)
+{
+	const char *str = *(const char *const *) key;
+
+	return hash_bytes((const unsigned char *) str, strlen(str));
+}
+
+static int
+load_key_match(const void *key1, const void *key2, Size keysize)
+{
+	return strcmp(*(const char *const *) key1, *(const char *const *) key2);
+}
+
+/*
+ * load_parse_value
+ *		parse a value from the CSV file
+ *
+ * The error does not include the value, the caller may not be allowed to
+ * see contents of the file.
+ */
+static double
+load_parse_value(load_state_t *state, const char *str)
+{
+	char	   *end;
+	double		value;
+
+	errno = 0;
+	value = strtod(str, &end);
+
+	if ((end == str) || (*end != '\0') || (errno == ERANGE))
+		ereport(ERROR,
+				(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+				 errmsg("invalid value in record %lld of file \"%s\"",
+						(long long) state->record, state->path)));
+
+	return value;
+}
+
+/*
+ * load_csv
+ *		add values from a CSV file to the histograms
+ *
+ * The file is parsed one character at a time, so that only the key and
+ * value columns need to be copied. Quoted fields may include newlines.
+ * Empty lines are skipped.
+ */
+static void
+load_csv(load_state_t *state, FILE *file, bool header)
+{
+	StringInfoData key;
+	StringInfoData value;
+	bool		key_quoted = false;
+	bool		value_quoted = false;
+	bool		quoted = false;
+	bool		empty = true;
+	int			field = 1;
+	int			ncolumns = Max(state->key_column, state->value_column);
+	int			c;
+
+	initStringInfo(&key);
+	initStringInfo(&value);
+
+	while (true)
+	{
+		c = getc(file);
+
+		if (quoted)
+		{
+			if (c == EOF)
+				break;
+			else if (c != '"')
+			{
+				/* regular character in a quoted field */
+			}
+			else if ((c = getc(file)) != '"')
+			{
+				/* end of the quoted field, process the next character */
+				quoted = false;
+				ungetc(c, file);
+				continue;
+			}
+		}
+		else if (c == '"')
+		{
+			quoted = true;
+			empty = false;
+			key_quoted |= (field == state->key_column);
+			value_quoted |= (field == state->value_column);
+			continue;
+		}
+		else if (c == ',')
+		{
+			field++;
+			empty = false;
+			continue;
+		}
+		else if ((c == '\n') || (c == '\r') || (c == EOF))
+		{
+			/* end of a record (with \r\n, the \n ends an empty record) */
+			if (!empty)
+			{
+				CHECK_FOR_INTERRUPTS();
+
+				state->record++;
+
+				if (field < ncolumns)
+					ereport(ERROR,
+							(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							 errmsg("missing column %d in record %lld of file \"%s\"",
+									field + 1, (long long) state->record, state->path)));
+
+				/* unquoted empty fields are NULL, skip NULL values */
+				if ((state->record > 1 || !header) &&
+					(value.len > 0 || value_quoted))
+					load_add(state,
+							 (key.len > 0 || key_quoted) ? &key : NULL,
+							 load_parse_value(state, value.data));
+			}
+
+			if (c == EOF)
+				break;
+
+			resetStringInfo(&key);
+			resetStringInfo(&value);
+			key_quoted = false;
+			value_quoted = false;
+			empty = true;
+			field = 1;
+			continue;
+		}
+
+		/* a character of the field (only keep key and value) */
+		empty = false;
+
+		if (field == state->key_column)
+			appendStringInfoChar(&key, (char) c);
+
+		if (field == state->value_column)
+			appendStringInfoChar(&value, (char) c);
+	}
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", state->path)));
+
+	if (quoted)
+		ereport(ERROR,
+				(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+				 errmsg("unterminated quoted field in record %lld of file \"%s\"",
+						(long long) (state->record + 1), state->path)));
+
+	pfree(key.data);
+	pfree(value.data);
+}
+
+/*
+ * load_read
+ *		read data from the binary file, fail on a short read
+ */
+static void
+load_read(load_state_t *state, FILE *file, void *data, size_t len)
+{
+	if (fread(data, 1, len, file) == len)
+		return;
+
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", state->path)));
+
+	ereport(ERROR,
+			(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+			 errmsg("unexpected end of file \"%s\"", state->path)));
+}
+
+/*
+ * load_binary
+ *		add values from a binary COPY file to the histograms
+ */
+static void
+load_binary(load_state_t *state, FILE *file)
+{
+	char		signature[sizeof(load_binary_signature)];
+	uint32		flags;
+	uint32		extension;
+	StringInfoData key;
+	int			ncolumns = Max(state->key_column, state->value_column);
+
+	load_read(state, file, signature, sizeof(signature));
+
+	if (memcmp(signature, load_binary_signature, sizeof(signature)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+				 errmsg("file \"%s\" is not a binary COPY file", state->path)));
+
+	load_read(state, file, &flags, sizeof(flags));
+
+	/* bit 16 means OIDs included, the upper half are critical flags */
+	if ((pg_ntoh32(flags) & 0xFFFF0000) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+				 errmsg("unrecognized critical flags in binary COPY file \"%s\"", state->path)));
+
+	/* skip the header extension */
+	load_read(state, file, &extension, sizeof(extension));
+
+	if (fseeko(file, pg_ntoh32(extension), SEEK_CUR) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m", state->path)));
+
+	initStringInfo(&key);
+
+	while (true)
+	{
+		int16		nfields;
+		bool		key_null = true;
+		bool		value_null = true;
+		double		value = 0;
+
+		CHECK_FOR_INTERRUPTS();
+
+		load_read(state, file, &nfields, sizeof(nfields));
+		nfields = pg_ntoh16(nfields);
+
+		/* file trailer */
+		if (nfields == -1)
+			break;
+
+		state->record++;
+
+		if (nfields < ncolumns)
+			ereport(ERROR,
+					(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+					 errmsg("missing column %d in record %lld of file \"%s\"",
+							nfields + 1, (long long) state->record, state->path)));
+
+		for (int i = 1; i <= nfields; i++)
+		{
+			int32		len;
+
+			load_read(state, file, &len, sizeof(len));
+			len = pg_ntoh32(len);
+
+			/* NULL field */
+			if (len == -1)
+				continue;
+
+			if (len < 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+						 errmsg("invalid field size in record %lld of file \"%s\"",
+								(long long) state->record, state->path)));
+
+			if (i == state->value_column)
+			{
+				uint64		bits;
+
+				if (len != sizeof(bits))
+					ereport(ERROR,
+							(errcode(ERRCODE_BAD_COPY_FILE_FORMAT),
+							 errmsg("value in record %lld of file \"%s\" is not double precision",
+									(long long) state->record, state->path)));
+
+				load_read(state, file, &bits, sizeof(bits));
+				bits = pg_ntoh64(bits);
+				memcpy(&value, &bits, sizeof(value));
+				value_null = false;
+			}
+			else if (i == state->key_column)
+			{
+				resetStringInfo(&key);
+				enlargeStringInfo(&key, len);
+				load_read(state, file, key.data, len);
+				key.len = len;
+				key.data[len] = '\0';
+				key_null = false;
+			}
+			else if (fseeko(file, len, SEEK_CUR) != 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not seek in file \"%s\": %m", state->path)));
+		}
+
+		if (!value_null)
+			load_add(state, key_null ? NULL : &key, value);
+	}
+
+	pfree(key.data);
+}
+
+/*
+ * tinyhist_load
+ *		histograms of values for keys, loaded from a server-side file
+ */
+Datum
+tinyhist_load(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *fctx;
+	load_state_t *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext mctx;
+		char	   *format;
+		FILE	   *file;
+		HASHCTL		ctl;
+		HASH_SEQ_STATUS status;
+		load_entry_t *entry;
+
+		if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(3) || PG_ARGISNULL(4))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("only the key column may be NULL")));
+
+		if (!superuser() && !has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+			ereport(ERROR,
+					(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+					 errmsg("permission denied to load histograms from a file"),
+					 errdetail("Only roles with privileges of the \"%s\" role may load histograms from a file.",
+							   "pg_read_server_files")));
+
+		fctx = SRF_FIRSTCALL_INIT();
+
+		mctx = MemoryContextSwitchTo(fctx->multi_call_memory_ctx);
+
+		state = palloc0(sizeof(load_state_t));
+
+		if (get_call_result_type(fcinfo, NULL, &state->tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		state->tupdesc = BlessTupleDesc(state->tupdesc);
+		state->path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		format = text_to_cstring(PG_GETARG_TEXT_PP(1));
+		state->key_column = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2);
+		state->value_column = PG_GETARG_INT32(3);
+
+		if (strcmp(format, "csv") != 0 && strcmp(format, "binary") != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid file format \"%s\"", format),
+					 errhint("Valid formats are \"csv\" and \"binary\".")));
+
+		if ((state->value_column < 1) || (!PG_ARGISNULL(2) && state->key_column < 1))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("column numbers must be at least 1")));
+
+		if (PG_GETARG_BOOL(4) && (strcmp(format, "binary") == 0))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("header is supported only for the csv format")));
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(char *);
+		ctl.entrysize = sizeof(load_entry_t);
+		ctl.hash = load_key_hash;
+		ctl.match = load_key_match;
+		ctl.hcxt = CurrentMemoryContext;
+
+		state->entries = hash_create("tinyhist load histograms", 256, &ctl,
+									 HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_CONTEXT);
+
+		file = AllocateFile(state->path, PG_BINARY_R);
+
+		if (file == NULL)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\" for reading: %m", state->path)));
+
+		if (strcmp(format, "csv") == 0)
+			load_csv(state, file, PG_GETARG_BOOL(4));
+		else
+			load_binary(state, file);
+
+		FreeFile(file);
+
+		/* collect the histograms, so that we don't need to keep a hash scan open */
+		state->nresults = hash_get_num_entries(state->entries) + 1;
+		state->keys = palloc(sizeof(char *) * state->nresults);
+		state->hists = palloc(sizeof(tinyhist_t *) * state->nresults);
+		state->nresults = 0;
+
+		hash_seq_init(&status, state->entries);
+
+		while ((entry = (load_entry_t *) hash_seq_search(&status)) != NULL)
+		{
+			state->keys[state->nresults] = entry->key;
+			state->hists[state->nresults] = &entry->hist;
+			state->nresults++;
+		}
+
+		if (state->null_hist != NULL)
+		{
+			state->keys[state->nresults] = NULL;
+			state->hists[state->nresults] = state->null_hist;
+			state->nresults++;
+		}
+
+		fctx->user_fctx = state;
+		fctx->max_calls = state->nresults;
+
+		MemoryContextSwitchTo(mctx);
+	}
+
+	fctx = SRF_PERCALL_SETUP();
+	state = (load_state_t *) fctx->user_fctx;
+
+	if (fctx->call_cntr < fctx->max_calls)
+	{
+		Datum		values[2];
+		bool		nulls[2] = {false, false};
+		int			idx = fctx->call_cntr;
+
+		if (state->keys[idx] == NULL)
+			nulls[0] = true;
+		else
+			values[0] = CStringGetTextDatum(state->keys[idx]);
+
+		values[1] = PointerGetDatum(state->hists[idx]);
+
+		SRF_RETURN_NEXT(fctx, HeapTupleGetDatum(heap_form_tuple(state->tupdesc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(fctx);
+}